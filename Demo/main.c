@@ -1,11 +1,20 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <SDMMobileDevice/SDMMobileDevice.h>
+#include <pthread.h>
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 void DemoOne();
 void DemoTwo();
 void AFCTest();
 void DemoThree(const char *path);
 void DemoFour(const char *path);
+void DemoFive();
+void AFCLockBenchmark();
+void AFCOperationBenchmark();
+void SyslogRelayBenchmark();
 
 int main (int argc, const char * argv[]) {
 	// Needed to initialize the library and start the device listener (SDMMD_MCP.h)
@@ -13,6 +22,10 @@ int main (int argc, const char * argv[]) {
 	
 	//DemoOne();
 	//DemoTwo();
+	//DemoFive();
+	//AFCLockBenchmark();
+	//AFCOperationBenchmark();
+	//SyslogRelayBenchmark();
 	if (argc == 2) {
 		//DemoThree(argv[1]);
 		//DemoFour(argv[1]);
@@ -232,6 +245,50 @@ void DemoFour(const char *appPath) {
 	
 }
 
+void fleet_callback(CFDictionaryRef dict, void* arg) {
+	int percent;
+	CFStringRef device = CFDictionaryGetValue(dict, CFSTR(kSDMMD_FleetKeyDeviceIdentifier));
+	CFStringRef status = CFDictionaryGetValue(dict, CFSTR(kSDMMD_FleetKeyStatus));
+	CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kSDMMD_FleetKeyPercentComplete)), kCFNumberSInt32Type, &percent);
+	// CFStringGetCStringPtr() is NULL unless the string happens to be stored in that encoding, so copy them out
+	char deviceName[0x100] = {0}, statusName[0x100] = {0};
+	CFStringGetCString(device, deviceName, sizeof(deviceName), kCFStringEncodingUTF8);
+	CFStringGetCString(status, statusName, sizeof(statusName), kCFStringEncodingUTF8);
+	printf("[%3d%%] %s: %s\n", percent, deviceName, statusName);
+}
+
+void DemoFive() {
+	// same lookup as DemoTwo, but run on every connected device at once instead of one after another (SDMMD_Fleet.h)
+	CFArrayRef devices = SDMMD_AMDCreateDeviceList();
+	printf("%i device(s) connected!\n",(uint32_t)CFArrayGetCount(devices));
+	
+	// limit to 8 devices at a time, and 4 behind any single USB hub
+	int32_t maxDevices = 8, maxPerHub = 4;
+	CFNumberRef maxDevicesNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &maxDevices);
+	CFNumberRef maxPerHubNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &maxPerHub);
+	CFMutableDictionaryRef fleetOptions = SDMMD_create_dict();
+	CFDictionarySetValue(fleetOptions, CFSTR(kSDMMD_FleetOptionMaxConcurrentDevices), maxDevicesNumber);
+	CFDictionarySetValue(fleetOptions, CFSTR(kSDMMD_FleetOptionMaxConcurrentPerHub), maxPerHubNumber);
+	
+	SDMMD_FleetRef fleet = SDMMD_FleetCreate(fleetOptions, fleet_callback, NULL);
+	if (fleet) {
+		CFMutableDictionaryRef lookupOptions = SDMMD_create_dict();
+		CFDictionarySetValue(lookupOptions, CFSTR("ReturnAttributes"), SDMMD_ApplicationLookupDictionary());
+		
+		// a failure on one device is reported through the callback and the results, the rest keep going
+		CFDictionaryRef results = NULL;
+		SDMMD_FleetRunOperation(fleet, devices, SDMMD_FleetOperationLookupApplications, lookupOptions, &results);
+		CFShow(results);
+		
+		CFRelease(results);
+		CFRelease(lookupOptions);
+		SDMMD_FleetRelease(fleet);
+	}
+	CFRelease(fleetOptions);
+	CFRelease(maxPerHubNumber);
+	CFRelease(maxDevicesNumber);
+}
+
 void AFCTest() {
 	
 	CFArrayRef devices = SDMMD_AMDCreateDeviceList();
@@ -274,3 +331,315 @@ void AFCTest() {
 		}
 	}
 }
+
+#define kLockBenchmarkIterations	10000000
+#define kLockBenchmarkThreads		4
+
+struct lock_benchmark {
+	pthread_mutex_t mutex;
+	struct sdmmd_AFCLockState state;
+	volatile uint64_t counter;
+};
+
+static double lock_benchmark_nanoseconds(CFAbsoluteTime start, uint64_t pairs) {
+	return ((CFAbsoluteTimeGetCurrent() - start) * 1e9) / (double)pairs;
+}
+
+static void lock_benchmark_mutex(void *context, size_t index) {
+	struct lock_benchmark *bench = (struct lock_benchmark *)context;
+	for (uint32_t i = 0; i < kLockBenchmarkIterations / kLockBenchmarkThreads; i++) {
+		pthread_mutex_lock(&bench->mutex);
+		bench->counter++;
+		pthread_mutex_unlock(&bench->mutex);
+	}
+}
+
+static void lock_benchmark_state(void *context, size_t index) {
+	struct lock_benchmark *bench = (struct lock_benchmark *)context;
+	for (uint32_t i = 0; i < kLockBenchmarkIterations / kLockBenchmarkThreads; i++) {
+		SDMMD_AFCLockStateLock(&bench->state);
+		bench->counter++;
+		SDMMD_AFCLockStateUnlock(&bench->state);
+	}
+}
+
+void AFCLockBenchmark() {
+	// the AFC lock used to be a pthread mutex inside a CF object, it is now an atomic count that only sleeps when contended (SDMMD_AFCLock.h)
+	struct lock_benchmark bench;
+	pthread_mutex_init(&bench.mutex, NULL);
+	SDMMD_AFCLockStateInit(&bench.state);
+	dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	
+	// uncontended, one thread taking and dropping the lock
+	bench.counter = 0;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	for (uint32_t i = 0; i < kLockBenchmarkIterations; i++) {
+		pthread_mutex_lock(&bench.mutex);
+		bench.counter++;
+		pthread_mutex_unlock(&bench.mutex);
+	}
+	printf("uncontended pthread_mutex: %.1f ns per lock/unlock\n", lock_benchmark_nanoseconds(start, kLockBenchmarkIterations));
+	
+	SDMMD_AFCLockRef lock = SDMMD_AFCLockCreate();
+	start = CFAbsoluteTimeGetCurrent();
+	for (uint32_t i = 0; i < kLockBenchmarkIterations; i++) {
+		SDMMD_AFCLockLock(lock);
+		bench.counter++;
+		SDMMD_AFCLockUnlock(lock);
+	}
+	printf("uncontended SDMMD_AFCLock: %.1f ns per lock/unlock\n", lock_benchmark_nanoseconds(start, kLockBenchmarkIterations));
+	CFRelease(lock);
+	
+	// contended, every thread incrementing the same counter
+	bench.counter = 0;
+	start = CFAbsoluteTimeGetCurrent();
+	dispatch_apply_f(kLockBenchmarkThreads, queue, &bench, lock_benchmark_mutex);
+	printf("%i threads pthread_mutex: %.1f ns per lock/unlock (counter %llu)\n", kLockBenchmarkThreads, lock_benchmark_nanoseconds(start, kLockBenchmarkIterations), bench.counter);
+	
+	bench.counter = 0;
+	start = CFAbsoluteTimeGetCurrent();
+	dispatch_apply_f(kLockBenchmarkThreads, queue, &bench, lock_benchmark_state);
+	printf("%i threads SDMMD_AFCLock: %.1f ns per lock/unlock (counter %llu)\n", kLockBenchmarkThreads, lock_benchmark_nanoseconds(start, kLockBenchmarkIterations), bench.counter);
+	
+	SDMMD_AFCLockStateDestroy(&bench.state);
+	pthread_mutex_destroy(&bench.mutex);
+}
+
+#define kOperationBenchmarkIterations	100000
+#define kOperationBenchmarkRoundTrips	1000
+
+// Counts malloc, calloc and realloc calls made on the thread that turned counting on, by swapping the default zone's entry points
+static malloc_zone_t *alloc_zone;
+static void *(*alloc_zone_malloc)(malloc_zone_t *zone, size_t size);
+static void *(*alloc_zone_calloc)(malloc_zone_t *zone, size_t count, size_t size);
+static void *(*alloc_zone_realloc)(malloc_zone_t *zone, void *ptr, size_t size);
+static __thread bool alloc_counting;
+static __thread uint64_t alloc_count;
+
+static void *alloc_count_malloc(malloc_zone_t *zone, size_t size) {
+	if (alloc_counting) alloc_count++;
+	return alloc_zone_malloc(zone, size);
+}
+
+static void *alloc_count_calloc(malloc_zone_t *zone, size_t count, size_t size) {
+	if (alloc_counting) alloc_count++;
+	return alloc_zone_calloc(zone, count, size);
+}
+
+static void *alloc_count_realloc(malloc_zone_t *zone, void *ptr, size_t size) {
+	if (alloc_counting) alloc_count++;
+	return alloc_zone_realloc(zone, ptr, size);
+}
+
+static void alloc_count_install(bool install) {
+	alloc_zone = malloc_default_zone();
+	vm_protect(mach_task_self(), (vm_address_t)alloc_zone, sizeof(malloc_zone_t), 0, VM_PROT_READ | VM_PROT_WRITE);
+	if (install) {
+		alloc_zone_malloc = alloc_zone->malloc;
+		alloc_zone_calloc = alloc_zone->calloc;
+		alloc_zone_realloc = alloc_zone->realloc;
+		alloc_zone->malloc = alloc_count_malloc;
+		alloc_zone->calloc = alloc_count_calloc;
+		alloc_zone->realloc = alloc_count_realloc;
+	} else {
+		alloc_zone->malloc = alloc_zone_malloc;
+		alloc_zone->calloc = alloc_zone_calloc;
+		alloc_zone->realloc = alloc_zone_realloc;
+	}
+	vm_protect(mach_task_self(), (vm_address_t)alloc_zone, sizeof(malloc_zone_t), 0, VM_PROT_READ);
+}
+
+// What a GetFileInfo request cost before operations were pooled: the operation, its packet and the path copy were separate blocks, the
+// path went through a temporary C string and sending wrapped the header and the body in a CFData each
+struct legacy_operation {
+	struct sdmmd_AFCPacket *packet;
+};
+
+static struct legacy_operation *legacy_operation_create(CFStringRef path) {
+	struct legacy_operation *op = calloc(1, sizeof(struct legacy_operation));
+	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
+	char *cpath = SDMCFStringGetString(path);
+	size_t length = strlen(cpath)+1;
+	op->packet->data = calloc(1, length);
+	memcpy(op->packet->data, cpath, length);
+	op->packet->header.signature = 0x4141504c36414643;
+	op->packet->header.headerLen = sizeof(SDMMD_AFCPacketHeader)+length;
+	op->packet->header.packetLen = op->packet->header.headerLen;
+	op->packet->header.type = kSDMMD_AFCPacketTypeGetFileInfo;
+	free(cpath);
+	return op;
+}
+
+static void legacy_operation_encode(struct legacy_operation *op) {
+	CFDataRef header = CFDataCreate(kCFAllocatorDefault, (UInt8 *)&op->packet->header, sizeof(SDMMD_AFCPacketHeader));
+	CFDataRef body = CFDataCreate(kCFAllocatorDefault, op->packet->data, op->packet->header.headerLen - sizeof(SDMMD_AFCPacketHeader));
+	CFRelease(header);
+	CFRelease(body);
+}
+
+static void legacy_operation_release(struct legacy_operation *op) {
+	free(op->packet->data);
+	free(op->packet);
+	free(op);
+}
+
+static void operation_benchmark_report(const char *name, CFAbsoluteTime start, uint64_t allocations, uint64_t count) {
+	printf("%s: %.2f allocations, %.0f ns per operation\n", name, (double)allocations / (double)count, ((CFAbsoluteTimeGetCurrent() - start) * 1e9) / (double)count);
+}
+
+void AFCOperationBenchmark() {
+	// GetFileInfo requests built, packed into one send buffer and released, first the way it used to be done and then with pooled operations (SDMMD_AFC.h)
+	CFStringRef path = CFSTR("/DCIM/100APPLE/IMG_0001.JPG");
+	char buffer[kSDMMD_AFCOperationPoolDataSize + sizeof(SDMMD_AFCPacketHeader)];
+	alloc_count_install(true);
+	alloc_counting = true;
+	
+	alloc_count = 0;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	for (uint32_t i = 0; i < kOperationBenchmarkIterations; i++) {
+		struct legacy_operation *op = legacy_operation_create(path);
+		legacy_operation_encode(op);
+		legacy_operation_release(op);
+	}
+	operation_benchmark_report("legacy operation", start, alloc_count, kOperationBenchmarkIterations);
+	
+	alloc_count = 0;
+	start = CFAbsoluteTimeGetCurrent();
+	for (uint32_t i = 0; i < kOperationBenchmarkIterations; i++) {
+		SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateGetFileInfo(path);
+		uint64_t argumentsLength = op->packet->header.headerLen - sizeof(SDMMD_AFCPacketHeader);
+		memcpy(buffer, &op->packet->header, sizeof(SDMMD_AFCPacketHeader));
+		memcpy(&buffer[sizeof(SDMMD_AFCPacketHeader)], op->packet->data, argumentsLength);
+		SDMMD_AFCOperationRelease(op);
+	}
+	operation_benchmark_report("pooled operation", start, alloc_count, kOperationBenchmarkIterations);
+	
+	// the same request answered by a device, includes the reply
+	CFArrayRef devices = SDMMD_AMDCreateDeviceList();
+	if (CFArrayGetCount(devices)) {
+		SDMMD_AMDeviceRef device = (SDMMD_AMDeviceRef)CFArrayGetValueAtIndex(devices, 0);
+		SDMMD_AMConnectionRef afcFd;
+		if (SDM_MD_CallSuccessful(SDMMD_AMDeviceConnect(device))) {
+			if (SDM_MD_CallSuccessful(SDMMD_AMDeviceStartSession(device))) {
+				if (SDM_MD_CallSuccessful(SDMMD_AMDeviceStartService(device, CFSTR(AMSVC_AFC), NULL, &afcFd))) {
+					SDMMD_AFCConnectionRef afc = SDMMD_AFCConnectionCreate(afcFd);
+					alloc_count = 0;
+					start = CFAbsoluteTimeGetCurrent();
+					for (uint32_t i = 0; i < kOperationBenchmarkRoundTrips; i++) {
+						SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateGetFileInfo(CFSTR("/"));
+						SDMMD_AFCOperationRef response = NULL;
+						SDMMD_AFCProcessOperation(afc, op, &response);
+						SDMMD_AFCOperationRelease(response);
+						SDMMD_AFCOperationRelease(op);
+					}
+					// only counts this thread, allocations made by the connection's reader are not included
+					operation_benchmark_report("device round trip", start, alloc_count, kOperationBenchmarkRoundTrips);
+					SDMMD_AFCConnectionRelease(afc);
+				} else {
+					printf("could not start service\n");
+				}
+				SDMMD_AMDeviceStopSession(device);
+			} else {
+				printf("could not start session\n");
+			}
+			SDMMD_AMDeviceDisconnect(device);
+		}
+	}
+	CFRelease(devices);
+	
+	alloc_counting = false;
+	alloc_count_install(false);
+	uint64_t allocations = 0, reuses = 0;
+	SDMMD_AFCOperationGetPoolStatistics(&allocations, &reuses);
+	printf("operation pool: %llu allocations, %llu reuses\n", allocations, reuses);
+}
+
+#define kSyslogBenchmarkLines		0x1000
+#define kSyslogBenchmarkRepeats		0x100
+
+struct syslog_replay {
+	int socket;
+	char *stream;
+	size_t length;
+	volatile uint64_t handled;
+};
+
+static void syslog_replay_write(void *context) {
+	struct syslog_replay *replay = (struct syslog_replay *)context;
+	for (uint32_t repeat = 0; repeat < kSyslogBenchmarkRepeats; repeat++) {
+		size_t offset = 0;
+		while (offset < replay->length) {
+			ssize_t sent = write(replay->socket, replay->stream + offset, replay->length - offset);
+			if (sent <= 0) {
+				return;
+			}
+			offset += sent;
+		}
+	}
+	// ends the stream the same way the device closing syslog_relay would
+	shutdown(replay->socket, SHUT_WR);
+}
+
+static void syslog_replay_line(const char *line, uint32_t length, void *context) {
+	((struct syslog_replay *)context)->handled++;
+}
+
+static void syslog_replay_run(const char *name, struct syslog_replay *replay, CFDictionaryRef options) {
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+		printf("could not create socket pair\n");
+		return;
+	}
+	replay->socket = sockets[0];
+	replay->handled = 0;
+	SDMMD_SyslogRelayRef relay = NULL;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	if (SDM_MD_CallSuccessful(SDMMD_SyslogRelayCreateWithSocket(sockets[1], options, NULL, syslog_replay_line, replay, &relay))) {
+		dispatch_group_t writer = dispatch_group_create();
+		dispatch_group_async_f(writer, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), replay, syslog_replay_write);
+		while (SDMMD_SyslogRelayIsRunning(relay)) {
+			usleep(1000);
+		}
+		dispatch_group_wait(writer, DISPATCH_TIME_FOREVER);
+		dispatch_release(writer);
+		uint64_t received = 0, kept = 0, dropped = 0;
+		SDMMD_SyslogRelayGetStatistics(relay, &received, &kept, &dropped);
+		// waits for the handler to see the last of the lines, so they count towards the time
+		SDMMD_SyslogRelayRelease(relay);
+		CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+		printf("%s: %.0f lines/sec read, %llu kept, %llu dropped, %llu handled\n", name, (double)received / elapsed, kept, dropped, replay->handled);
+	}
+	close(sockets[0]);
+	close(sockets[1]);
+}
+
+void SyslogRelayBenchmark() {
+	// replays a synthetic syslog stream through the relay without a device (SDMMD_SyslogRelay.h), the reader runs on one core so this is also lines/sec per core
+	const char *processes[] = { "SpringBoard", "backboardd", "kernel", "locationd" };
+	struct syslog_replay replay;
+	CFMutableDataRef stream = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	for (uint32_t index = 0; index < kSyslogBenchmarkLines; index++) {
+		char line[0x100];
+		int length = snprintf(line, sizeof(line), "Oct 19 12:%02u:%02u iPhone %s[%u] <Notice>: replayed message %u with some padding to look like a real line", (index / 60) % 60, index % 60, processes[index % 4], 50 + (index % 4), index);
+		// every message ends with a NUL like syslog_relay sends it
+		CFDataAppendBytes(stream, (UInt8 *)line, length + 1);
+	}
+	replay.stream = (char *)CFDataGetMutableBytePtr(stream);
+	replay.length = CFDataGetLength(stream);
+	
+	syslog_replay_run("no filter", &replay, NULL);
+	
+	CFMutableDictionaryRef options = SDMMD_create_dict();
+	CFStringRef kept[] = { CFSTR("SpringBoard") };
+	CFArrayRef keptProcesses = CFArrayCreate(kCFAllocatorDefault, (const void **)kept, 1, &kCFTypeArrayCallBacks);
+	CFDictionarySetValue(options, CFSTR(kSDMMD_SyslogRelayOptionProcesses), keptProcesses);
+	syslog_replay_run("process filter", &replay, options);
+	
+	CFDictionaryRemoveAllValues(options);
+	CFDictionarySetValue(options, CFSTR(kSDMMD_SyslogRelayOptionRegex), CFSTR("message [0-9]*7 "));
+	syslog_replay_run("regex filter", &replay, options);
+	
+	CFRelease(keptProcesses);
+	CFRelease(options);
+	CFRelease(stream);
+}
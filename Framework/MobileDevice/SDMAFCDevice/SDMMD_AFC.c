@@ -20,265 +20,1945 @@
 #define _SDM_MD_AFC_C_
 
 #include "SDMMD_AFC.h"
+#include "SDMMD_AFCIterator.h"
 #include "SDMMD_Functions.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-sdmmd_return_t SDMMD_check_can_touch(SDMMD_AFCConnectionRef conn, CFDataRef *unknown) {
-	SDMMD_AFCOperationRef fileInfo = SDMMD_AFCOperationCreateGetFileInfo(unknown);
-	SDMMD_AFCOperationRef reply; 
-	SDMMD_AFCProcessOperation(conn, fileInfo, &reply);
-	*unknown = SDMMD_GetDataResponseFromOperation(reply);
+static void SDMMD_AFCMetadataCacheRelease(struct sdmmd_AFCMetadataCache *cache);
+static void SDMMD_AFCConnectionNegotiateBlockSizes(SDMMD_AFCConnectionRef conn);
+static uint32_t SDMMD_AFCConnectionGetTunedBlockSize(SDMMD_AFCConnectionRef conn);
+static void SDMMD_AFCConnectionTeardownIfOwed(SDMMD_AFCConnectionRef conn);
+
+// Goes through the metadata cache like every other GetFileInfo
+sdmmd_return_t SDMMD_check_can_touch(SDMMD_AFCConnectionRef conn, CFStringRef path) {
+	CFDictionaryRef info = NULL;
+	sdmmd_return_t result = SDMMD_AFCConnectionCopyFileInfo(conn, path, &info);
+	if (info) {
+		CFRelease(info);
+	}
+	return result;
+}
+
+SDMMD_AFCConnectionRef SDMMD_AFCConnectionCreate(SDMMD_AMConnectionRef conn) {
+	SDMMD_AFCConnectionRef afc = calloc(1, sizeof(struct sdmmd_AFCConnectionClass));
+	afc->handle = conn;
+	CFStringRef name = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%s.%s.%s"), "com.samdmarshall.sdmmobiledevice.afc", SDMCFStringGetString((conn->ivars.device)->ivars.unique_device_id), SDMCFStringGetString(SDMGetCurrentDateString()));
+	char *queueName = SDMCFStringGetString(name);
+	afc->operationQueue = dispatch_queue_create(queueName, NULL);
+	free(queueName);
+	CFRelease(name);
+	afc->operationCount = 0;
+	afc->sendBuffer = malloc(kSDMMD_AFCSendBufferSize);
+	afc->chunkSize = kSDMMD_AFCChunkSizeDefault;
+	afc->pipelineDepth = kSDMMD_AFCPipelineDepthDefault;
+	SDMMD_AFCLockStateInit(&afc->replyLock);
+	afc->transportError = kAMDSuccess;
+	afc->readerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.afc.reader", NULL);
+	afc->readerGroup = dispatch_group_create();
+	afc->asyncGroup = dispatch_group_create();
+	// the block sizes themselves are only sent before the first transfer, creating a connection never waits on the device
+	uint32_t blockSize = SDMMD_AFCConnectionGetTunedBlockSize(afc);
+	if (blockSize) {
+		SDMMD_AFCConnectionSetChunkSize(afc, blockSize);
+	}
+	return afc;
+}
+
+void SDMMD_AFCConnectionRelease(SDMMD_AFCConnectionRef conn) {
+	if (conn) {
+		// asynchronous operations can still touch the connection from their callbacks and from the closes of cancelled opens
+		SDMMD_AFCConnectionCancelOperations(conn);
+		// cancelled operations can still be owed replies, so both waits depend on the reader getting out
+		SDMMD_AFCConnectionTeardownIfOwed(conn);
+		dispatch_group_wait(conn->asyncGroup, DISPATCH_TIME_FOREVER);
+		dispatch_group_wait(conn->readerGroup, DISPATCH_TIME_FOREVER);
+		dispatch_release(conn->asyncGroup);
+		dispatch_release(conn->readerGroup);
+		dispatch_release(conn->readerQueue);
+		dispatch_release(conn->operationQueue);
+		SDMMD_AFCLockStateDestroy(&conn->replyLock);
+		free(conn->sendBuffer);
+		SDMMD_AFCMetadataCacheRelease(conn->metadataCache);
+		free(conn);
+	}
+}
+
+void SDMMD_AFCConnectionSetChunkSize(SDMMD_AFCConnectionRef conn, uint32_t chunkSize) {
+	if (conn) {
+		chunkSize = (chunkSize < kSDMMD_AFCChunkSizeMin ? kSDMMD_AFCChunkSizeMin : chunkSize);
+		chunkSize = (chunkSize > kSDMMD_AFCChunkSizeMax ? kSDMMD_AFCChunkSizeMax : chunkSize);
+		conn->chunkSize = chunkSize;
+	}
+}
+
+void SDMMD_AFCConnectionSetPipelineDepth(SDMMD_AFCConnectionRef conn, uint32_t depth) {
+	if (conn) {
+		depth = (depth == 0x0 ? 0x1 : depth);
+		depth = (depth > kSDMMD_AFCPipelineDepthMax ? kSDMMD_AFCPipelineDepthMax : depth);
+		conn->pipelineDepth = depth;
+	}
+}
+
+void SDMMD_AFCHeaderInit(SDMMD_AFCPacketHeader *header, uint32_t command, uint32_t size, uint32_t data, uint32_t pack_num) {
+	header->signature = 0x4141504c36414643;
+	header->headerLen = size;
+	header->packetLen = data+size;
+	header->type = command;
+	if (pack_num) {
+		header->pid = pack_num;
+	} else {
+		header->pid = 0xffffffff;
+	}
+}
+
+#pragma mark -
+#pragma mark Operations
+#pragma mark -
+
+// Small operations (every path and file handle request, and most replies) are recycled through a free list instead of going back to malloc
+static pthread_mutex_t SDMMD_AFCOperationPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static SDMMD_AFCOperationRef SDMMD_AFCOperationPool = NULL;
+static uint32_t SDMMD_AFCOperationPoolCount = 0x0;
+static volatile uint64_t SDMMD_AFCOperationAllocations = 0x0;
+static volatile uint64_t SDMMD_AFCOperationReuses = 0x0;
+
+// The operation, its packet and the packet data share one block, data is followed by a NUL so path replies can be read as strings
+static SDMMD_AFCOperationRef SDMMD_AFCOperationAllocate(uint64_t dataLength) {
+	SDMMD_AFCOperationRef op = NULL;
+	uint32_t capacity = 0x0;
+	if (dataLength <= kSDMMD_AFCOperationPoolDataSize) {
+		capacity = kSDMMD_AFCOperationPoolDataSize;
+		pthread_mutex_lock(&SDMMD_AFCOperationPoolLock);
+		op = SDMMD_AFCOperationPool;
+		if (op) {
+			SDMMD_AFCOperationPool = op->next;
+			SDMMD_AFCOperationPoolCount--;
+		}
+		pthread_mutex_unlock(&SDMMD_AFCOperationPoolLock);
+	}
+	if (op) {
+		__sync_add_and_fetch(&SDMMD_AFCOperationReuses, 0x1);
+	} else {
+		op = malloc(sizeof(struct sdmmd_AFCOperation) + sizeof(struct sdmmd_AFCPacket) + (capacity ? capacity : dataLength) + 0x1);
+		__sync_add_and_fetch(&SDMMD_AFCOperationAllocations, 0x1);
+	}
+	op->packet = (struct sdmmd_AFCPacket *)(op + 0x1);
+	op->packet->data = (op->packet + 0x1);
+	op->timeout = 0x0;
+	op->capacity = capacity;
+	op->next = NULL;
+	((char *)op->packet->data)[dataLength] = '\0';
+	return op;
+}
+
+void SDMMD_AFCOperationRelease(SDMMD_AFCOperationRef op) {
+	if (op) {
+		if (op->capacity) {
+			pthread_mutex_lock(&SDMMD_AFCOperationPoolLock);
+			if (SDMMD_AFCOperationPoolCount < kSDMMD_AFCOperationPoolMax) {
+				op->next = SDMMD_AFCOperationPool;
+				SDMMD_AFCOperationPool = op;
+				SDMMD_AFCOperationPoolCount++;
+				op = NULL;
+			}
+			pthread_mutex_unlock(&SDMMD_AFCOperationPoolLock);
+		}
+		free(op);
+	}
+}
+
+void SDMMD_AFCOperationGetPoolStatistics(uint64_t *allocations, uint64_t *reuses) {
+	if (allocations) {
+		*allocations = SDMMD_AFCOperationAllocations;
+	}
+	if (reuses) {
+		*reuses = SDMMD_AFCOperationReuses;
+	}
+}
+
+// Header data (file handles, lengths, modes) and the payload are stored back to back in packet->data, the header lengths tell them apart
+static SDMMD_AFCOperationRef SDMMD_AFCOperationCreateWithArguments(uint32_t type, const void *arguments, uint32_t argumentsLength, const void *payload, uint32_t payloadLength) {
+	SDMMD_AFCOperationRef op = SDMMD_AFCOperationAllocate(argumentsLength+payloadLength);
+	if (argumentsLength) {
+		memcpy(op->packet->data, arguments, argumentsLength);
+	}
+	if (payloadLength) {
+		memcpy((char*)op->packet->data+argumentsLength, payload, payloadLength);
+	}
+	SDMMD_AFCHeaderInit(&op->packet->header, type, sizeof(SDMMD_AFCPacketHeader)+argumentsLength, payloadLength, 0x0);
+	return op;
+}
+
+static CFIndex SDMMD_AFCPathLength(CFStringRef path) {
+	CFIndex length = 0x0;
+	CFStringGetBytes(path, CFRangeMake(0x0, CFStringGetLength(path)), kCFStringEncodingUTF8, 0x0, false, NULL, 0x0, &length);
+	return length;
+}
+
+// Writes the path as a NUL terminated UTF-8 string straight into the packet, returns the bytes used
+static CFIndex SDMMD_AFCEncodePath(CFStringRef path, char *destination, CFIndex length) {
+	CFStringGetBytes(path, CFRangeMake(0x0, CFStringGetLength(path)), kCFStringEncodingUTF8, 0x0, false, (UInt8 *)destination, length, NULL);
+	destination[length] = '\0';
+	return length + 0x1;
+}
+
+// Path operations carry the fixed width arguments first and the NUL terminated paths last, second may be NULL
+static SDMMD_AFCOperationRef SDMMD_AFCOperationCreateWithPaths(uint64_t type, const uint64_t *values, uint32_t valueCount, CFStringRef first, CFStringRef second) {
+	uint32_t valuesLength = valueCount*(uint32_t)sizeof(uint64_t);
+	CFIndex firstLength = SDMMD_AFCPathLength(first);
+	CFIndex secondLength = (second ? SDMMD_AFCPathLength(second) : 0x0);
+	uint32_t argumentsLength = valuesLength + (uint32_t)firstLength + 0x1 + (second ? (uint32_t)secondLength + 0x1 : 0x0);
+	SDMMD_AFCOperationRef op = SDMMD_AFCOperationAllocate(argumentsLength);
+	char *cursor = op->packet->data;
+	if (valuesLength) {
+		memcpy(cursor, values, valuesLength);
+		cursor += valuesLength;
+	}
+	cursor += SDMMD_AFCEncodePath(first, cursor, firstLength);
+	if (second) {
+		SDMMD_AFCEncodePath(second, cursor, secondLength);
+	}
+	SDMMD_AFCHeaderInit(&op->packet->header, (uint32_t)type, sizeof(SDMMD_AFCPacketHeader)+argumentsLength, 0x0, 0x0);
+	return op;
+}
+
+static SDMMD_AFCOperationRef SDMMD_AFCOperationCreateWithPath(uint64_t type, const uint64_t *values, uint32_t valueCount, CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPaths(type, values, valueCount, path, NULL);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateReadDirectory(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeReadDirectory, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRemovePath(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeRemovePath, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateMakeDirectory(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeMakeDirectory, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileInfo(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeGetFileInfo, NULL, 0x0, path);
+}
+
+// The path is the only argument, the file contents are the payload
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateWriteFileAtomic(CFStringRef path, CFDataRef data) {
+	CFIndex pathLength = SDMMD_AFCPathLength(path);
+	uint32_t argumentsLength = (uint32_t)pathLength + 0x1;
+	uint32_t payloadLength = (uint32_t)CFDataGetLength(data);
+	SDMMD_AFCOperationRef op = SDMMD_AFCOperationAllocate(argumentsLength + payloadLength);
+	SDMMD_AFCEncodePath(path, op->packet->data, pathLength);
+	if (payloadLength) {
+		memcpy((char*)op->packet->data + argumentsLength, CFDataGetBytePtr(data), payloadLength);
+	}
+	SDMMD_AFCHeaderInit(&op->packet->header, kSDMMD_AFCPacketTypeWriteFileAtomic, sizeof(SDMMD_AFCPacketHeader)+argumentsLength, payloadLength, 0x0);
+	return op;
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetDeviceInfo() {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeGetDeviceInfo, NULL, 0x0, NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateOpenFile(CFStringRef path, uint64_t mode) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeFileRefOpen, &mode, 0x1, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateReadOperation(uint64_t fileRef, uint64_t length) {
+	uint64_t arguments[0x2] = {fileRef, length};
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefRead, arguments, sizeof(arguments), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateWriteOperation(uint64_t fileRef, CFDataRef data) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefWrite, &fileRef, sizeof(uint64_t), CFDataGetBytePtr(data), (uint32_t)CFDataGetLength(data));
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateSeekOperation(uint64_t fileRef, int64_t offset, uint64_t origin) {
+	uint64_t arguments[0x3] = {fileRef, origin, (uint64_t)offset};
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefSeek, arguments, sizeof(arguments), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateTellOperation(uint64_t fileRef) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefTell, &fileRef, sizeof(uint64_t), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateCloseOperation(uint64_t fileRef) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefClose, &fileRef, sizeof(uint64_t), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateSetFileSizeOperation(uint64_t fileRef, uint64_t size) {
+	uint64_t arguments[0x2] = {fileRef, size};
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefSetFileSize, arguments, sizeof(arguments), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRenamePath(CFStringRef old, CFStringRef new) {
+	return SDMMD_AFCOperationCreateWithPaths(kSDMMD_AFCPacketTypeRenamePath, NULL, 0x0, old, new);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateLockOperation(uint64_t fileRef, uint64_t operation) {
+	uint64_t arguments[0x2] = {fileRef, operation};
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeFileRefLock, arguments, sizeof(arguments), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateLinkPath(uint64_t linkType, CFStringRef target, CFStringRef link) {
+	return SDMMD_AFCOperationCreateWithPaths(kSDMMD_AFCPacketTypeMakeLink, &linkType, 0x1, target, link);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateDirectoryEnumeratorOpen(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeDirectoryEnumeratorRefOpen, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCDirectoryEnumeratorCreateReadOperation(uint64_t enumerator) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeDirectoryEnumeratorRefRead, &enumerator, sizeof(uint64_t), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCDirectoryEnumeratorCreateCloseOperation(uint64_t enumerator) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeDirectoryEnumeratorRefClose, &enumerator, sizeof(uint64_t), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetSizeOfPathContents(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeGetSizeOfPathContents, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRemovePathAndContents(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeRemovePathAndContents, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileHash(CFStringRef path) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeGetFileHash, NULL, 0x0, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileHashWithRange(CFStringRef path, uint64_t start, uint64_t end) {
+	uint64_t range[0x2] = {start, end};
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeGetFileHashWithRange, range, 0x2, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetModTime(CFStringRef path, uint64_t modTime) {
+	return SDMMD_AFCOperationCreateWithPath(kSDMMD_AFCPacketTypeSetModTime, &modTime, 0x1, path);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetFSBlockSize(uint64_t size) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeSetFSBlockSize, &size, sizeof(uint64_t), NULL, 0x0);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetSocketBlockSize(uint64_t size) {
+	return SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeSetSocketBlockSize, &size, sizeof(uint64_t), NULL, 0x0);
+}
+
+static void SDMMD_AFCAppendOption(const void *key, const void *value, void *context) {
+	CFMutableDataRef data = context;
+	CFStringRef string = (CFGetTypeID(value) == CFStringGetTypeID() ? CFRetain(value) : CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@"), value));
+	CFStringRef pair[0x2] = {key, string};
+	for (uint32_t index = 0x0; index < 0x2; index++) {
+		CFIndex length = SDMMD_AFCPathLength(pair[index]);
+		CFIndex offset = CFDataGetLength(data);
+		CFDataIncreaseLength(data, length + 0x1);
+		SDMMD_AFCEncodePath(pair[index], (char *)CFDataGetMutableBytePtr(data) + offset, length);
+	}
+	CFRelease(string);
+}
+
+// Options go out as NUL terminated key and value strings, the same layout GetFileInfo replies use
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetConnectionOptions(CFDictionaryRef options) {
+	CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault, 0x0);
+	CFDictionaryApplyFunction(options, SDMMD_AFCAppendOption, data);
+	SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateWithArguments(kSDMMD_AFCPacketTypeSetConnectionOptions, CFDataGetBytePtr(data), (uint32_t)CFDataGetLength(data), NULL, 0x0);
+	CFRelease(data);
+	return op;
+}
+
+static sdmmd_return_t SDMMD_AFCSendBytes(SocketConnection sock, const void *bytes, uint64_t length) {
+	const char *cursor = bytes;
+	while (length) {
+		ssize_t sent;
+		if (sock.isSSL) {
+			sent = SSL_write(sock.socket.ssl, cursor, (int)(length > 0x40000000 ? 0x40000000 : length));
+		} else {
+			sent = send(sock.socket.conn, cursor, length, 0x0);
+		}
+		if (sent <= 0) {
+			if (sent < 0 && !sock.isSSL && errno == EINTR) {
+				continue;
+			}
+			return kAMDNotConnectedError;
+		}
+		cursor += sent;
+		length -= sent;
+	}
+	return kAMDSuccess;
+}
+
+// Passing NULL for bytes reads and throws away length bytes, used to skip parts of a reply nobody asked for
+static sdmmd_return_t SDMMD_AFCReceiveBytes(SocketConnection sock, void *bytes, uint64_t length) {
+	char scratch[0x1000];
+	char *cursor = bytes;
+	while (length) {
+		char *target = (cursor ? cursor : scratch);
+		uint64_t wanted = (cursor ? length : (length > sizeof(scratch) ? sizeof(scratch) : length));
+		ssize_t received;
+		if (sock.isSSL) {
+			received = SSL_read(sock.socket.ssl, target, (int)(wanted > 0x40000000 ? 0x40000000 : wanted));
+		} else {
+			received = recv(sock.socket.conn, target, wanted, 0x0);
+		}
+		if (received <= 0) {
+			if (received < 0 && !sock.isSSL && errno == EINTR) {
+				continue;
+			}
+			return kAMDNotConnectedError;
+		}
+		if (cursor) {
+			cursor += received;
+		}
+		length -= received;
+	}
+	return kAMDSuccess;
+}
+
+// Payload of a request that is sent straight from a local file rather than from memory
+struct sdmmd_AFCPayloadFile {
+	int fd;
+	uint64_t offset;
+};
+
+// On a plain socket the kernel copies the file to the socket itself, anything sendfile() will not do is read through buffer and sent from there
+static sdmmd_return_t SDMMD_AFCSendFileBytes(SocketConnection sock, char *buffer, const struct sdmmd_AFCPayloadFile *file, uint64_t length) {
+	uint64_t offset = file->offset;
+	bool useSendFile = !sock.isSSL;
+	while (length) {
+		if (useSendFile) {
+			off_t sent = (off_t)length;
+			int status = sendfile(file->fd, (int)sock.socket.conn, (off_t)offset, &sent, NULL, 0x0);
+			offset += (uint64_t)sent;
+			length -= (uint64_t)sent;
+			if (status == -1 && errno != EINTR && errno != EAGAIN) {
+				useSendFile = false;
+			} else if (status == 0x0 && sent == 0x0 && length) {
+				// the file is shorter than the packet claims
+				return kAMDUndefinedError;
+			}
+			continue;
+		}
+		uint64_t chunk = (length > kSDMMD_AFCSendBufferSize ? kSDMMD_AFCSendBufferSize : length);
+		ssize_t readLength = pread(file->fd, buffer, chunk, (off_t)offset);
+		if (readLength <= 0x0) {
+			if (readLength == -1 && errno == EINTR) {
+				continue;
+			}
+			return kAMDUndefinedError;
+		}
+		sdmmd_return_t result = SDMMD_AFCSendBytes(sock, buffer, (uint64_t)readLength);
+		if (result != kAMDSuccess) {
+			return result;
+		}
+		offset += (uint64_t)readLength;
+		length -= (uint64_t)readLength;
+	}
 	return kAMDSuccess;
 }
 
-SDMMD_AFCConnectionRef SDMMD_AFCConnectionCreate(SDMMD_AMConnectionRef conn) {
-	SDMMD_AFCConnectionRef afc = calloc(1, sizeof(struct sdmmd_AFCConnectionClass));
-	afc->handle = conn;
-	CFStringRef name = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%s.%s.%s"), "com.samdmarshall.sdmmobiledevice.afc", SDMCFStringGetString((conn->ivars.device)->ivars.unique_device_id), SDMCFStringGetString(SDMGetCurrentDateString()));
-	afc->operationQueue = dispatch_queue_create(SDMCFStringGetString(name), NULL);
-	afc->operationCount = 0;
-	return afc;
+// When file is set the payload comes from it and payload is ignored
+static sdmmd_return_t SDMMD_AFCSendPacket(SDMMD_AFCConnectionRef conn, SDMMD_AFCPacketHeader *header, const void *arguments, const void *payload, const struct sdmmd_AFCPayloadFile *file) {
+	SocketConnection sock = SDMMD_TranslateConnectionToSocket(conn->handle);
+	uint64_t argumentsLength = header->headerLen - sizeof(SDMMD_AFCPacketHeader);
+	uint64_t payloadLength = header->packetLen - header->headerLen;
+	uint64_t packed = sizeof(SDMMD_AFCPacketHeader) + argumentsLength;
+	sdmmd_return_t result = kAMDSuccess;
+	if (packed > kSDMMD_AFCSendBufferSize) {
+		result = SDMMD_AFCSendBytes(sock, header, sizeof(SDMMD_AFCPacketHeader));
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCSendBytes(sock, arguments, argumentsLength);
+		}
+		if (result == kAMDSuccess && payloadLength) {
+			result = (file ? SDMMD_AFCSendFileBytes(sock, conn->sendBuffer, file, payloadLength) : SDMMD_AFCSendBytes(sock, payload, payloadLength));
+		}
+		return result;
+	}
+	// one write per request instead of up to three, file data too large for the buffer is still sent without a copy
+	char *buffer = conn->sendBuffer;
+	memcpy(buffer, header, sizeof(SDMMD_AFCPacketHeader));
+	if (argumentsLength) {
+		memcpy(&buffer[sizeof(SDMMD_AFCPacketHeader)], arguments, argumentsLength);
+	}
+	bool packPayload = (payloadLength && file == NULL && packed + payloadLength <= kSDMMD_AFCSendBufferSize);
+	if (packPayload) {
+		memcpy(&buffer[packed], payload, payloadLength);
+		packed += payloadLength;
+	}
+	result = SDMMD_AFCSendBytes(sock, buffer, packed);
+	if (result == kAMDSuccess && payloadLength && !packPayload) {
+		result = (file ? SDMMD_AFCSendFileBytes(sock, buffer, file, payloadLength) : SDMMD_AFCSendBytes(sock, payload, payloadLength));
+	}
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCReceiveHeader(SocketConnection sock, SDMMD_AFCPacketHeader *header) {
+	sdmmd_return_t result = SDMMD_AFCReceiveBytes(sock, header, sizeof(SDMMD_AFCPacketHeader));
+	if (result == kAMDSuccess) {
+		if (header->signature != 0x4141504c36414643 || header->headerLen < sizeof(SDMMD_AFCPacketHeader) || header->packetLen < header->headerLen) {
+			printf("SDMMD_AFCReceiveHeader: Invalid packet header.\n");
+			result = kAMDBadHeaderError;
+		}
+	}
+	return result;
+}
+
+// Reads the rest of a packet whose header has already been read, reply is NULL when nobody is waiting for it anymore
+static sdmmd_return_t SDMMD_AFCReceiveReplyBody(SocketConnection sock, SDMMD_AFCPacketHeader *header, struct sdmmd_AFCPendingReply *reply) {
+	sdmmd_return_t result = kAMDSuccess;
+	uint64_t argumentsLength = header->headerLen - sizeof(SDMMD_AFCPacketHeader);
+	uint64_t bodyLength = header->packetLen - header->headerLen;
+	if (reply == NULL) {
+		result = SDMMD_AFCReceiveBytes(sock, NULL, argumentsLength + bodyLength);
+	} else if (reply->keepPacket) {
+		SDMMD_AFCOperationRef response = SDMMD_AFCOperationAllocate(argumentsLength + bodyLength);
+		result = SDMMD_AFCReceiveBytes(sock, response->packet->data, argumentsLength + bodyLength);
+		if (result == kAMDSuccess) {
+			response->packet->header = *header;
+			reply->response = response;
+		} else {
+			SDMMD_AFCOperationRelease(response);
+		}
+	} else {
+		uint64_t keep = (argumentsLength > sizeof(reply->arguments) ? sizeof(reply->arguments) : argumentsLength);
+		uint64_t capacity = (reply->payload ? reply->payloadLength : 0x0);
+		uint64_t copied = (bodyLength > capacity ? capacity : bodyLength);
+		result = SDMMD_AFCReceiveBytes(sock, reply->arguments, keep);
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCReceiveBytes(sock, NULL, argumentsLength - keep);
+		}
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCReceiveBytes(sock, reply->payload, copied);
+		}
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCReceiveBytes(sock, NULL, bodyLength - copied);
+		}
+		reply->payloadLength = copied;
+	}
+	if (reply) {
+		reply->type = header->type;
+	}
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCStatusToResult(uint64_t status) {
+	return (status == 0x0 ? kAMDSuccess : AMDErrorMake((uint32_t)(status & 0xff)));
+}
+
+sdmmd_return_t SDMMD_AFCOperationGetResponseStatus(SDMMD_AFCOperationRef response) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (response && response->packet) {
+		result = kAMDSuccess;
+		if (response->packet->header.type == kSDMMD_AFCPacketTypeStatus) {
+			uint64_t status = 0x0;
+			if (response->packet->header.headerLen >= sizeof(SDMMD_AFCPacketHeader)+sizeof(uint64_t)) {
+				memcpy(&status, response->packet->data, sizeof(uint64_t));
+			}
+			result = SDMMD_AFCStatusToResult(status);
+		}
+	}
+	return result;
+}
+
+#pragma mark -
+#pragma mark Metadata Cache
+#pragma mark -
+
+// A cached GetFileInfo answer, info is NULL for a negative entry and result then holds the error the device gave
+struct sdmmd_AFCMetadataEntry {
+	CFAbsoluteTime expires;
+	sdmmd_return_t result;
+	CFDictionaryRef info;
+};
+
+struct sdmmd_AFCMetadataCache {
+	pthread_mutex_t lock;				// guards everything below
+	CFTimeInterval ttl;					// 0 while the cache is off
+	CFMutableDictionaryRef entries;		// path -> struct sdmmd_AFCMetadataEntry
+	CFMutableDictionaryRef writers;		// file handle -> path, for handles opened for writing
+	uint64_t generation;				// bumped by every invalidation, a lookup only stores its answer if nothing changed while it was in flight
+	uint64_t hits;
+	uint64_t negativeHits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+static void SDMMD_AFCMetadataEntryRelease(CFAllocatorRef allocator, const void *value) {
+	struct sdmmd_AFCMetadataEntry *entry = (struct sdmmd_AFCMetadataEntry *)value;
+	if (entry->info) {
+		CFRelease(entry->info);
+	}
+	free(entry);
+}
+
+static struct sdmmd_AFCMetadataCache* SDMMD_AFCMetadataCacheCreate() {
+	struct sdmmd_AFCMetadataCache *cache = calloc(1, sizeof(struct sdmmd_AFCMetadataCache));
+	CFDictionaryValueCallBacks entryCallBacks = {0x0, NULL, SDMMD_AFCMetadataEntryRelease, NULL, NULL};
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->entries = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &entryCallBacks);
+	cache->writers = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	return cache;
+}
+
+static void SDMMD_AFCMetadataCacheRelease(struct sdmmd_AFCMetadataCache *cache) {
+	if (cache) {
+		CFRelease(cache->entries);
+		CFRelease(cache->writers);
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+	}
+}
+
+// "/a/b/" and "/a/b" name the same entry
+static CFStringRef SDMMD_AFCMetadataCacheCreateKey(CFStringRef path) {
+	CFIndex length = CFStringGetLength(path);
+	while (length > 0x1 && CFStringGetCharacterAtIndex(path, length-0x1) == '/') {
+		length--;
+	}
+	return CFStringCreateWithSubstring(kCFAllocatorDefault, path, CFRangeMake(0x0, length));
+}
+
+static void SDMMD_AFCMetadataCacheCollectDescendant(const void *key, const void *value, void *context) {
+	CFMutableArrayRef *match = context;
+	if (CFStringHasPrefix(key, match[0x0])) {
+		CFArrayAppendValue(match[0x1], key);
+	}
+}
+
+// Must be called with the cache lock held. Creating, removing or renaming something also changes the parent directory (and a MakeDirectory can
+// bring missing ancestors into existence), removing or renaming a directory takes everything below it along.
+static void SDMMD_AFCMetadataCacheInvalidateKey(struct sdmmd_AFCMetadataCache *cache, CFStringRef key, bool ancestors, bool descendants) {
+	cache->generation++;
+	cache->invalidations++;
+	if (CFDictionaryGetCount(cache->entries) == 0x0) {
+		return;
+	}
+	CFDictionaryRemoveValue(cache->entries, key);
+	if (ancestors) {
+		CFIndex end = CFStringGetLength(key);
+		CFRange slash;
+		while (end > 0x1 && CFStringFindWithOptions(key, CFSTR("/"), CFRangeMake(0x0, end), kCFCompareBackwards, &slash)) {
+			end = (slash.location ? slash.location : 0x1);
+			CFStringRef parent = CFStringCreateWithSubstring(kCFAllocatorDefault, key, CFRangeMake(0x0, end));
+			CFDictionaryRemoveValue(cache->entries, parent);
+			CFRelease(parent);
+		}
+	}
+	if (descendants) {
+		CFMutableArrayRef match[0x2];
+		match[0x0] = (CFMutableArrayRef)(CFStringHasSuffix(key, CFSTR("/")) ? CFRetain(key) : CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@/"), key));
+		match[0x1] = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+		CFDictionaryApplyFunction(cache->entries, SDMMD_AFCMetadataCacheCollectDescendant, match);
+		for (CFIndex index = 0x0; index < CFArrayGetCount(match[0x1]); index++) {
+			CFDictionaryRemoveValue(cache->entries, CFArrayGetValueAtIndex(match[0x1], index));
+		}
+		CFRelease(match[0x0]);
+		CFRelease(match[0x1]);
+	}
+}
+
+// Must be called with the cache lock held, path is a NUL terminated string taken from a request
+static void SDMMD_AFCMetadataCacheInvalidatePath(struct sdmmd_AFCMetadataCache *cache, const char *path, bool ancestors, bool descendants) {
+	CFStringRef string = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+	if (string) {
+		CFStringRef key = SDMMD_AFCMetadataCacheCreateKey(string);
+		SDMMD_AFCMetadataCacheInvalidateKey(cache, key, ancestors, descendants);
+		CFRelease(key);
+		CFRelease(string);
+	}
+}
+
+// Must be called with the cache lock held
+static void SDMMD_AFCMetadataCacheInvalidateFileRef(struct sdmmd_AFCMetadataCache *cache, uint64_t fileRef, bool closing) {
+	CFNumberRef handle = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &fileRef);
+	CFStringRef key = CFDictionaryGetValue(cache->writers, handle);
+	if (key) {
+		SDMMD_AFCMetadataCacheInvalidateKey(cache, key, false, false);
+		if (closing) {
+			CFDictionaryRemoveValue(cache->writers, handle);
+		}
+	}
+	CFRelease(handle);
+}
+
+// Every request goes through here before it is sent, so anything this connection changes on the device is dropped from the cache first
+static void SDMMD_AFCMetadataCacheNoteRequest(SDMMD_AFCConnectionRef conn, SDMMD_AFCPacketHeader *header, const void *arguments) {
+	struct sdmmd_AFCMetadataCache *cache = conn->metadataCache;
+	if (cache == NULL) {
+		return;
+	}
+	const char *data = arguments;
+	uint64_t argumentsLength = header->headerLen - sizeof(SDMMD_AFCPacketHeader);
+	pthread_mutex_lock(&cache->lock);
+	if (cache->ttl > 0.0) {
+		switch (header->type) {
+			case kSDMMD_AFCPacketTypeRemovePath:
+			case kSDMMD_AFCPacketTypeRemovePathAndContents: {
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, data, true, true);
+				break;
+			}
+			case kSDMMD_AFCPacketTypeWriteFileAtomic:
+			case kSDMMD_AFCPacketTypeMakeDirectory: {
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, data, true, false);
+				break;
+			}
+			case kSDMMD_AFCPacketTypeRenamePath: {
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, data, true, true);
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, data + strlen(data) + 0x1, true, true);
+				break;
+			}
+			case kSDMMD_AFCPacketTypeMakeLink: {
+				// link type, target, then the link itself
+				const char *target = data + sizeof(uint64_t);
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, target + strlen(target) + 0x1, true, false);
+				break;
+			}
+			case kSDMMD_AFCPacketTypeSetModTime: {
+				SDMMD_AFCMetadataCacheInvalidatePath(cache, data + sizeof(uint64_t), false, false);
+				break;
+			}
+			case kSDMMD_AFCPacketTypeFileRefOpen: {
+				uint64_t mode = 0x0;
+				memcpy(&mode, data, sizeof(uint64_t));
+				if (mode != kSDMMD_AFCFileModeRead) {
+					SDMMD_AFCMetadataCacheInvalidatePath(cache, data + sizeof(uint64_t), true, false);
+				}
+				break;
+			}
+			case kSDMMD_AFCPacketTypeFileRefWrite:
+			case kSDMMD_AFCPacketTypeFileRefSetFileSize:
+			case kSDMMD_AFCPacketTypeFileRefClose: {
+				if (argumentsLength >= sizeof(uint64_t)) {
+					uint64_t fileRef = 0x0;
+					memcpy(&fileRef, data, sizeof(uint64_t));
+					SDMMD_AFCMetadataCacheInvalidateFileRef(cache, fileRef, (header->type == kSDMMD_AFCPacketTypeFileRefClose));
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Writes through a handle only name the handle, so remember which path it belongs to until it is closed
+static void SDMMD_AFCMetadataCacheNoteOpen(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t mode, uint64_t fileRef) {
+	struct sdmmd_AFCMetadataCache *cache = conn->metadataCache;
+	if (cache && mode != kSDMMD_AFCFileModeRead) {
+		CFNumberRef handle = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &fileRef);
+		CFStringRef key = SDMMD_AFCMetadataCacheCreateKey(path);
+		pthread_mutex_lock(&cache->lock);
+		if (cache->ttl > 0.0) {
+			CFDictionarySetValue(cache->writers, handle, key);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		CFRelease(key);
+		CFRelease(handle);
+	}
+}
+
+static void SDMMD_AFCMetadataCacheCollectExpired(const void *key, const void *value, void *context) {
+	const struct sdmmd_AFCMetadataEntry *entry = value;
+	CFMutableArrayRef expired = context;
+	if (entry->expires <= CFAbsoluteTimeGetCurrent()) {
+		CFArrayAppendValue(expired, key);
+	}
+}
+
+struct sdmmd_AFCMetadataAge {
+	const void *key;
+	CFAbsoluteTime expires;
+};
+
+static int SDMMD_AFCMetadataCompareAge(const void *a, const void *b) {
+	CFAbsoluteTime left = ((const struct sdmmd_AFCMetadataAge *)a)->expires;
+	CFAbsoluteTime right = ((const struct sdmmd_AFCMetadataAge *)b)->expires;
+	return (left < right ? -1 : (left > right ? 1 : 0x0));
+}
+
+// Must be called with the cache lock held, makes room by dropping expired entries and then the oldest ones. Every entry lives for the same ttl, so
+// the earliest to expire is the one fetched longest ago. Trims to kSDMMD_AFCMetadataCacheEntriesLow so a walk that keeps the cache full sorts only
+// once in a while.
+static void SDMMD_AFCMetadataCacheTrim(struct sdmmd_AFCMetadataCache *cache) {
+	if (CFDictionaryGetCount(cache->entries) >= kSDMMD_AFCMetadataCacheEntriesMax) {
+		CFMutableArrayRef expired = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+		CFDictionaryApplyFunction(cache->entries, SDMMD_AFCMetadataCacheCollectExpired, expired);
+		for (CFIndex index = 0x0; index < CFArrayGetCount(expired); index++) {
+			CFDictionaryRemoveValue(cache->entries, CFArrayGetValueAtIndex(expired, index));
+		}
+		CFRelease(expired);
+		CFIndex count = CFDictionaryGetCount(cache->entries);
+		if (count >= kSDMMD_AFCMetadataCacheEntriesMax) {
+			const void **keys = calloc(count, sizeof(void *));
+			const void **values = calloc(count, sizeof(void *));
+			struct sdmmd_AFCMetadataAge *ages = calloc(count, sizeof(struct sdmmd_AFCMetadataAge));
+			CFDictionaryGetKeysAndValues(cache->entries, keys, values);
+			for (CFIndex index = 0x0; index < count; index++) {
+				ages[index].key = CFRetain(keys[index]);
+				ages[index].expires = ((const struct sdmmd_AFCMetadataEntry *)values[index])->expires;
+			}
+			qsort(ages, count, sizeof(struct sdmmd_AFCMetadataAge), SDMMD_AFCMetadataCompareAge);
+			for (CFIndex index = 0x0; index < count; index++) {
+				if (index < count - kSDMMD_AFCMetadataCacheEntriesLow) {
+					CFDictionaryRemoveValue(cache->entries, ages[index].key);
+				}
+				CFRelease(ages[index].key);
+			}
+			free(ages);
+			free(values);
+			free(keys);
+		}
+	}
+}
+
+void SDMMD_AFCConnectionSetMetadataCacheTTL(SDMMD_AFCConnectionRef conn, CFTimeInterval ttl) {
+	if (conn) {
+		// the cache is never freed before the connection, so requests already past the NULL check stay safe
+		if (conn->metadataCache == NULL && ttl > 0.0) {
+			struct sdmmd_AFCMetadataCache *cache = SDMMD_AFCMetadataCacheCreate();
+			if (!__sync_bool_compare_and_swap(&conn->metadataCache, NULL, cache)) {
+				SDMMD_AFCMetadataCacheRelease(cache);
+			}
+		}
+		struct sdmmd_AFCMetadataCache *cache = conn->metadataCache;
+		if (cache) {
+			pthread_mutex_lock(&cache->lock);
+			cache->ttl = (ttl > 0.0 ? ttl : 0.0);
+			if (cache->ttl == 0.0) {
+				CFDictionaryRemoveAllValues(cache->entries);
+				CFDictionaryRemoveAllValues(cache->writers);
+				cache->generation++;
+			}
+			pthread_mutex_unlock(&cache->lock);
+		}
+	}
+}
+
+void SDMMD_AFCConnectionFlushMetadataCache(SDMMD_AFCConnectionRef conn) {
+	struct sdmmd_AFCMetadataCache *cache = (conn ? conn->metadataCache : NULL);
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		CFDictionaryRemoveAllValues(cache->entries);
+		cache->generation++;
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+void SDMMD_AFCConnectionGetMetadataCacheStatistics(SDMMD_AFCConnectionRef conn, uint64_t *hits, uint64_t *negativeHits, uint64_t *misses, uint64_t *invalidations) {
+	struct sdmmd_AFCMetadataCache *cache = (conn ? conn->metadataCache : NULL);
+	uint64_t counts[0x4] = {0};
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		counts[0x0] = cache->hits;
+		counts[0x1] = cache->negativeHits;
+		counts[0x2] = cache->misses;
+		counts[0x3] = cache->invalidations;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	if (hits) {
+		*hits = counts[0x0];
+	}
+	if (negativeHits) {
+		*negativeHits = counts[0x1];
+	}
+	if (misses) {
+		*misses = counts[0x2];
+	}
+	if (invalidations) {
+		*invalidations = counts[0x3];
+	}
+}
+
+#pragma mark -
+#pragma mark Reply Routing
+#pragma mark -
+
+static void SDMMD_AFCDeliverReply(struct sdmmd_AFCPendingReply *reply) {
+	if (reply->deliver) {
+		reply->deliver(reply);
+	} else {
+		dispatch_semaphore_signal(reply->done);
+	}
+}
+
+static dispatch_time_t SDMMD_AFCConnectionDeadline(SDMMD_AFCConnectionRef conn) {
+	return (conn->operationTimeout ? dispatch_time(DISPATCH_TIME_NOW, conn->operationTimeout) : 0x0);
+}
+
+// The operation's own timeout wins, otherwise the connection default counts from now
+static dispatch_time_t SDMMD_AFCOperationDeadline(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op) {
+	return (op->timeout ? op->timeout : SDMMD_AFCConnectionDeadline(conn));
+}
+
+// Must be called with replyLock held, returns false if the reply was already claimed by the reader
+static bool SDMMD_AFCUnlinkPendingReply(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCPendingReply *reply) {
+	struct sdmmd_AFCPendingReply **link = &conn->pendingReplies[reply->pid % kSDMMD_AFCReplyBuckets];
+	while (*link) {
+		if (*link == reply) {
+			*link = reply->next;
+			conn->pendingCount--;
+			return true;
+		}
+		link = &(*link)->next;
+	}
+	return false;
+}
+
+static struct sdmmd_AFCPendingReply* SDMMD_AFCClaimPendingReply(SDMMD_AFCConnectionRef conn, uint64_t pid) {
+	SDMMD_AFCLockStateLock(&conn->replyLock);
+	struct sdmmd_AFCPendingReply *reply = conn->pendingReplies[pid % kSDMMD_AFCReplyBuckets];
+	while (reply && reply->pid != pid) {
+		reply = reply->next;
+	}
+	if (reply) {
+		SDMMD_AFCUnlinkPendingReply(conn, reply);
+	}
+	SDMMD_AFCLockStateUnlock(&conn->replyLock);
+	return reply;
+}
+
+// The byte stream can not be trusted after a failed send or receive, so every waiter is woken with the error and later requests fail immediately
+static void SDMMD_AFCFailPendingReplies(SDMMD_AFCConnectionRef conn, sdmmd_return_t error) {
+	SDMMD_AFCLockStateLock(&conn->replyLock);
+	conn->transportError = error;
+	for (uint32_t index = 0x0; index < kSDMMD_AFCReplyBuckets; index++) {
+		struct sdmmd_AFCPendingReply *reply = conn->pendingReplies[index];
+		conn->pendingReplies[index] = NULL;
+		while (reply) {
+			struct sdmmd_AFCPendingReply *next = reply->next;
+			reply->result = error;
+			SDMMD_AFCDeliverReply(reply);
+			reply = next;
+		}
+	}
+	conn->pendingCount = 0x0;
+	SDMMD_AFCLockStateUnlock(&conn->replyLock);
+}
+
+// A reader waiting on a reply the device never sends would block forever, shutting the socket down makes it fail every pending reply and exit.
+// Left alone when nothing is owed so the service underneath stays usable. Nothing new is sent afterwards, that includes the closes of cancelled opens.
+static void SDMMD_AFCConnectionTeardownIfOwed(SDMMD_AFCConnectionRef conn) {
+	SDMMD_AFCLockStateLock(&conn->replyLock);
+	conn->closing = true;
+	bool owed = (conn->transportError == kAMDSuccess && (conn->pendingCount || conn->abandonedCount));
+	SDMMD_AFCLockStateUnlock(&conn->replyLock);
+	if (owed) {
+		shutdown(conn->handle->ivars.socket, SHUT_RDWR);
+	}
+}
+
+// Runs on readerQueue while there are requests outstanding, each reply is handed to whoever sent the packet with the same id
+static void SDMMD_AFCReaderLoop(SDMMD_AFCConnectionRef conn) {
+	SocketConnection sock = SDMMD_TranslateConnectionToSocket(conn->handle);
+	while (true) {
+		SDMMD_AFCLockStateLock(&conn->replyLock);
+		bool idle = (conn->pendingCount == 0x0 || conn->transportError != kAMDSuccess);
+		if (idle) {
+			conn->readerActive = false;
+		}
+		SDMMD_AFCLockStateUnlock(&conn->replyLock);
+		if (idle) {
+			break;
+		}
+		SDMMD_AFCPacketHeader header;
+		sdmmd_return_t result = SDMMD_AFCReceiveHeader(sock, &header);
+		if (result == kAMDSuccess) {
+			struct sdmmd_AFCPendingReply *reply = SDMMD_AFCClaimPendingReply(conn, header.pid);
+			result = SDMMD_AFCReceiveReplyBody(sock, &header, reply);
+			if (reply) {
+				reply->result = result;
+				SDMMD_AFCDeliverReply(reply);
+			} else {
+				SDMMD_AFCLockStateLock(&conn->replyLock);
+				if (conn->abandonedCount) {
+					conn->abandonedCount--;
+				}
+				SDMMD_AFCLockStateUnlock(&conn->replyLock);
+			}
+		}
+		if (result != kAMDSuccess) {
+			printf("SDMMD_AFCReaderLoop: Lost connection to AFC service: 0x%x\n",result);
+			SDMMD_AFCFailPendingReplies(conn, result);
+		}
+	}
+}
+
+// Registers the reply before the packet goes out so the reader can never see an answer it does not know about. On failure nothing is outstanding and the caller must not wait.
+static sdmmd_return_t SDMMD_AFCSubmitPacket(SDMMD_AFCConnectionRef conn, SDMMD_AFCPacketHeader *header, const void *arguments, const void *payload, const struct sdmmd_AFCPayloadFile *file, struct sdmmd_AFCPendingReply *reply) {
+	__block sdmmd_return_t result = kAMDSuccess;
+	SDMMD_AFCMetadataCacheNoteRequest(conn, header, arguments);
+	reply->done = dispatch_semaphore_create(0x0);
+	reply->result = kAMDSuccess;
+	reply->response = NULL;
+	dispatch_sync(conn->operationQueue, ^{
+		bool startReader = false;
+		header->pid = conn->operationCount++;
+		reply->pid = header->pid;
+		SDMMD_AFCLockStateLock(&conn->replyLock);
+		result = conn->transportError;
+		if (result == kAMDSuccess && conn->closing) {
+			result = kAMDNotConnectedError;
+		}
+		if (result == kAMDSuccess) {
+			uint32_t bucket = reply->pid % kSDMMD_AFCReplyBuckets;
+			reply->next = conn->pendingReplies[bucket];
+			conn->pendingReplies[bucket] = reply;
+			conn->pendingCount++;
+			startReader = !conn->readerActive;
+			conn->readerActive = true;
+		}
+		SDMMD_AFCLockStateUnlock(&conn->replyLock);
+		if (startReader) {
+			dispatch_group_async(conn->readerGroup, conn->readerQueue, ^{
+				SDMMD_AFCReaderLoop(conn);
+			});
+		}
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCSendPacket(conn, header, arguments, payload, file);
+			if (result != kAMDSuccess) {
+				// the device never saw all of this request, it is taken back so the caller alone deals with the failure
+				SDMMD_AFCLockStateLock(&conn->replyLock);
+				SDMMD_AFCUnlinkPendingReply(conn, reply);
+				SDMMD_AFCLockStateUnlock(&conn->replyLock);
+				SDMMD_AFCFailPendingReplies(conn, result);
+			}
+		}
+	});
+	if (result != kAMDSuccess) {
+		dispatch_release(reply->done);
+	}
+	return result;
+}
+
+// A timeout of 0 waits forever. A reply that arrives after its waiter gave up is read and dropped by the reader.
+static sdmmd_return_t SDMMD_AFCWaitForReply(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCPendingReply *reply, dispatch_time_t timeout) {
+	sdmmd_return_t result = kAMDSuccess;
+	if (dispatch_semaphore_wait(reply->done, (timeout ? timeout : DISPATCH_TIME_FOREVER)) != 0x0) {
+		SDMMD_AFCLockStateLock(&conn->replyLock);
+		bool unlinked = SDMMD_AFCUnlinkPendingReply(conn, reply);
+		if (unlinked) {
+			conn->abandonedCount++;
+		}
+		SDMMD_AFCLockStateUnlock(&conn->replyLock);
+		if (unlinked) {
+			result = kAMDTimeOutError;
+		} else {
+			// the reader is already filling this reply in
+			dispatch_semaphore_wait(reply->done, DISPATCH_TIME_FOREVER);
+			result = reply->result;
+		}
+	} else {
+		result = reply->result;
+	}
+	dispatch_release(reply->done);
+	return result;
+}
+
+// Turns a delivered reply into a return code, a Status reply is only a success when Status was what the request expects
+static sdmmd_return_t SDMMD_AFCReplyResult(struct sdmmd_AFCPendingReply *reply, uint64_t expectedType) {
+	sdmmd_return_t result = kAMDSuccess;
+	if (reply->type == kSDMMD_AFCPacketTypeStatus) {
+		result = SDMMD_AFCStatusToResult(reply->arguments[0x0]);
+		if (result == kAMDSuccess && expectedType != kSDMMD_AFCPacketTypeStatus) {
+			result = kAMDInvalidResponseError;
+		}
+	} else if (reply->type != expectedType) {
+		result = kAMDInvalidResponseError;
+	}
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCSubmitOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, struct sdmmd_AFCPendingReply *reply) {
+	uint64_t argumentsLength = op->packet->header.headerLen - sizeof(SDMMD_AFCPacketHeader);
+	return SDMMD_AFCSubmitPacket(conn, &op->packet->header, op->packet->data, (char*)op->packet->data + argumentsLength, NULL, reply);
+}
+
+sdmmd_return_t SDMMD_AFCProcessOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, SDMMD_AFCOperationRef *response) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && op && response) {
+		struct sdmmd_AFCPendingReply reply = {.keepPacket = true};
+		result = SDMMD_AFCSubmitOperation(conn, op, &reply);
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCWaitForReply(conn, &reply, SDMMD_AFCOperationDeadline(conn, op));
+		}
+		*response = reply.response;
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCProcessOperations(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef *operations, SDMMD_AFCOperationRef *responses, uint32_t count) {
+	if (conn == NULL || operations == NULL || responses == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	sdmmd_return_t result = kAMDSuccess;
+	struct sdmmd_AFCPendingReply *replies = calloc(kSDMMD_AFCBatchWindow, sizeof(struct sdmmd_AFCPendingReply));
+	bool *submitted = calloc(kSDMMD_AFCBatchWindow, sizeof(bool));
+	uint32_t sent = 0x0;
+	for (uint32_t index = 0x0; index < count; index++) {
+		// refill the window before blocking on the oldest reply
+		while (sent < count && sent < index + kSDMMD_AFCBatchWindow) {
+			uint32_t slot = sent % kSDMMD_AFCBatchWindow;
+			replies[slot] = (struct sdmmd_AFCPendingReply){.keepPacket = true};
+			sdmmd_return_t submitResult = SDMMD_AFCSubmitOperation(conn, operations[sent], &replies[slot]);
+			submitted[slot] = (submitResult == kAMDSuccess);
+			if (submitResult != kAMDSuccess && result == kAMDSuccess) {
+				result = submitResult;
+			}
+			sent++;
+		}
+		uint32_t slot = index % kSDMMD_AFCBatchWindow;
+		responses[index] = NULL;
+		if (submitted[slot]) {
+			sdmmd_return_t waitResult = SDMMD_AFCWaitForReply(conn, &replies[slot], SDMMD_AFCOperationDeadline(conn, operations[index]));
+			if (waitResult != kAMDSuccess && result == kAMDSuccess) {
+				result = waitResult;
+			}
+			responses[index] = replies[slot].response;
+		}
+	}
+	free(submitted);
+	free(replies);
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionPerformOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op) {
+	SDMMD_AFCOperationRef response = NULL;
+	sdmmd_return_t result = SDMMD_AFCProcessOperation(conn, op, &response);
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCOperationGetResponseStatus(response);
+	}
+	SDMMD_AFCOperationRelease(response);
+	return result;
+}
+
+CFDataRef SDMMD_GetDataResponseFromOperation(SDMMD_AFCOperationRef op) {
+	uint64_t argumentsLength = op->packet->header.headerLen - sizeof(SDMMD_AFCPacketHeader);
+	return CFDataCreate(kCFAllocatorDefault, (UInt8*)op->packet->data + argumentsLength, op->packet->header.packetLen-op->packet->header.headerLen);
+}
+
+#pragma mark -
+#pragma mark Asynchronous Operations
+#pragma mark -
+
+void SDMMD_AFCConnectionSetOperationTimeout(SDMMD_AFCConnectionRef conn, CFTimeInterval timeout) {
+	if (conn) {
+		conn->operationTimeout = (timeout > 0.0 ? (int64_t)(timeout * NSEC_PER_SEC) : 0x0);
+	}
+}
+
+SDMMD_AFCFutureRef SDMMD_AFCFutureRetain(SDMMD_AFCFutureRef future) {
+	if (future) {
+		__sync_add_and_fetch(&future->refCount, 0x1);
+	}
+	return future;
+}
+
+void SDMMD_AFCFutureRelease(SDMMD_AFCFutureRef future) {
+	if (future && __sync_sub_and_fetch(&future->refCount, 0x1) == 0x0) {
+		SDMMD_AFCOperationRelease(future->response);
+		if (future->reply.done) {
+			dispatch_release(future->reply.done);
+		}
+		if (future->timer) {
+			dispatch_release(future->timer);
+		}
+		if (future->queue) {
+			dispatch_release(future->queue);
+		}
+		if (future->openPath) {
+			CFRelease(future->openPath);
+		}
+		dispatch_release(future->finished);
+		free(future);
+	}
+}
+
+// The reference and the asyncGroup entry that belong to the request itself, dropped once the reader can no longer hand the reply back
+static void SDMMD_AFCFutureDropRequest(SDMMD_AFCFutureRef future) {
+	dispatch_group_t asyncGroup = future->conn->asyncGroup;
+	SDMMD_AFCFutureRelease(future);
+	dispatch_group_leave(asyncGroup);
+}
+
+// Only the first caller gets to set the outcome, returns false and releases response for everyone else
+static bool SDMMD_AFCFutureFinish(SDMMD_AFCFutureRef future, sdmmd_return_t result, SDMMD_AFCOperationRef response) {
+	if (!__sync_bool_compare_and_swap(&future->state, kSDMMD_AFCFutureStatePending, kSDMMD_AFCFutureStateFinishing)) {
+		SDMMD_AFCOperationRelease(response);
+		return false;
+	}
+	future->result = result;
+	future->response = response;
+	// pollers only read the outcome after seeing Done, so it has to be visible first
+	__sync_synchronize();
+	future->state = kSDMMD_AFCFutureStateDone;
+	if (future->timer) {
+		dispatch_source_cancel(future->timer);
+	}
+	dispatch_group_t asyncGroup = future->conn->asyncGroup;
+	dispatch_group_leave(future->finished);
+	if (future->callback) {
+		SDMMD_AFCFutureRetain(future);
+		dispatch_async(future->queue, ^{
+			future->callback(future, future->context);
+			SDMMD_AFCFutureRelease(future);
+			dispatch_group_leave(asyncGroup);
+		});
+	} else {
+		dispatch_group_leave(asyncGroup);
+	}
+	return true;
+}
+
+// Called by the reader, or with replyLock held when the connection is lost, so nothing here may wait on the connection
+static void SDMMD_AFCFutureDeliver(struct sdmmd_AFCPendingReply *reply) {
+	SDMMD_AFCFutureRef future = (SDMMD_AFCFutureRef)reply;
+	SDMMD_AFCConnectionRef conn = future->conn;
+	SDMMD_AFCOperationRef response = reply->response;
+	reply->response = NULL;
+	sdmmd_return_t result = reply->result;
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCOperationGetResponseStatus(response);
+	}
+	uint64_t fileRef = 0x0;
+	bool opened = (result == kAMDSuccess && future->requestType == kSDMMD_AFCPacketTypeFileRefOpen && response->packet->header.type == kSDMMD_AFCPacketTypeFileRefOpenResult && response->packet->header.headerLen >= sizeof(SDMMD_AFCPacketHeader)+sizeof(uint64_t));
+	if (opened) {
+		memcpy(&fileRef, response->packet->data, sizeof(uint64_t));
+		// a cancelled open is closed right away, remembering its handle would only outlive the close
+		if (future->openPath && future->state == kSDMMD_AFCFutureStatePending) {
+			SDMMD_AFCMetadataCacheNoteOpen(conn, future->openPath, future->openMode, fileRef);
+		}
+	}
+	if (SDMMD_AFCFutureFinish(future, result, response) || !opened) {
+		SDMMD_AFCFutureDropRequest(future);
+	} else {
+		// cancelled after the device had already opened the file, nobody else knows the handle
+		dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^{
+			if (SDMMD_AFCFileRefClose(conn, fileRef) != kAMDSuccess) {
+				// the device still holds the handle and only lets go of it with the connection, so the connection must not be reused
+				SDMMD_AFCFailPendingReplies(conn, kAMDNotConnectedError);
+				shutdown(conn->handle->ivars.socket, SHUT_RDWR);
+			}
+			SDMMD_AFCFutureDropRequest(future);
+		});
+	}
+}
+
+static void SDMMD_AFCFutureAbort(SDMMD_AFCFutureRef future, sdmmd_return_t error) {
+	SDMMD_AFCConnectionRef conn = future->conn;
+	bool unlinked = false;
+	// an open stays registered so the handle in its reply can still be closed, anything else is dropped by the reader when it arrives
+	if (future->requestType != kSDMMD_AFCPacketTypeFileRefOpen) {
+		SDMMD_AFCLockStateLock(&conn->replyLock);
+		unlinked = SDMMD_AFCUnlinkPendingReply(conn, &future->reply);
+		if (unlinked) {
+			conn->abandonedCount++;
+		}
+		SDMMD_AFCLockStateUnlock(&conn->replyLock);
+	}
+	SDMMD_AFCFutureFinish(future, error, NULL);
+	if (unlinked) {
+		SDMMD_AFCFutureDropRequest(future);
+	}
+}
+
+SDMMD_AFCFutureRef SDMMD_AFCConnectionPerformOperationAsync(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, dispatch_queue_t queue, SDMMD_AFCCompletionCallback callback, void *context) {
+	if (conn == NULL || op == NULL) {
+		return NULL;
+	}
+	SDMMD_AFCFutureRef future = calloc(1, sizeof(struct sdmmd_AFCFuture));
+	future->reply.keepPacket = true;
+	future->reply.deliver = SDMMD_AFCFutureDeliver;
+	future->conn = conn;
+	// one reference for the caller and one for the request
+	future->refCount = 0x2;
+	future->state = kSDMMD_AFCFutureStatePending;
+	future->requestType = op->packet->header.type;
+	future->finished = dispatch_group_create();
+	dispatch_group_enter(future->finished);
+	if (callback) {
+		future->callback = callback;
+		future->context = context;
+		future->queue = (queue ? queue : dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0));
+		dispatch_retain(future->queue);
+	}
+	if (future->requestType == kSDMMD_AFCPacketTypeFileRefOpen && conn->metadataCache) {
+		memcpy(&future->openMode, op->packet->data, sizeof(uint64_t));
+		future->openPath = CFStringCreateWithCString(kCFAllocatorDefault, (char*)op->packet->data + sizeof(uint64_t), kCFStringEncodingUTF8);
+	}
+	// one entry for the request and one for finishing
+	dispatch_group_enter(conn->asyncGroup);
+	dispatch_group_enter(conn->asyncGroup);
+	dispatch_time_t deadline = SDMMD_AFCOperationDeadline(conn, op);
+	if (deadline) {
+		dispatch_group_t asyncGroup = conn->asyncGroup;
+		SDMMD_AFCFutureRetain(future);
+		dispatch_group_enter(asyncGroup);
+		future->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0x0, 0x0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0));
+		dispatch_source_set_timer(future->timer, deadline, DISPATCH_TIME_FOREVER, 0x0);
+		dispatch_source_set_event_handler(future->timer, ^{
+			SDMMD_AFCFutureAbort(future, kAMDTimeOutError);
+		});
+		// finishing cancels the timer, which is what lets go of the connection
+		dispatch_source_set_cancel_handler(future->timer, ^{
+			SDMMD_AFCFutureRelease(future);
+			dispatch_group_leave(asyncGroup);
+		});
+		dispatch_resume(future->timer);
+	}
+	sdmmd_return_t result = SDMMD_AFCSubmitOperation(conn, op, &future->reply);
+	if (result != kAMDSuccess) {
+		future->reply.done = NULL;
+		SDMMD_AFCFutureFinish(future, result, NULL);
+		SDMMD_AFCFutureDropRequest(future);
+	}
+	return future;
+}
+
+sdmmd_return_t SDMMD_AFCFutureWait(SDMMD_AFCFutureRef future, dispatch_time_t deadline) {
+	if (future == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (dispatch_group_wait(future->finished, (deadline ? deadline : DISPATCH_TIME_FOREVER)) != 0x0) {
+		return kAMDTimeOutError;
+	}
+	return future->result;
+}
+
+bool SDMMD_AFCFutureIsDone(SDMMD_AFCFutureRef future) {
+	bool done = (future && future->state == kSDMMD_AFCFutureStateDone);
+	// pairs with the barrier in SDMMD_AFCFutureFinish()
+	__sync_synchronize();
+	return done;
+}
+
+sdmmd_return_t SDMMD_AFCFutureGetResult(SDMMD_AFCFutureRef future) {
+	return (SDMMD_AFCFutureIsDone(future) ? future->result : kAMDInvalidArgumentError);
+}
+
+SDMMD_AFCOperationRef SDMMD_AFCFutureGetResponse(SDMMD_AFCFutureRef future) {
+	return (SDMMD_AFCFutureIsDone(future) ? future->response : NULL);
+}
+
+void SDMMD_AFCFutureCancel(SDMMD_AFCFutureRef future) {
+	// a future that is finishing or done may already have let go of its connection
+	if (future && future->state == kSDMMD_AFCFutureStatePending) {
+		SDMMD_AFCFutureAbort(future, kSDMMD_AFCCancelledError);
+	}
+}
+
+void SDMMD_AFCConnectionCancelOperations(SDMMD_AFCConnectionRef conn) {
+	if (conn == NULL) {
+		return;
+	}
+	SDMMD_AFCLockStateLock(&conn->replyLock);
+	SDMMD_AFCFutureRef *futures = calloc(conn->pendingCount+0x1, sizeof(SDMMD_AFCFutureRef));
+	uint32_t count = 0x0;
+	for (uint32_t index = 0x0; index < kSDMMD_AFCReplyBuckets; index++) {
+		for (struct sdmmd_AFCPendingReply *reply = conn->pendingReplies[index]; reply; reply = reply->next) {
+			if (reply->deliver == SDMMD_AFCFutureDeliver) {
+				futures[count++] = SDMMD_AFCFutureRetain((SDMMD_AFCFutureRef)reply);
+			}
+		}
+	}
+	SDMMD_AFCLockStateUnlock(&conn->replyLock);
+	for (uint32_t index = 0x0; index < count; index++) {
+		SDMMD_AFCFutureCancel(futures[index]);
+		SDMMD_AFCFutureRelease(futures[index]);
+	}
+	free(futures);
+}
+
+bool SDMMD_AFCConnectionIsReusable(SDMMD_AFCConnectionRef conn) {
+	bool reusable = false;
+	if (conn) {
+		SDMMD_AFCLockStateLock(&conn->replyLock);
+		reusable = (conn->transportError == kAMDSuccess && !conn->closing && conn->pendingCount == 0x0 && conn->abandonedCount == 0x0);
+		SDMMD_AFCLockStateUnlock(&conn->replyLock);
+	}
+	return reusable;
+}
+
+#pragma mark -
+#pragma mark File References
+#pragma mark -
+
+// Sends a single request and waits for its reply, replyArgument receives the first word of the reply (file handle, position) and expectedType rejects unexpected replies
+static sdmmd_return_t SDMMD_AFCPerformRequest(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, uint64_t expectedType, uint64_t *replyArgument) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && op) {
+		struct sdmmd_AFCPendingReply reply = {0};
+		result = SDMMD_AFCSubmitOperation(conn, op, &reply);
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCWaitForReply(conn, &reply, SDMMD_AFCOperationDeadline(conn, op));
+		}
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCReplyResult(&reply, expectedType);
+		}
+		if (result == kAMDSuccess && replyArgument) {
+			*replyArgument = reply.arguments[0x0];
+		}
+	}
+	SDMMD_AFCOperationRelease(op);
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCFileRefOpen(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t mode, uint64_t *fileRef) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path && fileRef) {
+		SDMMD_AFCConnectionNegotiateBlockSizes(conn);
+		result = SDMMD_AFCPerformRequest(conn, SDMMD_AFCOperationCreateOpenFile(path, mode), kSDMMD_AFCPacketTypeFileRefOpenResult, fileRef);
+		if (result == kAMDSuccess) {
+			SDMMD_AFCMetadataCacheNoteOpen(conn, path, mode, *fileRef);
+		}
+	}
+	return result;
 }
 
-void SDMMD_AFCConnectionRelease(SDMMD_AFCConnectionRef conn) {
-	
+sdmmd_return_t SDMMD_AFCFileRefRead(SDMMD_AFCConnectionRef conn, uint64_t fileRef, void *buffer, uint64_t *length) {
+	if (conn == NULL || buffer == NULL || length == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	sdmmd_return_t result = kAMDSuccess;
+	struct sdmmd_AFCPendingReply replies[kSDMMD_AFCPipelineDepthMax];
+	uint64_t offsets[kSDMMD_AFCPipelineDepthMax], chunks[kSDMMD_AFCPipelineDepthMax];
+	uint32_t head = 0x0, inFlight = 0x0;
+	uint64_t wanted = *length, requested = 0x0, received = 0x0;
+	bool endOfFile = false;
+	// reads on one handle are served in the order they were sent, each chunk lands at its own offset and is only moved down if an earlier chunk came back short
+	while (inFlight || (result == kAMDSuccess && !endOfFile && requested < wanted)) {
+		while (result == kAMDSuccess && !endOfFile && requested < wanted && inFlight < conn->pipelineDepth) {
+			uint32_t slot = (head + inFlight) % kSDMMD_AFCPipelineDepthMax;
+			uint64_t chunk = (wanted - requested > conn->chunkSize ? conn->chunkSize : wanted - requested);
+			uint64_t arguments[0x2] = {fileRef, chunk};
+			SDMMD_AFCPacketHeader header;
+			SDMMD_AFCHeaderInit(&header, kSDMMD_AFCPacketTypeFileRefRead, sizeof(SDMMD_AFCPacketHeader)+sizeof(arguments), 0x0, 0x0);
+			replies[slot] = (struct sdmmd_AFCPendingReply){.payload = (char*)buffer + requested, .payloadLength = chunk};
+			result = SDMMD_AFCSubmitPacket(conn, &header, arguments, NULL, NULL, &replies[slot]);
+			if (result == kAMDSuccess) {
+				offsets[slot] = requested;
+				chunks[slot] = chunk;
+				requested += chunk;
+				inFlight++;
+			}
+		}
+		if (inFlight) {
+			sdmmd_return_t replyResult = SDMMD_AFCWaitForReply(conn, &replies[head], SDMMD_AFCConnectionDeadline(conn));
+			if (replyResult == kAMDSuccess) {
+				replyResult = SDMMD_AFCReplyResult(&replies[head], kSDMMD_AFCPacketTypeData);
+			}
+			if (replyResult == kAMDSuccess && result == kAMDSuccess) {
+				if (offsets[head] != received) {
+					memmove((char*)buffer + received, (char*)buffer + offsets[head], replies[head].payloadLength);
+				}
+				received += replies[head].payloadLength;
+				endOfFile |= (replies[head].payloadLength < chunks[head]);
+			} else if (result == kAMDSuccess) {
+				// the rest of the window is still drained, but only the first failure is reported
+				result = replyResult;
+			}
+			head = (head + 0x1) % kSDMMD_AFCPipelineDepthMax;
+			inFlight--;
+		}
+	}
+	*length = received;
+	return result;
 }
 
-void SDMMD_AFCHeaderInit(SDMMD_AFCPacketHeader *header, uint32_t command, uint32_t size, uint32_t data, uint32_t pack_num) {
-	header->signature = 0x4141504c36414643;
-	header->headerLen = size;
-	header->packetLen = data+size;
-	header->type = command;
-	if (pack_num) {
-		header->pid = pack_num;
-	} else {
-		header->pid = 0xffffffff;
+// Data comes from buffer, or from file when buffer is NULL
+static sdmmd_return_t SDMMD_AFCFileRefWritePipelined(SDMMD_AFCConnectionRef conn, uint64_t fileRef, const void *buffer, const struct sdmmd_AFCPayloadFile *file, uint64_t length) {
+	sdmmd_return_t result = kAMDSuccess;
+	struct sdmmd_AFCPendingReply replies[kSDMMD_AFCPipelineDepthMax];
+	uint32_t head = 0x0, inFlight = 0x0;
+	uint64_t sent = 0x0;
+	while (inFlight || (result == kAMDSuccess && sent < length)) {
+		while (result == kAMDSuccess && sent < length && inFlight < conn->pipelineDepth) {
+			uint32_t slot = (head + inFlight) % kSDMMD_AFCPipelineDepthMax;
+			uint64_t chunk = (length - sent > conn->chunkSize ? conn->chunkSize : length - sent);
+			SDMMD_AFCPacketHeader header;
+			SDMMD_AFCHeaderInit(&header, kSDMMD_AFCPacketTypeFileRefWrite, sizeof(SDMMD_AFCPacketHeader)+sizeof(uint64_t), (uint32_t)chunk, 0x0);
+			replies[slot] = (struct sdmmd_AFCPendingReply){0};
+			if (buffer) {
+				result = SDMMD_AFCSubmitPacket(conn, &header, &fileRef, (const char*)buffer + sent, NULL, &replies[slot]);
+			} else {
+				struct sdmmd_AFCPayloadFile chunkFile = {file->fd, file->offset + sent};
+				result = SDMMD_AFCSubmitPacket(conn, &header, &fileRef, NULL, &chunkFile, &replies[slot]);
+			}
+			if (result == kAMDSuccess) {
+				sent += chunk;
+				inFlight++;
+			}
+		}
+		if (inFlight) {
+			sdmmd_return_t replyResult = SDMMD_AFCWaitForReply(conn, &replies[head], SDMMD_AFCConnectionDeadline(conn));
+			if (replyResult == kAMDSuccess) {
+				replyResult = SDMMD_AFCReplyResult(&replies[head], kSDMMD_AFCPacketTypeStatus);
+			}
+			if (result == kAMDSuccess) {
+				result = replyResult;
+			}
+			head = (head + 0x1) % kSDMMD_AFCPipelineDepthMax;
+			inFlight--;
+		}
 	}
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateReadDirectory(CFStringRef path) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	op->packet->data = calloc(1, strlen(cpath)+1);
-	memcpy(op->packet->data, cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x3, strlen(cpath)+0x29, 0x0, 0x0);
-	free(cpath);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefWrite(SDMMD_AFCConnectionRef conn, uint64_t fileRef, const void *buffer, uint64_t length) {
+	if (conn == NULL || (buffer == NULL && length)) {
+		return kAMDInvalidArgumentError;
+	}
+	return SDMMD_AFCFileRefWritePipelined(conn, fileRef, buffer, NULL, length);
 }
 
-/*
-SDMMD_AFCOperationRef SDMMD
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, , , 0x0, 0x0);
-	return op;
+// Maps the part of fd that holds offset up to offset+length, mapping points at offset and base/baseLength are what has to be unmapped
+static bool SDMMD_AFCMapFileRange(int fd, uint64_t offset, uint64_t length, int protection, void **mapping, void **base, size_t *baseLength) {
+	uint64_t pageSize = (uint64_t)getpagesize();
+	uint64_t delta = offset % pageSize;
+	*baseLength = (size_t)(length + delta);
+	*base = mmap(NULL, *baseLength, protection, MAP_SHARED, fd, (off_t)(offset - delta));
+	if (*base == MAP_FAILED) {
+		return false;
+	}
+	*mapping = (char *)*base + delta;
+	return true;
 }
-*/
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRemovePath(CFStringRef path) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	op->packet->data = calloc(1, strlen(cpath)+1);
-	memcpy(op->packet->data, cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x8, strlen(cpath)+0x29, 0x0, 0x0);
-	free(cpath);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefWriteFromFile(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int fd, uint64_t offset, uint64_t length) {
+	if (conn == NULL || fd == -1) {
+		return kAMDInvalidArgumentError;
+	}
+	if (length == 0x0) {
+		return kAMDSuccess;
+	}
+	struct sdmmd_AFCPayloadFile file = {fd, offset};
+	SocketConnection sock = SDMMD_TranslateConnectionToSocket(conn->handle);
+	if (sock.isSSL) {
+		// SSL has to see the bytes, so it encrypts straight out of the page cache instead of from a copy
+		void *mapping = NULL, *base = NULL;
+		size_t baseLength = 0x0;
+		if (SDMMD_AFCMapFileRange(fd, offset, length, PROT_READ, &mapping, &base, &baseLength)) {
+			madvise(base, baseLength, MADV_SEQUENTIAL);
+			sdmmd_return_t result = SDMMD_AFCFileRefWritePipelined(conn, fileRef, mapping, NULL, length);
+			munmap(base, baseLength);
+			return result;
+		}
+	}
+	return SDMMD_AFCFileRefWritePipelined(conn, fileRef, NULL, &file, length);
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateMakeDirectory(CFStringRef path) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	op->packet->data = calloc(1, strlen(cpath)+1);
-	memcpy(op->packet->data, cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x9, strlen(cpath)+0x29, 0x0, 0x0);
-	free(cpath);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefReadToFile(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int fd, uint64_t offset, uint64_t *length) {
+	if (conn == NULL || fd == -1 || length == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (*length == 0x0) {
+		return kAMDSuccess;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) == -1) {
+		return kAMDUndefinedError;
+	}
+	// the destination is grown to its final size first so the replies can be received straight into the mapping
+	if ((uint64_t)fileStat.st_size < offset + *length && ftruncate(fd, (off_t)(offset + *length)) == -1) {
+		return kAMDUndefinedError;
+	}
+	void *mapping = NULL, *base = NULL;
+	size_t baseLength = 0x0;
+	if (SDMMD_AFCMapFileRange(fd, offset, *length, PROT_READ | PROT_WRITE, &mapping, &base, &baseLength)) {
+		sdmmd_return_t result = SDMMD_AFCFileRefRead(conn, fileRef, mapping, length);
+		munmap(base, baseLength);
+		return result;
+	}
+	// a file system that cannot be mapped still works, just through a bounce buffer
+	uint64_t wanted = *length, received = 0x0;
+	uint64_t bufferSize = (uint64_t)conn->chunkSize * conn->pipelineDepth;
+	void *buffer = malloc(bufferSize);
+	sdmmd_return_t result = kAMDSuccess;
+	while (result == kAMDSuccess && received < wanted) {
+		uint64_t chunk = (wanted - received > bufferSize ? bufferSize : wanted - received);
+		uint64_t chunkLength = chunk;
+		result = SDMMD_AFCFileRefRead(conn, fileRef, buffer, &chunkLength);
+		if (result == kAMDSuccess && pwrite(fd, buffer, chunkLength, (off_t)(offset + received)) != (ssize_t)chunkLength) {
+			result = kAMDUndefinedError;
+		}
+		received += (result == kAMDSuccess ? chunkLength : 0x0);
+		if (chunkLength < chunk) {
+			break;
+		}
+	}
+	free(buffer);
+	*length = received;
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileInfo(CFStringRef path) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	op->packet->data = calloc(1, strlen(cpath)+1);
-	memcpy(op->packet->data, cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0xa, strlen(cpath)+0x29, 0x0, 0x0);
-	free(cpath);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefSeek(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int64_t offset, uint64_t origin) {
+	return SDMMD_AFCPerformRequest(conn, SDMMD_AFCFileDescriptorCreateSeekOperation(fileRef, offset, origin), kSDMMD_AFCPacketTypeStatus, NULL);
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetDeviceInfo() {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0xb, 0x28, 0x0, 0x0);
-	op->timeout = dispatch_time(DISPATCH_TIME_NOW, 0);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefTell(SDMMD_AFCConnectionRef conn, uint64_t fileRef, uint64_t *offset) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (offset) {
+		result = SDMMD_AFCPerformRequest(conn, SDMMD_AFCFileDescriptorCreateTellOperation(fileRef), kSDMMD_AFCPacketTypeFileRefTellResult, offset);
+	}
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateOpenFile(CFStringRef path, uint16_t mode, void* *fileRef) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	op->packet->data = calloc(1, strlen(cpath)+2);
-	op->packet->data = (void*)mode;
-	memcpy(&op->packet->data[2], cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0xd, strlen(cpath)+0x31, 0x0, 0x0);
-	free(cpath);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefSetFileSize(SDMMD_AFCConnectionRef conn, uint64_t fileRef, uint64_t size) {
+	return SDMMD_AFCPerformRequest(conn, SDMMD_AFCFileDescriptorCreateSetFileSizeOperation(fileRef, size), kSDMMD_AFCPacketTypeStatus, NULL);
 }
 
-/*
-SDMMD_AFCOperationRef SDMMD
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, , , 0x0, 0x0);
-	return op;
+sdmmd_return_t SDMMD_AFCFileRefClose(SDMMD_AFCConnectionRef conn, uint64_t fileRef) {
+	return SDMMD_AFCPerformRequest(conn, SDMMD_AFCFileDescriptorCreateCloseOperation(fileRef), kSDMMD_AFCPacketTypeStatus, NULL);
 }
-*/
 
-SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateReadOperation(void* fileRef) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0xf, 0x38, 0x0, 0x0);
-	return op;
+#pragma mark -
+#pragma mark Small Files
+#pragma mark -
+
+// Returns the first failure of the replies in responses, a missing reply counts as a lost connection
+static sdmmd_return_t SDMMD_AFCCollectStatus(SDMMD_AFCOperationRef *responses, uint32_t count) {
+	sdmmd_return_t result = kAMDSuccess;
+	for (uint32_t index = 0x0; index < count && result == kAMDSuccess; index++) {
+		result = (responses[index] ? SDMMD_AFCOperationGetResponseStatus(responses[index]) : kAMDNotConnectedError);
+	}
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateWriteOperation(void* thing, CFDataRef data, void* thing2) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x10, 0x30, CFDataGetLength(data), 0x0);
-	return op;
+static void SDMMD_AFCReleaseOperations(SDMMD_AFCOperationRef *operations, uint32_t count) {
+	for (uint32_t index = 0x0; index < count; index++) {
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRenamePath(CFStringRef old, CFStringRef new) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *oldPath = SDMCFStringGetString(old);
-	char *newPath = SDMCFStringGetString(new);
-	op->packet->data = calloc(1, strlen(oldPath)+strlen(newPath)+2);
-	memcpy(&op->packet->data, oldPath, strlen(oldPath));
-	memcpy(&op->packet->data[strlen(oldPath)+1], newPath, strlen(newPath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x18, strlen(oldPath)+strlen(newPath)+0x30, 0x0, 0x0);
-	free(oldPath);
-	free(newPath);
-	return op;
+// One WriteFileAtomic per file, each followed by its SetModTime, all in a single pipelined batch
+static sdmmd_return_t SDMMD_AFCWriteFilesAtomic(SDMMD_AFCConnectionRef conn, CFStringRef *paths, CFDataRef *contents, const uint64_t *modTimes, sdmmd_return_t *results, uint32_t count) {
+	uint32_t stride = (modTimes ? 0x2 : 0x1);
+	SDMMD_AFCOperationRef *operations = calloc(count * stride, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *responses = calloc(count * stride, sizeof(SDMMD_AFCOperationRef));
+	for (uint32_t index = 0x0; index < count; index++) {
+		operations[index*stride] = SDMMD_AFCOperationCreateWriteFileAtomic(paths[index], contents[index]);
+		if (modTimes) {
+			operations[index*stride+0x1] = SDMMD_AFCOperationCreateSetModTime(paths[index], modTimes[index]);
+		}
+	}
+	sdmmd_return_t result = SDMMD_AFCProcessOperations(conn, operations, responses, count * stride);
+	for (uint32_t index = 0x0; index < count; index++) {
+		// a failed mtime only costs the next sync a hash comparison, so it does not fail the file
+		results[index] = SDMMD_AFCCollectStatus(&responses[index*stride], 0x1);
+		result = (result == kAMDSuccess ? results[index] : result);
+	}
+	SDMMD_AFCReleaseOperations(responses, count * stride);
+	SDMMD_AFCReleaseOperations(operations, count * stride);
+	free(responses);
+	free(operations);
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateLockOperation(void* fileRef) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x1b, 0x38, 0x0, 0x0);
-	return op;
+// Without WriteFileAtomic every file needs a handle first, so all the opens go out as one batch and then the write, close and SetModTime of
+// every file as a second one, two round trips for the whole set instead of four per file
+static sdmmd_return_t SDMMD_AFCWriteFilesChained(SDMMD_AFCConnectionRef conn, CFStringRef *paths, CFDataRef *contents, const uint64_t *modTimes, sdmmd_return_t *results, uint32_t count) {
+	SDMMD_AFCOperationRef *opens = calloc(count, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *openResponses = calloc(count, sizeof(SDMMD_AFCOperationRef));
+	for (uint32_t index = 0x0; index < count; index++) {
+		opens[index] = SDMMD_AFCOperationCreateOpenFile(paths[index], kSDMMD_AFCFileModeWriteTruncate);
+	}
+	sdmmd_return_t result = SDMMD_AFCProcessOperations(conn, opens, openResponses, count);
+	uint32_t stride = (modTimes ? 0x3 : 0x2);
+	SDMMD_AFCOperationRef *operations = calloc(count * stride, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *responses = calloc(count * stride, sizeof(SDMMD_AFCOperationRef));
+	uint32_t *owners = calloc(count, sizeof(uint32_t));
+	uint32_t opened = 0x0;
+	for (uint32_t index = 0x0; index < count; index++) {
+		SDMMD_AFCOperationRef reply = openResponses[index];
+		results[index] = SDMMD_AFCCollectStatus(&reply, 0x1);
+		if (results[index] == kAMDSuccess && (reply->packet->header.type != kSDMMD_AFCPacketTypeFileRefOpenResult || reply->packet->header.headerLen < sizeof(SDMMD_AFCPacketHeader)+sizeof(uint64_t))) {
+			results[index] = kAMDInvalidResponseError;
+		}
+		if (results[index] == kAMDSuccess) {
+			uint64_t fileRef = 0x0;
+			memcpy(&fileRef, reply->packet->data, sizeof(uint64_t));
+			SDMMD_AFCMetadataCacheNoteOpen(conn, paths[index], kSDMMD_AFCFileModeWriteTruncate, fileRef);
+			operations[opened*stride] = SDMMD_AFCFileDescriptorCreateWriteOperation(fileRef, contents[index]);
+			operations[opened*stride+0x1] = SDMMD_AFCFileDescriptorCreateCloseOperation(fileRef);
+			if (modTimes) {
+				operations[opened*stride+0x2] = SDMMD_AFCOperationCreateSetModTime(paths[index], modTimes[index]);
+			}
+			owners[opened++] = index;
+		} else if (result == kAMDSuccess) {
+			result = results[index];
+		}
+	}
+	if (opened) {
+		sdmmd_return_t batchResult = SDMMD_AFCProcessOperations(conn, operations, responses, opened * stride);
+		result = (result == kAMDSuccess ? batchResult : result);
+		for (uint32_t index = 0x0; index < opened; index++) {
+			results[owners[index]] = SDMMD_AFCCollectStatus(&responses[index*stride], 0x2);
+			result = (result == kAMDSuccess ? results[owners[index]] : result);
+		}
+	}
+	SDMMD_AFCReleaseOperations(responses, opened * stride);
+	SDMMD_AFCReleaseOperations(operations, opened * stride);
+	SDMMD_AFCReleaseOperations(openResponses, count);
+	SDMMD_AFCReleaseOperations(opens, count);
+	free(owners);
+	free(responses);
+	free(operations);
+	free(openResponses);
+	free(opens);
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateLinkPath(uint64_t linkType, CFStringRef target, CFStringRef link) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *targetPath = SDMCFStringGetString(target);
-	char *linkPath = SDMCFStringGetString(link);
-	op->packet->data = calloc(1, strlen(targetPath)+strlen(linkPath)+2);
-	memcpy(&op->packet->data, targetPath, strlen(targetPath));
-	memcpy(&op->packet->data[strlen(targetPath)+1], linkPath, strlen(linkPath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x1c, strlen(targetPath)+strlen(linkPath)+0x30, 0x0, 0x0);
-	free(targetPath);
-	free(linkPath);
-	return op;
+sdmmd_return_t SDMMD_AFCConnectionWriteFiles(SDMMD_AFCConnectionRef conn, CFStringRef *paths, CFDataRef *contents, const uint64_t *modTimes, sdmmd_return_t *results, uint32_t count) {
+	if (conn == NULL || paths == NULL || contents == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (count == 0x0) {
+		return kAMDSuccess;
+	}
+	SDMMD_AFCConnectionNegotiateBlockSizes(conn);
+	sdmmd_return_t *fileResults = (results ? results : calloc(count, sizeof(sdmmd_return_t)));
+	sdmmd_return_t result = kAMDSuccess;
+	uint32_t first = 0x0;
+	if (conn->atomicWriteSupport == 0x0) {
+		// the first file finds out whether the device knows WriteFileAtomic, it is simply written again the other way if not
+		result = SDMMD_AFCWriteFilesAtomic(conn, paths, contents, modTimes, fileResults, 0x1);
+		if (SDMMD_AFCResultIsUnsupported(result)) {
+			conn->atomicWriteSupport = -1;
+			result = kAMDSuccess;
+		} else {
+			// any other failure says nothing about support, the rest of this batch takes the chained path and the next batch asks again
+			if (result == kAMDSuccess) {
+				conn->atomicWriteSupport = 0x1;
+			}
+			first = 0x1;
+		}
+	}
+	if (first < count) {
+		sdmmd_return_t batchResult;
+		if (conn->atomicWriteSupport > 0x0) {
+			batchResult = SDMMD_AFCWriteFilesAtomic(conn, &paths[first], &contents[first], (modTimes ? &modTimes[first] : NULL), &fileResults[first], count - first);
+		} else {
+			batchResult = SDMMD_AFCWriteFilesChained(conn, &paths[first], &contents[first], (modTimes ? &modTimes[first] : NULL), &fileResults[first], count - first);
+		}
+		result = (result == kAMDSuccess ? batchResult : result);
+	}
+	if (results == NULL) {
+		free(fileResults);
+	}
+	return result;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileHash(CFStringRef path) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cpath = SDMCFStringGetString(path);
-	memcpy(op->packet->data, cpath, strlen(cpath));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x1d, strlen(cpath)+0x29, 0x0, 0x0);
-	free(cpath);
-	return op;
+#pragma mark -
+#pragma mark Block Sizes
+#pragma mark -
+
+// Tuned block sizes survive the process in one plist, keyed by SDMMD_AFCConnectionCopyTuningKey()
+static pthread_mutex_t SDMMD_AFCTuningLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef SDMMD_AFCTuningTable = NULL;
+
+static char* SDMMD_AFCCopyTuningPath() {
+	const char *home = getenv("HOME");
+	if (home == NULL) {
+		return NULL;
+	}
+	char *path = calloc(1, PATH_MAX);
+	snprintf(path, PATH_MAX, "%s/%s", home, kSDMMD_AFCTuningFile);
+	return path;
 }
 
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetModTime(CFStringRef ref) {
-	SDMMD_AFCOperationRef op = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	op->packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	char *cref = SDMCFStringGetString(ref);
-	memcpy(op->packet->data, cref, strlen(cref));
-	SDMMD_AFCHeaderInit(&op->packet->header, 0x1e, strlen(cref)+0x31, 0x0, 0x0);
-	free(cref);
-	return op;
+// Must be called with SDMMD_AFCTuningLock held
+static CFMutableDictionaryRef SDMMD_AFCGetTuningTable() {
+	if (SDMMD_AFCTuningTable == NULL) {
+		char *path = SDMMD_AFCCopyTuningPath();
+		if (path && access(path, R_OK) == 0x0) {
+			SDMMD_AFCTuningTable = SDMMD__CreateDictFromFileContents(path);
+		}
+		if (SDMMD_AFCTuningTable == NULL) {
+			SDMMD_AFCTuningTable = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		}
+		free(path);
+	}
+	return SDMMD_AFCTuningTable;
 }
 
-sdmmd_return_t SDMMD_AFCSendOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op);
-sdmmd_return_t SDMMD_AFCReceiveOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef *op);
+// Throughput depends on the hardware and the link, so results are kept per USB product id and interface type, "12a8-1" is an iPhone 5s over USB
+static CFStringRef SDMMD_AFCConnectionCopyTuningKey(SDMMD_AFCConnectionRef conn) {
+	CFStringRef key = NULL;
+	SDMMD_AMDeviceRef device = (conn->handle ? conn->handle->ivars.device : NULL);
+	if (device) {
+		key = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%04x-%x"), SDMMD_AMDeviceUSBProductID(device), SDMMD_AMDeviceGetInterfaceType(device));
+	}
+	return key;
+}
 
-sdmmd_return_t SDMMD_AFCConnectionPerformOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op) {
-	__block sdmmd_return_t result = 0x0;
-	dispatch_sync(conn->operationQueue, ^{
-		printf("Packet: %s\n",SDMMD_gAFCPacketTypeNames[op->packet->header.type]);
-		op->packet->header.pid = conn->operationCount;
-		result = SDMMD_AFCSendOperation(conn, op);
-		SDMMD_AFCOperationRef response;
-		result = SDMMD_AFCReceiveOperation(conn, &response);
-		printf("Response: %08x\n",result);
-		CFShow(response->packet->data);
-	});
-	conn->operationCount++;
-	return result;
+static uint32_t SDMMD_AFCConnectionGetTunedBlockSize(SDMMD_AFCConnectionRef conn) {
+	uint32_t blockSize = 0x0;
+	CFStringRef key = SDMMD_AFCConnectionCopyTuningKey(conn);
+	if (key) {
+		pthread_mutex_lock(&SDMMD_AFCTuningLock);
+		CFNumberRef size = CFDictionaryGetValue(SDMMD_AFCGetTuningTable(), key);
+		if (size && CFGetTypeID(size) == CFNumberGetTypeID()) {
+			CFNumberGetValue(size, kCFNumberSInt32Type, &blockSize);
+		}
+		pthread_mutex_unlock(&SDMMD_AFCTuningLock);
+		CFRelease(key);
+	}
+	return blockSize;
 }
 
-sdmmd_return_t SDMMD_AFCSendOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op) {
-	sdmmd_return_t result = 0x0;
-	CFDataRef headerData = CFDataCreate(kCFAllocatorDefault, (UInt8*)&op->packet->header, sizeof(SDMMD_AFCPacketHeader));
-	result = SDMMD_DirectServiceSend(SDMMD_TranslateConnectionToSocket(conn->handle), headerData);
-	printf("header sent status: %08x\n",result);
-	CFDataRef bodyData = CFDataCreate(kCFAllocatorDefault, (UInt8*)&op->packet->data, op->packet->header.packetLen - sizeof(SDMMD_AFCPacketHeader));
-	result = SDMMD_DirectServiceSend(SDMMD_TranslateConnectionToSocket(conn->handle), bodyData);
-	printf("body sent status: %08x\n",result);
+static void SDMMD_AFCConnectionStoreTunedBlockSize(SDMMD_AFCConnectionRef conn, uint32_t blockSize) {
+	CFStringRef key = SDMMD_AFCConnectionCopyTuningKey(conn);
+	if (key) {
+		CFNumberRef size = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &blockSize);
+		pthread_mutex_lock(&SDMMD_AFCTuningLock);
+		CFMutableDictionaryRef table = SDMMD_AFCGetTuningTable();
+		CFDictionarySetValue(table, key, size);
+		char *path = SDMMD_AFCCopyTuningPath();
+		if (path) {
+			// create each missing component of the directory
+			for (char *separator = strchr(path+0x1, '/'); separator; separator = strchr(separator+0x1, '/')) {
+				*separator = '\0';
+				mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+				*separator = '/';
+			}
+			SDMMD_store_dict(table, path, true);
+			free(path);
+		}
+		pthread_mutex_unlock(&SDMMD_AFCTuningLock);
+		CFRelease(size);
+		CFRelease(key);
+	}
+}
+
+sdmmd_return_t SDMMD_AFCConnectionSetBlockSizes(SDMMD_AFCConnectionRef conn, uint32_t fsBlockSize, uint32_t socketBlockSize) {
+	if (conn == NULL || fsBlockSize == 0x0 || socketBlockSize == 0x0) {
+		return kAMDInvalidArgumentError;
+	}
+	__sync_lock_test_and_set(&conn->blockSizesSent, 0x1);
+	// the local end of the socket gets the same buffering as the device, the kernel caps it at its own limit
+	int bufferSize = (int)socketBlockSize;
+	setsockopt(conn->handle->ivars.socket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+	setsockopt(conn->handle->ivars.socket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	SDMMD_AFCOperationRef operations[0x2] = {SDMMD_AFCOperationCreateSetFSBlockSize(fsBlockSize), SDMMD_AFCOperationCreateSetSocketBlockSize(socketBlockSize)};
+	SDMMD_AFCOperationRef responses[0x2] = {NULL, NULL};
+	sdmmd_return_t result = SDMMD_AFCProcessOperations(conn, operations, responses, 0x2);
+	for (uint32_t index = 0x0; index < 0x2; index++) {
+		if (result == kAMDSuccess) {
+			result = SDMMD_AFCOperationGetResponseStatus(responses[index]);
+		}
+		SDMMD_AFCOperationRelease(responses[index]);
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
+	if (SDMMD_AFCResultIsUnsupported(result)) {
+		// older devices keep their own sizes, that is no reason to fail
+		result = kAMDSuccess;
+	}
+	if (result == kAMDSuccess) {
+		conn->fsBlockSize = fsBlockSize;
+		conn->socketBlockSize = socketBlockSize;
+	}
 	return result;
 }
 
-sdmmd_return_t SDMMD_AFCReceiveOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef *op) {
-	sdmmd_return_t result = 0x0;
-	CFMutableDataRef headerData = CFDataCreateMutable(kCFAllocatorDefault, sizeof(SDMMD_AFCPacketHeader));
-	SDMMD_AFCPacketHeader *zeros = calloc(1, sizeof(SDMMD_AFCPacketHeader));
-	CFDataAppendBytes(headerData, zeros, sizeof(SDMMD_AFCPacketHeader));
-	free(zeros);
-	result = SDMMD_DirectServiceReceive(SDMMD_TranslateConnectionToSocket(conn->handle), (CFDataRef*)&headerData);
-	SDMMD_AFCPacketHeader *header = (SDMMD_AFCPacketHeader *)CFDataGetBytePtr(headerData);
-	
-	CFMutableDataRef bodyData = CFDataCreateMutable(kCFAllocatorDefault, header->packetLen - sizeof(SDMMD_AFCPacketHeader));
-	char *body = calloc(1, header->packetLen - sizeof(SDMMD_AFCPacketHeader));
-	CFDataAppendBytes(bodyData, body, header->packetLen - sizeof(SDMMD_AFCPacketHeader));
-	free(body);
-	result = SDMMD_DirectServiceReceive(SDMMD_TranslateConnectionToSocket(conn->handle), (CFDataRef*)&bodyData);
-	struct sdmmd_AFCPacket *packet = calloc(1, sizeof(struct sdmmd_AFCPacket));
-	packet->header = *header;
-	if (bodyData)
-		packet->data = (void*)CFDataGetBytePtr(bodyData);
-	SDMMD_AFCOperationRef response = calloc(1, sizeof(struct sdmmd_AFCOperation));
-	response->packet = packet;
-	response->timeout = 0;
-	*op = response;
+sdmmd_return_t SDMMD_AFCConnectionSetOptions(SDMMD_AFCConnectionRef conn, CFDictionaryRef options) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && options) {
+		SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateSetConnectionOptions(options);
+		result = SDMMD_AFCConnectionPerformOperation(conn, op);
+		SDMMD_AFCOperationRelease(op);
+	}
 	return result;
 }
 
-sdmmd_return_t SDMMD_AFCProcessOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, SDMMD_AFCOperationRef *response) {
-	__block sdmmd_return_t result = 0x0;
-	__block SDMMD_AFCOperationRef blockReply;
-	dispatch_sync(conn->operationQueue, ^{
-		conn->semaphore = dispatch_semaphore_create(0x0);
-		op->packet->header.pid = conn->operationCount;
-		result = SDMMD_AFCSendOperation(conn, op);
-		dispatch_semaphore_wait(conn->semaphore, op->timeout);
-		SDMMD_AFCReceiveOperation(conn, &blockReply);
-		dispatch_release(conn->semaphore);
-		conn->operationCount++;
-	});
-	*response = blockReply;
+// Called before each transfer, only the first one on a connection that was not given block sizes asks the device. Uses what the auto-tuner found
+// for this kind of device if it ran before. A failure is left to the transfer itself to report.
+static void SDMMD_AFCConnectionNegotiateBlockSizes(SDMMD_AFCConnectionRef conn) {
+	if (conn->blockSizesSent == 0x0) {
+		uint32_t blockSize = SDMMD_AFCConnectionGetTunedBlockSize(conn);
+		blockSize = (blockSize ? blockSize : kSDMMD_AFCBlockSizeDefault);
+		SDMMD_AFCConnectionSetBlockSizes(conn, blockSize, blockSize);
+	}
+}
+
+// Writes the probe file and reads it back, returns bytes per second or 0 if the device refused
+static double SDMMD_AFCConnectionProbeThroughput(SDMMD_AFCConnectionRef conn, CFStringRef probePath, void *buffer, uint64_t length) {
+	double throughput = 0.0;
+	uint64_t fileRef = 0x0;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	sdmmd_return_t result = SDMMD_AFCFileRefOpen(conn, probePath, kSDMMD_AFCFileModeWriteTruncate, &fileRef);
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCFileRefWrite(conn, fileRef, buffer, length);
+		sdmmd_return_t closeResult = SDMMD_AFCFileRefClose(conn, fileRef);
+		result = (result == kAMDSuccess ? closeResult : result);
+	}
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCFileRefOpen(conn, probePath, kSDMMD_AFCFileModeRead, &fileRef);
+		if (result == kAMDSuccess) {
+			uint64_t received = length;
+			result = SDMMD_AFCFileRefRead(conn, fileRef, buffer, &received);
+			SDMMD_AFCFileRefClose(conn, fileRef);
+			result = (result == kAMDSuccess && received != length ? kAMDEOFError : result);
+		}
+	}
+	CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+	if (result == kAMDSuccess && elapsed > 0.0) {
+		throughput = (double)(length * 0x2) / elapsed;
+	}
+	return throughput;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionAutoTune(SDMMD_AFCConnectionRef conn, CFStringRef probePath, uint32_t *blockSize) {
+	if (conn == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	probePath = (probePath ? probePath : CFSTR(kSDMMD_AFCAutoTuneProbePath));
+	void *buffer = calloc(1, kSDMMD_AFCAutoTuneProbeLength);
+	if (buffer == NULL) {
+		return kAMDNoResourcesError;
+	}
+	uint32_t bestSize = 0x0;
+	double bestThroughput = 0.0;
+	for (uint32_t candidate = kSDMMD_AFCChunkSizeMin; candidate <= kSDMMD_AFCChunkSizeMax; candidate <<= 0x1) {
+		if (SDMMD_AFCConnectionSetBlockSizes(conn, candidate, candidate) != kAMDSuccess) {
+			continue;
+		}
+		SDMMD_AFCConnectionSetChunkSize(conn, candidate);
+		double throughput = SDMMD_AFCConnectionProbeThroughput(conn, probePath, buffer, kSDMMD_AFCAutoTuneProbeLength);
+		if (throughput > bestThroughput) {
+			bestThroughput = throughput;
+			bestSize = candidate;
+		}
+	}
+	free(buffer);
+	SDMMD_AFCOperationRef remove = SDMMD_AFCOperationCreateRemovePath(probePath);
+	SDMMD_AFCConnectionPerformOperation(conn, remove);
+	SDMMD_AFCOperationRelease(remove);
+
+	sdmmd_return_t result = kAMDUndefinedError;
+	if (bestSize) {
+		SDMMD_AFCConnectionSetChunkSize(conn, bestSize);
+		result = SDMMD_AFCConnectionSetBlockSizes(conn, bestSize, bestSize);
+		SDMMD_AFCConnectionStoreTunedBlockSize(conn, bestSize);
+		if (blockSize) {
+			*blockSize = bestSize;
+		}
+	} else {
+		printf("SDMMD_AFCConnectionAutoTune: Could not write the probe file.\n");
+		SDMMD_AFCConnectionSetChunkSize(conn, kSDMMD_AFCChunkSizeDefault);
+		SDMMD_AFCConnectionSetBlockSizes(conn, kSDMMD_AFCBlockSizeDefault, kSDMMD_AFCBlockSizeDefault);
+	}
 	return result;
 }
 
-CFDataRef SDMMD_GetDataResponseFromOperation(SDMMD_AFCOperationRef op) {
-	return CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, op->packet->data, op->packet->header.packetLen-op->packet->header.headerLen, kCFAllocatorDefault);
+bool SDMMD_AFCConnectionIsTuned(SDMMD_AFCConnectionRef conn) {
+	return (conn && SDMMD_AFCConnectionGetTunedBlockSize(conn) != 0x0);
 }
 
 
@@ -526,4 +2206,358 @@ sdmmd_return_t SDMMD_AFCValidateHeader(SDMMD_AFCHeaderRef header, uint32_t comma
 	}
 }*/
 
+#pragma mark -
+#pragma mark Path Information
+#pragma mark -
+
+// Sends op and hands back the payload of the Data reply, a Status reply is converted into its error code
+static sdmmd_return_t SDMMD_AFCCopyDataResponse(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, CFDataRef *data) {
+	SDMMD_AFCOperationRef response = NULL;
+	sdmmd_return_t result = SDMMD_AFCProcessOperation(conn, op, &response);
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCOperationGetResponseStatus(response);
+	}
+	if (result == kAMDSuccess) {
+		if (response->packet->header.type == kSDMMD_AFCPacketTypeData) {
+			*data = SDMMD_GetDataResponseFromOperation(response);
+		} else {
+			result = kAMDInvalidResponseError;
+		}
+	}
+	SDMMD_AFCOperationRelease(response);
+	SDMMD_AFCOperationRelease(op);
+	return result;
+}
+
+CFDictionaryRef SDMMD_AFCCreateDictionaryFromData(CFDataRef data) {
+	CFMutableDictionaryRef dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (data) {
+		// the reply is a run of NUL terminated strings, alternating between key and value
+		const char *cursor = (const char *)CFDataGetBytePtr(data);
+		const char *end = cursor + CFDataGetLength(data);
+		while (cursor < end) {
+			const char *valueStart = memchr(cursor, '\0', end-cursor);
+			if (valueStart == NULL || ++valueStart >= end) {
+				break;
+			}
+			const char *valueEnd = memchr(valueStart, '\0', end-valueStart);
+			if (valueEnd == NULL) {
+				break;
+			}
+			CFStringRef key = CFStringCreateWithCString(kCFAllocatorDefault, cursor, kCFStringEncodingUTF8);
+			CFStringRef value = CFStringCreateWithCString(kCFAllocatorDefault, valueStart, kCFStringEncodingUTF8);
+			if (key && value) {
+				CFDictionarySetValue(dict, key, value);
+			}
+			if (key) {
+				CFRelease(key);
+			}
+			if (value) {
+				CFRelease(value);
+			}
+			cursor = valueEnd+1;
+		}
+	}
+	return dict;
+}
+
+uint64_t SDMMD_AFCFileInfoGetNumber(CFDictionaryRef info, CFStringRef key) {
+	uint64_t number = 0x0;
+	CFStringRef value = (info ? CFDictionaryGetValue(info, key) : NULL);
+	if (value && CFGetTypeID(value) == CFStringGetTypeID()) {
+		char buffer[0x20] = {0};
+		if (CFStringGetCString(value, buffer, sizeof(buffer), kCFStringEncodingUTF8)) {
+			number = strtoull(buffer, NULL, 10);
+		}
+	}
+	return number;
+}
+
+// Answers from the metadata cache when it is on, misses go to the device and the answer (found or not) is kept for the cache TTL
+sdmmd_return_t SDMMD_AFCConnectionCopyFileInfo(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDictionaryRef *info) {
+	if (conn == NULL || path == NULL || info == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	struct sdmmd_AFCMetadataCache *cache = conn->metadataCache;
+	CFStringRef key = NULL;
+	uint64_t generation = 0x0;
+	if (cache) {
+		key = SDMMD_AFCMetadataCacheCreateKey(path);
+		pthread_mutex_lock(&cache->lock);
+		if (cache->ttl > 0.0) {
+			const struct sdmmd_AFCMetadataEntry *entry = CFDictionaryGetValue(cache->entries, key);
+			if (entry && entry->expires > CFAbsoluteTimeGetCurrent()) {
+				sdmmd_return_t result = entry->result;
+				if (entry->info) {
+					*info = CFRetain(entry->info);
+					cache->hits++;
+				} else {
+					cache->negativeHits++;
+				}
+				pthread_mutex_unlock(&cache->lock);
+				CFRelease(key);
+				return result;
+			}
+			cache->misses++;
+			generation = cache->generation;
+		} else {
+			CFRelease(key);
+			key = NULL;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	CFDataRef data = NULL;
+	sdmmd_return_t result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCOperationCreateGetFileInfo(path), &data);
+	if (result == kAMDSuccess) {
+		*info = SDMMD_AFCCreateDictionaryFromData(data);
+		CFRelease(data);
+	}
+	if (key) {
+		if (result == kAMDSuccess || result == kAMDNotFoundError) {
+			pthread_mutex_lock(&cache->lock);
+			if (cache->ttl > 0.0 && cache->generation == generation) {
+				SDMMD_AFCMetadataCacheTrim(cache);
+				struct sdmmd_AFCMetadataEntry *entry = calloc(1, sizeof(struct sdmmd_AFCMetadataEntry));
+				entry->expires = CFAbsoluteTimeGetCurrent() + cache->ttl;
+				entry->result = result;
+				entry->info = (result == kAMDSuccess ? CFRetain(*info) : NULL);
+				CFDictionarySetValue(cache->entries, key, entry);
+			}
+			pthread_mutex_unlock(&cache->lock);
+		}
+		CFRelease(key);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionCopyFileHash(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDataRef *hash) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path && hash) {
+		result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCOperationCreateGetFileHash(path), hash);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionCopyFileHashWithRange(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t start, uint64_t end, CFDataRef *hash) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path && hash && start <= end) {
+		result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCOperationCreateGetFileHashWithRange(path, start, end), hash);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionSetModTime(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t modTime) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path) {
+		SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateSetModTime(path, modTime);
+		result = SDMMD_AFCConnectionPerformOperation(conn, op);
+		SDMMD_AFCOperationRelease(op);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionCopyDirectoryListing(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDataRef *listing) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path && listing) {
+		result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCOperationCreateReadDirectory(path), listing);
+	}
+	return result;
+}
+
+#pragma mark -
+#pragma mark Directory Enumerators
+#pragma mark -
+
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorOpen(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t *enumerator) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && path && enumerator) {
+		result = SDMMD_AFCPerformRequest(conn, SDMMD_AFCOperationCreateDirectoryEnumeratorOpen(path), kSDMMD_AFCPacketTypeDirectoryEnumeratorRefOpenResult, enumerator);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorRead(SDMMD_AFCConnectionRef conn, uint64_t enumerator, CFDataRef *names) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (conn && names) {
+		result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCDirectoryEnumeratorCreateReadOperation(enumerator), names);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorClose(SDMMD_AFCConnectionRef conn, uint64_t enumerator) {
+	return SDMMD_AFCPerformRequest(conn, SDMMD_AFCDirectoryEnumeratorCreateCloseOperation(enumerator), kSDMMD_AFCPacketTypeStatus, NULL);
+}
+
+#pragma mark -
+#pragma mark Recursive Operations
+#pragma mark -
+
+// Client side stand-in for the recursive packets on firmware without them
+struct sdmmd_AFCTreeWalk {
+	SDMMD_AFCConnectionRef conn;
+	pthread_mutex_t lock;
+	CFMutableArrayRef directories;		// breadth first, the root is first
+	CFMutableArrayRef files;			// everything that is not a directory, only kept when removing
+	volatile uint64_t size;
+	volatile uint32_t result;
+};
+
+static CFStringRef SDMMD_AFCCreateChildPath(CFStringRef parent, CFStringRef name) {
+	return CFStringCreateWithFormat(kCFAllocatorDefault, NULL, (CFStringHasSuffix(parent, CFSTR("/")) ? CFSTR("%@%@") : CFSTR("%@/%@")), parent, name);
+}
+
+static void SDMMD_AFCTreeWalkDirectory(struct sdmmd_AFCTreeWalk *walk, CFStringRef directory) {
+	const void *keys[0x1] = {CFSTR(kSDMMD_AFCIteratorOptionPrefetchFileInfo)};
+	const void *values[0x1] = {kCFBooleanTrue};
+	CFDictionaryRef options = CFDictionaryCreate(kCFAllocatorDefault, keys, values, 0x1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	SDMMD_AFCIteratorRef iterator = NULL;
+	sdmmd_return_t result = SDMMD_AFCIteratorCreate(walk->conn, directory, options, &iterator);
+	CFRelease(options);
+	while (result == kAMDSuccess && walk->result == kAMDSuccess) {
+		CFArrayRef names = NULL, infos = NULL;
+		result = SDMMD_AFCIteratorCopyNextBatch(iterator, &names, &infos);
+		if (result != kAMDSuccess) {
+			break;
+		}
+		for (CFIndex index = 0x0; index < CFArrayGetCount(names); index++) {
+			CFTypeRef info = CFArrayGetValueAtIndex(infos, index);
+			if (info == kCFNull) {
+				// already gone
+				continue;
+			}
+			CFStringRef path = SDMMD_AFCCreateChildPath(directory, CFArrayGetValueAtIndex(names, index));
+			CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+			pthread_mutex_lock(&walk->lock);
+			if (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeDirectory))) {
+				CFArrayAppendValue(walk->directories, path);
+			} else {
+				if (walk->files) {
+					CFArrayAppendValue(walk->files, path);
+				}
+				__sync_add_and_fetch(&walk->size, SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize)));
+			}
+			pthread_mutex_unlock(&walk->lock);
+			CFRelease(path);
+		}
+		CFRelease(names);
+		CFRelease(infos);
+	}
+	SDMMD_AFCIteratorRelease(iterator);
+	// a directory removed while walking is not an error
+	if (result != kAMDSuccess && result != kAMDEOFError && result != kAMDNotFoundError) {
+		__sync_bool_compare_and_swap(&walk->result, (uint32_t)kAMDSuccess, (uint32_t)result);
+	}
+}
+
+// Lists every directory of a level at once, the requests are multiplexed over the one connection
+static sdmmd_return_t SDMMD_AFCTreeWalk(struct sdmmd_AFCTreeWalk *walk, CFStringRef root) {
+	CFArrayAppendValue(walk->directories, root);
+	CFIndex levelStart = 0x0;
+	CFIndex levelEnd = 0x1;
+	while (levelStart < levelEnd && walk->result == kAMDSuccess) {
+		CFIndex start = levelStart;
+		CFIndex count = levelEnd - levelStart;
+		CFStringRef *level = calloc(count, sizeof(CFStringRef));
+		CFArrayGetValues(walk->directories, CFRangeMake(start, count), (const void **)level);
+		dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^(size_t index) {
+			SDMMD_AFCTreeWalkDirectory(walk, level[index]);
+		});
+		free(level);
+		levelStart = levelEnd;
+		levelEnd = CFArrayGetCount(walk->directories);
+	}
+	return (sdmmd_return_t)walk->result;
+}
+
+static sdmmd_return_t SDMMD_AFCConnectionCopyPathType(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t *size, bool *isDirectory) {
+	CFDictionaryRef info = NULL;
+	sdmmd_return_t result = SDMMD_AFCConnectionCopyFileInfo(conn, path, &info);
+	if (result == kAMDSuccess) {
+		CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+		*isDirectory = (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeDirectory)));
+		*size = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+		CFRelease(info);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionGetSizeOfPathContents(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t *size) {
+	if (conn == NULL || path == NULL || size == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	CFDataRef data = NULL;
+	sdmmd_return_t result = SDMMD_AFCCopyDataResponse(conn, SDMMD_AFCOperationCreateGetSizeOfPathContents(path), &data);
+	if (result == kAMDSuccess) {
+		CFDictionaryRef info = SDMMD_AFCCreateDictionaryFromData(data);
+		*size = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+		CFRelease(info);
+		CFRelease(data);
+	} else if (SDMMD_AFCResultIsUnsupported(result)) {
+		bool isDirectory = false;
+		result = SDMMD_AFCConnectionCopyPathType(conn, path, size, &isDirectory);
+		if (result == kAMDSuccess && isDirectory) {
+			struct sdmmd_AFCTreeWalk walk = {.conn = conn, .result = kAMDSuccess};
+			pthread_mutex_init(&walk.lock, NULL);
+			walk.directories = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+			result = SDMMD_AFCTreeWalk(&walk, path);
+			*size = walk.size;
+			CFRelease(walk.directories);
+			pthread_mutex_destroy(&walk.lock);
+		}
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCConnectionRemovePathAndContents(SDMMD_AFCConnectionRef conn, CFStringRef path) {
+	if (conn == NULL || path == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_AFCOperationRef op = SDMMD_AFCOperationCreateRemovePathAndContents(path);
+	sdmmd_return_t result = SDMMD_AFCConnectionPerformOperation(conn, op);
+	SDMMD_AFCOperationRelease(op);
+	if (SDMMD_AFCResultIsUnsupported(result)) {
+		uint64_t size = 0x0;
+		bool isDirectory = false;
+		result = SDMMD_AFCConnectionCopyPathType(conn, path, &size, &isDirectory);
+		struct sdmmd_AFCTreeWalk walk = {.conn = conn, .result = kAMDSuccess};
+		pthread_mutex_init(&walk.lock, NULL);
+		walk.directories = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+		walk.files = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+		if (result == kAMDSuccess && isDirectory) {
+			result = SDMMD_AFCTreeWalk(&walk, path);
+		} else if (result == kAMDSuccess) {
+			CFArrayAppendValue(walk.files, path);
+		}
+		if (result == kAMDSuccess) {
+			// the device works through pipelined requests in order, so files first and then directories deepest first empties each one before it goes
+			CFIndex fileCount = CFArrayGetCount(walk.files);
+			CFIndex directoryCount = CFArrayGetCount(walk.directories);
+			uint32_t count = (uint32_t)(fileCount + directoryCount);
+			SDMMD_AFCOperationRef *operations = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+			SDMMD_AFCOperationRef *responses = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+			for (CFIndex index = 0x0; index < fileCount; index++) {
+				operations[index] = SDMMD_AFCOperationCreateRemovePath(CFArrayGetValueAtIndex(walk.files, index));
+			}
+			for (CFIndex index = 0x0; index < directoryCount; index++) {
+				operations[fileCount+index] = SDMMD_AFCOperationCreateRemovePath(CFArrayGetValueAtIndex(walk.directories, directoryCount-index-0x1));
+			}
+			result = SDMMD_AFCProcessOperations(conn, operations, responses, count);
+			for (uint32_t index = 0x0; index < count; index++) {
+				sdmmd_return_t status = SDMMD_AFCOperationGetResponseStatus(responses[index]);
+				if (result == kAMDSuccess && responses[index] && status != kAMDSuccess && status != kAMDNotFoundError) {
+					result = status;
+				}
+				SDMMD_AFCOperationRelease(responses[index]);
+				SDMMD_AFCOperationRelease(operations[index]);
+			}
+			free(responses);
+			free(operations);
+		}
+		CFRelease(walk.files);
+		CFRelease(walk.directories);
+		pthread_mutex_destroy(&walk.lock);
+	}
+	return result;
+}
+
 #endif
\ No newline at end of file
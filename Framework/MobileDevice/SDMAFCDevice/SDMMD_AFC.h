@@ -22,24 +22,45 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include "SDMMD_Error.h"
 #include "SDMMD_Service.h"
+#include <pthread.h>
 //#include "SDMMD_AFCDevice.h"
 //#include "SDMMD_AFCIterator.h"
 //#include "SDMMD_AFCOperation.h"
-//#include "SDMMD_AFCLock.h"
+#include "SDMMD_AFCLock.h"
 //#include "SDMMD_AFCCondition.h"
 
 #pragma mark -
 #pragma mark TYPES
 #pragma mark -
 
-struct sdmmd_AFCConnectionClass {
-	SDMMD_AMConnectionRef handle;
-	dispatch_queue_t operationQueue;
-	dispatch_semaphore_t semaphore;
-	uint64_t operationCount;
-} sdmmd_AFCConnectionClass;
+// FileRefRead and FileRefWrite are split into chunks of this size, several chunks are kept in flight per file handle
+#define kSDMMD_AFCChunkSizeMin				0x100000
+#define kSDMMD_AFCChunkSizeMax				0x400000
+#define kSDMMD_AFCChunkSizeDefault			0x100000
+#define kSDMMD_AFCPipelineDepthDefault		0x4
+#define kSDMMD_AFCPipelineDepthMax			0x10
 
-#define SDMMD_AFCConnectionRef struct sdmmd_AFCConnectionClass*
+// Outstanding requests are kept in buckets by packet id until the reader delivers their reply
+#define kSDMMD_AFCReplyBuckets				0x40
+
+// Header, arguments and payload of a packet are packed into this per connection buffer and sent with one write, larger payloads are sent from the caller's memory
+#define kSDMMD_AFCSendBufferSize			0x10000
+
+// Operations with at most this much packet data are recycled, up to kSDMMD_AFCOperationPoolMax of them are kept around
+#define kSDMMD_AFCOperationPoolDataSize		0x400
+#define kSDMMD_AFCOperationPoolMax			0x400
+
+// What a connection asks the device for before its first file transfer until SDMMD_AFCConnectionAutoTune() has measured something better for that kind of device
+#define kSDMMD_AFCBlockSizeDefault			0x100000
+
+// The auto-tuner writes and reads back this much per candidate block size, results are kept in kSDMMD_AFCTuningFile under the home directory
+#define kSDMMD_AFCAutoTuneProbeLength		0x1000000
+#define kSDMMD_AFCAutoTuneProbePath			"/com.samdmarshall.sdmmobiledevice.probe"
+#define kSDMMD_AFCTuningFile				"Library/Caches/com.samdmarshall.sdmmobiledevice/AFCBlockSizes.plist"
+
+// Upper bound on cached GetFileInfo answers per connection, a full cache drops its oldest answers down to the low mark
+#define kSDMMD_AFCMetadataCacheEntriesMax	0x2000
+#define kSDMMD_AFCMetadataCacheEntriesLow	0x1800
 
 typedef struct SDMMD_AFCPacketHeader {
 	uint64_t signature;
@@ -49,18 +70,164 @@ typedef struct SDMMD_AFCPacketHeader {
 	uint64_t type;
 } __attribute__ ((packed)) SDMMD_AFCPacketHeader;
 
+struct sdmmd_AFCConnectionClass {
+	SDMMD_AMConnectionRef handle;
+	dispatch_queue_t operationQueue;	// serializes writes to the socket
+	void *sendBuffer;					// only touched on operationQueue
+	uint64_t operationCount;
+	uint32_t chunkSize;
+	uint32_t pipelineDepth;
+	struct sdmmd_AFCLockState replyLock;	// guards everything below, taken for every packet so it is the cheap kind
+	struct sdmmd_AFCPendingReply *pendingReplies[kSDMMD_AFCReplyBuckets];
+	uint32_t pendingCount;
+	uint32_t abandonedCount;			// replies the device still owes to waiters that gave up on them
+	bool readerActive;
+	bool closing;						// set by SDMMD_AFCConnectionRelease(), later requests fail with kAMDNotConnectedError
+	sdmmd_return_t transportError;		// once set the connection is unusable
+	dispatch_queue_t readerQueue;
+	dispatch_group_t readerGroup;
+	dispatch_group_t asyncGroup;		// entered by every asynchronous operation until its reply and completion are both done with the connection
+	int64_t operationTimeout;			// nanoseconds, applies to operations without a timeout of their own, 0 waits forever
+	volatile int32_t blockSizesSent;	// set once block sizes were asked for, explicitly or by the first transfer
+	uint32_t fsBlockSize;				// last sizes the device accepted, 0 if it never did
+	uint32_t socketBlockSize;
+	int8_t atomicWriteSupport;			// 0 until an SDMMD_AFCConnectionWriteFiles() probe gets an answer, then 1 if the device takes WriteFileAtomic and -1 if not
+	struct sdmmd_AFCMetadataCache *metadataCache;	// NULL until SDMMD_AFCConnectionSetMetadataCacheTTL() turns it on
+} sdmmd_AFCConnectionClass;
+
+#define SDMMD_AFCConnectionRef struct sdmmd_AFCConnectionClass*
+
 struct sdmmd_AFCPacket {
 	SDMMD_AFCPacketHeader header;
 	void* data;
 } sdmmd_AFCPacket;
 
+// The packet and its data live in the same allocation as the operation
 struct sdmmd_AFCOperation {
 	struct sdmmd_AFCPacket *packet;
 	dispatch_time_t timeout;
+	uint32_t capacity;					// data size of a pooled operation, 0 if it is freed on release
+	struct sdmmd_AFCOperation *next;	// free list link while pooled
 } sdmmd_AFCOperation;
 
 #define SDMMD_AFCOperationRef struct sdmmd_AFCOperation*
 
+// A request waiting for its reply. With keepPacket set the reader hands back the whole reply as an operation, otherwise the first header words go to arguments and the payload is read straight into payload.
+struct sdmmd_AFCPendingReply {
+	struct sdmmd_AFCPendingReply *next;
+	uint64_t pid;
+	dispatch_semaphore_t done;
+	sdmmd_return_t result;
+	bool keepPacket;
+	SDMMD_AFCOperationRef response;
+	uint64_t type;
+	uint64_t arguments[0x4];
+	void *payload;
+	uint64_t payloadLength;
+	void (*deliver)(struct sdmmd_AFCPendingReply *reply);	// NULL for a thread waiting on done, otherwise called by the reader instead of signalling
+} sdmmd_AFCPendingReply;
+
+#define kSDMMD_AFCFutureStatePending		0x0
+#define kSDMMD_AFCFutureStateFinishing		0x2	// claimed by whoever finishes it, result and response are not written yet
+#define kSDMMD_AFCFutureStateDone			0x1
+
+// Returned by futures that were cancelled, kept clear of the sdmmd_return_t table so it can not be mistaken for a device error
+#define kSDMMD_AFCCancelledError			AMDErrorMake(0x400)
+
+struct sdmmd_AFCFuture;
+typedef void (*SDMMD_AFCCompletionCallback)(struct sdmmd_AFCFuture *future, void *context);
+
+// An operation started with SDMMD_AFCConnectionPerformOperationAsync(). The result and response are fixed once state is done.
+struct sdmmd_AFCFuture {
+	struct sdmmd_AFCPendingReply reply;		// must stay first, the reader only knows about the reply
+	SDMMD_AFCConnectionRef conn;
+	volatile uint32_t refCount;
+	volatile uint32_t state;
+	uint64_t requestType;
+	uint64_t openMode;						// for opens, so a handle that arrives after a cancel can still be closed
+	CFStringRef openPath;
+	sdmmd_return_t result;
+	SDMMD_AFCOperationRef response;
+	dispatch_group_t finished;				// left once when the future is done
+	dispatch_source_t timer;
+	dispatch_queue_t queue;
+	SDMMD_AFCCompletionCallback callback;
+	void *context;
+} sdmmd_AFCFuture;
+
+#define SDMMD_AFCFutureRef struct sdmmd_AFCFuture*
+
+// Packet types used by the file engine, the full list is SDMMD_gAFCPacketTypeNames
+#define kSDMMD_AFCPacketTypeStatus					0x1
+#define kSDMMD_AFCPacketTypeData					0x2
+#define kSDMMD_AFCPacketTypeReadDirectory			0x3
+#define kSDMMD_AFCPacketTypeRemovePath				0x8
+#define kSDMMD_AFCPacketTypeMakeDirectory			0x9
+#define kSDMMD_AFCPacketTypeGetFileInfo				0xa
+#define kSDMMD_AFCPacketTypeGetDeviceInfo			0xb
+#define kSDMMD_AFCPacketTypeWriteFileAtomic			0xc
+#define kSDMMD_AFCPacketTypeFileRefOpen				0xd
+#define kSDMMD_AFCPacketTypeFileRefOpenResult		0xe
+#define kSDMMD_AFCPacketTypeFileRefRead				0xf
+#define kSDMMD_AFCPacketTypeFileRefWrite			0x10
+#define kSDMMD_AFCPacketTypeFileRefSeek				0x11
+#define kSDMMD_AFCPacketTypeFileRefTell				0x12
+#define kSDMMD_AFCPacketTypeFileRefTellResult		0x13
+#define kSDMMD_AFCPacketTypeFileRefClose			0x14
+#define kSDMMD_AFCPacketTypeFileRefSetFileSize		0x15
+#define kSDMMD_AFCPacketTypeSetConnectionOptions	0x17
+#define kSDMMD_AFCPacketTypeRenamePath				0x18
+#define kSDMMD_AFCPacketTypeSetFSBlockSize			0x19
+#define kSDMMD_AFCPacketTypeSetSocketBlockSize		0x1a
+#define kSDMMD_AFCPacketTypeFileRefLock				0x1b
+#define kSDMMD_AFCPacketTypeMakeLink				0x1c
+#define kSDMMD_AFCPacketTypeGetFileHash				0x1d
+#define kSDMMD_AFCPacketTypeSetModTime				0x1e
+#define kSDMMD_AFCPacketTypeGetFileHashWithRange	0x1f
+#define kSDMMD_AFCPacketTypeGetSizeOfPathContents	0x21
+#define kSDMMD_AFCPacketTypeRemovePathAndContents	0x22
+#define kSDMMD_AFCPacketTypeDirectoryEnumeratorRefOpen			0x23
+#define kSDMMD_AFCPacketTypeDirectoryEnumeratorRefOpenResult	0x24
+#define kSDMMD_AFCPacketTypeDirectoryEnumeratorRefRead			0x25
+#define kSDMMD_AFCPacketTypeDirectoryEnumeratorRefClose			0x26
+
+// Status codes an older device sends for packet types it doesn't implement, after conversion by SDMMD_AFCOperationGetResponseStatus()
+#define SDMMD_AFCResultIsUnsupported(result)	((result) == kAMDUnknownPacketError || (result) == kAMDUnsupportedError)
+
+// Modes for SDMMD_AFCFileRefOpen(), these follow fopen() "r", "r+", "w", "w+", "a" and "a+"
+enum SDMMD_AFCFileMode {
+	kSDMMD_AFCFileModeRead = 0x1,
+	kSDMMD_AFCFileModeReadWrite = 0x2,
+	kSDMMD_AFCFileModeWriteTruncate = 0x3,
+	kSDMMD_AFCFileModeReadWriteTruncate = 0x4,
+	kSDMMD_AFCFileModeAppend = 0x5,
+	kSDMMD_AFCFileModeReadAppend = 0x6
+};
+
+// Keys of the dictionary returned by SDMMD_AFCConnectionCopyFileInfo(), the values are strings as sent by the device
+#define kSDMMD_AFCFileInfoKeySize			"st_size"
+#define kSDMMD_AFCFileInfoKeyBlocks			"st_blocks"
+#define kSDMMD_AFCFileInfoKeyLinkCount		"st_nlink"
+#define kSDMMD_AFCFileInfoKeyType			"st_ifmt"
+#define kSDMMD_AFCFileInfoKeyModTime		"st_mtime"		// nanoseconds since 1970
+#define kSDMMD_AFCFileInfoKeyBirthTime		"st_birthtime"	// nanoseconds since 1970
+#define kSDMMD_AFCFileInfoKeyLinkTarget		"LinkTarget"
+
+#define kSDMMD_AFCFileTypeRegular			"S_IFREG"
+#define kSDMMD_AFCFileTypeDirectory			"S_IFDIR"
+#define kSDMMD_AFCFileTypeSymlink			"S_IFLNK"
+
+// Link types for SDMMD_AFCOperationCreateLinkPath()
+#define kSDMMD_AFCLinkTypeHard				0x1
+#define kSDMMD_AFCLinkTypeSymbolic			0x2
+
+// Origins for SDMMD_AFCFileRefSeek()
+enum SDMMD_AFCSeekOrigin {
+	kSDMMD_AFCSeekSet = 0x0,
+	kSDMMD_AFCSeekCurrent = 0x1,
+	kSDMMD_AFCSeekEnd = 0x2
+};
+
 static char* SDMMD_gAFCPacketTypeNames[39] = {
 	"Invalid",
 	"Status",
@@ -119,21 +286,153 @@ void SDMMD_AFCConnectionRelease(SDMMD_AFCConnectionRef);
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateReadDirectory(CFStringRef path);
 
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRemovePath(CFStringRef path);
+// Recursive versions handled entirely by the device, GetSizeOfPathContents replies with key/value pairs like GetFileInfo
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRemovePathAndContents(CFStringRef path);
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetSizeOfPathContents(CFStringRef path);
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateMakeDirectory(CFStringRef path);
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileInfo(CFStringRef path);
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetDeviceInfo();
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateOpenFile(CFStringRef path, uint16_t mode, void* *fileRef);
+// Creates or replaces path with data in a single request, not every device supports it
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateWriteFileAtomic(CFStringRef path, CFDataRef data);
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateOpenFile(CFStringRef path, uint64_t mode);
+
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateReadOperation(uint64_t fileRef, uint64_t length);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateWriteOperation(uint64_t fileRef, CFDataRef data);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateSeekOperation(uint64_t fileRef, int64_t offset, uint64_t origin);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateTellOperation(uint64_t fileRef);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateCloseOperation(uint64_t fileRef);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateSetFileSizeOperation(uint64_t fileRef, uint64_t size);
+SDMMD_AFCOperationRef SDMMD_AFCFileDescriptorCreateLockOperation(uint64_t fileRef, uint64_t operation);
 
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateRenamePath(CFStringRef old, CFStringRef new);
 
+// An enumerator replies to each read with a Data packet of NUL terminated names, an empty one marks the end of the directory
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateDirectoryEnumeratorOpen(CFStringRef path);
+SDMMD_AFCOperationRef SDMMD_AFCDirectoryEnumeratorCreateReadOperation(uint64_t enumerator);
+SDMMD_AFCOperationRef SDMMD_AFCDirectoryEnumeratorCreateCloseOperation(uint64_t enumerator);
+
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateLinkPath(uint64_t linkType, CFStringRef target, CFStringRef link);
+// The device replies with a Data packet holding the digest of the file, or of bytes start up to (not including) end
 SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileHash(CFStringRef path);
-SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetModTime(CFStringRef ref);
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateGetFileHashWithRange(CFStringRef path, uint64_t start, uint64_t end);
+// modTime is in nanoseconds since 1970
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetModTime(CFStringRef path, uint64_t modTime);
+
+// FS block size is the buffer the device reads and writes files with, socket block size the one it sends and receives with
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetFSBlockSize(uint64_t size);
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetSocketBlockSize(uint64_t size);
+// Values that are not strings are sent as their description
+SDMMD_AFCOperationRef SDMMD_AFCOperationCreateSetConnectionOptions(CFDictionaryRef options);
 
 sdmmd_return_t SDMMD_AFCConnectionPerformOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op);
 
+// Safe to call from several threads at once on the same connection, requests are multiplexed and replies are matched by packet id. An operation timeout of 0 waits forever.
 sdmmd_return_t SDMMD_AFCProcessOperation(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, SDMMD_AFCOperationRef *response);
 
+// Keeps up to kSDMMD_AFCBatchWindow of the operations in flight at once, responses[index] is the reply to operations[index] or NULL if it failed
+#define kSDMMD_AFCBatchWindow				0x100
+sdmmd_return_t SDMMD_AFCProcessOperations(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef *operations, SDMMD_AFCOperationRef *responses, uint32_t count);
+
+// Starts op and returns at once, the callback runs on queue (a global queue if NULL) when the reply arrives, the operation times out or the future
+// is cancelled. The result already includes the status the device answered with. The caller owns the returned future and op may be released as
+// soon as this returns. Returns NULL only for invalid arguments.
+SDMMD_AFCFutureRef SDMMD_AFCConnectionPerformOperationAsync(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef op, dispatch_queue_t queue, SDMMD_AFCCompletionCallback callback, void *context);
+
+// Blocks until the future is done or deadline passes, a deadline of 0 waits forever. kAMDTimeOutError means the deadline passed and the
+// operation is still running.
+sdmmd_return_t SDMMD_AFCFutureWait(SDMMD_AFCFutureRef future, dispatch_time_t deadline);
+bool SDMMD_AFCFutureIsDone(SDMMD_AFCFutureRef future);
+// Only valid once the future is done, the response stays owned by the future
+sdmmd_return_t SDMMD_AFCFutureGetResult(SDMMD_AFCFutureRef future);
+SDMMD_AFCOperationRef SDMMD_AFCFutureGetResponse(SDMMD_AFCFutureRef future);
+
+// Finishes the future with kSDMMD_AFCCancelledError unless it is already done. A cancelled open whose request already reached the device has the
+// handle it returns closed in the background.
+void SDMMD_AFCFutureCancel(SDMMD_AFCFutureRef future);
+void SDMMD_AFCConnectionCancelOperations(SDMMD_AFCConnectionRef conn);
+// True when the transport never failed and no reply is still owed, only then can the service underneath be handed to another connection
+// once this one is released.
+bool SDMMD_AFCConnectionIsReusable(SDMMD_AFCConnectionRef conn);
+
+SDMMD_AFCFutureRef SDMMD_AFCFutureRetain(SDMMD_AFCFutureRef future);
+void SDMMD_AFCFutureRelease(SDMMD_AFCFutureRef future);
+
+// Applies to every operation on the connection that does not set its own timeout, synchronous or not. 0 waits forever.
+void SDMMD_AFCConnectionSetOperationTimeout(SDMMD_AFCConnectionRef conn, CFTimeInterval timeout);
+
+void SDMMD_AFCOperationRelease(SDMMD_AFCOperationRef op);
+// Operations that needed a fresh malloc versus ones served from the pool, since launch
+void SDMMD_AFCOperationGetPoolStatistics(uint64_t *allocations, uint64_t *reuses);
+
+// Converts a Status reply into a return code, any other reply type is treated as success
+sdmmd_return_t SDMMD_AFCOperationGetResponseStatus(SDMMD_AFCOperationRef response);
+
+// Chunk size is clamped to kSDMMD_AFCChunkSizeMin-kSDMMD_AFCChunkSizeMax and depth to 1-kSDMMD_AFCPipelineDepthMax
+void SDMMD_AFCConnectionSetChunkSize(SDMMD_AFCConnectionRef conn, uint32_t chunkSize);
+void SDMMD_AFCConnectionSetPipelineDepth(SDMMD_AFCConnectionRef conn, uint32_t depth);
+
+// Writes a set of small files with as few round trips as possible. Devices that support WriteFileAtomic get one request per file and all of them are
+// in flight at once, other devices get every open in one batch followed by every write and close in a second. modTimes is optional (nanoseconds
+// since 1970, applied after each file is written) and so is results, which receives the outcome of each file. Returns the first failure.
+sdmmd_return_t SDMMD_AFCConnectionWriteFiles(SDMMD_AFCConnectionRef conn, CFStringRef *paths, CFDataRef *contents, const uint64_t *modTimes, sdmmd_return_t *results, uint32_t count);
+
+// Sets both device side block sizes and sizes the local socket buffers to match. Devices that do not know the requests are left alone and this still
+// succeeds. The first file open or SDMMD_AFCConnectionWriteFiles() does this with kSDMMD_AFCBlockSizeDefault or the tuned size for the device
+// unless it was called before.
+sdmmd_return_t SDMMD_AFCConnectionSetBlockSizes(SDMMD_AFCConnectionRef conn, uint32_t fsBlockSize, uint32_t socketBlockSize);
+sdmmd_return_t SDMMD_AFCConnectionSetOptions(SDMMD_AFCConnectionRef conn, CFDictionaryRef options);
+
+// Times a write and read back of kSDMMD_AFCAutoTuneProbeLength bytes at probePath (kSDMMD_AFCAutoTuneProbePath if NULL) for each block size from
+// kSDMMD_AFCChunkSizeMin to kSDMMD_AFCChunkSizeMax, keeps the fastest as block and chunk size and remembers it for the device model and interface,
+// so later connections to the same kind of device start with it.
+sdmmd_return_t SDMMD_AFCConnectionAutoTune(SDMMD_AFCConnectionRef conn, CFStringRef probePath, uint32_t *blockSize);
+bool SDMMD_AFCConnectionIsTuned(SDMMD_AFCConnectionRef conn);
+
+sdmmd_return_t SDMMD_AFCFileRefOpen(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t mode, uint64_t *fileRef);
+// length is the size of buffer on the way in and the number of bytes read on the way out, a short read means the end of the file was reached
+sdmmd_return_t SDMMD_AFCFileRefRead(SDMMD_AFCConnectionRef conn, uint64_t fileRef, void *buffer, uint64_t *length);
+sdmmd_return_t SDMMD_AFCFileRefWrite(SDMMD_AFCConnectionRef conn, uint64_t fileRef, const void *buffer, uint64_t length);
+// Same as FileRefWrite but the data is length bytes of fd starting at offset. Plain connections hand the file to sendfile(), SSL ones encrypt
+// straight from a mapping of it, either way the data is never copied into a buffer of ours.
+sdmmd_return_t SDMMD_AFCFileRefWriteFromFile(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int fd, uint64_t offset, uint64_t length);
+// Same as FileRefRead but into fd at offset, fd must be open for reading and writing. The file is grown to offset+length and the data is received
+// straight into a mapping of it, a short read leaves it at that size so the caller should truncate to offset plus the returned length.
+sdmmd_return_t SDMMD_AFCFileRefReadToFile(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int fd, uint64_t offset, uint64_t *length);
+sdmmd_return_t SDMMD_AFCFileRefSeek(SDMMD_AFCConnectionRef conn, uint64_t fileRef, int64_t offset, uint64_t origin);
+sdmmd_return_t SDMMD_AFCFileRefTell(SDMMD_AFCConnectionRef conn, uint64_t fileRef, uint64_t *offset);
+sdmmd_return_t SDMMD_AFCFileRefSetFileSize(SDMMD_AFCConnectionRef conn, uint64_t fileRef, uint64_t size);
+sdmmd_return_t SDMMD_AFCFileRefClose(SDMMD_AFCConnectionRef conn, uint64_t fileRef);
+
+// Parses the key/value string pairs of a GetFileInfo or GetDeviceInfo reply
+CFDictionaryRef SDMMD_AFCCreateDictionaryFromData(CFDataRef data);
+uint64_t SDMMD_AFCFileInfoGetNumber(CFDictionaryRef info, CFStringRef key);
+
+// Optional per connection cache of GetFileInfo answers, including "not found" ones. Entries live for ttl seconds and anything this connection
+// changes (write, truncate, remove, rename, mkdir, link, set mtime) is dropped before the request goes out. Changes made through other connections
+// are only picked up once the entry expires. A ttl of 0 turns the cache off, it is off by default.
+void SDMMD_AFCConnectionSetMetadataCacheTTL(SDMMD_AFCConnectionRef conn, CFTimeInterval ttl);
+void SDMMD_AFCConnectionFlushMetadataCache(SDMMD_AFCConnectionRef conn);
+// Every hit is a GetFileInfo round trip saved, negativeHits are the hits that answered "not found"
+void SDMMD_AFCConnectionGetMetadataCacheStatistics(SDMMD_AFCConnectionRef conn, uint64_t *hits, uint64_t *negativeHits, uint64_t *misses, uint64_t *invalidations);
+
+sdmmd_return_t SDMMD_AFCConnectionCopyFileInfo(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDictionaryRef *info);
+// Succeeds if path exists on the device
+sdmmd_return_t SDMMD_check_can_touch(SDMMD_AFCConnectionRef conn, CFStringRef path);
+sdmmd_return_t SDMMD_AFCConnectionCopyFileHash(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDataRef *hash);
+sdmmd_return_t SDMMD_AFCConnectionCopyFileHashWithRange(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t start, uint64_t end, CFDataRef *hash);
+sdmmd_return_t SDMMD_AFCConnectionSetModTime(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t modTime);
+// The whole directory in one reply, see SDMMD_AFCIterator for a version that streams large directories
+sdmmd_return_t SDMMD_AFCConnectionCopyDirectoryListing(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDataRef *listing);
+
+// Total size of everything under path, and recursive removal of path. Both are a single request where the device supports it, older
+// firmware gets a parallel walk over the connection instead, with the removals sent as one pipelined batch.
+sdmmd_return_t SDMMD_AFCConnectionGetSizeOfPathContents(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t *size);
+sdmmd_return_t SDMMD_AFCConnectionRemovePathAndContents(SDMMD_AFCConnectionRef conn, CFStringRef path);
+
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorOpen(SDMMD_AFCConnectionRef conn, CFStringRef path, uint64_t *enumerator);
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorRead(SDMMD_AFCConnectionRef conn, uint64_t enumerator, CFDataRef *names);
+sdmmd_return_t SDMMD_AFCDirectoryEnumeratorClose(SDMMD_AFCConnectionRef conn, uint64_t enumerator);
+
 /*void SDMMD_AFCLog(uint32_t level, const char *format, ...);
 sdmmd_return_t SDMMD_AFCSetErrorInfoWithArgs(uint32_t level, uint32_t mask, uint32_t code, char *file, uint32_t line, char *call);
 sdmmd_return_t SDMMD__AFCSetErrorResult(uint32_t level, uint32_t code, uint32_t line, char *call);
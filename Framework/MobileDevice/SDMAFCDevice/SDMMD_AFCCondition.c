@@ -26,12 +26,19 @@ static CFTypeID _kSDMMD_AFCConditionRefID = _kCFRuntimeNotATypeID;
 
 static CFRuntimeClass _kSDMMD_AFCConditionRefClass = {0};
 
+static void SDMMD_AFCConditionRefFinalize(CFTypeRef cf) {
+	SDMMD_AFCConditionRef cond = (SDMMD_AFCConditionRef)cf;
+	if (cond->ivars.semaphore) {
+		dispatch_release(cond->ivars.semaphore);
+	}
+}
+
 void SDMMD_AFCConditionRefClassInitialize(void) {
     _kSDMMD_AFCConditionRefClass.version = 0;
     _kSDMMD_AFCConditionRefClass.className = "SDMMD_AFCConditionRef";
     _kSDMMD_AFCConditionRefClass.init = NULL;
     _kSDMMD_AFCConditionRefClass.copy = NULL;
-    _kSDMMD_AFCConditionRefClass.finalize = NULL;
+    _kSDMMD_AFCConditionRefClass.finalize = SDMMD_AFCConditionRefFinalize;
     _kSDMMD_AFCConditionRefClass.equal = NULL;
     _kSDMMD_AFCConditionRefClass.hash = NULL;
     _kSDMMD_AFCConditionRefClass.copyFormattingDesc = NULL;
@@ -46,41 +53,52 @@ CFTypeID SDMMD_AFCConditionGetTypeID(void) {
 
 SDMMD_AFCConditionRef SDMMD_AFCConditionCreate() {
 	uint32_t extra = sizeof(AFCConditionClassBody);
-	SDMMD_AFCConditionRef cond = calloc(0x1, sizeof(SDMMD_AFCConditionClass));
-	cond = (SDMMD_AFCConditionRef)_CFRuntimeCreateInstance(kCFAllocatorDefault, _kSDMMD_AFCConditionRefID, extra, NULL);
+	SDMMD_AFCConditionRef cond = (SDMMD_AFCConditionRef)_CFRuntimeCreateInstance(kCFAllocatorDefault, _kSDMMD_AFCConditionRefID, extra, NULL);
 	if (cond) {
-		pthread_mutex_init(&cond->ivars.mutex_lock,0x0);
-		pthread_cond_init(&cond->ivars.mutex_cond,0x0);
 		cond->ivars.signaled = false;
+		cond->ivars.waiters = 0x0;
+		cond->ivars.semaphore = dispatch_semaphore_create(0x0);
 	}
 	return cond;
 }
 
 bool SDMMD_AFCConditionIsSignaled(SDMMD_AFCConditionRef cond) {
-	return cond->ivars.signaled;
+	return (cond && cond->ivars.signaled);
 }
 
 sdmmd_return_t SDMMD_AFCConditionSignal(SDMMD_AFCConditionRef cond) {
-	sdmmd_return_t result = pthread_mutex_lock(&cond->ivars.mutex_lock);
-	if (result == 0) {
-		cond->ivars.signaled = true;
-		result = pthread_cond_broadcast(&cond->ivars.mutex_cond);
-		pthread_mutex_unlock(&cond->ivars.mutex_lock);
+	if (cond == NULL) {
+		return 0xe8004007;
 	}
-	return result;
+	// the swap is a full barrier, any waiter counted after it is guaranteed to see signaled and not go to sleep
+	if (__sync_bool_compare_and_swap(&cond->ivars.signaled, false, true)) {
+		int32_t waiters = cond->ivars.waiters;
+		for (int32_t index = 0x0; index < waiters; index++) {
+			dispatch_semaphore_signal(cond->ivars.semaphore);
+		}
+	}
+	return kAMDSuccess;
 }
 
-sdmmd_return_t SDMMD_AFCConditionWait(SDMMD_AFCConditionRef cond) {
-	sdmmd_return_t result = pthread_mutex_lock(&cond->ivars.mutex_lock);
-	if (result == 0) {
-		if (cond->ivars.signaled) {
-			struct timespec waittime = {0x0, 0x000000008e0004c0};
-			pthread_cond_timedwait(&cond->ivars.mutex_cond,&cond->ivars.mutex_lock,&waittime);
+sdmmd_return_t SDMMD_AFCConditionWaitWithDeadline(SDMMD_AFCConditionRef cond, dispatch_time_t deadline) {
+	if (cond == NULL) {
+		return 0xe8004007;
+	}
+	if (cond->ivars.signaled) {
+		return kAMDSuccess;
+	}
+	__sync_add_and_fetch(&cond->ivars.waiters, 0x1);
+	while (!cond->ivars.signaled) {
+		if (dispatch_semaphore_wait(cond->ivars.semaphore, (deadline ? deadline : DISPATCH_TIME_FOREVER)) != 0x0) {
+			return (cond->ivars.signaled ? kAMDSuccess : kAMDTimeOutError);
 		}
-		pthread_mutex_unlock(&cond->ivars.mutex_lock);
 	}
-	return result;
-	
+	// a wakeup meant for a waiter that saw signaled before sleeping is left on the semaphore, which is harmless since nobody sleeps on it again
+	return kAMDSuccess;
+}
+
+sdmmd_return_t SDMMD_AFCConditionWait(SDMMD_AFCConditionRef cond) {
+	return SDMMD_AFCConditionWaitWithDeadline(cond, 0x0);
 }
 
 #endif
\ No newline at end of file
@@ -19,8 +19,9 @@
 #ifndef _SDM_MD_AFCCONDITION_H_
 #define _SDM_MD_AFCCONDITION_H_
 
+#include <CoreFoundation/CoreFoundation.h>
 #include "SDMMD_Error.h"
-#include <pthread.h>
+#include <dispatch/dispatch.h>
 
 #pragma mark -
 #pragma mark TYPES
@@ -30,16 +31,17 @@ typedef struct AFCConditionClassHeader {
 	unsigned char header[16];
 } __attribute__ ((packed)) AFCConditionClassHeader; // 0x10
 
+// Once signaled a condition stays signaled, waiting on it then returns at once without touching the semaphore
 typedef struct AFCConditionClassBody {
-	pthread_mutex_t mutex_lock;	// 16
-	pthread_cond_t mutex_cond; 	// 80
-	bool signaled; 				// 128
-} __attribute__ ((packed)) AFCConditionClassBody; // 0x78
+	volatile uint32_t signaled;
+	volatile int32_t waiters;		// threads that may be asleep on the semaphore, only ever grows
+	dispatch_semaphore_t semaphore;
+} AFCConditionClassBody;
 
 typedef struct afc_condition {
 	struct AFCConditionClassHeader base;
 	struct AFCConditionClassBody ivars;
-} __attribute__ ((packed)) afc_condition;
+} afc_condition;
 
 typedef struct afc_condition SDMMD_AFCConditionClass;
 
@@ -57,6 +59,9 @@ void SDMMD_AFCConditionRefClassInitialize(void);
 SDMMD_AFCConditionRef SDMMD_AFCConditionCreate();
 bool SDMMD_AFCConditionIsSignaled(SDMMD_AFCConditionRef cond);
 sdmmd_return_t SDMMD_AFCConditionSignal(SDMMD_AFCConditionRef cond);
+// Blocks until the condition is signaled
 sdmmd_return_t SDMMD_AFCConditionWait(SDMMD_AFCConditionRef cond);
+// Returns kAMDTimeOutError if deadline passes first, a deadline of 0 waits forever
+sdmmd_return_t SDMMD_AFCConditionWaitWithDeadline(SDMMD_AFCConditionRef cond, dispatch_time_t deadline);
 
 #endif
\ No newline at end of file
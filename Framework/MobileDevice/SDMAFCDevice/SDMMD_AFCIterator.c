@@ -21,4 +21,234 @@
 
 #include "SDMMD_AFCIterator.h"
 
-#endif
\ No newline at end of file
+static void SDMMD_AFCIteratorBatchRelease(struct sdmmd_AFCIteratorBatch *batch) {
+	if (batch) {
+		if (batch->names) {
+			CFRelease(batch->names);
+		}
+		if (batch->infos) {
+			CFRelease(batch->infos);
+		}
+		free(batch);
+	}
+}
+
+// Replaces the consumed listing with the next reply from the enumerator, a ReadDirectory listing only ever has the one reply
+static sdmmd_return_t SDMMD_AFCIteratorRefill(SDMMD_AFCIteratorRef iterator) {
+	if (iterator->listing) {
+		CFRelease(iterator->listing);
+		iterator->listing = NULL;
+	}
+	iterator->offset = 0x0;
+	if (iterator->finished || iterator->enumerator == false) {
+		iterator->finished = true;
+		return kAMDEOFError;
+	}
+	CFDataRef names = NULL;
+	sdmmd_return_t result = SDMMD_AFCDirectoryEnumeratorRead(iterator->conn, iterator->handle, &names);
+	if (result == kAMDSuccess) {
+		if (CFDataGetLength(names) == 0x0) {
+			CFRelease(names);
+			result = kAMDEOFError;
+		} else {
+			iterator->listing = names;
+		}
+	}
+	if (result == kAMDEOFError) {
+		iterator->finished = true;
+	}
+	return result;
+}
+
+static void SDMMD_AFCIteratorPrefetch(SDMMD_AFCIteratorRef iterator, struct sdmmd_AFCIteratorBatch *batch) {
+	CFIndex count = CFArrayGetCount(batch->names);
+	bool hasSeparator = CFStringHasSuffix(iterator->path, CFSTR("/"));
+	SDMMD_AFCOperationRef *operations = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *responses = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+	for (CFIndex index = 0x0; index < count; index++) {
+		CFStringRef path = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, (hasSeparator ? CFSTR("%@%@") : CFSTR("%@/%@")), iterator->path, CFArrayGetValueAtIndex(batch->names, index));
+		operations[index] = SDMMD_AFCOperationCreateGetFileInfo(path);
+		CFRelease(path);
+	}
+	// the whole batch goes out in one pipelined run instead of one round trip per entry
+	batch->result = SDMMD_AFCProcessOperations(iterator->conn, operations, responses, (uint32_t)count);
+	batch->infos = CFArrayCreateMutable(kCFAllocatorDefault, count, &kCFTypeArrayCallBacks);
+	for (CFIndex index = 0x0; index < count; index++) {
+		if (SDMMD_AFCOperationGetResponseStatus(responses[index]) == kAMDSuccess && responses[index]->packet->header.type == kSDMMD_AFCPacketTypeData) {
+			CFDataRef data = SDMMD_GetDataResponseFromOperation(responses[index]);
+			CFDictionaryRef info = SDMMD_AFCCreateDictionaryFromData(data);
+			CFArrayAppendValue(batch->infos, info);
+			CFRelease(info);
+			CFRelease(data);
+		} else {
+			// removed between listing and lookup
+			CFArrayAppendValue(batch->infos, kCFNull);
+		}
+		SDMMD_AFCOperationRelease(responses[index]);
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
+	free(responses);
+	free(operations);
+}
+
+static struct sdmmd_AFCIteratorBatch* SDMMD_AFCIteratorCreateBatch(SDMMD_AFCIteratorRef iterator) {
+	struct sdmmd_AFCIteratorBatch *batch = calloc(1, sizeof(struct sdmmd_AFCIteratorBatch));
+	batch->names = CFArrayCreateMutable(kCFAllocatorDefault, iterator->batchSize, &kCFTypeArrayCallBacks);
+	sdmmd_return_t result = kAMDSuccess;
+	while (CFArrayGetCount(batch->names) < iterator->batchSize) {
+		if (iterator->listing == NULL || iterator->offset >= CFDataGetLength(iterator->listing)) {
+			result = SDMMD_AFCIteratorRefill(iterator);
+			if (result != kAMDSuccess) {
+				break;
+			}
+			continue;
+		}
+		const char *name = (const char *)CFDataGetBytePtr(iterator->listing) + iterator->offset;
+		CFIndex remaining = CFDataGetLength(iterator->listing) - iterator->offset;
+		const char *end = memchr(name, '\0', remaining);
+		CFIndex nameLength = (end ? end - name : remaining);
+		iterator->offset += nameLength + 0x1;
+		if (nameLength == 0x0 || (nameLength == 0x1 && name[0x0] == '.') || (nameLength == 0x2 && name[0x0] == '.' && name[0x1] == '.')) {
+			continue;
+		}
+		CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name, nameLength, kCFStringEncodingUTF8, false);
+		if (string) {
+			CFArrayAppendValue(batch->names, string);
+			CFRelease(string);
+		}
+	}
+	// the end of the directory is only reported once every name has been handed out
+	if (result == kAMDEOFError && CFArrayGetCount(batch->names)) {
+		result = kAMDSuccess;
+	}
+	batch->result = result;
+	if (result == kAMDSuccess && iterator->prefetch) {
+		SDMMD_AFCIteratorPrefetch(iterator, batch);
+	}
+	return batch;
+}
+
+sdmmd_return_t SDMMD_AFCIteratorCreate(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDictionaryRef options, SDMMD_AFCIteratorRef *iterator) {
+	if (conn == NULL || path == NULL || iterator == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	uint32_t batchSize = kSDMMD_AFCIteratorBatchSizeDefault;
+	bool prefetch = false;
+	if (options) {
+		CFNumberRef size = CFDictionaryGetValue(options, CFSTR(kSDMMD_AFCIteratorOptionBatchSize));
+		if (size && CFGetTypeID(size) == CFNumberGetTypeID()) {
+			CFNumberGetValue(size, kCFNumberSInt32Type, &batchSize);
+		}
+		CFBooleanRef prefetchOption = CFDictionaryGetValue(options, CFSTR(kSDMMD_AFCIteratorOptionPrefetchFileInfo));
+		prefetch = (prefetchOption && CFGetTypeID(prefetchOption) == CFBooleanGetTypeID() && CFBooleanGetValue(prefetchOption));
+	}
+	batchSize = (batchSize == 0x0 ? 0x1 : batchSize);
+	batchSize = (batchSize > kSDMMD_AFCIteratorBatchSizeMax ? kSDMMD_AFCIteratorBatchSizeMax : batchSize);
+
+	uint64_t handle = 0x0;
+	CFDataRef listing = NULL;
+	sdmmd_return_t result = SDMMD_AFCDirectoryEnumeratorOpen(conn, path, &handle);
+	bool enumerator = (result == kAMDSuccess);
+	if (SDMMD_AFCResultIsUnsupported(result)) {
+		// older devices have no enumerators, the whole listing then arrives in one reply
+		result = SDMMD_AFCConnectionCopyDirectoryListing(conn, path, &listing);
+	}
+	if (result == kAMDSuccess) {
+		SDMMD_AFCIteratorRef iter = calloc(1, sizeof(struct sdmmd_AFCIteratorClass));
+		iter->conn = conn;
+		iter->path = CFStringCreateCopy(kCFAllocatorDefault, path);
+		iter->batchSize = batchSize;
+		iter->prefetch = prefetch;
+		iter->enumerator = enumerator;
+		iter->handle = handle;
+		iter->listing = listing;
+		iter->queue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.afc.iterator", NULL);
+		*iterator = iter;
+	} else {
+		printf("SDMMD_AFCIteratorCreate: Could not list %s: 0x%x\n", SDMCFStringGetString(path), result);
+	}
+	return result;
+}
+
+void SDMMD_AFCIteratorRelease(SDMMD_AFCIteratorRef iterator) {
+	if (iterator) {
+		// wait for a batch that is still being built
+		dispatch_sync(iterator->queue, ^{});
+		dispatch_release(iterator->queue);
+		SDMMD_AFCIteratorBatchRelease(iterator->pending);
+		if (iterator->enumerator) {
+			SDMMD_AFCDirectoryEnumeratorClose(iterator->conn, iterator->handle);
+		}
+		if (iterator->listing) {
+			CFRelease(iterator->listing);
+		}
+		if (iterator->currentNames) {
+			CFRelease(iterator->currentNames);
+		}
+		if (iterator->currentInfos) {
+			CFRelease(iterator->currentInfos);
+		}
+		CFRelease(iterator->path);
+		free(iterator);
+	}
+}
+
+sdmmd_return_t SDMMD_AFCIteratorCopyNextBatch(SDMMD_AFCIteratorRef iterator, CFArrayRef *names, CFArrayRef *infos) {
+	if (iterator == NULL || names == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	dispatch_sync(iterator->queue, ^{
+		if (iterator->pending == NULL) {
+			iterator->pending = SDMMD_AFCIteratorCreateBatch(iterator);
+		}
+	});
+	struct sdmmd_AFCIteratorBatch *batch = iterator->pending;
+	iterator->pending = NULL;
+	sdmmd_return_t result = batch->result;
+	if (result == kAMDSuccess && iterator->prefetch) {
+		// the next batch and its file info are fetched while the caller works through this one
+		dispatch_async(iterator->queue, ^{
+			iterator->pending = SDMMD_AFCIteratorCreateBatch(iterator);
+		});
+	}
+	if (result == kAMDSuccess) {
+		*names = batch->names;
+		batch->names = NULL;
+		if (infos) {
+			*infos = batch->infos;
+			batch->infos = NULL;
+		}
+	}
+	SDMMD_AFCIteratorBatchRelease(batch);
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCIteratorCopyNext(SDMMD_AFCIteratorRef iterator, CFStringRef *name, CFDictionaryRef *info) {
+	if (iterator == NULL || name == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (iterator->currentNames == NULL || iterator->currentIndex >= CFArrayGetCount(iterator->currentNames)) {
+		if (iterator->currentNames) {
+			CFRelease(iterator->currentNames);
+			iterator->currentNames = NULL;
+		}
+		if (iterator->currentInfos) {
+			CFRelease(iterator->currentInfos);
+			iterator->currentInfos = NULL;
+		}
+		sdmmd_return_t result = SDMMD_AFCIteratorCopyNextBatch(iterator, &iterator->currentNames, &iterator->currentInfos);
+		if (result != kAMDSuccess) {
+			return result;
+		}
+		iterator->currentIndex = 0x0;
+	}
+	*name = CFRetain(CFArrayGetValueAtIndex(iterator->currentNames, iterator->currentIndex));
+	if (info) {
+		CFTypeRef value = (iterator->currentInfos ? CFArrayGetValueAtIndex(iterator->currentInfos, iterator->currentIndex) : NULL);
+		*info = ((value && value != kCFNull) ? CFRetain(value) : NULL);
+	}
+	iterator->currentIndex++;
+	return kAMDSuccess;
+}
+
+#endif
@@ -19,35 +19,59 @@
 #ifndef _SDM_MD_AFCITERATOR_H_
 #define _SDM_MD_AFCITERATOR_H_
 
-#import <CoreFoundation/CoreFoundation.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include "SDMMD_Error.h"
+#include "SDMMD_AFC.h"
 
 #pragma mark -
 #pragma mark TYPES
 #pragma mark -
 
-typedef struct AFCIteratorClassHeader {
-	unsigned char header[16];		// CF Object header
-} __attribute__ ((packed)) AFCIteratorClassHeader; // 0x10
+// Options dictionary keys for SDMMD_AFCIteratorCreate()
+#define kSDMMD_AFCIteratorOptionBatchSize			"BatchSize"			// CFNumber, most names handed out per batch, defaults to kSDMMD_AFCIteratorBatchSizeDefault
+#define kSDMMD_AFCIteratorOptionPrefetchFileInfo	"PrefetchFileInfo"	// CFBoolean, fetch GetFileInfo for every entry, one batch ahead of the caller (default false)
 
-typedef struct AFCIteratorClassBody {
-	// 16
-	CFArrayRef keys_values;			// 24
-	int32_t count0;					// 32
-	CFMutableDataRef key_buffer; 	// 40
-	CFMutableDataRef value_buffer;	// 48
-} __attribute__ ((packed)) AFCIteratorClassBody; // 0x28
+#define kSDMMD_AFCIteratorBatchSizeDefault			0x100
+#define kSDMMD_AFCIteratorBatchSizeMax				kSDMMD_AFCBatchWindow
 
-typedef struct afc_iterator {
-	struct AFCIteratorClassHeader base;
-	struct AFCIteratorClassBody ivars;
-} __attribute__ ((packed)) afc_iterator;
+struct sdmmd_AFCIteratorBatch {
+	CFMutableArrayRef names;
+	CFMutableArrayRef infos;		// GetFileInfo dictionaries parallel to names, kCFNull where the entry vanished, NULL without prefetching
+	sdmmd_return_t result;
+};
 
-typedef struct afc_iterator SDMMD_AFCIteratorClass;
+struct sdmmd_AFCIteratorClass {
+	SDMMD_AFCConnectionRef conn;
+	CFStringRef path;
+	uint32_t batchSize;
+	bool prefetch;
+	bool enumerator;				// a DirectoryEnumeratorRef is open on the device, otherwise the listing came from ReadDirectory
+	uint64_t handle;
+	bool finished;
+	CFDataRef listing;				// names still to be handed out, at most one reply's worth
+	CFIndex offset;
+	dispatch_queue_t queue;			// builds the next batch while the caller works on the current one
+	struct sdmmd_AFCIteratorBatch *pending;
+	CFArrayRef currentNames;		// for SDMMD_AFCIteratorCopyNext()
+	CFArrayRef currentInfos;
+	CFIndex currentIndex;
+} sdmmd_AFCIteratorClass;
 
-#define SDMMD_AFCIteratorRef SDMMD_AFCIteratorClass*
+#define SDMMD_AFCIteratorRef struct sdmmd_AFCIteratorClass*
 
 #pragma mark -
 #pragma mark FUNCTIONS
 #pragma mark -
 
-#endif
\ No newline at end of file
+// Opens a DirectoryEnumeratorRef on path and falls back to a single ReadDirectory on devices without one. The iterator must not outlive conn.
+sdmmd_return_t SDMMD_AFCIteratorCreate(SDMMD_AFCConnectionRef conn, CFStringRef path, CFDictionaryRef options, SDMMD_AFCIteratorRef *iterator);
+void SDMMD_AFCIteratorRelease(SDMMD_AFCIteratorRef iterator);
+
+// Hands out up to the batch size of names ("." and ".." are skipped) and returns kAMDEOFError once the directory is exhausted. infos is only set
+// when prefetching. Both arrays belong to the caller.
+sdmmd_return_t SDMMD_AFCIteratorCopyNextBatch(SDMMD_AFCIteratorRef iterator, CFArrayRef *names, CFArrayRef *infos);
+
+// One entry at a time on top of the batches, info may be NULL and is only set when prefetching
+sdmmd_return_t SDMMD_AFCIteratorCopyNext(SDMMD_AFCIteratorRef iterator, CFStringRef *name, CFDictionaryRef *info);
+
+#endif
@@ -27,12 +27,60 @@ static CFTypeID _kSDMMD_AFCLockRefID = _kCFRuntimeNotATypeID;
 
 static CFRuntimeClass _kSDMMD_AFCLockRefClass = {0};
 
+#pragma mark -
+#pragma mark Lock State
+#pragma mark -
+
+void SDMMD_AFCLockStateInit(struct sdmmd_AFCLockState *state) {
+	state->count = 0x0;
+	state->waiters = dispatch_semaphore_create(0x0);
+}
+
+void SDMMD_AFCLockStateDestroy(struct sdmmd_AFCLockState *state) {
+	if (state->waiters) {
+		dispatch_release(state->waiters);
+		state->waiters = NULL;
+	}
+}
+
+bool SDMMD_AFCLockStateTryLock(struct sdmmd_AFCLockState *state) {
+	return __sync_bool_compare_and_swap(&state->count, 0x0, 0x1);
+}
+
+void SDMMD_AFCLockStateLock(struct sdmmd_AFCLockState *state) {
+	for (uint32_t spin = 0x0; spin < kSDMMD_AFCLockSpinCount; spin++) {
+		// only read while spinning so waiting threads don't fight over the cache line
+		if (state->count == 0x0 && SDMMD_AFCLockStateTryLock(state)) {
+			return;
+		}
+	}
+	// the unlock that hands over the lock may signal before this thread waits, the semaphore keeps count
+	if (__sync_fetch_and_add(&state->count, 0x1) > 0x0) {
+		dispatch_semaphore_wait(state->waiters, DISPATCH_TIME_FOREVER);
+	}
+}
+
+void SDMMD_AFCLockStateUnlock(struct sdmmd_AFCLockState *state) {
+	if (__sync_sub_and_fetch(&state->count, 0x1) > 0x0) {
+		dispatch_semaphore_signal(state->waiters);
+	}
+}
+
+#pragma mark -
+#pragma mark Lock Objects
+#pragma mark -
+
+static void SDMMD_AFCLockRefFinalize(CFTypeRef cf) {
+	SDMMD_AFCLockRef lock = (SDMMD_AFCLockRef)cf;
+	SDMMD_AFCLockStateDestroy(&lock->ivars.state);
+}
+
 void SDMMD_AFCLockRefClassInitialize(void) {
     _kSDMMD_AFCLockRefClass.version = 0;
     _kSDMMD_AFCLockRefClass.className = "SDMMD_AFCLockRef";
     _kSDMMD_AFCLockRefClass.init = NULL;
     _kSDMMD_AFCLockRefClass.copy = NULL;
-    _kSDMMD_AFCLockRefClass.finalize = NULL;
+    _kSDMMD_AFCLockRefClass.finalize = SDMMD_AFCLockRefFinalize;
     _kSDMMD_AFCLockRefClass.equal = NULL;
     _kSDMMD_AFCLockRefClass.hash = NULL;
     _kSDMMD_AFCLockRefClass.copyFormattingDesc = NULL;
@@ -47,30 +95,27 @@ CFTypeID SDMMD_AFCLockGetTypeID(void) {
 
 SDMMD_AFCLockRef SDMMD_AFCLockCreate() {
 	uint32_t extra = sizeof(AFCLockClassBody);
-	SDMMD_AFCLockRef lock = calloc(0x1, sizeof(SDMMD_AFCLockClass));
-	lock = (SDMMD_AFCLockRef)_CFRuntimeCreateInstance(kCFAllocatorDefault, _kSDMMD_AFCLockRefID, extra, NULL);
+	SDMMD_AFCLockRef lock = (SDMMD_AFCLockRef)_CFRuntimeCreateInstance(kCFAllocatorDefault, _kSDMMD_AFCLockRefID, extra, NULL);
 	if (lock) {
-		sdmmd_mutex_init(lock->ivars.mutex_lock);
+		SDMMD_AFCLockStateInit(&lock->ivars.state);
 	}
 	return lock;
 }
 
 sdmmd_return_t SDMMD_AFCLockLock(SDMMD_AFCLockRef lock) {
-	sdmmd_return_t result = 0xe8004017;
+	sdmmd_return_t result = 0xe8004007;
 	if (lock) {
-		result = pthread_mutex_lock(&(lock->ivars.mutex_lock));
-	} else {
-		result = 0xe8004007;
+		SDMMD_AFCLockStateLock(&lock->ivars.state);
+		result = kAMDSuccess;
 	}
 	return result;
 }
 
 sdmmd_return_t SDMMD_AFCLockUnlock(SDMMD_AFCLockRef lock) {
-	sdmmd_return_t result = 0xe8004017;
+	sdmmd_return_t result = 0xe8004007;
 	if (lock) {
-		result = pthread_mutex_unlock(&(lock->ivars.mutex_lock));
-	} else {
-		result = 0xe8004007;
+		SDMMD_AFCLockStateUnlock(&lock->ivars.state);
+		result = kAMDSuccess;
 	}
 	return result;
 }
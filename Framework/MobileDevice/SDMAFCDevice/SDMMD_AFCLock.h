@@ -19,27 +19,37 @@
 #ifndef _SDM_MD_AFCLOCK_H_
 #define _SDM_MD_AFCLOCK_H_
 
+#include <CoreFoundation/CoreFoundation.h>
 #include "SDMMD_Error.h"
 #include <stdint.h>
-#include <pthread.h>
+#include <dispatch/dispatch.h>
 
 #pragma mark -
 #pragma mark TYPES
 #pragma mark -
 
+// Lock and unlock are a single atomic operation while nobody else holds the lock, a thread only sleeps on the semaphore when it has to wait.
+// Small enough to embed, SDMMD_AFCLockRef wraps one for callers that want a CF object.
+struct sdmmd_AFCLockState {
+	volatile int32_t count;		// holder plus waiters
+	dispatch_semaphore_t waiters;
+} sdmmd_AFCLockState;
+
+// Tries to take a held lock this many times before going to sleep, the AFC locks are only ever held for a few instructions
+#define kSDMMD_AFCLockSpinCount		0x40
+
 typedef struct AFCLockClassHeader {
 	unsigned char header[16];
 } __attribute__ ((packed)) AFCLockClassHeader; // 0x10
 
 typedef struct AFCLockClassBody {
-	pthread_mutex_t mutex_lock;	// 16
-	unsigned char padding[44];	// 20
-} __attribute__ ((packed)) AFCLockClassBody; // 0x40
+	struct sdmmd_AFCLockState state;
+} AFCLockClassBody;
 
 typedef struct afc_lock {
 	struct AFCLockClassHeader base;
 	struct AFCLockClassBody ivars;
-} __attribute__ ((packed)) afc_lock;
+} afc_lock;
 
 typedef struct afc_lock SDMMD_AFCLockClass;
 
@@ -51,6 +61,12 @@ CFTypeID SDMMD_AFCLockGetTypeID(void);
 #pragma mark FUNCTIONS
 #pragma mark -
 
+void SDMMD_AFCLockStateInit(struct sdmmd_AFCLockState *state);
+void SDMMD_AFCLockStateDestroy(struct sdmmd_AFCLockState *state);
+void SDMMD_AFCLockStateLock(struct sdmmd_AFCLockState *state);
+bool SDMMD_AFCLockStateTryLock(struct sdmmd_AFCLockState *state);
+void SDMMD_AFCLockStateUnlock(struct sdmmd_AFCLockState *state);
+
 void SDMMD_AFCLockRefClassInitialize(void);
 
 SDMMD_AFCLockRef SDMMD_AFCLockCreate();
@@ -0,0 +1,1250 @@
+/*
+ *  SDMMD_AFCTransfer.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef _SDM_MD_AFCTRANSFER_C_
+#define _SDM_MD_AFCTRANSFER_C_
+
+#include "SDMMD_AFCTransfer.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Functions.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <openssl/sha.h>
+
+struct sdmmd_AFCTransferEntry {
+	char *localPath;
+	char *remotePath;
+	char *linkTarget;
+	uint64_t size;
+	uint64_t modified;		// nanoseconds since 1970, the unit AFC uses for st_mtime
+};
+
+struct sdmmd_AFCTransferList {
+	struct sdmmd_AFCTransferEntry *entries;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+struct sdmmd_AFCTransferPlan {
+	pthread_mutex_t lock;							// guards the lists while the tree is being walked
+	struct sdmmd_AFCTransferList directories;		// breadth first, so parents always come before their children
+	struct sdmmd_AFCTransferList files;
+	struct sdmmd_AFCTransferList links;
+	uint64_t totalBytes;
+	volatile uint32_t nextFile;
+	uint32_t smallStart;							// files from here on are small enough to be written in batches, the list is sorted largest first
+	volatile uint32_t result;						// first error hit by any worker, once set no new files are started
+	bool sync;										// compare against the device before writing, see SDMMD_AMDeviceSyncTree()
+	CFMutableDictionaryRef syncedFiles;				// manifest entries of files known to match the device, guarded by lock
+};
+
+struct sdmmd_AFCTransferProgress {
+	pthread_mutex_t lock;
+	uint64_t totalBytes;
+	volatile uint64_t sentBytes;
+	uint32_t lastPercent;
+	void (*callback)(CFDictionaryRef dict, void* arg);
+	void* arg;
+};
+
+#pragma mark -
+#pragma mark Connections
+#pragma mark -
+
+static bool SDMMD_AFCTransferGetBoolOption(CFDictionaryRef options, CFStringRef key, bool defaultValue) {
+	CFBooleanRef value = (options ? CFDictionaryGetValue(options, key) : NULL);
+	return (value && CFGetTypeID(value) == CFBooleanGetTypeID() ? CFBooleanGetValue(value) : defaultValue);
+}
+
+static uint32_t SDMMD_AFCTransferGetConnectionCount(SDMMD_AMDeviceRef device, CFDictionaryRef options) {
+	uint32_t connectionCount = kSDMMD_AFCTransferConnectionCountDefault;
+	CFNumberRef count = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_AFCTransferOptionConnectionCount)) : NULL);
+	if (count && CFGetTypeID(count) == CFNumberGetTypeID()) {
+		CFNumberGetValue(count, kCFNumberSInt32Type, &connectionCount);
+	}
+	connectionCount = (connectionCount == 0x0 ? 0x1 : connectionCount);
+	connectionCount = (connectionCount > kSDMMD_AFCTransferConnectionCountMax ? kSDMMD_AFCTransferConnectionCountMax : connectionCount);
+	// without a device there is nothing to check more connections out of
+	return (device ? connectionCount : 0x1);
+}
+
+// The first connection is afcConnection when one is passed in, fails only if not a single connection could be opened
+static sdmmd_return_t SDMMD_AFCTransferOpenConnections(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFDictionaryRef options, uint32_t connectionCount, SDMMD_AMConnectionRef *services, SDMMD_AFCConnectionRef *connections, uint32_t *opened) {
+	sdmmd_return_t result = kAMDSuccess;
+	// lockdown handles one request at a time, so the extra connections are started here rather than by the workers
+	while (*opened < connectionCount) {
+		SDMMD_AMConnectionRef service = afcConnection;
+		if (*opened || service == NULL) {
+			service = NULL;
+			sdmmd_return_t checkout = SDMMD_AMDeviceCheckoutServiceConnection(device, CFSTR(AMSVC_AFC), NULL, &service);
+			if (checkout != kAMDSuccess) {
+				// fewer connections only makes the copy slower
+				if (*opened == 0x0) {
+					printf("SDMMD_AFCTransferOpenConnections: Could not start the AFC service: 0x%x\n", checkout);
+					result = checkout;
+				}
+				break;
+			}
+		}
+		services[*opened] = service;
+		connections[*opened] = SDMMD_AFCConnectionCreate(service);
+		(*opened)++;
+	}
+	// only the first copy to a kind of device pays for the probe, the other connections pick the result up from the first one
+	if (*opened && SDMMD_AFCTransferGetBoolOption(options, CFSTR(kSDMMD_AFCTransferOptionAutoTune), false) && !SDMMD_AFCConnectionIsTuned(connections[0x0])) {
+		uint32_t blockSize = 0x0;
+		if (SDMMD_AFCConnectionAutoTune(connections[0x0], NULL, &blockSize) == kAMDSuccess) {
+			for (uint32_t index = 0x1; index < *opened; index++) {
+				SDMMD_AFCConnectionSetChunkSize(connections[index], blockSize);
+				SDMMD_AFCConnectionSetBlockSizes(connections[index], blockSize, blockSize);
+			}
+		}
+	}
+	return result;
+}
+
+static void SDMMD_AFCTransferCloseConnections(SDMMD_AMConnectionRef afcConnection, SDMMD_AMConnectionRef *services, SDMMD_AFCConnectionRef *connections, uint32_t opened) {
+	for (uint32_t index = 0x0; index < opened; index++) {
+		// has to be asked before the release, which frees the connection
+		bool reusable = SDMMD_AFCConnectionIsReusable(connections[index]);
+		SDMMD_AFCConnectionRelease(connections[index]);
+		if (services[index] != afcConnection) {
+			if (reusable) {
+				SDMMD_AMDeviceCheckinServiceConnection(services[index]);
+			} else {
+				// a connection that lost its place in the byte stream would hand the next user someone else's replies
+				SDMMD_AMDServiceConnectionInvalidate(services[index]);
+				free(services[index]);
+			}
+		}
+	}
+	free(connections);
+	free(services);
+}
+
+#pragma mark -
+#pragma mark Plan
+#pragma mark -
+
+static char* SDMMD_AFCTransferJoinPath(const char *base, const char *name) {
+	size_t baseLength = strlen(base);
+	bool needsSeparator = (baseLength && base[baseLength-1] != '/');
+	char *path = calloc(1, baseLength+needsSeparator+strlen(name)+1);
+	strcpy(path, base);
+	if (needsSeparator) {
+		path[baseLength] = '/';
+	}
+	strcat(path, name);
+	return path;
+}
+
+// The list takes ownership of the strings
+static void SDMMD_AFCTransferListAppend(struct sdmmd_AFCTransferList *list, char *localPath, char *remotePath, char *linkTarget, uint64_t size, uint64_t modified) {
+	if (list->count == list->capacity) {
+		list->capacity = (list->capacity ? list->capacity*2 : 0x40);
+		list->entries = realloc(list->entries, list->capacity*sizeof(struct sdmmd_AFCTransferEntry));
+	}
+	list->entries[list->count] = (struct sdmmd_AFCTransferEntry){localPath, remotePath, linkTarget, size, modified};
+	list->count++;
+}
+
+static void SDMMD_AFCTransferListFree(struct sdmmd_AFCTransferList *list) {
+	for (uint32_t index = 0x0; index < list->count; index++) {
+		free(list->entries[index].localPath);
+		free(list->entries[index].remotePath);
+		free(list->entries[index].linkTarget);
+	}
+	free(list->entries);
+	*list = (struct sdmmd_AFCTransferList){0};
+}
+
+static void SDMMD_AFCTransferSetResult(struct sdmmd_AFCTransferPlan *plan, sdmmd_return_t result) {
+	__sync_bool_compare_and_swap(&plan->result, (uint32_t)kAMDSuccess, (uint32_t)result);
+}
+
+static void SDMMD_AFCTransferAddPath(struct sdmmd_AFCTransferPlan *plan, char *localPath, char *remotePath, struct stat *pathStat) {
+	char *linkTarget = NULL;
+	if (S_ISLNK(pathStat->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t targetLength = readlink(localPath, target, PATH_MAX-1);
+		if (targetLength == -1) {
+			printf("SDMMD_AFCTransferAddPath: Could not read the symlink at %s.\n", localPath);
+			SDMMD_AFCTransferSetResult(plan, kAMDUndefinedError);
+			free(localPath);
+			free(remotePath);
+			return;
+		}
+		target[targetLength] = '\0';
+		linkTarget = strdup(target);
+	}
+	uint64_t modified = (uint64_t)pathStat->st_mtimespec.tv_sec*NSEC_PER_SEC + (uint64_t)pathStat->st_mtimespec.tv_nsec;
+	pthread_mutex_lock(&plan->lock);
+	if (S_ISDIR(pathStat->st_mode)) {
+		SDMMD_AFCTransferListAppend(&plan->directories, localPath, remotePath, NULL, 0x0, 0x0);
+	} else if (S_ISREG(pathStat->st_mode)) {
+		SDMMD_AFCTransferListAppend(&plan->files, localPath, remotePath, NULL, (uint64_t)pathStat->st_size, modified);
+		plan->totalBytes += (uint64_t)pathStat->st_size;
+	} else if (linkTarget) {
+		SDMMD_AFCTransferListAppend(&plan->links, localPath, remotePath, linkTarget, 0x0, 0x0);
+	} else {
+		printf("SDMMD_AFCTransferAddPath: Don't know how to copy this type of file: %s\n", localPath);
+		free(localPath);
+		free(remotePath);
+	}
+	pthread_mutex_unlock(&plan->lock);
+}
+
+static void SDMMD_AFCTransferScanDirectory(struct sdmmd_AFCTransferPlan *plan, uint32_t index) {
+	// the list can be reallocated by other readers, the strings themselves never move
+	pthread_mutex_lock(&plan->lock);
+	char *localDirectory = plan->directories.entries[index].localPath;
+	char *remoteDirectory = plan->directories.entries[index].remotePath;
+	pthread_mutex_unlock(&plan->lock);
+	DIR *directory = opendir(localDirectory);
+	if (directory == NULL) {
+		printf("SDMMD_AFCTransferScanDirectory: Could not open %s.\n", localDirectory);
+		SDMMD_AFCTransferSetResult(plan, kAMDUndefinedError);
+		return;
+	}
+	struct dirent *entry;
+	while (plan->result == kAMDSuccess && (entry = readdir(directory)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0x0 || strcmp(entry->d_name, "..") == 0x0) {
+			continue;
+		}
+		char *localPath = SDMMD_AFCTransferJoinPath(localDirectory, entry->d_name);
+		struct stat pathStat;
+		if (lstat(localPath, &pathStat) != 0x0) {
+			printf("SDMMD_AFCTransferScanDirectory: Could not stat %s.\n", localPath);
+			SDMMD_AFCTransferSetResult(plan, kAMDUndefinedError);
+			free(localPath);
+			break;
+		}
+		SDMMD_AFCTransferAddPath(plan, localPath, SDMMD_AFCTransferJoinPath(remoteDirectory, entry->d_name), &pathStat);
+	}
+	closedir(directory);
+}
+
+static sdmmd_return_t SDMMD_AFCTransferScanTree(struct sdmmd_AFCTransferPlan *plan, const char *localRoot, const char *remoteRoot) {
+	struct stat rootStat;
+	if (lstat(localRoot, &rootStat) != 0x0) {
+		printf("SDMMD_AFCTransferScanTree: Could not stat %s.\n", localRoot);
+		return kAMDUndefinedError;
+	}
+	SDMMD_AFCTransferAddPath(plan, strdup(localRoot), strdup(remoteRoot), &rootStat);
+	uint32_t levelStart = 0x0;
+	uint32_t levelEnd = plan->directories.count;
+	while (levelStart < levelEnd && plan->result == kAMDSuccess) {
+		// every directory of one level is read at once, the subdirectories they turn up make the next level
+		uint32_t start = levelStart;
+		dispatch_apply(levelEnd - levelStart, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^(size_t offset) {
+			SDMMD_AFCTransferScanDirectory(plan, start + (uint32_t)offset);
+		});
+		levelStart = levelEnd;
+		levelEnd = plan->directories.count;
+	}
+	return (sdmmd_return_t)plan->result;
+}
+
+static int SDMMD_AFCTransferCompareSize(const void *a, const void *b) {
+	uint64_t sizeA = ((struct sdmmd_AFCTransferEntry *)a)->size;
+	uint64_t sizeB = ((struct sdmmd_AFCTransferEntry *)b)->size;
+	return (sizeA < sizeB) - (sizeA > sizeB);
+}
+
+#pragma mark -
+#pragma mark Remote Setup
+#pragma mark -
+
+static CFStringRef SDMMD_AFCTransferCreateString(const char *path) {
+	return CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+}
+
+// Sends every operation in one pipelined batch, only the replies flagged in checkStatus (or all of them when it is NULL) can fail the batch
+static sdmmd_return_t SDMMD_AFCTransferProcessBatch(SDMMD_AFCConnectionRef conn, SDMMD_AFCOperationRef *operations, bool *checkStatus, uint32_t count) {
+	SDMMD_AFCOperationRef *responses = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+	sdmmd_return_t result = SDMMD_AFCProcessOperations(conn, operations, responses, count);
+	for (uint32_t index = 0x0; index < count; index++) {
+		if (result == kAMDSuccess && (checkStatus == NULL || checkStatus[index])) {
+			result = SDMMD_AFCOperationGetResponseStatus(responses[index]);
+		}
+		SDMMD_AFCOperationRelease(responses[index]);
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
+	free(responses);
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCTransferCreateDirectories(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferPlan *plan) {
+	uint32_t count = plan->directories.count;
+	SDMMD_AFCOperationRef *operations = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+	for (uint32_t index = 0x0; index < count; index++) {
+		CFStringRef path = SDMMD_AFCTransferCreateString(plan->directories.entries[index].remotePath);
+		operations[index] = SDMMD_AFCOperationCreateMakeDirectory(path);
+		CFRelease(path);
+	}
+	sdmmd_return_t result = SDMMD_AFCTransferProcessBatch(conn, operations, NULL, count);
+	if (result) {
+		printf("SDMMD_AFCTransferCreateDirectories: Could not create the directory tree on the device: 0x%x\n", result);
+	}
+	free(operations);
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCTransferCreateLinks(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferPlan *plan) {
+	// each link is preceded by a remove of whatever is already at its path, that reply is ignored
+	uint32_t count = plan->links.count*0x2;
+	SDMMD_AFCOperationRef *operations = calloc(count ? count : 0x1, sizeof(SDMMD_AFCOperationRef));
+	bool *checkStatus = calloc(count ? count : 0x1, sizeof(bool));
+	for (uint32_t index = 0x0; index < plan->links.count; index++) {
+		CFStringRef path = SDMMD_AFCTransferCreateString(plan->links.entries[index].remotePath);
+		CFStringRef target = SDMMD_AFCTransferCreateString(plan->links.entries[index].linkTarget);
+		operations[index*0x2] = SDMMD_AFCOperationCreateRemovePath(path);
+		operations[index*0x2+0x1] = SDMMD_AFCOperationCreateLinkPath(kSDMMD_AFCLinkTypeSymbolic, target, path);
+		checkStatus[index*0x2+0x1] = true;
+		CFRelease(target);
+		CFRelease(path);
+	}
+	sdmmd_return_t result = SDMMD_AFCTransferProcessBatch(conn, operations, checkStatus, count);
+	if (result) {
+		printf("SDMMD_AFCTransferCreateLinks: Could not create the symlinks on the device: 0x%x\n", result);
+	}
+	free(checkStatus);
+	free(operations);
+	return result;
+}
+
+#pragma mark -
+#pragma mark File Contents
+#pragma mark -
+
+static void SDMMD_AFCTransferAddProgress(struct sdmmd_AFCTransferProgress *progress, uint64_t length, bool force) {
+	if (progress == NULL || progress->callback == NULL) {
+		return;
+	}
+	uint64_t sent = __sync_add_and_fetch(&progress->sentBytes, length);
+	uint32_t percent = (progress->totalBytes ? (uint32_t)((sent*100)/progress->totalBytes) : 100);
+	if (force || percent > progress->lastPercent) {
+		pthread_mutex_lock(&progress->lock);
+		// another worker may have reported a higher value while this one waited
+		if (force || percent > progress->lastPercent) {
+			progress->lastPercent = percent;
+			CFMutableDictionaryRef dict = SDMMD_create_dict();
+			CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &percent);
+			CFDictionarySetValue(dict, CFSTR(kSDMMD_AFCTransferKeyStatus), CFSTR(kSDMMD_AFCTransferStatusTransfering));
+			CFDictionarySetValue(dict, CFSTR(kSDMMD_AFCTransferKeyPercentComplete), number);
+			progress->callback(dict, progress->arg);
+			CFRelease(number);
+			CFRelease(dict);
+		}
+		pthread_mutex_unlock(&progress->lock);
+	}
+}
+
+static sdmmd_return_t SDMMD_AFCTransferUploadEntry(SDMMD_AFCConnectionRef conn, const char *localPath, const char *remotePath, struct sdmmd_AFCTransferProgress *progress) {
+	int fd = open(localPath, O_RDONLY);
+	struct stat fileStat;
+	if (fd == -1 || fstat(fd, &fileStat) == -1) {
+		printf("SDMMD_AFCTransferUploadEntry: Could not open %s.\n", localPath);
+		if (fd != -1) {
+			close(fd);
+		}
+		return kAMDUndefinedError;
+	}
+	CFStringRef remote = SDMMD_AFCTransferCreateString(remotePath);
+	uint64_t fileRef = 0x0;
+	sdmmd_return_t result = SDMMD_AFCFileRefOpen(conn, remote, kSDMMD_AFCFileModeWriteTruncate, &fileRef);
+	if (result == kAMDSuccess) {
+		// the file goes out a window at a time straight from the page cache, the window only sets how often progress is reported
+		uint64_t size = (uint64_t)fileStat.st_size;
+		for (uint64_t offset = 0x0; offset < size && result == kAMDSuccess; offset += kSDMMD_AFCTransferWindowSize) {
+			uint64_t length = (size - offset > kSDMMD_AFCTransferWindowSize ? kSDMMD_AFCTransferWindowSize : size - offset);
+			result = SDMMD_AFCFileRefWriteFromFile(conn, fileRef, fd, offset, length);
+			if (result == kAMDSuccess) {
+				SDMMD_AFCTransferAddProgress(progress, length, false);
+			}
+		}
+		sdmmd_return_t closeResult = SDMMD_AFCFileRefClose(conn, fileRef);
+		if (result == kAMDSuccess) {
+			result = closeResult;
+		}
+	} else {
+		printf("SDMMD_AFCTransferUploadEntry: Could not open %s on the device: 0x%x\n", remotePath, result);
+	}
+	CFRelease(remote);
+	close(fd);
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCTransferDownloadEntry(SDMMD_AFCConnectionRef conn, const char *remotePath, const char *localPath) {
+	int fd = open(localPath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		printf("SDMMD_AFCTransferDownloadEntry: Could not create %s.\n", localPath);
+		return kAMDUndefinedError;
+	}
+	CFStringRef remote = SDMMD_AFCTransferCreateString(remotePath);
+	CFDictionaryRef info = NULL;
+	uint64_t size = 0x0;
+	sdmmd_return_t result = SDMMD_AFCConnectionCopyFileInfo(conn, remote, &info);
+	if (result == kAMDSuccess) {
+		size = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+		CFRelease(info);
+	}
+	uint64_t fileRef = 0x0;
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCFileRefOpen(conn, remote, kSDMMD_AFCFileModeRead, &fileRef);
+	}
+	if (result == kAMDSuccess) {
+		// the reported size only pre-sizes the destination, reading stops at whatever end the device finds
+		uint64_t received = 0x0;
+		bool endOfFile = false;
+		while (result == kAMDSuccess && !endOfFile) {
+			uint64_t wanted = (size > received ? size - received : 0x0);
+			wanted = (wanted > kSDMMD_AFCTransferWindowSize ? kSDMMD_AFCTransferWindowSize : (wanted ? wanted : conn->chunkSize));
+			uint64_t length = wanted;
+			result = SDMMD_AFCFileRefReadToFile(conn, fileRef, fd, received, &length);
+			received += length;
+			endOfFile = (length < wanted);
+		}
+		if (ftruncate(fd, (off_t)received) == -1 && result == kAMDSuccess) {
+			result = kAMDUndefinedError;
+		}
+		sdmmd_return_t closeResult = SDMMD_AFCFileRefClose(conn, fileRef);
+		if (result == kAMDSuccess) {
+			result = closeResult;
+		}
+	} else {
+		printf("SDMMD_AFCTransferDownloadEntry: Could not open %s on the device: 0x%x\n", remotePath, result);
+	}
+	CFRelease(remote);
+	close(fd);
+	return result;
+}
+
+#pragma mark -
+#pragma mark Sync
+#pragma mark -
+
+static sdmmd_return_t SDMMD_AFCTransferReadRange(int fd, void *buffer, uint64_t offset, uint64_t length) {
+	while (length) {
+		ssize_t readLength = pread(fd, buffer, length, (off_t)offset);
+		if (readLength <= 0x0) {
+			return kAMDUndefinedError;
+		}
+		buffer = (char *)buffer + readLength;
+		offset += (uint64_t)readLength;
+		length -= (uint64_t)readLength;
+	}
+	return kAMDSuccess;
+}
+
+// The device answers GetFileHash with a SHA-1 or, on newer versions, a SHA-256 digest, the local side is hashed to match
+static bool SDMMD_AFCTransferHashMatches(CFDataRef remoteHash, int fd, uint64_t offset, uint64_t length, void *buffer, uint64_t bufferSize) {
+	CFIndex digestLength = CFDataGetLength(remoteHash);
+	if (digestLength != SHA_DIGEST_LENGTH && digestLength != SHA256_DIGEST_LENGTH) {
+		return false;
+	}
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	if (digestLength == SHA_DIGEST_LENGTH) {
+		SHA1_Init(&sha1);
+	} else {
+		SHA256_Init(&sha256);
+	}
+	while (length) {
+		uint64_t readLength = (length > bufferSize ? bufferSize : length);
+		if (SDMMD_AFCTransferReadRange(fd, buffer, offset, readLength) != kAMDSuccess) {
+			return false;
+		}
+		if (digestLength == SHA_DIGEST_LENGTH) {
+			SHA1_Update(&sha1, buffer, readLength);
+		} else {
+			SHA256_Update(&sha256, buffer, readLength);
+		}
+		offset += readLength;
+		length -= readLength;
+	}
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	if (digestLength == SHA_DIGEST_LENGTH) {
+		SHA1_Final(digest, &sha1);
+	} else {
+		SHA256_Final(digest, &sha256);
+	}
+	return (memcmp(digest, CFDataGetBytePtr(remoteHash), digestLength) == 0x0);
+}
+
+// Rewrites only the ranges of a large file whose digest differs, the hashes of every range are requested in one pipelined batch
+static sdmmd_return_t SDMMD_AFCTransferSyncRanges(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferEntry *entry, CFStringRef remote, uint64_t remoteSize, void *buffer, uint64_t bufferSize, struct sdmmd_AFCTransferProgress *progress) {
+	int fd = open(entry->localPath, O_RDONLY);
+	if (fd == -1) {
+		printf("SDMMD_AFCTransferSyncRanges: Could not open %s.\n", entry->localPath);
+		return kAMDUndefinedError;
+	}
+	uint32_t rangeCount = (uint32_t)((entry->size + bufferSize - 0x1) / bufferSize);
+	// only ranges that lie entirely inside the remote file can be compared, anything past its end is always written
+	uint32_t comparedCount = (uint32_t)((remoteSize < entry->size ? remoteSize : entry->size) / bufferSize);
+	SDMMD_AFCOperationRef *operations = calloc(comparedCount ? comparedCount : 0x1, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *responses = calloc(comparedCount ? comparedCount : 0x1, sizeof(SDMMD_AFCOperationRef));
+	for (uint32_t index = 0x0; index < comparedCount; index++) {
+		operations[index] = SDMMD_AFCOperationCreateGetFileHashWithRange(remote, index*bufferSize, (index+0x1)*bufferSize);
+	}
+	sdmmd_return_t result = SDMMD_AFCProcessOperations(conn, operations, responses, comparedCount);
+	uint64_t fileRef = 0x0;
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCFileRefOpen(conn, remote, kSDMMD_AFCFileModeReadWrite, &fileRef);
+		if (result == kAMDSuccess) {
+			for (uint32_t index = 0x0; index < rangeCount && result == kAMDSuccess; index++) {
+				uint64_t offset = index*bufferSize;
+				uint64_t length = (entry->size - offset > bufferSize ? bufferSize : entry->size - offset);
+				bool changed = true;
+				// a device without ranged hashing fails every request, which degrades into rewriting the whole file
+				if (index < comparedCount && SDMMD_AFCOperationGetResponseStatus(responses[index]) == kAMDSuccess && responses[index]->packet->header.type == kSDMMD_AFCPacketTypeData) {
+					CFDataRef hash = SDMMD_GetDataResponseFromOperation(responses[index]);
+					changed = !SDMMD_AFCTransferHashMatches(hash, fd, offset, length, buffer, bufferSize);
+					CFRelease(hash);
+				}
+				if (changed) {
+					result = SDMMD_AFCFileRefSeek(conn, fileRef, (int64_t)offset, kSDMMD_AFCSeekSet);
+					if (result == kAMDSuccess) {
+						result = SDMMD_AFCFileRefWriteFromFile(conn, fileRef, fd, offset, length);
+					}
+				}
+				SDMMD_AFCTransferAddProgress(progress, length, false);
+			}
+			if (result == kAMDSuccess && remoteSize != entry->size) {
+				result = SDMMD_AFCFileRefSetFileSize(conn, fileRef, entry->size);
+			}
+			sdmmd_return_t closeResult = SDMMD_AFCFileRefClose(conn, fileRef);
+			if (result == kAMDSuccess) {
+				result = closeResult;
+			}
+		}
+	}
+	for (uint32_t index = 0x0; index < comparedCount; index++) {
+		SDMMD_AFCOperationRelease(responses[index]);
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
+	free(responses);
+	free(operations);
+	close(fd);
+	return result;
+}
+
+static sdmmd_return_t SDMMD_AFCTransferSyncEntry(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferEntry *entry, void *buffer, uint64_t bufferSize, struct sdmmd_AFCTransferProgress *progress) {
+	CFStringRef remote = SDMMD_AFCTransferCreateString(entry->remotePath);
+	sdmmd_return_t result = kAMDSuccess;
+	bool upload = true;
+	bool setModTime = true;
+	CFDictionaryRef info = NULL;
+	// a missing remote file simply gets uploaded
+	if (SDMMD_AFCConnectionCopyFileInfo(conn, remote, &info) == kAMDSuccess) {
+		CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+		uint64_t remoteSize = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+		uint64_t remoteModTime = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeyModTime));
+		if (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeRegular))) {
+			if (remoteSize == entry->size && remoteModTime == entry->modified) {
+				// every file a sync writes is stamped with the local mtime, so this one is already up to date
+				upload = false;
+				setModTime = false;
+				SDMMD_AFCTransferAddProgress(progress, entry->size, false);
+			} else if (entry->size >= kSDMMD_AFCTransferRangeThreshold && remoteSize) {
+				upload = false;
+				result = SDMMD_AFCTransferSyncRanges(conn, entry, remote, remoteSize, buffer, bufferSize, progress);
+			} else if (remoteSize == entry->size) {
+				CFDataRef hash = NULL;
+				if (SDMMD_AFCConnectionCopyFileHash(conn, remote, &hash) == kAMDSuccess) {
+					int fd = open(entry->localPath, O_RDONLY);
+					if (fd != -1) {
+						upload = !SDMMD_AFCTransferHashMatches(hash, fd, 0x0, entry->size, buffer, bufferSize);
+						close(fd);
+					}
+					CFRelease(hash);
+				}
+				if (!upload) {
+					SDMMD_AFCTransferAddProgress(progress, entry->size, false);
+				}
+			}
+		}
+		CFRelease(info);
+	}
+	if (upload) {
+		result = SDMMD_AFCTransferUploadEntry(conn, entry->localPath, entry->remotePath, progress);
+	}
+	if (result == kAMDSuccess && setModTime) {
+		// not fatal, the next sync just falls back to comparing hashes for this file
+		SDMMD_AFCConnectionSetModTime(conn, remote, entry->modified);
+	}
+	CFRelease(remote);
+	return result;
+}
+
+static CFDictionaryRef SDMMD_AFCTransferCreateManifestEntry(struct sdmmd_AFCTransferEntry *entry) {
+	CFNumberRef size = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &entry->size);
+	CFNumberRef modified = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &entry->modified);
+	const void *keys[0x2] = {CFSTR(kSDMMD_AFCTransferManifestKeySize), CFSTR(kSDMMD_AFCTransferManifestKeyModTime)};
+	const void *values[0x2] = {size, modified};
+	CFDictionaryRef manifestEntry = CFDictionaryCreate(kCFAllocatorDefault, keys, values, 0x2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	CFRelease(modified);
+	CFRelease(size);
+	return manifestEntry;
+}
+
+static void SDMMD_AFCTransferRecordEntry(struct sdmmd_AFCTransferPlan *plan, struct sdmmd_AFCTransferEntry *entry) {
+	CFStringRef remote = SDMMD_AFCTransferCreateString(entry->remotePath);
+	CFDictionaryRef manifestEntry = SDMMD_AFCTransferCreateManifestEntry(entry);
+	pthread_mutex_lock(&plan->lock);
+	CFDictionarySetValue(plan->syncedFiles, remote, manifestEntry);
+	pthread_mutex_unlock(&plan->lock);
+	CFRelease(manifestEntry);
+	CFRelease(remote);
+}
+
+// Manifests live under ~/Library/Caches, one per device and local/remote pair, named by a digest of the two paths
+static char* SDMMD_AFCTransferCopyManifestPath(CFStringRef udid, const char *localRoot, const char *remoteRoot) {
+	const char *home = getenv("HOME");
+	if (home == NULL || udid == NULL) {
+		return NULL;
+	}
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA_CTX sha1;
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, localRoot, strlen(localRoot)+0x1);
+	SHA1_Update(&sha1, remoteRoot, strlen(remoteRoot));
+	SHA1_Final(digest, &sha1);
+	char name[SHA_DIGEST_LENGTH*0x2+0x1] = {0};
+	for (uint32_t index = 0x0; index < SHA_DIGEST_LENGTH; index++) {
+		snprintf(&name[index*0x2], 0x3, "%02x", digest[index]);
+	}
+	char *device = SDMCFStringGetString(udid);
+	char *path = calloc(1, PATH_MAX);
+	snprintf(path, PATH_MAX, "%s/%s/%s/", home, kSDMMD_AFCTransferManifestDirectory, device);
+	free(device);
+	// create each missing component of the directory
+	for (char *separator = strchr(path+0x1, '/'); separator; separator = strchr(separator+0x1, '/')) {
+		*separator = '\0';
+		mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		*separator = '/';
+	}
+	strlcat(path, name, PATH_MAX);
+	strlcat(path, ".plist", PATH_MAX);
+	return path;
+}
+
+static CFArrayRef SDMMD_AFCTransferCreateDirectoryArray(struct sdmmd_AFCTransferPlan *plan) {
+	CFMutableArrayRef directories = CFArrayCreateMutable(kCFAllocatorDefault, plan->directories.count, &kCFTypeArrayCallBacks);
+	for (uint32_t index = 0x0; index < plan->directories.count; index++) {
+		CFStringRef path = SDMMD_AFCTransferCreateString(plan->directories.entries[index].remotePath);
+		CFArrayAppendValue(directories, path);
+		CFRelease(path);
+	}
+	return directories;
+}
+
+static CFDictionaryRef SDMMD_AFCTransferCreateLinkDictionary(struct sdmmd_AFCTransferPlan *plan) {
+	CFMutableDictionaryRef links = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	for (uint32_t index = 0x0; index < plan->links.count; index++) {
+		CFStringRef path = SDMMD_AFCTransferCreateString(plan->links.entries[index].remotePath);
+		CFStringRef target = SDMMD_AFCTransferCreateString(plan->links.entries[index].linkTarget);
+		CFDictionarySetValue(links, path, target);
+		CFRelease(target);
+		CFRelease(path);
+	}
+	return links;
+}
+
+// Drops every file whose size and mtime still match what the manifest recorded on the last sync, they are carried over into syncedFiles
+static void SDMMD_AFCTransferFilterUnchanged(struct sdmmd_AFCTransferPlan *plan, CFDictionaryRef previousFiles) {
+	uint32_t kept = 0x0;
+	plan->totalBytes = 0x0;
+	for (uint32_t index = 0x0; index < plan->files.count; index++) {
+		struct sdmmd_AFCTransferEntry *entry = &plan->files.entries[index];
+		bool unchanged = false;
+		if (previousFiles) {
+			CFStringRef remote = SDMMD_AFCTransferCreateString(entry->remotePath);
+			CFDictionaryRef previous = CFDictionaryGetValue(previousFiles, remote);
+			if (previous && CFGetTypeID(previous) == CFDictionaryGetTypeID()) {
+				CFDictionaryRef current = SDMMD_AFCTransferCreateManifestEntry(entry);
+				unchanged = CFEqual(previous, current);
+				CFRelease(current);
+			}
+			if (unchanged) {
+				CFDictionarySetValue(plan->syncedFiles, remote, previous);
+			}
+			CFRelease(remote);
+		}
+		if (unchanged) {
+			free(entry->localPath);
+			free(entry->remotePath);
+			free(entry->linkTarget);
+		} else {
+			plan->totalBytes += entry->size;
+			plan->files.entries[kept++] = *entry;
+		}
+	}
+	plan->files.count = kept;
+}
+
+#pragma mark -
+#pragma mark Workers
+#pragma mark -
+
+// Reads the whole of a small local file, NULL if it can't be read
+static CFDataRef SDMMD_AFCTransferCopyFileContents(struct sdmmd_AFCTransferEntry *entry) {
+	CFMutableDataRef contents = NULL;
+	int fd = open(entry->localPath, O_RDONLY);
+	if (fd != -1) {
+		contents = CFDataCreateMutable(kCFAllocatorDefault, (CFIndex)entry->size);
+		CFDataSetLength(contents, (CFIndex)entry->size);
+		if (SDMMD_AFCTransferReadRange(fd, CFDataGetMutableBytePtr(contents), 0x0, entry->size) != kAMDSuccess) {
+			CFRelease(contents);
+			contents = NULL;
+		}
+		close(fd);
+	}
+	return contents;
+}
+
+// Asks for the info of every file in one batch and marks the ones whose remote size and mtime already match, for files this small a hash
+// comparison would cost as much as just writing them again
+static void SDMMD_AFCTransferFindUnchanged(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferEntry **entries, CFStringRef *paths, bool *unchanged, uint32_t count) {
+	SDMMD_AFCOperationRef *operations = calloc(count, sizeof(SDMMD_AFCOperationRef));
+	SDMMD_AFCOperationRef *responses = calloc(count, sizeof(SDMMD_AFCOperationRef));
+	for (uint32_t index = 0x0; index < count; index++) {
+		operations[index] = SDMMD_AFCOperationCreateGetFileInfo(paths[index]);
+	}
+	SDMMD_AFCProcessOperations(conn, operations, responses, count);
+	for (uint32_t index = 0x0; index < count; index++) {
+		if (SDMMD_AFCOperationGetResponseStatus(responses[index]) == kAMDSuccess && responses[index]->packet->header.type == kSDMMD_AFCPacketTypeData) {
+			CFDataRef data = SDMMD_GetDataResponseFromOperation(responses[index]);
+			CFDictionaryRef info = SDMMD_AFCCreateDictionaryFromData(data);
+			CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+			unchanged[index] = (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeRegular)) && SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize)) == entries[index]->size && SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeyModTime)) == entries[index]->modified);
+			CFRelease(info);
+			CFRelease(data);
+		}
+		SDMMD_AFCOperationRelease(responses[index]);
+		SDMMD_AFCOperationRelease(operations[index]);
+	}
+	free(responses);
+	free(operations);
+}
+
+// Copies a run of small files with SDMMD_AFCConnectionWriteFiles(), so the whole run costs a couple of round trips instead of several per file
+static void SDMMD_AFCTransferUploadSmallFiles(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferPlan *plan, uint32_t first, uint32_t count, struct sdmmd_AFCTransferProgress *progress) {
+	struct sdmmd_AFCTransferEntry **entries = calloc(count, sizeof(struct sdmmd_AFCTransferEntry *));
+	CFStringRef *paths = calloc(count, sizeof(CFStringRef));
+	CFDataRef *contents = calloc(count, sizeof(CFDataRef));
+	uint64_t *modTimes = calloc(count, sizeof(uint64_t));
+	sdmmd_return_t *results = calloc(count, sizeof(sdmmd_return_t));
+	bool *unchanged = calloc(count, sizeof(bool));
+	for (uint32_t index = 0x0; index < count; index++) {
+		entries[index] = &plan->files.entries[first + index];
+		paths[index] = SDMMD_AFCTransferCreateString(entries[index]->remotePath);
+	}
+	if (plan->sync) {
+		SDMMD_AFCTransferFindUnchanged(conn, entries, paths, unchanged, count);
+	}
+	uint32_t pending = 0x0;
+	for (uint32_t index = 0x0; index < count; index++) {
+		struct sdmmd_AFCTransferEntry *entry = entries[index];
+		if (unchanged[index]) {
+			SDMMD_AFCTransferRecordEntry(plan, entry);
+			SDMMD_AFCTransferAddProgress(progress, entry->size, false);
+			continue;
+		}
+		CFDataRef data = SDMMD_AFCTransferCopyFileContents(entry);
+		if (data == NULL) {
+			printf("SDMMD_AFCTransferUploadSmallFiles: Could not read %s.\n", entry->localPath);
+			SDMMD_AFCTransferSetResult(plan, kAMDUndefinedError);
+			continue;
+		}
+		// the pending files are packed to the front, in the same order as entries
+		entries[pending] = entry;
+		CFStringRef path = paths[pending];
+		paths[pending] = paths[index];
+		paths[index] = path;
+		contents[pending] = data;
+		modTimes[pending] = entry->modified;
+		pending++;
+	}
+	if (pending && plan->result == kAMDSuccess) {
+		// a sync stamps every file with its local mtime so the next sync can match it without reading it back
+		SDMMD_AFCConnectionWriteFiles(conn, paths, contents, (plan->sync ? modTimes : NULL), results, pending);
+		for (uint32_t index = 0x0; index < pending; index++) {
+			if (results[index] == kAMDSuccess) {
+				if (plan->syncedFiles) {
+					SDMMD_AFCTransferRecordEntry(plan, entries[index]);
+				}
+			} else {
+				printf("SDMMD_AFCTransferUploadSmallFiles: Could not copy %s to %s on the device.\n", entries[index]->localPath, entries[index]->remotePath);
+				SDMMD_AFCTransferSetResult(plan, results[index]);
+			}
+			SDMMD_AFCTransferAddProgress(progress, entries[index]->size, false);
+		}
+	}
+	for (uint32_t index = 0x0; index < count; index++) {
+		CFRelease(paths[index]);
+		if (contents[index]) {
+			CFRelease(contents[index]);
+		}
+	}
+	free(unchanged);
+	free(results);
+	free(modTimes);
+	free(contents);
+	free(paths);
+	free(entries);
+}
+
+static void SDMMD_AFCTransferUploadWorker(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCTransferPlan *plan, struct sdmmd_AFCTransferProgress *progress) {
+	// file data never passes through here, the buffer is only scratch space for hashing local ranges during a sync
+	uint64_t bufferSize = (uint64_t)conn->chunkSize * conn->pipelineDepth;
+	void *buffer = (plan->sync ? malloc(bufferSize) : NULL);
+	while (plan->result == kAMDSuccess) {
+		// workers pull files from a shared cursor, so a connection stuck on one big file doesn't hold up the rest, the small files at the end of the
+		// list are claimed a batch at a time
+		uint32_t claim = (plan->nextFile >= plan->smallStart ? kSDMMD_AFCTransferSmallFileBatch : 0x1);
+		uint32_t index = __sync_fetch_and_add(&plan->nextFile, claim);
+		if (index >= plan->files.count) {
+			break;
+		}
+		if (index >= plan->smallStart) {
+			uint32_t count = (plan->files.count - index < claim ? plan->files.count - index : claim);
+			SDMMD_AFCTransferUploadSmallFiles(conn, plan, index, count, progress);
+			continue;
+		}
+		struct sdmmd_AFCTransferEntry *entry = &plan->files.entries[index];
+		sdmmd_return_t result;
+		if (plan->sync) {
+			result = SDMMD_AFCTransferSyncEntry(conn, entry, buffer, bufferSize, progress);
+		} else {
+			result = SDMMD_AFCTransferUploadEntry(conn, entry->localPath, entry->remotePath, progress);
+		}
+		if (result == kAMDSuccess) {
+			if (plan->syncedFiles) {
+				SDMMD_AFCTransferRecordEntry(plan, entry);
+			}
+		} else {
+			printf("SDMMD_AFCTransferUploadWorker: Could not copy %s to %s on the device.\n", entry->localPath, entry->remotePath);
+			SDMMD_AFCTransferSetResult(plan, result);
+		}
+	}
+	free(buffer);
+}
+
+static sdmmd_return_t SDMMD_AFCTransferTree(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef localPath, CFStringRef remotePath, CFDictionaryRef options, void* transferCallback, void* arg, bool sync) {
+	if (localPath == NULL || remotePath == NULL || (device == NULL && afcConnection == NULL)) {
+		return kAMDInvalidArgumentError;
+	}
+	uint32_t connectionCount = SDMMD_AFCTransferGetConnectionCount(device, options);
+	CFStringRef manifestOption = NULL;
+	bool ignoreManifest = false;
+	if (options) {
+		manifestOption = CFDictionaryGetValue(options, CFSTR(kSDMMD_AFCTransferOptionManifestPath));
+		if (manifestOption && CFGetTypeID(manifestOption) != CFStringGetTypeID()) {
+			manifestOption = NULL;
+		}
+		ignoreManifest = SDMMD_AFCTransferGetBoolOption(options, CFSTR(kSDMMD_AFCTransferOptionIgnoreManifest), false);
+	}
+
+	struct sdmmd_AFCTransferPlan plan = {.result = kAMDSuccess, .sync = sync};
+	pthread_mutex_init(&plan.lock, NULL);
+	char *local = SDMCFStringGetString(localPath);
+	char *remote = SDMCFStringGetString(remotePath);
+	sdmmd_return_t result = SDMMD_AFCTransferScanTree(&plan, local, remote);
+
+	char *manifestPath = NULL;
+	CFDictionaryRef previousManifest = NULL;
+	CFArrayRef directories = NULL;
+	CFDictionaryRef links = NULL;
+	bool layoutOnDevice = false;
+	if (result == kAMDSuccess && sync) {
+		if (manifestOption) {
+			manifestPath = SDMCFStringGetString(manifestOption);
+		} else {
+			// a connection made without a device has nothing to key the manifest on, so that sync simply starts from scratch every time
+			SDMMD_AMDeviceRef owner = (device ? device : afcConnection->ivars.device);
+			manifestPath = (owner ? SDMMD_AFCTransferCopyManifestPath(owner->ivars.unique_device_id, local, remote) : NULL);
+		}
+		if (manifestPath && !ignoreManifest && access(manifestPath, R_OK) == 0x0) {
+			previousManifest = SDMMD__CreateDictFromFileContents(manifestPath);
+		}
+		CFDictionaryRef previousFiles = (previousManifest ? CFDictionaryGetValue(previousManifest, CFSTR(kSDMMD_AFCTransferManifestKeyFiles)) : NULL);
+		if (previousFiles && CFGetTypeID(previousFiles) != CFDictionaryGetTypeID()) {
+			previousFiles = NULL;
+		}
+		plan.syncedFiles = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		SDMMD_AFCTransferFilterUnchanged(&plan, previousFiles);
+		directories = SDMMD_AFCTransferCreateDirectoryArray(&plan);
+		links = SDMMD_AFCTransferCreateLinkDictionary(&plan);
+		if (previousManifest) {
+			CFTypeRef previousDirectories = CFDictionaryGetValue(previousManifest, CFSTR(kSDMMD_AFCTransferManifestKeyDirectories));
+			CFTypeRef previousLinks = CFDictionaryGetValue(previousManifest, CFSTR(kSDMMD_AFCTransferManifestKeyLinks));
+			layoutOnDevice = (previousDirectories && previousLinks && CFEqual(previousDirectories, directories) && CFEqual(previousLinks, links));
+		}
+	}
+	free(remote);
+	free(local);
+
+	// an unchanged tree is finished without ever talking to the device
+	bool needsDevice = !(layoutOnDevice && plan.files.count == 0x0);
+	SDMMD_AMConnectionRef *services = calloc(connectionCount, sizeof(SDMMD_AMConnectionRef));
+	SDMMD_AFCConnectionRef *connections = calloc(connectionCount, sizeof(SDMMD_AFCConnectionRef));
+	uint32_t opened = 0x0;
+	if (result == kAMDSuccess && needsDevice) {
+		result = SDMMD_AFCTransferOpenConnections(device, afcConnection, options, connectionCount, services, connections, &opened);
+	}
+	if (result == kAMDSuccess && needsDevice && !layoutOnDevice) {
+		result = SDMMD_AFCTransferCreateDirectories(connections[0x0], &plan);
+		if (result == kAMDSuccess && plan.links.count) {
+			result = SDMMD_AFCTransferCreateLinks(connections[0x0], &plan);
+		}
+		layoutOnDevice = (result == kAMDSuccess);
+	}
+	if (result == kAMDSuccess) {
+		qsort(plan.files.entries, plan.files.count, sizeof(struct sdmmd_AFCTransferEntry), SDMMD_AFCTransferCompareSize);
+		plan.smallStart = plan.files.count;
+		while (plan.smallStart && plan.files.entries[plan.smallStart-0x1].size <= kSDMMD_AFCTransferSmallFileSize) {
+			plan.smallStart--;
+		}
+		struct sdmmd_AFCTransferProgress progress = {.totalBytes = plan.totalBytes, .callback = transferCallback, .arg = arg};
+		pthread_mutex_init(&progress.lock, NULL);
+		SDMMD_AFCTransferAddProgress(&progress, 0x0, true);
+		struct sdmmd_AFCTransferPlan *planRef = &plan;
+		struct sdmmd_AFCTransferProgress *progressRef = &progress;
+		dispatch_apply(opened, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^(size_t index) {
+			SDMMD_AFCTransferUploadWorker(connections[index], planRef, progressRef);
+		});
+		result = (sdmmd_return_t)plan.result;
+		if (result == kAMDSuccess && progress.lastPercent < 100) {
+			SDMMD_AFCTransferAddProgress(&progress, progress.totalBytes - progress.sentBytes, true);
+		}
+		pthread_mutex_destroy(&progress.lock);
+	}
+
+	if (manifestPath && plan.syncedFiles) {
+		// files that did make it are kept even after a failure, the directory layout only once it has been created
+		CFMutableDictionaryRef manifest = SDMMD_create_dict();
+		CFDictionarySetValue(manifest, CFSTR(kSDMMD_AFCTransferManifestKeyFiles), plan.syncedFiles);
+		if (layoutOnDevice) {
+			CFDictionarySetValue(manifest, CFSTR(kSDMMD_AFCTransferManifestKeyDirectories), directories);
+			CFDictionarySetValue(manifest, CFSTR(kSDMMD_AFCTransferManifestKeyLinks), links);
+		}
+		SDMMD_store_dict(manifest, manifestPath, true);
+		CFRelease(manifest);
+	}
+
+	SDMMD_AFCTransferCloseConnections(afcConnection, services, connections, opened);
+	if (plan.syncedFiles) {
+		CFRelease(plan.syncedFiles);
+	}
+	if (previousManifest) {
+		CFRelease(previousManifest);
+	}
+	if (directories) {
+		CFRelease(directories);
+	}
+	if (links) {
+		CFRelease(links);
+	}
+	free(manifestPath);
+	SDMMD_AFCTransferListFree(&plan.directories);
+	SDMMD_AFCTransferListFree(&plan.files);
+	SDMMD_AFCTransferListFree(&plan.links);
+	pthread_mutex_destroy(&plan.lock);
+	return result;
+}
+
+#pragma mark -
+#pragma mark Ranged Downloads
+#pragma mark -
+
+struct sdmmd_AFCDownload {
+	pthread_mutex_t lock;				// guards completed and the sidecar file
+	CFStringRef remotePath;
+	int fd;
+	uint64_t size;
+	uint64_t modTime;
+	uint64_t rangeSize;
+	uint32_t rangeCount;
+	CFMutableDataRef completed;			// one byte per range, non-zero once the range is on disk (and verified)
+	char *sidecarPath;
+	volatile uint32_t nextRange;
+	volatile uint32_t result;			// first error hit by any worker, once set no new ranges are started
+	volatile bool verify;				// cleared if the device turns out not to support ranged hashes
+};
+
+// Must be called with the download lock held, written after every range so an interrupted download loses at most the ranges in flight
+static void SDMMD_AFCDownloadStoreSidecar(struct sdmmd_AFCDownload *download) {
+	CFMutableDictionaryRef sidecar = SDMMD_create_dict();
+	CFNumberRef size = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &download->size);
+	CFNumberRef modTime = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &download->modTime);
+	CFNumberRef rangeSize = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &download->rangeSize);
+	CFDictionarySetValue(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyRemotePath), download->remotePath);
+	CFDictionarySetValue(sidecar, CFSTR(kSDMMD_AFCTransferManifestKeySize), size);
+	CFDictionarySetValue(sidecar, CFSTR(kSDMMD_AFCTransferManifestKeyModTime), modTime);
+	CFDictionarySetValue(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyRangeSize), rangeSize);
+	CFDictionarySetValue(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyCompletedRanges), download->completed);
+	SDMMD_store_dict(sidecar, download->sidecarPath, true);
+	CFRelease(rangeSize);
+	CFRelease(modTime);
+	CFRelease(size);
+	CFRelease(sidecar);
+}
+
+static uint64_t SDMMD_AFCDownloadGetNumber(CFDictionaryRef dict, CFStringRef key) {
+	uint64_t value = 0x0;
+	CFNumberRef number = CFDictionaryGetValue(dict, key);
+	if (number && CFGetTypeID(number) == CFNumberGetTypeID()) {
+		CFNumberGetValue(number, kCFNumberSInt64Type, &value);
+	}
+	return value;
+}
+
+// Picks up the completed ranges of an earlier attempt, only if it was downloading the same remote file, unchanged, with the same range size
+static bool SDMMD_AFCDownloadLoadSidecar(struct sdmmd_AFCDownload *download, const char *localPath) {
+	bool resumed = false;
+	if (access(download->sidecarPath, R_OK) == 0x0 && access(localPath, W_OK) == 0x0) {
+		CFDictionaryRef sidecar = SDMMD__CreateDictFromFileContents(download->sidecarPath);
+		if (sidecar) {
+			CFStringRef remotePath = CFDictionaryGetValue(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyRemotePath));
+			CFDataRef completed = CFDictionaryGetValue(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyCompletedRanges));
+			resumed = (remotePath && CFEqual(remotePath, download->remotePath) &&
+					   SDMMD_AFCDownloadGetNumber(sidecar, CFSTR(kSDMMD_AFCTransferManifestKeySize)) == download->size &&
+					   SDMMD_AFCDownloadGetNumber(sidecar, CFSTR(kSDMMD_AFCTransferManifestKeyModTime)) == download->modTime &&
+					   SDMMD_AFCDownloadGetNumber(sidecar, CFSTR(kSDMMD_AFCTransferSidecarKeyRangeSize)) == download->rangeSize &&
+					   completed && CFGetTypeID(completed) == CFDataGetTypeID() && CFDataGetLength(completed) == download->rangeCount);
+			if (resumed) {
+				CFDataReplaceBytes(download->completed, CFRangeMake(0x0, download->rangeCount), CFDataGetBytePtr(completed), download->rangeCount);
+			}
+			CFRelease(sidecar);
+		}
+	}
+	return resumed;
+}
+
+// Reads one range into place and checks it against the device's digest of the same bytes
+static sdmmd_return_t SDMMD_AFCDownloadRange(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCDownload *download, uint64_t fileRef, uint64_t offset, uint64_t length, void *buffer, uint64_t bufferSize) {
+	sdmmd_return_t result = SDMMD_AFCFileRefSeek(conn, fileRef, (int64_t)offset, kSDMMD_AFCSeekSet);
+	uint64_t received = length;
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCFileRefReadToFile(conn, fileRef, download->fd, offset, &received);
+	}
+	if (result == kAMDSuccess && received != length) {
+		// the file shrank on the device since it was looked at
+		result = kAMDEOFError;
+	}
+	if (result == kAMDSuccess && download->verify) {
+		CFDataRef hash = NULL;
+		sdmmd_return_t hashResult = SDMMD_AFCConnectionCopyFileHashWithRange(conn, download->remotePath, offset, offset + length, &hash);
+		if (hashResult == kAMDSuccess) {
+			if (!SDMMD_AFCTransferHashMatches(hash, download->fd, offset, length, buffer, bufferSize)) {
+				result = kAMDDigestFailedError;
+			}
+			CFRelease(hash);
+		} else if (SDMMD_AFCResultIsUnsupported(hashResult)) {
+			printf("SDMMD_AFCDownloadRange: The device cannot hash ranges, the download is not verified.\n");
+			download->verify = false;
+		} else {
+			result = hashResult;
+		}
+	}
+	return result;
+}
+
+static void SDMMD_AFCDownloadWorker(SDMMD_AFCConnectionRef conn, struct sdmmd_AFCDownload *download, struct sdmmd_AFCTransferProgress *progress) {
+	uint64_t fileRef = 0x0;
+	sdmmd_return_t result = SDMMD_AFCFileRefOpen(conn, download->remotePath, kSDMMD_AFCFileModeRead, &fileRef);
+	if (result != kAMDSuccess) {
+		__sync_bool_compare_and_swap(&download->result, kAMDSuccess, result);
+		return;
+	}
+	// the buffer is only scratch space for hashing the local copy of a range
+	uint64_t bufferSize = (uint64_t)conn->chunkSize * conn->pipelineDepth;
+	void *buffer = (download->verify ? malloc(bufferSize) : NULL);
+	UInt8 *completed = CFDataGetMutableBytePtr(download->completed);
+	while (download->result == kAMDSuccess) {
+		uint32_t index = __sync_fetch_and_add(&download->nextRange, 0x1);
+		if (index >= download->rangeCount) {
+			break;
+		}
+		if (completed[index]) {
+			continue;
+		}
+		uint64_t offset = (uint64_t)index * download->rangeSize;
+		uint64_t length = (download->size - offset > download->rangeSize ? download->rangeSize : download->size - offset);
+		for (uint32_t attempt = 0x0; attempt < kSDMMD_AFCTransferRangeAttempts; attempt++) {
+			result = SDMMD_AFCDownloadRange(conn, download, fileRef, offset, length, buffer, bufferSize);
+			if (result != kAMDDigestFailedError) {
+				break;
+			}
+		}
+		if (result == kAMDSuccess) {
+			pthread_mutex_lock(&download->lock);
+			completed[index] = 0x1;
+			SDMMD_AFCDownloadStoreSidecar(download);
+			pthread_mutex_unlock(&download->lock);
+			SDMMD_AFCTransferAddProgress(progress, length, false);
+		} else {
+			printf("SDMMD_AFCDownloadWorker: Could not download bytes %llu-%llu: 0x%x\n", offset, offset + length, result);
+			__sync_bool_compare_and_swap(&download->result, kAMDSuccess, result);
+		}
+	}
+	SDMMD_AFCFileRefClose(conn, fileRef);
+	free(buffer);
+}
+
+static sdmmd_return_t SDMMD_AFCTransferDownload(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef remotePath, CFStringRef localPath, CFDictionaryRef options, void* transferCallback, void* arg) {
+	if (localPath == NULL || remotePath == NULL || (device == NULL && afcConnection == NULL)) {
+		return kAMDInvalidArgumentError;
+	}
+	uint32_t connectionCount = SDMMD_AFCTransferGetConnectionCount(device, options);
+	struct sdmmd_AFCDownload download = {.remotePath = remotePath, .fd = -1, .rangeSize = kSDMMD_AFCTransferDownloadRangeSize, .result = kAMDSuccess};
+	download.verify = SDMMD_AFCTransferGetBoolOption(options, CFSTR(kSDMMD_AFCTransferOptionVerify), true);
+	CFNumberRef rangeSize = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_AFCTransferOptionRangeSize)) : NULL);
+	if (rangeSize && CFGetTypeID(rangeSize) == CFNumberGetTypeID()) {
+		CFNumberGetValue(rangeSize, kCFNumberSInt64Type, &download.rangeSize);
+	}
+	download.rangeSize = (download.rangeSize < kSDMMD_AFCChunkSizeMin ? kSDMMD_AFCChunkSizeMin : download.rangeSize);
+	pthread_mutex_init(&download.lock, NULL);
+
+	SDMMD_AMConnectionRef *services = calloc(connectionCount, sizeof(SDMMD_AMConnectionRef));
+	SDMMD_AFCConnectionRef *connections = calloc(connectionCount, sizeof(SDMMD_AFCConnectionRef));
+	uint32_t opened = 0x0;
+	sdmmd_return_t result = SDMMD_AFCTransferOpenConnections(device, afcConnection, options, 0x1, services, connections, &opened);
+	CFDictionaryRef info = NULL;
+	if (result == kAMDSuccess) {
+		result = SDMMD_AFCConnectionCopyFileInfo(connections[0x0], remotePath, &info);
+	}
+	if (result == kAMDSuccess) {
+		CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+		if (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeRegular))) {
+			download.size = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+			download.modTime = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeyModTime));
+		} else {
+			result = kAMDInvalidArgumentError;
+		}
+		CFRelease(info);
+	}
+
+	char *local = SDMCFStringGetString(localPath);
+	bool resumed = false;
+	if (result == kAMDSuccess) {
+		download.rangeCount = (uint32_t)((download.size + download.rangeSize - 0x1) / download.rangeSize);
+		download.completed = CFDataCreateMutable(kCFAllocatorDefault, 0x0);
+		CFDataSetLength(download.completed, download.rangeCount);
+		download.sidecarPath = calloc(1, PATH_MAX);
+		snprintf(download.sidecarPath, PATH_MAX, "%s%s", local, kSDMMD_AFCTransferSidecarExtension);
+		resumed = SDMMD_AFCDownloadLoadSidecar(&download, local);
+		download.fd = open(local, O_RDWR | O_CREAT | (resumed ? 0x0 : O_TRUNC), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (download.fd == -1 || ftruncate(download.fd, (off_t)download.size) == -1) {
+			printf("SDMMD_AFCTransferDownload: Could not create %s.\n", local);
+			result = kAMDUndefinedError;
+		}
+	}
+	if (result == kAMDSuccess) {
+		uint64_t doneBytes = 0x0;
+		uint32_t remaining = 0x0;
+		const UInt8 *completed = CFDataGetBytePtr(download.completed);
+		for (uint32_t index = 0x0; index < download.rangeCount; index++) {
+			if (completed[index]) {
+				uint64_t offset = (uint64_t)index * download.rangeSize;
+				doneBytes += (download.size - offset > download.rangeSize ? download.rangeSize : download.size - offset);
+			} else {
+				remaining++;
+			}
+		}
+		// there is no point in holding more connections than ranges left to fetch
+		connectionCount = (remaining < connectionCount ? (remaining ? remaining : 0x1) : connectionCount);
+		SDMMD_AFCTransferOpenConnections(device, afcConnection, NULL, connectionCount, services, connections, &opened);
+
+		struct sdmmd_AFCTransferProgress progress = {.totalBytes = download.size, .sentBytes = doneBytes, .callback = transferCallback, .arg = arg};
+		pthread_mutex_init(&progress.lock, NULL);
+		SDMMD_AFCTransferAddProgress(&progress, 0x0, true);
+		struct sdmmd_AFCDownload *downloadRef = &download;
+		struct sdmmd_AFCTransferProgress *progressRef = &progress;
+		dispatch_apply(opened, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^(size_t index) {
+			SDMMD_AFCDownloadWorker(connections[index], downloadRef, progressRef);
+		});
+		result = (sdmmd_return_t)download.result;
+		if (result == kAMDSuccess) {
+			// finished, so there is nothing left to resume
+			unlink(download.sidecarPath);
+			if (progress.lastPercent < 100) {
+				SDMMD_AFCTransferAddProgress(&progress, progress.totalBytes - progress.sentBytes, true);
+			}
+		}
+		pthread_mutex_destroy(&progress.lock);
+	}
+
+	if (download.fd != -1) {
+		close(download.fd);
+	}
+	SDMMD_AFCTransferCloseConnections(afcConnection, services, connections, opened);
+	if (download.completed) {
+		CFRelease(download.completed);
+	}
+	free(download.sidecarPath);
+	free(local);
+	pthread_mutex_destroy(&download.lock);
+	return result;
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+sdmmd_return_t SDMMD_AFCUploadFile(SDMMD_AFCConnectionRef conn, CFStringRef localPath, CFStringRef remotePath) {
+	if (conn == NULL || localPath == NULL || remotePath == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	char *local = SDMCFStringGetString(localPath);
+	char *remote = SDMCFStringGetString(remotePath);
+	sdmmd_return_t result = SDMMD_AFCTransferUploadEntry(conn, local, remote, NULL);
+	free(remote);
+	free(local);
+	return result;
+}
+
+sdmmd_return_t SDMMD_AFCDownloadFile(SDMMD_AFCConnectionRef conn, CFStringRef remotePath, CFStringRef localPath) {
+	if (conn == NULL || localPath == NULL || remotePath == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	char *local = SDMCFStringGetString(localPath);
+	char *remote = SDMCFStringGetString(remotePath);
+	sdmmd_return_t result = SDMMD_AFCTransferDownloadEntry(conn, remote, local);
+	free(remote);
+	free(local);
+	return result;
+}
+
+sdmmd_return_t SDMMD_AMDeviceUploadTree(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef localPath, CFStringRef remotePath, CFDictionaryRef options, void* transferCallback, void* arg) {
+	return SDMMD_AFCTransferTree(device, afcConnection, localPath, remotePath, options, transferCallback, arg, false);
+}
+
+sdmmd_return_t SDMMD_AMDeviceSyncTree(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef localPath, CFStringRef remotePath, CFDictionaryRef options, void* transferCallback, void* arg) {
+	return SDMMD_AFCTransferTree(device, afcConnection, localPath, remotePath, options, transferCallback, arg, true);
+}
+
+sdmmd_return_t SDMMD_AMDeviceDownloadFile(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef remotePath, CFStringRef localPath, CFDictionaryRef options, void* transferCallback, void* arg) {
+	return SDMMD_AFCTransferDownload(device, afcConnection, remotePath, localPath, options, transferCallback, arg);
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ *  SDMMD_AFCTransfer.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef _SDM_MD_AFCTRANSFER_H_
+#define _SDM_MD_AFCTRANSFER_H_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include "SDMMD_Error.h"
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_AFC.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_AMDeviceUploadTree() and SDMMD_AMDeviceSyncTree()
+#define kSDMMD_AFCTransferOptionConnectionCount		"AFCConnectionCount"	// CFNumber, AFC connections files are spread across, defaults to kSDMMD_AFCTransferConnectionCountDefault
+#define kSDMMD_AFCTransferOptionManifestPath		"SyncManifestPath"		// CFString, where the sync manifest is kept, defaults to a file under kSDMMD_AFCTransferManifestDirectory
+#define kSDMMD_AFCTransferOptionIgnoreManifest		"SyncIgnoreManifest"	// CFBoolean, compare every file against the device even if the manifest says it is unchanged (default false)
+#define kSDMMD_AFCTransferOptionRangeSize			"DownloadRangeSize"		// CFNumber, bytes per range of SDMMD_AMDeviceDownloadFile(), defaults to kSDMMD_AFCTransferDownloadRangeSize
+#define kSDMMD_AFCTransferOptionVerify				"DownloadVerify"		// CFBoolean, compare every downloaded range against the device's digest of it (default true)
+#define kSDMMD_AFCTransferOptionAutoTune			"AFCAutoTune"			// CFBoolean, run SDMMD_AFCConnectionAutoTune() first if this kind of device has not been tuned yet (default false)
+
+#define kSDMMD_AFCTransferConnectionCountDefault	0x4
+#define kSDMMD_AFCTransferConnectionCountMax		0x8
+
+// Files at least this large are synced range by range with GetFileHashWithRange, smaller ones are compared with a single GetFileHash
+#define kSDMMD_AFCTransferRangeThreshold			0x2000000
+
+// Files are sent and received this much at a time, data is never staged in a buffer so this only sets how often progress is reported
+#define kSDMMD_AFCTransferWindowSize				0x4000000
+
+// Files up to this size are read whole and written kSDMMD_AFCTransferSmallFileBatch at a time with SDMMD_AFCConnectionWriteFiles()
+#define kSDMMD_AFCTransferSmallFileSize				0x10000
+#define kSDMMD_AFCTransferSmallFileBatch			0x80
+
+// Downloads are split into ranges of this size, a range whose digest does not match is fetched again up to kSDMMD_AFCTransferRangeAttempts times
+#define kSDMMD_AFCTransferDownloadRangeSize			0x1000000
+#define kSDMMD_AFCTransferRangeAttempts				0x2
+
+// Next to the local file while a download is incomplete, records which ranges are already on disk
+#define kSDMMD_AFCTransferSidecarExtension			".sdmmdpart"
+#define kSDMMD_AFCTransferSidecarKeyRemotePath		"RemotePath"
+#define kSDMMD_AFCTransferSidecarKeyRangeSize		"RangeSize"
+#define kSDMMD_AFCTransferSidecarKeyCompletedRanges	"CompletedRanges"
+
+// Sync manifests, relative to the home directory there is one per device and local/remote path pair
+#define kSDMMD_AFCTransferManifestDirectory			"Library/Caches/com.samdmarshall.sdmmobiledevice/Sync"
+#define kSDMMD_AFCTransferManifestKeyFiles			"Files"
+#define kSDMMD_AFCTransferManifestKeyDirectories	"Directories"
+#define kSDMMD_AFCTransferManifestKeyLinks			"Links"
+#define kSDMMD_AFCTransferManifestKeySize			"Size"
+#define kSDMMD_AFCTransferManifestKeyModTime		"ModTime"
+
+// Keys of the dictionaries passed to the transfer callback, these match the install callback
+#define kSDMMD_AFCTransferKeyStatus					"Status"
+#define kSDMMD_AFCTransferKeyPercentComplete		"PercentComplete"
+
+#define kSDMMD_AFCTransferStatusTransfering			"TransferingPackage"
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Copies a single local file to remotePath, the remote file is created or truncated
+sdmmd_return_t SDMMD_AFCUploadFile(SDMMD_AFCConnectionRef conn, CFStringRef localPath, CFStringRef remotePath);
+
+// Copies the file at remotePath to localPath, the local file is created or truncated
+sdmmd_return_t SDMMD_AFCDownloadFile(SDMMD_AFCConnectionRef conn, CFStringRef remotePath, CFStringRef localPath);
+
+// Copies the local file or directory at localPath to remotePath. Directories and symlinks are created up front on one connection, file contents are
+// then spread over several AFC connections, largest files first. afcConnection is optional, when it is NULL every connection is checked out from the
+// device. The callback receives "Status" and "PercentComplete" as the copy progresses.
+sdmmd_return_t SDMMD_AMDeviceUploadTree(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef localPath, CFStringRef remotePath, CFDictionaryRef options, void* transferCallback, void* arg);
+
+// Like SDMMD_AMDeviceUploadTree() but only writes what differs. Files whose size and mtime match the local manifest of the last sync are skipped
+// without contacting the device, the rest are compared by remote size and mtime, then by hash, and large files only have their changed ranges
+// rewritten. Remote files that no longer exist locally are left alone.
+sdmmd_return_t SDMMD_AMDeviceSyncTree(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef localPath, CFStringRef remotePath, CFDictionaryRef options, void* transferCallback, void* arg);
+
+// Copies the remote file at remotePath to localPath. The file is split into ranges that are read over several AFC connections at once and written
+// at their offsets, each range is checked against the device's digest of it. Progress is kept in a sidecar next to localPath, calling this again
+// after an interruption only fetches the missing ranges as long as the remote file has not changed. Takes the same connection options and
+// callback as SDMMD_AMDeviceUploadTree().
+sdmmd_return_t SDMMD_AMDeviceDownloadFile(SDMMD_AMDeviceRef device, SDMMD_AMConnectionRef afcConnection, CFStringRef remotePath, CFStringRef localPath, CFDictionaryRef options, void* transferCallback, void* arg);
+
+#endif
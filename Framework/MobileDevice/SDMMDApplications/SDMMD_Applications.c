@@ -24,6 +24,7 @@
 #include "SDMMD_Functions.h"
 #include "SDMMD_AMDevice.h"
 #include "SDMMD_AFC.h"
+#include "SDMMD_AFCTransfer.h"
 
 #define kAppLookupMasterKey "ReturnAttributes"
 
@@ -38,9 +39,8 @@ sdmmd_return_t SDMMD_AMDeviceLookupApplications(SDMMD_AMDeviceRef device, CFDict
 	sdmmd_return_t result = kAMDInvalidArgumentError;
 	if (device) {
 		if (options) {
-			CFDictionaryRef dict = NULL;
-			SDMMD_AMConnectionRef conn = SDMMD_AMDServiceConnectionCreate(0, NULL, dict);
-			result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_INSTALLATION_PROXY), 0x0, &conn);
+			SDMMD_AMConnectionRef conn = NULL;
+			result = SDMMD_AMDeviceCheckoutServiceConnection(device, CFSTR(AMSVC_INSTALLATION_PROXY), 0x0, &conn);
 			if (result == 0) {
 				CFMutableDictionaryRef dict = SDMMD_create_dict();
 				result = kAMDNoResourcesError;
@@ -48,8 +48,17 @@ sdmmd_return_t SDMMD_AMDeviceLookupApplications(SDMMD_AMDeviceRef device, CFDict
 					result = SDMMD_perform_command(conn, CFSTR("Browse"), 0x0, SDMMD_browse_callback, 2, dict, CFSTR("ClientOptions"), options);
 					if (!result) {
 						*response = dict;
+					} else {
+						CFRelease(dict);
 					}
 				}
+				if (result == 0) {
+					SDMMD_AMDeviceCheckinServiceConnection(conn);
+				} else {
+					// a failed command can leave the proxy mid-reply, so don't hand this connection out again
+					SDMMD_AMDServiceConnectionInvalidate(conn);
+					free(conn);
+				}
 			} else {
 				printf("SDMMD_AMDeviceLookupApplications: Was unable to start the install service on the device: %i\n",device->ivars.device_id);
 			}
@@ -87,75 +96,37 @@ sdmmd_return_t SDMMD_AMDeviceTransferApplication(SDMMD_AMConnectionRef conn, CFS
 	sdmmd_return_t result = kAMDInvalidArgumentError;
 	if (path) {
 		if (conn) {
-			char *cpath = calloc(0x1, 0x401);
-			struct stat pathStat, remoteStat;
-			Boolean status = CFStringGetCString(path, cpath, 0x401, 0x8000100);
-			if (status) {
-				CFURLRef deviceURL = SDMMD__AMDCFURLCreateFromFileSystemPathWithSmarts(path);
-				if (deviceURL) {
-					CFStringRef lastComp = CFURLCopyLastPathComponent(deviceURL);
-					if (lastComp) {
-						CFURLRef base = SDMMD__AMDCFURLCreateWithFileSystemPathRelativeToBase(kCFAllocatorDefault, CFSTR("PublicStaging"), 0x0, 0x1);
-						CFURLRef copy = CFURLCreateCopyAppendingPathComponent(kCFAllocatorDefault, base, lastComp, true);
-						char *copyPath;
-						SDMMD__AMDCFURLGetCStringForFileSystemPath(copy, copyPath);
-						SDMMD_fire_callback_767f4(transferCallback, unknown, 0x0, CFSTR("PreflightingTransfer"));
-						//SDMMD_preflight_transfer(&cpath, &pathStat, &remoteStat);
-						SDMMD_fire_callback_767f4(transferCallback, unknown, 0x0, CFSTR("TransferingPackage"));
-						SDMMD_AFCConnectionRef afcConn = SDMMD_AFCConnectionCreate(conn);//(r12, conn, 0x0, 0x0, &var_72);
-						// loop that iterates through all of file contents
-						
-						
-						/*if (result == 0) {
- 							CFDataRef touchResponse;
-							result = SDMMD_check_can_touch(afcConn, &touchResponse);
-							if (result == 0) {
-								CFURLRef parent = CFURLCreateCopyDeletingLastPathComponent(r12, r13);
-								result = SDMMD_make_path(afcConn, parent);
-								if (result == 0) {
-									result = SDMMD_nuke_path(afcConn, r13);
-									if ((result | 0x8) == 0x8) {
-										int statResult = lstat(cpath, &pathStat);
-										if (statResult != 0xff) {
-											f ((var_84 & 0xffff & 0xf000) != 0xa000) {
-												if (rax == 0x8000) {
-													rbx = SDMMD_copy_touch_file(&remoteStat, transferCallback, unknown, afcConn, &cpath, &copyPath);
-												} else {
-													if (rax == 0x4000) {
-														rbx = SDMMD_copy_directory(&remoteStat, transferCallback, unknown, afcConn, &cpath, &copyPath);
-													} else {
-														printf("transfer_package: Don't know how to copy this type of file: %s\n", cpath);
-													}
-												}
-											} else {
-												rbx = SDMMD_copy_symlink(afcConn, &cpath, &copyPath);
-											}
-											r14 = 0x0;
-											if (rbx != 0x0) {
-												r9 = SDMMD_AFCErrorString(rbx);
-												printf("transfer_package: Could not copy %s to %s on the device.\n", cpath, copyPath);
-												result = kAMDUndefinedError;
-											}
-											result = SDMMD_AFCConnectionClose(afcConn);
-											if (result) {
-												printf("transfer_package: Could not close AFC connection. error: %i\n", result);
-											}
-											if (r12 != 0x0) {
-												CFRelease(r12);
-											}
-										}
-									}
-								} else {
-									// error!
-								}
-							}
-						}*/
+			result = kAMDUndefinedError;
+			CFURLRef deviceURL = SDMMD__AMDCFURLCreateFromFileSystemPathWithSmarts(path);
+			if (deviceURL) {
+				CFStringRef lastComp = CFURLCopyLastPathComponent(deviceURL);
+				if (lastComp) {
+					CFStringRef remotePath = CFStringCreateWithFormat(kCFAllocatorDefault, 0x0, CFSTR("%s%c%@"), "PublicStaging", 0x2f, lastComp);
+					SDMMD_fire_callback_767f4(transferCallback, unknown, 0x0, CFSTR("PreflightingTransfer"));
+					SDMMD_AFCConnectionRef afcConn = SDMMD_AFCConnectionCreate(conn);
+					SDMMD_AFCOperationRef makeStaging = SDMMD_AFCOperationCreateMakeDirectory(CFSTR("PublicStaging"));
+					result = SDMMD_AFCConnectionPerformOperation(afcConn, makeStaging);
+					SDMMD_AFCOperationRelease(makeStaging);
+					if (result == kAMDSuccess) {
+						// a package left over from an earlier transfer is replaced, the result is ignored as there usually isn't one
+						SDMMD_AFCConnectionRemovePathAndContents(afcConn, remotePath);
 					} else {
-						result = kAMDUndefinedError;
+						printf("SDMMD_AMDeviceTransferApplication: Could not create PublicStaging on the device: 0x%x\n", result);
 					}
+					SDMMD_AFCConnectionRelease(afcConn);
+					if (result == kAMDSuccess) {
+						// the first connection is the one passed in, the rest are checked out from the same device
+						result = SDMMD_AMDeviceUploadTree(conn->ivars.device, conn, path, remotePath, options, transferCallback, unknown);
+						if (result) {
+							char *localPath = SDMCFStringGetString(path);
+							printf("SDMMD_AMDeviceTransferApplication: Could not copy %s to the device: 0x%x\n", localPath, result);
+							free(localPath);
+						}
+					}
+					CFRelease(remotePath);
+					CFRelease(lastComp);
 				}
-			} else {
-				result = kAMDUndefinedError;
+				CFRelease(deviceURL);
 			}
 		}
 	}
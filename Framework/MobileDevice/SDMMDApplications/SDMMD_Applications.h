@@ -21,6 +21,7 @@
 
 #include "SDMMD_Error.h"
 #include "SDMMD_AMDevice.h"
+#include "SDMMD_Service.h"
 
 #pragma mark -
 #pragma mark TYPES
@@ -71,6 +72,8 @@
 #pragma mark -
 
 sdmmd_return_t SDMMD_AMDeviceLookupApplications(SDMMD_AMDeviceRef device, CFDictionaryRef options, CFDictionaryRef *response);
+// Copies the package at path into PublicStaging over AFC, conn must be an AFC service connection
+sdmmd_return_t SDMMD_AMDeviceTransferApplication(SDMMD_AMConnectionRef conn, CFStringRef path, CFDictionaryRef options, void* transferCallback, void* unknown);
 sdmmd_return_t SDMMD_AMDeviceInstallApplication(SDMMD_AMDeviceRef device, CFStringRef path, CFDictionaryRef options, void* installCallback, void* unknown);
 
 #endif
\ No newline at end of file
@@ -23,6 +23,25 @@
 #include "SDMMD_Service.h"
 #include "SDMMD_Functions.h"
 #include "SDMMD_AMDevice.h"
+#include <sys/socket.h>
+#include <errno.h>
+
+struct sdmmd_ServicePoolEntry {
+	struct sdmmd_ServicePoolEntry *next;
+	SDMMD_AMConnectionRef connection;
+	CFStringRef udid;
+	uint32_t device_id;
+	CFAbsoluteTime idleSince;
+};
+
+static pthread_mutex_t SDMMD_ServicePoolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sdmmd_ServicePoolEntry *SDMMD_ServicePool = NULL;
+
+static char* SDMMD_PoolableServices[] = {
+	AMSVC_AFC,
+	AMSVC_INSTALLATION_PROXY,
+	AMSVC_NOTIFICATION_PROXY
+};
 
 sdmmd_return_t SDMMD_perform_command(SDMMD_AMConnectionRef conn, CFStringRef command, uint64_t code, void (*callback)(CFDictionaryRef dict, void* arg), uint32_t argsCount, void* paramStart, ...) {
 	sdmmd_return_t result = 0x0;
@@ -116,6 +135,56 @@ SDMMD_AMConnectionRef SDMMD_AMDServiceConnectionCreate(uint32_t socket, SSL* ssl
 	return handle;
 }
 
+static sdmmd_return_t SDMMD_ReadServiceStartResponse(CFDictionaryRef response, uint32_t *port, bool *enableSSL) {
+	sdmmd_return_t result = kAMDReceiveMessageError;
+	if (response) {
+		result = kAMDInvalidResponseError;
+		CFTypeRef error = CFDictionaryGetValue(response, CFSTR("Error"));
+		if (error) {
+			if (CFGetTypeID(error) == CFStringGetTypeID()) {
+				result = (sdmmd_return_t)SDMMD__ConvertLockdowndError(error);
+			}
+		} else {
+			CFTypeRef portNumber = CFDictionaryGetValue(response, CFSTR("Port"));
+			if (portNumber) {
+				if (CFGetTypeID(portNumber) == CFNumberGetTypeID()) {
+					CFNumberGetValue(portNumber, 0x9, port);
+				}
+			}
+			CFTypeRef sslService = CFDictionaryGetValue(response, CFSTR("EnableServiceSSL"));
+			if (sslService) {
+				*enableSSL = (CFEqual(sslService, kCFBooleanTrue) ? true : false);
+			} else {
+				*enableSSL = false;
+			}
+			result = 0x0;
+		}
+	}
+	return result;
+}
+
+// The handshake has to run over the socket of the service that was just connected, not the lockdown connection.
+static sdmmd_return_t SDMMD__EnableSSLOnServiceSocket(uint32_t socket, CFDictionaryRef record, SSL **ssl) {
+	sdmmd_return_t result = kAMDMissingPairRecordError;
+	*ssl = NULL;
+	if (record) {
+		CFTypeRef rootCertVal = CFDictionaryGetValue(record, CFSTR("RootCertificate"));
+		CFTypeRef deviceCertVal = CFDictionaryGetValue(record, CFSTR("DeviceCertificate"));
+		CFTypeRef rootPrivKeyVal = CFDictionaryGetValue(record, CFSTR("RootPrivateKey"));
+		if (rootCertVal && deviceCertVal && rootPrivKeyVal) {
+			SDMMD_lockdown_conn serviceConn = { .connection = socket };
+			*ssl = SDMMD_lockssl_handshake(&serviceConn, rootCertVal, deviceCertVal, rootPrivKeyVal, 0x1);
+			if (*ssl) {
+				result = 0x0;
+			} else {
+				printf("_TurnOnSSLOverSocket: Could not perform SSL handshake.\n");
+				result = kAMDNoWifiSyncSupportError;
+			}
+		}
+	}
+	return result;
+}
+
 sdmmd_return_t SDMMD_send_service_start(SDMMD_AMDeviceRef device, CFStringRef service, CFTypeRef escrowBag, uint32_t *port, bool *enableSSL) {
 	sdmmd_return_t result = kAMDInvalidArgumentError;
 	if (device) {
@@ -136,27 +205,7 @@ sdmmd_return_t SDMMD_send_service_start(SDMMD_AMDeviceRef device, CFStringRef se
 							CFMutableDictionaryRef response;
 							result = SDMMD_lockconn_receive_message(device, &response);
 							if (result == 0) {
-								result = kAMDInvalidResponseError;
-								CFTypeRef error = CFDictionaryGetValue(response, CFSTR("Error"));
-								if (error) {
-									if (CFGetTypeID(error) == CFStringGetTypeID()) {
-										result = (sdmmd_return_t)SDMMD__ConvertLockdowndError(error);
-									}
-								} else {
-									CFTypeRef portNumber = CFDictionaryGetValue(response, CFSTR("Port"));
-									if (portNumber) {
-										if (CFGetTypeID(portNumber) == CFNumberGetTypeID()) {
-											CFNumberGetValue(portNumber, 0x9, port);
-										}
-									}
-									CFTypeRef sslService = CFDictionaryGetValue(response, CFSTR("EnableServiceSSL"));
-									if (sslService) {
-										*enableSSL = (CFEqual(sslService, kCFBooleanTrue) ? true : false);
-									} else {
-										*enableSSL = false;
-									}
-									result = 0x0;
-								}
+								result = SDMMD_ReadServiceStartResponse(response, port, enableSSL);
 							}
 						}
 					}
@@ -265,6 +314,7 @@ sdmmd_return_t SDMMD_AMDeviceSecureStartService(SDMMD_AMDeviceRef device, CFStri
 									}
 									CFRelease(fileDict);
 								}
+								SDMMD__InvalidatePairingRecordCache(device->ivars.unique_device_id);
 								free(path);
 								if (escrowBag) {
 									CFRelease(escrowBag);
@@ -281,29 +331,13 @@ sdmmd_return_t SDMMD_AMDeviceSecureStartService(SDMMD_AMDeviceRef device, CFStri
 						if (result == 0x0) {
 							if (enableSSL) {
 								printf("AMDeviceSecureStartService: SSL requested for service %s with device %s.\n", cservice, (device->ivars.unique_device_id ? SDMCFStringGetString(device->ivars.unique_device_id) : "device with no name"));
-								CFMutableDictionaryRef record = NULL;
+								CFDictionaryRef record = NULL;
 								if (socket != 0xff) {
 									result = kAMDInvalidArgumentError;
 									if (device->ivars.device_active) {
-										result = SDMMD__CreatePairingRecordFromRecordOnDiskForIdentifier(device, &record);
+										result = SDMMD__CopyPairingRecord(device, &record);
 										if (result == 0x0) {
-											CFTypeRef rootCertVal = CFDictionaryGetValue(record, CFSTR("RootCertificate"));
-											result = kAMDMissingPairRecordError;
-											if (rootCertVal == 0x0) {
-												ssl = NULL;
-											} else {
-												CFTypeRef deviceCertVal = CFDictionaryGetValue(record, CFSTR("DeviceCertificate"));
-												CFTypeRef rootPrivKeyVal = CFDictionaryGetValue(record, CFSTR("RootPrivateKey"));
-												if (deviceCertVal && rootPrivKeyVal) {
-													ssl = SDMMD_lockssl_handshake((device->ivars.lockdown_conn), rootCertVal, deviceCertVal, rootPrivKeyVal, 0x1);
-													if (ssl) {
-														result = 0x0;
-													} else {
-														printf("_TurnOnSSLOverSocket: Could not perform SSL handshake.\n");
-														result = kAMDNoWifiSyncSupportError;
-													}
-												}
-											}
+											result = SDMMD__EnableSSLOnServiceSocket(socket, record, &ssl);
 										}
 									}
 									if (record) {
@@ -445,6 +479,135 @@ sdmmd_return_t SDMMD_AMDeviceStartService(SDMMD_AMDeviceRef device, CFStringRef
 	return result;
 }
 
+sdmmd_return_t SDMMD_AMDeviceSecureStartServices(SDMMD_AMDeviceRef device, CFArrayRef services, CFDictionaryRef options, SDMMD_AMConnectionRef *connections, sdmmd_return_t *results) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (device && services && connections && results) {
+		CFIndex count = CFArrayGetCount(services);
+		for (CFIndex index = 0x0; index < count; index++) {
+			connections[index] = NULL;
+			results[index] = kAMDUndefinedError;
+		}
+		result = kAMDDeviceDisconnectedError;
+		if (device->ivars.device_active) {
+			result = kAMDInvalidArgumentError;
+			if (device->ivars.session && device->ivars.lockdown_conn && count) {
+				bool timeoutConnection = false;
+				bool closeOnInvalidate = true;
+				CFDataRef escrowBag = NULL;
+				result = kAMDSuccess;
+				if (options) {
+					CFTypeRef closeVal = CFDictionaryGetValue(options, CFSTR("CloseOnInvalidate"));
+					if (closeVal && CFEqual(closeVal, kCFBooleanFalse)) {
+						closeOnInvalidate = false;
+					}
+					CFTypeRef timeoutVal = CFDictionaryGetValue(options, CFSTR("TimeoutConnection"));
+					if (timeoutVal) {
+						timeoutConnection = CFEqual(timeoutVal, kCFBooleanTrue);
+					}
+					CFTypeRef bag = CFDictionaryGetValue(options, CFSTR("UnlockEscrowBag"));
+					if (bag && CFEqual(bag, kCFBooleanTrue)) {
+						result = SDMMD__CopyEscrowBag(device, &escrowBag);
+						if (result) {
+							printf("SDMMD_AMDeviceSecureStartServices: Could not get escrow keybag for device %s!\n", (device->ivars.unique_device_id ? SDMCFStringGetString(device->ivars.unique_device_id) : "device with no name"));
+						}
+					}
+				}
+				if (result == kAMDSuccess) {
+					uint32_t *ports = calloc(count, sizeof(uint32_t));
+					bool *enableSSL = calloc(count, sizeof(bool));
+					bool needsRecord = false;
+					
+					// every StartService goes out back to back and lockdown answers them in the order they were sent, so the whole batch costs one round trip
+					SDMMD__mutex_lock(device->ivars.mutex_lock);
+					CFIndex sent = 0x0;
+					for (; sent < count; sent++) {
+						CFMutableDictionaryRef request = SDMMD__CreateMessageDict(CFSTR("StartService"));
+						if (request == NULL) {
+							break;
+						}
+						CFDictionarySetValue(request, CFSTR("Service"), CFArrayGetValueAtIndex(services, sent));
+						if (escrowBag) {
+							CFDictionarySetValue(request, CFSTR("EscrowBag"), escrowBag);
+						}
+						sdmmd_return_t sendResult = SDMMD_lockconn_send_message(device, request);
+						CFRelease(request);
+						if (sendResult) {
+							break;
+						}
+					}
+					for (CFIndex index = 0x0; index < count; index++) {
+						if (index < sent) {
+							CFMutableDictionaryRef response = NULL;
+							results[index] = SDMMD_lockconn_receive_message(device, &response);
+							if (results[index] == 0x0) {
+								results[index] = SDMMD_ReadServiceStartResponse(response, &ports[index], &enableSSL[index]);
+							}
+							if (response) {
+								CFRelease(response);
+							}
+							needsRecord |= (results[index] == 0x0 && enableSSL[index]);
+						} else {
+							results[index] = kAMDSendMessageError;
+						}
+					}
+					SDMMD__mutex_unlock(device->ivars.mutex_lock);
+					
+					CFDictionaryRef record = NULL;
+					if (needsRecord) {
+						SDMMD__CopyPairingRecord(device, &record);
+					}
+					
+					// the lockdown connection is no longer needed, so each service connects and handshakes on its own
+					dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^(size_t index){
+						if (results[index] == 0x0) {
+							uint32_t socket = 0xffffffff;
+							SSL *ssl = NULL;
+							sdmmd_return_t serviceResult = SDMMD__connect_to_port(device, ports[index], timeoutConnection, &socket, false);
+							if (serviceResult == 0x0 && enableSSL[index]) {
+								serviceResult = SDMMD__EnableSSLOnServiceSocket(socket, record, &ssl);
+							}
+							if (serviceResult == 0x0) {
+								SDMMD_AMConnectionRef conn = SDMMD_AMDServiceConnectionCreate(socket, ssl, NULL);
+								serviceResult = kAMDNoResourcesError;
+								if (conn) {
+									conn->ivars.closeOnInvalid = closeOnInvalidate;
+									SDMMD_AMDServiceConnectionSetDevice(&conn, device);
+									SDMMD_AMDServiceConnectionSetServiceName(&conn, CFArrayGetValueAtIndex(services, index));
+									connections[index] = conn;
+									serviceResult = 0x0;
+								}
+							}
+							if (serviceResult && socket != 0xffffffff) {
+								if (ssl) {
+									SSL_free(ssl);
+								}
+								close(socket);
+							}
+							results[index] = serviceResult;
+						}
+					});
+					
+					if (record) {
+						CFRelease(record);
+					}
+					free(enableSSL);
+					free(ports);
+					for (CFIndex index = 0x0; index < count; index++) {
+						if (results[index]) {
+							result = results[index];
+							break;
+						}
+					}
+				}
+				if (escrowBag) {
+					CFRelease(escrowBag);
+				}
+			}
+		}
+	}
+	return result;
+}
+
 void SDMMD_AMDServiceConnectionSetDevice(SDMMD_AMConnectionRef *connection, SDMMD_AMDeviceRef device) {
 	(*connection)->ivars.device = device;
 }
@@ -463,7 +626,22 @@ SSL* SDMMD_AMDServiceConnectionGetSecureIOContext(SDMMD_AMConnectionRef connecti
 }
 
 sdmmd_return_t SDMMD_AMDServiceConnectionInvalidate(SDMMD_AMConnectionRef connection) {
-	return 0x0;
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (connection) {
+		if (connection->ivars.ssl) {
+			SSL_shutdown(connection->ivars.ssl);
+			SSL_free(connection->ivars.ssl);
+			connection->ivars.ssl = NULL;
+		}
+		if (connection->ivars.closeOnInvalid && connection->ivars.socket != 0xffffffff) {
+			if (close(connection->ivars.socket) == -1) {
+				printf("SDMMD_AMDServiceConnectionInvalidate: close(2) on socket %d failed: %d.\n", connection->ivars.socket, errno);
+			}
+		}
+		connection->ivars.socket = 0xffffffff;
+		result = kAMDSuccess;
+	}
+	return result;
 }
 
 sdmmd_return_t SDMMD_AMDeviceSecureStartSessionedService(SDMMD_AMDeviceRef device, CFStringRef service, SDMMD_AMConnectionRef *connection) {
@@ -485,5 +663,167 @@ sdmmd_return_t SDMMD_AMDeviceSecureStartSessionedService(SDMMD_AMDeviceRef devic
 	return result;
 }
 
+#pragma mark -
+#pragma mark Service Connection Pool
+#pragma mark -
+
+bool SDMMD_AMDServiceConnectionIsValid(SDMMD_AMConnectionRef connection) {
+	bool result = false;
+	if (connection && connection->ivars.socket != 0xffffffff) {
+		// an idle service connection must have nothing to read, EOF means the device closed it and stray bytes mean the protocol state is unknown
+		char byte;
+		ssize_t peek = recv(connection->ivars.socket, &byte, 0x1, MSG_PEEK | MSG_DONTWAIT);
+		if (peek == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			result = (connection->ivars.ssl ? SSL_pending(connection->ivars.ssl) == 0x0 : true);
+		}
+	}
+	return result;
+}
+
+static bool SDMMD_ServiceIsPoolable(const char *service) {
+	bool result = false;
+	for (uint32_t index = 0x0; index < sizeof(SDMMD_PoolableServices)/sizeof(char*); index++) {
+		if (strncmp(service, SDMMD_PoolableServices[index], 0x80) == 0x0) {
+			result = true;
+			break;
+		}
+	}
+	return result;
+}
+
+static void SDMMD_ServicePoolEntryRelease(struct sdmmd_ServicePoolEntry *entry) {
+	SDMMD_AMDServiceConnectionInvalidate(entry->connection);
+	free(entry->connection);
+	if (entry->udid) {
+		CFRelease(entry->udid);
+	}
+	free(entry);
+}
+
+static bool SDMMD_ServicePoolEntryMatches(struct sdmmd_ServicePoolEntry *entry, SDMMD_AMDeviceRef device) {
+	return (entry->device_id == device->ivars.device_id && entry->udid && device->ivars.unique_device_id && CFEqual(entry->udid, device->ivars.unique_device_id));
+}
+
+// Must be called with SDMMD_ServicePoolLock held, unlinks idle entries past the timeout and returns them as a list for closing outside the lock
+static struct sdmmd_ServicePoolEntry* SDMMD_ServicePoolUnlinkExpired(CFAbsoluteTime now) {
+	struct sdmmd_ServicePoolEntry *expired = NULL;
+	struct sdmmd_ServicePoolEntry **link = &SDMMD_ServicePool;
+	while (*link) {
+		struct sdmmd_ServicePoolEntry *entry = *link;
+		if (now - entry->idleSince > kSDMMD_ServicePoolIdleTimeout) {
+			*link = entry->next;
+			entry->next = expired;
+			expired = entry;
+		} else {
+			link = &entry->next;
+		}
+	}
+	return expired;
+}
+
+static void SDMMD_ServicePoolReleaseList(struct sdmmd_ServicePoolEntry *list) {
+	while (list) {
+		struct sdmmd_ServicePoolEntry *next = list->next;
+		SDMMD_ServicePoolEntryRelease(list);
+		list = next;
+	}
+}
+
+sdmmd_return_t SDMMD_AMDeviceCheckoutServiceConnection(SDMMD_AMDeviceRef device, CFStringRef service, CFDictionaryRef options, SDMMD_AMConnectionRef *connection) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (device && service && connection) {
+		char cservice[0x80] = {0};
+		CFStringGetCString(service, cservice, 0x80, kCFStringEncodingUTF8);
+		struct sdmmd_ServicePoolEntry *stale = NULL;
+		struct sdmmd_ServicePoolEntry *found = NULL;
+		pthread_mutex_lock(&SDMMD_ServicePoolLock);
+		stale = SDMMD_ServicePoolUnlinkExpired(CFAbsoluteTimeGetCurrent());
+		struct sdmmd_ServicePoolEntry **link = &SDMMD_ServicePool;
+		while (*link && found == NULL) {
+			struct sdmmd_ServicePoolEntry *entry = *link;
+			if (SDMMD_ServicePoolEntryMatches(entry, device) && strncmp(entry->connection->ivars.service, cservice, 0x80) == 0x0) {
+				*link = entry->next;
+				if (SDMMD_AMDServiceConnectionIsValid(entry->connection)) {
+					found = entry;
+				} else {
+					entry->next = stale;
+					stale = entry;
+				}
+			} else {
+				link = &entry->next;
+			}
+		}
+		pthread_mutex_unlock(&SDMMD_ServicePoolLock);
+		SDMMD_ServicePoolReleaseList(stale);
+		if (found) {
+			*connection = found->connection;
+			found->connection->ivars.device = device;
+			if (found->udid) {
+				CFRelease(found->udid);
+			}
+			free(found);
+			result = kAMDSuccess;
+		} else {
+			result = SDMMD_AMDeviceSecureStartService(device, service, options, connection);
+		}
+	}
+	return result;
+}
+
+void SDMMD_AMDeviceCheckinServiceConnection(SDMMD_AMConnectionRef connection) {
+	if (connection) {
+		SDMMD_AMDeviceRef device = connection->ivars.device;
+		bool pooled = false;
+		if (device && device->ivars.unique_device_id && SDMMD_ServiceIsPoolable(connection->ivars.service) && SDMMD_AMDServiceConnectionIsValid(connection)) {
+			struct sdmmd_ServicePoolEntry *entry = calloc(0x1, sizeof(struct sdmmd_ServicePoolEntry));
+			if (entry) {
+				entry->connection = connection;
+				entry->udid = CFRetain(device->ivars.unique_device_id);
+				entry->device_id = device->ivars.device_id;
+				entry->idleSince = CFAbsoluteTimeGetCurrent();
+				uint32_t idleCount = 0x0;
+				pthread_mutex_lock(&SDMMD_ServicePoolLock);
+				for (struct sdmmd_ServicePoolEntry *check = SDMMD_ServicePool; check; check = check->next) {
+					if (SDMMD_ServicePoolEntryMatches(check, device) && strncmp(check->connection->ivars.service, connection->ivars.service, 0x80) == 0x0) {
+						idleCount++;
+					}
+				}
+				if (idleCount < kSDMMD_ServicePoolMaxIdlePerService) {
+					entry->next = SDMMD_ServicePool;
+					SDMMD_ServicePool = entry;
+					pooled = true;
+				}
+				pthread_mutex_unlock(&SDMMD_ServicePoolLock);
+				if (!pooled) {
+					CFRelease(entry->udid);
+					free(entry);
+				}
+			}
+		}
+		if (!pooled) {
+			SDMMD_AMDServiceConnectionInvalidate(connection);
+			free(connection);
+		}
+	}
+}
+
+void SDMMD_AMDeviceDrainServiceConnectionPool(SDMMD_AMDeviceRef device) {
+	struct sdmmd_ServicePoolEntry *drained = NULL;
+	pthread_mutex_lock(&SDMMD_ServicePoolLock);
+	struct sdmmd_ServicePoolEntry **link = &SDMMD_ServicePool;
+	while (*link) {
+		struct sdmmd_ServicePoolEntry *entry = *link;
+		if (device == NULL || SDMMD_ServicePoolEntryMatches(entry, device)) {
+			*link = entry->next;
+			entry->next = drained;
+			drained = entry;
+		} else {
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&SDMMD_ServicePoolLock);
+	SDMMD_ServicePoolReleaseList(drained);
+}
+
 #endif
 
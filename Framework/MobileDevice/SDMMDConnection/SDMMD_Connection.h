@@ -48,6 +48,10 @@ struct am_connection {
 /* Classes */
 #define SDMMD_AMConnectionRef struct am_connection*
 
+// services that are safe to hand back out once a caller is done with them, the device keeps these open between requests
+#define kSDMMD_ServicePoolMaxIdlePerService 0x4
+#define kSDMMD_ServicePoolIdleTimeout 30.0
+
 #pragma mark -
 #pragma mark FUNCTIONS
 #pragma mark -
@@ -60,6 +64,10 @@ SDMMD_AMConnectionRef SDMMD_AMDServiceConnectionCreate(uint32_t socket, SSL* ssl
 sdmmd_return_t SDMMD_AMDeviceStartService(SDMMD_AMDeviceRef device, CFStringRef service, CFDictionaryRef options, SDMMD_AMConnectionRef *connection);
 sdmmd_return_t SDMMD_AMDeviceSecureStartService(SDMMD_AMDeviceRef device, CFStringRef service, CFDictionaryRef options, SDMMD_AMConnectionRef *connection);
 
+// Starts every service in the array with a single lockdown round trip then connects to them in parallel, connections and results must have room for one entry per service.
+// Each service succeeds or fails on its own, the return value is the first failure or kAMDSuccess if all of them started.
+sdmmd_return_t SDMMD_AMDeviceSecureStartServices(SDMMD_AMDeviceRef device, CFArrayRef services, CFDictionaryRef options, SDMMD_AMConnectionRef *connections, sdmmd_return_t *results);
+
 void SDMMD_AMDServiceConnectionSetServiceName(SDMMD_AMConnectionRef *connection, CFStringRef service);
 void SDMMD_AMDServiceConnectionSetDevice(SDMMD_AMConnectionRef *connection, SDMMD_AMDeviceRef device);
 
@@ -70,4 +78,13 @@ sdmmd_return_t SDMMD_AMDServiceConnectionInvalidate(SDMMD_AMConnectionRef connec
 
 sdmmd_return_t SDMMD_AMDeviceSecureStartSessionedService(SDMMD_AMDeviceRef device, CFStringRef service, SDMMD_AMConnectionRef *connection);
 
+bool SDMMD_AMDServiceConnectionIsValid(SDMMD_AMConnectionRef connection);
+
+// Hands out an idle pooled connection to the service if there is a healthy one, otherwise starts the service (this needs an active session)
+sdmmd_return_t SDMMD_AMDeviceCheckoutServiceConnection(SDMMD_AMDeviceRef device, CFStringRef service, CFDictionaryRef options, SDMMD_AMConnectionRef *connection);
+// Returns a connection from SDMMD_AMDeviceCheckoutServiceConnection, it is kept warm if the service can be pooled and it is still healthy, otherwise it is closed
+void SDMMD_AMDeviceCheckinServiceConnection(SDMMD_AMConnectionRef connection);
+// Closes every idle connection pooled for the device, pass NULL to drain the pool for all devices
+void SDMMD_AMDeviceDrainServiceConnectionPool(SDMMD_AMDeviceRef device);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,309 @@
+/*
+ *  SDMMD_Fleet.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef _SDM_MD_FLEET_C_
+#define _SDM_MD_FLEET_C_
+
+#include "SDMMD_Fleet.h"
+#include "SDMMD_Functions.h"
+#include "SDMMD_Applications.h"
+#include <unistd.h>
+
+struct sdmmd_FleetDeviceContext {
+	SDMMD_FleetRef fleet;
+	SDMMD_AMDeviceRef device;
+};
+
+static CFNumberRef SDMMD_FleetCreateNumber(int32_t value) {
+	return CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+}
+
+static bool SDMMD_FleetCopyOption(CFDictionaryRef options, CFStringRef key, uint32_t *value) {
+	bool found = false;
+	if (options) {
+		CFNumberRef number = CFDictionaryGetValue(options, key);
+		if (number && CFGetTypeID(number) == CFNumberGetTypeID()) {
+			found = CFNumberGetValue(number, kCFNumberSInt32Type, value);
+		}
+	}
+	return found;
+}
+
+// USB location ids hold the bus number in the top byte followed by one nibble per port along the hub chain, so clearing the last port gives the hub the device hangs off.
+static uint32_t SDMMD_FleetHubForDevice(SDMMD_AMDeviceRef device) {
+	uint32_t hub = 0x0;
+	if (SDMMD_AMDeviceGetInterfaceType(device) == kAMDInterfaceConnectionTypeDirect) {
+		uint32_t location = SDMMD_AMDeviceUSBLocationID(device);
+		for (uint32_t shift = 0x0; shift < 0x18; shift += 0x4) {
+			if (location & (0xf << shift)) {
+				hub = location & ~(0xf << shift);
+				break;
+			}
+		}
+	}
+	return hub;
+}
+
+static void SDMMD_FleetReleaseHubSemaphore(const void *key, const void *value, void *context) {
+	dispatch_release((dispatch_semaphore_t)value);
+}
+
+static void SDMMD_FleetPost(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, uint32_t percent, CFStringRef status, CFTypeRef response, CFMutableDictionaryRef results, sdmmd_return_t result) {
+	CFMutableDictionaryRef dict = SDMMD_create_dict();
+	if (device->ivars.unique_device_id) {
+		CFDictionarySetValue(dict, CFSTR(kSDMMD_FleetKeyDeviceIdentifier), device->ivars.unique_device_id);
+	}
+	CFDictionarySetValue(dict, CFSTR(kSDMMD_FleetKeyStatus), status);
+	CFNumberRef percentNumber = SDMMD_FleetCreateNumber(percent);
+	CFDictionarySetValue(dict, CFSTR(kSDMMD_FleetKeyPercentComplete), percentNumber);
+	CFRelease(percentNumber);
+	if (response) {
+		CFDictionarySetValue(dict, CFSTR(kSDMMD_FleetKeyResponse), response);
+	}
+	CFNumberRef resultNumber = NULL;
+	if (results) {
+		resultNumber = SDMMD_FleetCreateNumber(result);
+		CFDictionarySetValue(dict, CFSTR(kSDMMD_FleetKeyResult), resultNumber);
+	}
+	// all callbacks and result bookkeeping happen on one serial queue so callers never see concurrent invocations
+	dispatch_async(fleet->callbackQueue, ^{
+		if (results && resultNumber && device->ivars.unique_device_id) {
+			CFDictionarySetValue(results, device->ivars.unique_device_id, resultNumber);
+		}
+		if (fleet->callback) {
+			(*fleet->callback)(dict, fleet->callbackArg);
+		}
+		if (resultNumber) {
+			CFRelease(resultNumber);
+		}
+		CFRelease(dict);
+	});
+}
+
+SDMMD_FleetRef SDMMD_FleetCreate(CFDictionaryRef options, void* callback, void* arg) {
+	SDMMD_FleetRef fleet = (SDMMD_FleetRef)calloc(0x1, sizeof(struct sdmmd_FleetClass));
+	if (fleet) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		fleet->maxConcurrentDevices = (cpus > 0 ? (uint32_t)cpus : 0x1);
+		fleet->maxConcurrentPerHub = 0x0;
+		fleet->startSession = true;
+		SDMMD_FleetCopyOption(options, CFSTR(kSDMMD_FleetOptionMaxConcurrentDevices), &fleet->maxConcurrentDevices);
+		SDMMD_FleetCopyOption(options, CFSTR(kSDMMD_FleetOptionMaxConcurrentPerHub), &fleet->maxConcurrentPerHub);
+		if (fleet->maxConcurrentDevices == 0x0) {
+			fleet->maxConcurrentDevices = 0x1;
+		}
+		if (options) {
+			CFBooleanRef startSession = CFDictionaryGetValue(options, CFSTR(kSDMMD_FleetOptionStartSession));
+			if (startSession && CFGetTypeID(startSession) == CFBooleanGetTypeID()) {
+				fleet->startSession = CFBooleanGetValue(startSession);
+			}
+		}
+		fleet->callback = callback;
+		fleet->callbackArg = arg;
+		fleet->callbackQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.fleetCallbackQueue", NULL);
+	}
+	return fleet;
+}
+
+void SDMMD_FleetRelease(SDMMD_FleetRef fleet) {
+	if (fleet) {
+		dispatch_sync(fleet->callbackQueue, ^{});
+		dispatch_release(fleet->callbackQueue);
+		free(fleet);
+	}
+}
+
+void SDMMD_FleetCancel(SDMMD_FleetRef fleet) {
+	if (fleet) {
+		__sync_lock_test_and_set(&fleet->cancelled, 0x1);
+	}
+}
+
+bool SDMMD_FleetIsCancelled(SDMMD_FleetRef fleet) {
+	return (fleet ? __sync_fetch_and_add(&fleet->cancelled, 0x0) != 0x0 : false);
+}
+
+void SDMMD_FleetReportProgress(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, uint32_t percent, CFStringRef status, CFTypeRef response) {
+	if (fleet && device && status) {
+		SDMMD_FleetPost(fleet, device, percent, status, response, NULL, kAMDSuccess);
+	}
+}
+
+static sdmmd_return_t SDMMD_FleetRunOnDevice(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, SDMMD_FleetOperation operation, void* context) {
+	sdmmd_return_t result = kAMDSuccess;
+	if (fleet->startSession) {
+		result = SDMMD_AMDeviceConnect(device);
+		if (SDM_MD_CallSuccessful(result)) {
+			result = kAMDMissingPairRecordError;
+			if (SDMMD_AMDeviceIsPaired(device)) {
+				result = SDMMD_AMDeviceValidatePairing(device);
+				if (SDM_MD_CallSuccessful(result)) {
+					result = SDMMD_AMDeviceStartSession(device);
+					if (SDM_MD_CallSuccessful(result)) {
+						result = (*operation)(fleet, device, context);
+						SDMMD_AMDeviceStopSession(device);
+					}
+				}
+			}
+			SDMMD_AMDeviceDisconnect(device);
+		}
+	} else {
+		result = (*operation)(fleet, device, context);
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD_FleetRunOperation(SDMMD_FleetRef fleet, CFArrayRef devices, SDMMD_FleetOperation operation, void* context, CFDictionaryRef *results) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (fleet && devices && operation) {
+		result = kAMDSuccess;
+		CFMutableDictionaryRef deviceResults = SDMMD_create_dict();
+		CFMutableArrayRef pending = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0x0, devices);
+		CFMutableDictionaryRef hubSlots = CFDictionaryCreateMutable(kCFAllocatorDefault, 0x0, NULL, NULL);
+		dispatch_semaphore_t hostSlots = dispatch_semaphore_create(fleet->maxConcurrentDevices);
+		dispatch_semaphore_t finished = dispatch_semaphore_create(0x0);
+		dispatch_group_t group = dispatch_group_create();
+
+		// scheduling happens on the calling thread so waiting devices never tie up worker threads
+		while (CFArrayGetCount(pending) && !SDMMD_FleetIsCancelled(fleet)) {
+			dispatch_semaphore_wait(hostSlots, DISPATCH_TIME_FOREVER);
+			CFIndex next = kCFNotFound;
+			dispatch_semaphore_t hubSlot = NULL;
+			for (CFIndex index = 0x0; index < CFArrayGetCount(pending); index++) {
+				SDMMD_AMDeviceRef device = (SDMMD_AMDeviceRef)CFArrayGetValueAtIndex(pending, index);
+				uint32_t hub = SDMMD_FleetHubForDevice(device);
+				if (fleet->maxConcurrentPerHub == 0x0 || hub == 0x0) {
+					next = index;
+					break;
+				}
+				dispatch_semaphore_t slot = (dispatch_semaphore_t)CFDictionaryGetValue(hubSlots, (const void *)(uintptr_t)hub);
+				if (slot == NULL) {
+					slot = dispatch_semaphore_create(fleet->maxConcurrentPerHub);
+					CFDictionarySetValue(hubSlots, (const void *)(uintptr_t)hub, slot);
+				}
+				if (dispatch_semaphore_wait(slot, DISPATCH_TIME_NOW) == 0x0) {
+					next = index;
+					hubSlot = slot;
+					break;
+				}
+			}
+			if (next == kCFNotFound) {
+				// every remaining device sits behind a saturated hub, hand the slot back until something finishes
+				dispatch_semaphore_signal(hostSlots);
+				dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+				continue;
+			}
+			SDMMD_AMDeviceRef device = (SDMMD_AMDeviceRef)CFArrayGetValueAtIndex(pending, next);
+			CFRetain(device);
+			CFArrayRemoveValueAtIndex(pending, next);
+			dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), ^{
+				sdmmd_return_t deviceResult = kAMDUndefinedError;
+				if (SDMMD_FleetIsCancelled(fleet)) {
+					SDMMD_FleetPost(fleet, device, 0x0, CFSTR(kSDMMD_FleetStatusCancelled), NULL, deviceResults, deviceResult);
+				} else {
+					SDMMD_FleetPost(fleet, device, 0x0, CFSTR(kSDMMD_FleetStatusStarted), NULL, NULL, kAMDSuccess);
+					deviceResult = SDMMD_FleetRunOnDevice(fleet, device, operation, context);
+					CFStringRef status = (SDM_MD_CallSuccessful(deviceResult) ? CFSTR(kSDMMD_FleetStatusComplete) : CFSTR(kSDMMD_FleetStatusFailed));
+					SDMMD_FleetPost(fleet, device, 0x64, status, NULL, deviceResults, deviceResult);
+				}
+				CFRelease(device);
+				if (hubSlot) {
+					dispatch_semaphore_signal(hubSlot);
+				}
+				dispatch_semaphore_signal(hostSlots);
+				dispatch_semaphore_signal(finished);
+			});
+		}
+
+		dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+		for (CFIndex index = 0x0; index < CFArrayGetCount(pending); index++) {
+			SDMMD_AMDeviceRef device = (SDMMD_AMDeviceRef)CFArrayGetValueAtIndex(pending, index);
+			SDMMD_FleetPost(fleet, device, 0x0, CFSTR(kSDMMD_FleetStatusCancelled), NULL, deviceResults, kAMDUndefinedError);
+		}
+		// flush the callback queue so every result has been delivered before returning
+		dispatch_sync(fleet->callbackQueue, ^{});
+		// cleared only once the run is over, so a cancel issued before the run started still applies to it
+		__sync_lock_release(&fleet->cancelled);
+
+		CFDictionaryApplyFunction(hubSlots, SDMMD_FleetReleaseHubSemaphore, NULL);
+		CFRelease(hubSlots);
+		CFRelease(pending);
+		dispatch_release(group);
+		dispatch_release(finished);
+		dispatch_release(hostSlots);
+
+		if (results) {
+			*results = deviceResults;
+		} else {
+			CFRelease(deviceResults);
+		}
+	}
+	return result;
+}
+
+#pragma mark -
+#pragma mark Stock Operations
+#pragma mark -
+
+sdmmd_return_t SDMMD_FleetOperationLookupApplications(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context) {
+	CFDictionaryRef response = NULL;
+	sdmmd_return_t result = SDMMD_AMDeviceLookupApplications(device, (CFDictionaryRef)context, &response);
+	if (SDM_MD_CallSuccessful(result) && response) {
+		SDMMD_FleetReportProgress(fleet, device, 0x64, CFSTR("LookupComplete"), response);
+		CFRelease(response);
+	}
+	return result;
+}
+
+static void SDMMD_FleetInstallCallback(CFDictionaryRef dict, void* arg) {
+	struct sdmmd_FleetDeviceContext *deviceContext = (struct sdmmd_FleetDeviceContext *)arg;
+	if (dict) {
+		uint32_t percent = 0x0;
+		CFNumberRef percentNumber = CFDictionaryGetValue(dict, CFSTR("PercentComplete"));
+		if (percentNumber) {
+			CFNumberGetValue(percentNumber, kCFNumberSInt32Type, &percent);
+		}
+		CFStringRef status = CFDictionaryGetValue(dict, CFSTR("Status"));
+		if (status) {
+			SDMMD_FleetReportProgress(deviceContext->fleet, deviceContext->device, percent, status, NULL);
+		}
+	}
+}
+
+sdmmd_return_t SDMMD_FleetOperationInstallApplication(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context) {
+	struct sdmmd_FleetDeviceContext deviceContext = { fleet, device };
+	CFStringRef keys[] = { CFSTR("PackageType") };
+	CFStringRef values[] = { CFSTR("Developer") };
+	CFDictionaryRef options = CFDictionaryCreate(kCFAllocatorDefault, (const void **)&keys, (const void **)&values, 0x1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	sdmmd_return_t result = SDMMD_AMDeviceInstallApplication(device, (CFStringRef)context, options, SDMMD_FleetInstallCallback, &deviceContext);
+	CFRelease(options);
+	return result;
+}
+
+sdmmd_return_t SDMMD_FleetOperationCopyValue(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context) {
+	sdmmd_return_t result = kAMDNotFoundError;
+	CFTypeRef value = SDMMD_AMDeviceCopyValue(device, NULL, (CFStringRef)context);
+	if (value) {
+		result = kAMDSuccess;
+		SDMMD_FleetReportProgress(fleet, device, 0x64, CFSTR("ValueCopied"), value);
+		CFRelease(value);
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *  SDMMD_Fleet.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef _SDM_MD_FLEET_H_
+#define _SDM_MD_FLEET_H_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include "SDMMD_Error.h"
+#include "SDMMD_AMDevice.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_FleetCreate()
+#define kSDMMD_FleetOptionMaxConcurrentDevices		"MaxConcurrentDevices"			// CFNumber, devices worked on at once by this host, defaults to the number of active cpus
+#define kSDMMD_FleetOptionMaxConcurrentPerHub		"MaxConcurrentDevicesPerHub"	// CFNumber, devices worked on at once behind a single USB hub, 0 for no limit (default)
+#define kSDMMD_FleetOptionStartSession				"StartSession"					// CFBoolean, connect, validate pairing, and start a session around each operation (default true)
+
+// Keys of the dictionaries passed to the fleet callback, "Status" and "PercentComplete" match the install and transfer callbacks
+#define kSDMMD_FleetKeyDeviceIdentifier				"DeviceIdentifier"
+#define kSDMMD_FleetKeyStatus						"Status"
+#define kSDMMD_FleetKeyPercentComplete				"PercentComplete"
+#define kSDMMD_FleetKeyResult						"Result"
+#define kSDMMD_FleetKeyResponse						"Response"
+
+// Values for "Status" that are posted by the executor itself
+#define kSDMMD_FleetStatusStarted					"Started"
+#define kSDMMD_FleetStatusComplete					"Complete"
+#define kSDMMD_FleetStatusFailed					"Failed"
+#define kSDMMD_FleetStatusCancelled					"Cancelled"
+
+struct sdmmd_FleetClass {
+	uint32_t maxConcurrentDevices;
+	uint32_t maxConcurrentPerHub;
+	bool startSession;
+	volatile int32_t cancelled;
+	dispatch_queue_t callbackQueue;
+	void (*callback)(CFDictionaryRef dict, void* arg);
+	void* callbackArg;
+} sdmmd_FleetClass;
+
+#define SDMMD_FleetRef struct sdmmd_FleetClass*
+
+// An operation is run once per device on a worker thread, any return code other than kAMDSuccess marks only that device as failed.
+typedef sdmmd_return_t (*SDMMD_FleetOperation)(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context);
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+SDMMD_FleetRef SDMMD_FleetCreate(CFDictionaryRef options, void* callback, void* arg);
+void SDMMD_FleetRelease(SDMMD_FleetRef fleet);
+
+// Runs the operation on every device in the array and blocks until all of them have finished or been cancelled, results is a dictionary of device identifier to result code
+sdmmd_return_t SDMMD_FleetRunOperation(SDMMD_FleetRef fleet, CFArrayRef devices, SDMMD_FleetOperation operation, void* context, CFDictionaryRef *results);
+
+// Safe to call from any thread, devices that have not started yet are reported as cancelled and running operations can poll SDMMD_FleetIsCancelled()
+// A cancel before SDMMD_FleetRunOperation() cancels the next run, the flag is cleared when a run returns
+void SDMMD_FleetCancel(SDMMD_FleetRef fleet);
+bool SDMMD_FleetIsCancelled(SDMMD_FleetRef fleet);
+
+// Called from inside an operation to stream progress for the device it is working on, response is optional
+void SDMMD_FleetReportProgress(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, uint32_t percent, CFStringRef status, CFTypeRef response);
+
+// Stock operations, these expect to be run with kSDMMD_FleetOptionStartSession enabled
+sdmmd_return_t SDMMD_FleetOperationLookupApplications(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context); // context is the lookup options dictionary
+sdmmd_return_t SDMMD_FleetOperationInstallApplication(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context); // context is the CFStringRef path of the package to install
+sdmmd_return_t SDMMD_FleetOperationCopyValue(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context); // context is the CFStringRef key to query
+
+#endif
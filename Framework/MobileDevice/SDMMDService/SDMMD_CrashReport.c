@@ -0,0 +1,398 @@
+/*
+ *  SDMMD_CrashReport.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_CRASHREPORT_C_
+#define _SDM_MD_CRASHREPORT_C_
+
+#include "SDMMD_CrashReport.h"
+#include "SDMMD_AFCIterator.h"
+#include "SDMMD_AFCTransfer.h"
+#include "SDMMD_Functions.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <openssl/sha.h>
+
+struct sdmmd_CrashReportHarvest {
+	SDMMD_AFCConnectionRef conn;
+	char *localRoot;
+	bool deleteAfterCopy;
+	CFDictionaryRef previous;			// manifest of the last harvest, may be NULL
+	CFMutableDictionaryRef manifest;	// rebuilt from what is on the device now, so removed reports drop out of it, except under directories that could not be listed
+	CFMutableArrayRef harvested;
+	sdmmd_return_t result;
+};
+
+static bool SDMMD_CrashReportGetBoolOption(CFDictionaryRef options, CFStringRef key, bool defaultValue) {
+	CFBooleanRef value = (options ? CFDictionaryGetValue(options, key) : NULL);
+	return (value && CFGetTypeID(value) == CFBooleanGetTypeID() ? CFBooleanGetValue(value) : defaultValue);
+}
+
+#pragma mark -
+#pragma mark Mover
+#pragma mark -
+
+// crashreportmover sends "ping" once it has moved everything, a short read or a closed connection means it did not finish
+static sdmmd_return_t SDMMD_CrashReportReceivePing(SDMMD_AMConnectionRef mover) {
+	SocketConnection socket = SDMMD_TranslateConnectionToSocket(mover);
+	char ping[sizeof(kSDMMD_CrashReportMoverPing)-0x1];
+	size_t length = 0x0;
+	while (length < sizeof(ping)) {
+		ssize_t received;
+		if (socket.isSSL) {
+			received = SSL_read(socket.socket.ssl, &ping[length], (int)(sizeof(ping)-length));
+		} else {
+			received = recv(socket.socket.conn, &ping[length], sizeof(ping)-length, 0x0);
+		}
+		if (received <= 0x0) {
+			return kAMDReceiveMessageError;
+		}
+		length += (size_t)received;
+	}
+	return (memcmp(ping, kSDMMD_CrashReportMoverPing, sizeof(ping)) == 0x0 ? kAMDSuccess : kAMDInvalidResponseError);
+}
+
+sdmmd_return_t SDMMD_CrashReportRunMover(SDMMD_AMDeviceRef device) {
+	if (device == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_AMConnectionRef mover = NULL;
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_CRASH_REPORT_COPY_MV), NULL, &mover);
+	if (result == kAMDSuccess) {
+		result = SDMMD_CrashReportReceivePing(mover);
+		if (result != kAMDSuccess) {
+			printf("SDMMD_CrashReportRunMover: No ping from crashreportmover: 0x%x\n", result);
+		}
+		SDMMD_AMDServiceConnectionInvalidate(mover);
+		free(mover);
+	} else {
+		printf("SDMMD_CrashReportRunMover: Was unable to start crashreportmover on the device: 0x%x\n", result);
+	}
+	return result;
+}
+
+#pragma mark -
+#pragma mark Manifest
+#pragma mark -
+
+static char* SDMMD_CrashReportCopyManifestPath(CFStringRef udid) {
+	const char *home = getenv("HOME");
+	if (home == NULL || udid == NULL) {
+		return NULL;
+	}
+	char *device = SDMCFStringGetString(udid);
+	char *path = calloc(1, PATH_MAX);
+	snprintf(path, PATH_MAX, "%s/%s/", home, kSDMMD_CrashReportManifestDirectory);
+	// create each missing component of the directory
+	for (char *separator = strchr(path+0x1, '/'); separator; separator = strchr(separator+0x1, '/')) {
+		*separator = '\0';
+		mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		*separator = '/';
+	}
+	strlcat(path, device, PATH_MAX);
+	strlcat(path, ".plist", PATH_MAX);
+	free(device);
+	return path;
+}
+
+static CFDictionaryRef SDMMD_CrashReportCreateManifestEntry(uint64_t size, uint64_t modTime) {
+	CFNumberRef sizeNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &size);
+	CFNumberRef modTimeNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &modTime);
+	const void *keys[0x2] = {CFSTR(kSDMMD_CrashReportManifestKeySize), CFSTR(kSDMMD_CrashReportManifestKeyModTime)};
+	const void *values[0x2] = {sizeNumber, modTimeNumber};
+	CFDictionaryRef entry = CFDictionaryCreate(kCFAllocatorDefault, keys, values, 0x2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	CFRelease(modTimeNumber);
+	CFRelease(sizeNumber);
+	return entry;
+}
+
+#pragma mark -
+#pragma mark Copying
+#pragma mark -
+
+// Creates every missing directory above path
+static void SDMMD_CrashReportCreateParents(char *path) {
+	for (char *separator = strchr(path+0x1, '/'); separator; separator = strchr(separator+0x1, '/')) {
+		*separator = '\0';
+		mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		*separator = '/';
+	}
+}
+
+// The device answers GetFileHash with a SHA-1 or, on newer versions, a SHA-256 digest. Devices that do not support it are only checked by size.
+static sdmmd_return_t SDMMD_CrashReportVerify(SDMMD_AFCConnectionRef conn, CFStringRef remote, const char *localPath, uint64_t size) {
+	struct stat localStat;
+	if (stat(localPath, &localStat) != 0x0 || (uint64_t)localStat.st_size != size) {
+		return kAMDDigestFailedError;
+	}
+	CFDataRef remoteHash = NULL;
+	if (SDMMD_AFCConnectionCopyFileHash(conn, remote, &remoteHash) != kAMDSuccess || remoteHash == NULL) {
+		return kAMDSuccess;
+	}
+	sdmmd_return_t result = kAMDDigestFailedError;
+	CFIndex digestLength = CFDataGetLength(remoteHash);
+	int fd = open(localPath, O_RDONLY);
+	if (fd != -1 && (digestLength == SHA_DIGEST_LENGTH || digestLength == SHA256_DIGEST_LENGTH)) {
+		SHA_CTX sha1;
+		SHA256_CTX sha256;
+		if (digestLength == SHA_DIGEST_LENGTH) {
+			SHA1_Init(&sha1);
+		} else {
+			SHA256_Init(&sha256);
+		}
+		unsigned char buffer[0x4000];
+		ssize_t readLength;
+		while ((readLength = read(fd, buffer, sizeof(buffer))) > 0x0) {
+			if (digestLength == SHA_DIGEST_LENGTH) {
+				SHA1_Update(&sha1, buffer, (size_t)readLength);
+			} else {
+				SHA256_Update(&sha256, buffer, (size_t)readLength);
+			}
+		}
+		unsigned char digest[SHA256_DIGEST_LENGTH];
+		if (digestLength == SHA_DIGEST_LENGTH) {
+			SHA1_Final(digest, &sha1);
+		} else {
+			SHA256_Final(digest, &sha256);
+		}
+		if (readLength == 0x0 && memcmp(digest, CFDataGetBytePtr(remoteHash), digestLength) == 0x0) {
+			result = kAMDSuccess;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	CFRelease(remoteHash);
+	return result;
+}
+
+static sdmmd_return_t SDMMD_CrashReportCopy(struct sdmmd_CrashReportHarvest *harvest, CFStringRef remote, const char *relativePath, uint64_t size, uint64_t modTime) {
+	char *localPath = calloc(1, PATH_MAX);
+	char *partialPath = calloc(1, PATH_MAX);
+	snprintf(localPath, PATH_MAX, "%s/%s", harvest->localRoot, relativePath);
+	snprintf(partialPath, PATH_MAX, "%s%s", localPath, kSDMMD_CrashReportPartialExtension);
+	SDMMD_CrashReportCreateParents(partialPath);
+	CFStringRef partial = CFStringCreateWithCString(kCFAllocatorDefault, partialPath, kCFStringEncodingUTF8);
+	sdmmd_return_t result = SDMMD_AFCDownloadFile(harvest->conn, remote, partial);
+	CFRelease(partial);
+	if (result == kAMDSuccess) {
+		result = SDMMD_CrashReportVerify(harvest->conn, remote, partialPath, size);
+	}
+	if (result == kAMDSuccess) {
+		struct timeval times[0x2];
+		times[0x0].tv_sec = times[0x1].tv_sec = (time_t)(modTime / 1000000000ull);
+		times[0x0].tv_usec = times[0x1].tv_usec = (suseconds_t)((modTime % 1000000000ull) / 1000ull);
+		utimes(partialPath, times);
+		if (rename(partialPath, localPath) != 0x0) {
+			result = kAMDUndefinedError;
+		}
+	}
+	if (result != kAMDSuccess) {
+		printf("SDMMD_CrashReportCopy: Could not copy %s: 0x%x\n", relativePath, result);
+		unlink(partialPath);
+	}
+	free(partialPath);
+	free(localPath);
+	return result;
+}
+
+static void SDMMD_CrashReportHarvestFile(struct sdmmd_CrashReportHarvest *harvest, CFStringRef remote, CFDictionaryRef info) {
+	uint64_t size = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeySize));
+	uint64_t modTime = SDMMD_AFCFileInfoGetNumber(info, CFSTR(kSDMMD_AFCFileInfoKeyModTime));
+	CFDictionaryRef entry = SDMMD_CrashReportCreateManifestEntry(size, modTime);
+	CFDictionaryRef previous = (harvest->previous ? CFDictionaryGetValue(harvest->previous, remote) : NULL);
+	bool copied = (previous && CFEqual(previous, entry));
+	if (!copied) {
+		char *relativePath = SDMCFStringGetString(remote);
+		sdmmd_return_t result = SDMMD_CrashReportCopy(harvest, remote, relativePath, size, modTime);
+		free(relativePath);
+		if (result == kAMDSuccess) {
+			CFArrayAppendValue(harvest->harvested, remote);
+			copied = true;
+		} else if (harvest->result == kAMDSuccess) {
+			harvest->result = result;
+		}
+	}
+	// reports whose delete failed last time are still in the manifest as copied, so they are removed now
+	if (copied && harvest->deleteAfterCopy) {
+		SDMMD_AFCOperationRef remove = SDMMD_AFCOperationCreateRemovePath(remote);
+		if (SDMMD_AFCConnectionPerformOperation(harvest->conn, remove) != kAMDSuccess) {
+			CFDictionarySetValue(harvest->manifest, remote, entry);
+		}
+		SDMMD_AFCOperationRelease(remove);
+	} else if (copied) {
+		CFDictionarySetValue(harvest->manifest, remote, entry);
+	}
+	CFRelease(entry);
+}
+
+static void SDMMD_CrashReportCarryEntry(const void *key, const void *value, void *context) {
+	struct sdmmd_CrashReportHarvest *harvest = ((void **)context)[0x0];
+	CFStringRef prefix = ((void **)context)[0x1];
+	if (CFStringGetLength(prefix) == 0x0 || CFStringHasPrefix(key, prefix)) {
+		// only adds, whatever the listing did get to is already in the manifest
+		CFDictionaryAddValue(harvest->manifest, key, value);
+	}
+}
+
+// A directory that could not be listed still holds the reports copied from it before, keeping their entries stops the next harvest
+// from copying them all over again
+static void SDMMD_CrashReportCarryForward(struct sdmmd_CrashReportHarvest *harvest, CFStringRef directory) {
+	if (harvest->previous) {
+		CFStringRef prefix = (CFStringGetLength(directory) ? CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@/"), directory) : CFRetain(directory));
+		void *context[0x2] = {harvest, (void *)prefix};
+		CFDictionaryApplyFunction(harvest->previous, SDMMD_CrashReportCarryEntry, context);
+		CFRelease(prefix);
+	}
+}
+
+// Walks the tree breadth first. File info comes with the listing, prefetched a batch ahead, so when nothing is new the whole harvest is a
+// handful of pipelined round trips per directory and no file is opened.
+static void SDMMD_CrashReportHarvestTree(struct sdmmd_CrashReportHarvest *harvest) {
+	CFMutableArrayRef directories = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+	CFArrayAppendValue(directories, CFSTR(""));
+	CFMutableDictionaryRef options = SDMMD_create_dict();
+	CFDictionarySetValue(options, CFSTR(kSDMMD_AFCIteratorOptionPrefetchFileInfo), kCFBooleanTrue);
+	while (CFArrayGetCount(directories)) {
+		CFStringRef directory = CFRetain(CFArrayGetValueAtIndex(directories, 0x0));
+		CFArrayRemoveValueAtIndex(directories, 0x0);
+		SDMMD_AFCIteratorRef iterator = NULL;
+		sdmmd_return_t result = SDMMD_AFCIteratorCreate(harvest->conn, (CFStringGetLength(directory) ? directory : CFSTR("/")), options, &iterator);
+		while (result == kAMDSuccess) {
+			CFArrayRef names = NULL, infos = NULL;
+			result = SDMMD_AFCIteratorCopyNextBatch(iterator, &names, &infos);
+			if (result != kAMDSuccess) {
+				break;
+			}
+			for (CFIndex index = 0x0; index < CFArrayGetCount(names); index++) {
+				CFDictionaryRef info = (infos ? CFArrayGetValueAtIndex(infos, index) : NULL);
+				if (info == NULL || CFGetTypeID(info) != CFDictionaryGetTypeID()) {
+					continue;
+				}
+				CFStringRef remote = (CFStringGetLength(directory) ? CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@/%@"), directory, CFArrayGetValueAtIndex(names, index)) : CFRetain(CFArrayGetValueAtIndex(names, index)));
+				CFStringRef type = CFDictionaryGetValue(info, CFSTR(kSDMMD_AFCFileInfoKeyType));
+				if (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeDirectory))) {
+					CFArrayAppendValue(directories, remote);
+				} else if (type && CFEqual(type, CFSTR(kSDMMD_AFCFileTypeRegular))) {
+					SDMMD_CrashReportHarvestFile(harvest, remote, info);
+				}
+				CFRelease(remote);
+			}
+			CFRelease(names);
+			if (infos) {
+				CFRelease(infos);
+			}
+		}
+		if (iterator) {
+			SDMMD_AFCIteratorRelease(iterator);
+		}
+		if (result != kAMDEOFError) {
+			SDMMD_CrashReportCarryForward(harvest, directory);
+			if (harvest->result == kAMDSuccess) {
+				char *path = SDMCFStringGetString(directory);
+				printf("SDMMD_CrashReportHarvestTree: Could not list %s: 0x%x\n", path, result);
+				free(path);
+				harvest->result = result;
+			}
+		}
+		CFRelease(directory);
+	}
+	CFRelease(options);
+	CFRelease(directories);
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+sdmmd_return_t SDMMD_CrashReportHarvest(SDMMD_AMDeviceRef device, CFStringRef localPath, CFDictionaryRef options, CFArrayRef *harvested) {
+	if (device == NULL || localPath == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (SDMMD_CrashReportGetBoolOption(options, CFSTR(kSDMMD_CrashReportOptionRunMover), true)) {
+		// without the mover only reports that were moved earlier are found, which is still worth harvesting
+		SDMMD_CrashReportRunMover(device);
+	}
+	SDMMD_AMConnectionRef service = NULL;
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_CRASH_REPORT_COPY_MOB), NULL, &service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_CrashReportHarvest: Was unable to start crashreportcopymobile on the device: 0x%x\n", result);
+		return result;
+	}
+
+	struct sdmmd_CrashReportHarvest harvest = {0};
+	harvest.conn = SDMMD_AFCConnectionCreate(service);
+	harvest.localRoot = SDMCFStringGetString(localPath);
+	harvest.deleteAfterCopy = SDMMD_CrashReportGetBoolOption(options, CFSTR(kSDMMD_CrashReportOptionDeleteAfterCopy), false);
+	harvest.manifest = SDMMD_create_dict();
+	harvest.harvested = CFArrayCreateMutable(kCFAllocatorDefault, 0x0, &kCFTypeArrayCallBacks);
+	harvest.result = kAMDSuccess;
+
+	CFStringRef manifestOption = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_CrashReportOptionManifestPath)) : NULL);
+	char *manifestPath = (manifestOption ? SDMCFStringGetString(manifestOption) : SDMMD_CrashReportCopyManifestPath(device->ivars.unique_device_id));
+	if (manifestPath && !SDMMD_CrashReportGetBoolOption(options, CFSTR(kSDMMD_CrashReportOptionIgnoreManifest), false) && access(manifestPath, R_OK) == 0x0) {
+		harvest.previous = SDMMD__CreateDictFromFileContents(manifestPath);
+	}
+	mkdir(harvest.localRoot, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+
+	SDMMD_CrashReportHarvestTree(&harvest);
+	result = harvest.result;
+
+	// reports that were copied are kept even after a failure, so they are not fetched again
+	if (manifestPath) {
+		SDMMD_store_dict(harvest.manifest, manifestPath, true);
+	}
+	if (harvested) {
+		*harvested = CFArrayCreateCopy(kCFAllocatorDefault, harvest.harvested);
+	}
+
+	SDMMD_AFCConnectionRelease(harvest.conn);
+	SDMMD_AMDServiceConnectionInvalidate(service);
+	free(service);
+	if (harvest.previous) {
+		CFRelease(harvest.previous);
+	}
+	CFRelease(harvest.manifest);
+	CFRelease(harvest.harvested);
+	free(harvest.localRoot);
+	free(manifestPath);
+	return result;
+}
+
+sdmmd_return_t SDMMD_FleetOperationHarvestCrashReports(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context) {
+	CFDictionaryRef options = (CFDictionaryRef)context;
+	CFStringRef destination = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_CrashReportOptionDestination)) : NULL);
+	if (destination == NULL || device->ivars.unique_device_id == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	CFStringRef localPath = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@/%@"), destination, device->ivars.unique_device_id);
+	char *root = SDMCFStringGetString(destination);
+	mkdir(root, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	free(root);
+	CFArrayRef harvested = NULL;
+	sdmmd_return_t result = SDMMD_CrashReportHarvest(device, localPath, options, &harvested);
+	if (harvested) {
+		SDMMD_FleetReportProgress(fleet, device, 0x64, CFSTR(kSDMMD_CrashReportStatusHarvested), harvested);
+		CFRelease(harvested);
+	}
+	CFRelease(localPath);
+	return result;
+}
+
+#endif
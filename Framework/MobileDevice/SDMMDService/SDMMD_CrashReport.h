@@ -0,0 +1,70 @@
+/*
+ *  SDMMD_CrashReport.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_CRASHREPORT_H_
+#define _SDM_MD_CRASHREPORT_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+#include "SDMMD_AFC.h"
+#include "SDMMD_Fleet.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_CrashReportHarvest() and SDMMD_FleetOperationHarvestCrashReports()
+#define kSDMMD_CrashReportOptionDestination			"Destination"		// CFString, fleet operation only, each device's reports go to a directory named by its udid under this one
+#define kSDMMD_CrashReportOptionRunMover			"RunMover"			// CFBoolean, have crashreportmover move new reports into place first (default true)
+#define kSDMMD_CrashReportOptionDeleteAfterCopy		"DeleteAfterCopy"	// CFBoolean, remove each report from the device once its local copy is verified (default false)
+#define kSDMMD_CrashReportOptionManifestPath		"ManifestPath"		// CFString, where the harvest manifest is kept, defaults to a file under kSDMMD_CrashReportManifestDirectory
+#define kSDMMD_CrashReportOptionIgnoreManifest		"IgnoreManifest"	// CFBoolean, copy every report again (default false)
+
+// crashreportmover answers with these four bytes once it has moved everything
+#define kSDMMD_CrashReportMoverPing					"ping"
+
+// Harvest manifests, relative to the home directory there is one per device. Every report seen on the device is recorded by its path with
+// its size and mtime, a report is only copied while it is missing from the manifest or either of those differ.
+#define kSDMMD_CrashReportManifestDirectory			"Library/Caches/com.samdmarshall.sdmmobiledevice/CrashReports"
+#define kSDMMD_CrashReportManifestKeySize			"Size"
+#define kSDMMD_CrashReportManifestKeyModTime		"ModTime"
+
+// Reports are copied next to their final name with this extension and only renamed once verified
+#define kSDMMD_CrashReportPartialExtension			".sdmmdpart"
+
+// Status posted to the fleet callback by SDMMD_FleetOperationHarvestCrashReports(), the response is the array of copied report paths
+#define kSDMMD_CrashReportStatusHarvested			"CrashReportsHarvested"
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Starts crashreportmover and waits for its ping, which it sends once pending reports are readable through crashreportcopymobile
+sdmmd_return_t SDMMD_CrashReportRunMover(SDMMD_AMDeviceRef device);
+
+// Copies every crash report on the device that is not in the manifest yet into localPath, keeping the device's directory layout. Each copy is
+// checked against the device's size and, where the device supports GetFileHash, its digest before it is given its final name. Needs an active
+// session. harvested is optional and receives the device paths of the reports copied by this call.
+sdmmd_return_t SDMMD_CrashReportHarvest(SDMMD_AMDeviceRef device, CFStringRef localPath, CFDictionaryRef options, CFArrayRef *harvested);
+
+// Fleet operation around SDMMD_CrashReportHarvest(), context is the options dictionary and must contain kSDMMD_CrashReportOptionDestination.
+// Run it with kSDMMD_FleetOptionStartSession enabled to harvest many devices at once.
+sdmmd_return_t SDMMD_FleetOperationHarvestCrashReports(SDMMD_FleetRef fleet, SDMMD_AMDeviceRef device, void* context);
+
+#endif
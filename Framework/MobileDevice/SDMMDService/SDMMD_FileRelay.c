@@ -0,0 +1,468 @@
+/*
+ *  SDMMD_FileRelay.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_FILERELAY_C_
+#define _SDM_MD_FILERELAY_C_
+
+#include "SDMMD_FileRelay.h"
+#include "SDMMD_Functions.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <zlib.h>
+
+enum SDMMD_FileRelayArchiveState {
+	kSDMMD_FileRelayArchiveHeader = 0x0,
+	kSDMMD_FileRelayArchiveName = 0x1,
+	kSDMMD_FileRelayArchiveData = 0x2,
+	kSDMMD_FileRelayArchivePadding = 0x3,
+	kSDMMD_FileRelayArchiveDone = 0x4
+};
+
+struct sdmmd_FileRelayArchive {
+	char *root;
+	enum SDMMD_FileRelayArchiveState state;
+	enum SDMMD_FileRelayArchiveState afterPadding;
+	uint64_t padding;
+	bool newc;
+	char header[kSDMMD_FileRelayCpioHeaderSizeNewc];
+	uint32_t headerLength;
+	char name[PATH_MAX];
+	uint64_t nameSize;
+	uint64_t nameLength;
+	uint64_t mode;
+	uint64_t modTime;
+	uint64_t fileSize;
+	uint64_t remaining;
+	// where the data of the current entry goes, at most one of these is in use
+	int fd;
+	char link[PATH_MAX];
+	uint64_t linkLength;
+	char path[PATH_MAX];
+	bool skip;
+	sdmmd_return_t result;
+};
+
+struct sdmmd_FileRelayChunk {
+	unsigned char *data;
+	ssize_t length;		// 0 once the stream has ended, -1 if the read failed
+};
+
+struct sdmmd_FileRelayStream {
+	SocketConnection socket;
+	struct sdmmd_FileRelayChunk chunks[kSDMMD_FileRelayChunkCount];
+	dispatch_semaphore_t empty;
+	dispatch_semaphore_t filled;
+	volatile int32_t stopped;
+};
+
+#pragma mark -
+#pragma mark cpio
+#pragma mark -
+
+static uint64_t SDMMD_FileRelayParseNumber(const char *field, uint32_t length, uint32_t base) {
+	char number[0x10] = {0};
+	memcpy(number, field, (length < sizeof(number) ? length : sizeof(number) - 0x1));
+	return strtoull(number, NULL, base);
+}
+
+static bool SDMMD_FileRelayHasParentComponent(const char *path) {
+	for (const char *component = path; component; component = strchr(component, '/')) {
+		component += (*component == '/' ? 0x1 : 0x0);
+		if (strncmp(component, "..", 0x2) == 0x0 && (component[0x2] == '/' || component[0x2] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Archive paths start with "./" or "/", they are made relative to the destination and refused if any component is ".."
+static bool SDMMD_FileRelayCopyEntryPath(struct sdmmd_FileRelayArchive *archive) {
+	const char *name = archive->name;
+	while (*name == '/' || (name[0x0] == '.' && name[0x1] == '/')) {
+		name += (*name == '/' ? 0x1 : 0x2);
+	}
+	if (*name == '\0' || strcmp(name, ".") == 0x0 || SDMMD_FileRelayHasParentComponent(name)) {
+		return false;
+	}
+	return (snprintf(archive->path, PATH_MAX, "%s/%s", archive->root, name) < PATH_MAX);
+}
+
+// Creates the directories between the destination and the entry. A component that already exists has to be a real directory, an earlier
+// symlink entry must not be able to redirect later entries outside the destination.
+static bool SDMMD_FileRelayCreateParents(char *path, size_t rootLength) {
+	bool created = true;
+	for (char *separator = strchr(path+rootLength+0x1, '/'); separator && created; separator = strchr(separator+0x1, '/')) {
+		*separator = '\0';
+		struct stat componentStat;
+		if (lstat(path, &componentStat) == 0x0) {
+			created = S_ISDIR(componentStat.st_mode);
+		} else {
+			created = (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == 0x0);
+		}
+		*separator = '/';
+	}
+	return created;
+}
+
+static void SDMMD_FileRelayBeginEntry(struct sdmmd_FileRelayArchive *archive) {
+	archive->fd = -1;
+	archive->linkLength = 0x0;
+	archive->skip = !SDMMD_FileRelayCopyEntryPath(archive);
+	if (archive->skip) {
+		return;
+	}
+	if (!SDMMD_FileRelayCreateParents(archive->path, strlen(archive->root))) {
+		printf("SDMMD_FileRelayBeginEntry: Skipping %s, a parent is not a directory.\n", archive->name);
+		archive->skip = true;
+		return;
+	}
+	switch (archive->mode & S_IFMT) {
+		case S_IFDIR: {
+			mkdir(archive->path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+			break;
+		}
+		case S_IFREG: {
+			archive->fd = open(archive->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, (mode_t)(archive->mode & 0x1ff) | S_IRUSR | S_IWUSR);
+			if (archive->fd == -1 && errno == ELOOP) {
+				printf("SDMMD_FileRelayBeginEntry: Skipping %s, it would replace a symlink.\n", archive->name);
+				archive->skip = true;
+			} else if (archive->fd == -1) {
+				printf("SDMMD_FileRelayBeginEntry: Could not create %s.\n", archive->path);
+				archive->result = kAMDUndefinedError;
+			}
+			break;
+		}
+		case S_IFLNK: {
+			break;
+		}
+		default: {
+			// device nodes, fifos and sockets are not recreated
+			archive->skip = true;
+			break;
+		}
+	}
+}
+
+static void SDMMD_FileRelayEntryData(struct sdmmd_FileRelayArchive *archive, const unsigned char *data, uint64_t length) {
+	if (archive->skip) {
+		return;
+	}
+	if (archive->fd != -1) {
+		while (length) {
+			ssize_t written = write(archive->fd, data, length);
+			if (written <= 0x0) {
+				printf("SDMMD_FileRelayEntryData: Could not write %s.\n", archive->path);
+				archive->result = kAMDWriteError;
+				break;
+			}
+			data += written;
+			length -= (uint64_t)written;
+		}
+	} else if ((archive->mode & S_IFMT) == S_IFLNK) {
+		uint64_t room = sizeof(archive->link) - 0x1 - archive->linkLength;
+		uint64_t copied = (length < room ? length : room);
+		memcpy(archive->link + archive->linkLength, data, copied);
+		archive->linkLength += copied;
+	}
+}
+
+static void SDMMD_FileRelayEndEntry(struct sdmmd_FileRelayArchive *archive) {
+	if (archive->skip) {
+		return;
+	}
+	if ((archive->mode & S_IFMT) == S_IFLNK) {
+		archive->link[archive->linkLength] = '\0';
+		// only links that stay inside the destination are recreated
+		if (archive->link[0x0] == '/' || SDMMD_FileRelayHasParentComponent(archive->link)) {
+			printf("SDMMD_FileRelayEndEntry: Skipping %s, its target leaves the destination.\n", archive->name);
+			return;
+		}
+		unlink(archive->path);
+		symlink(archive->link, archive->path);
+		return;
+	}
+	if (archive->fd != -1) {
+		close(archive->fd);
+		archive->fd = -1;
+	}
+	struct timeval times[0x2];
+	times[0x0].tv_sec = times[0x1].tv_sec = (time_t)archive->modTime;
+	times[0x0].tv_usec = times[0x1].tv_usec = 0x0;
+	utimes(archive->path, times);
+}
+
+static void SDMMD_FileRelayParseHeader(struct sdmmd_FileRelayArchive *archive) {
+	const char *header = archive->header;
+	if (archive->newc) {
+		archive->mode = SDMMD_FileRelayParseNumber(&header[14], 0x8, 0x10);
+		archive->modTime = SDMMD_FileRelayParseNumber(&header[46], 0x8, 0x10);
+		archive->fileSize = SDMMD_FileRelayParseNumber(&header[54], 0x8, 0x10);
+		archive->nameSize = SDMMD_FileRelayParseNumber(&header[94], 0x8, 0x10);
+	} else {
+		archive->mode = SDMMD_FileRelayParseNumber(&header[18], 0x6, 0x8);
+		archive->modTime = SDMMD_FileRelayParseNumber(&header[48], 0xb, 0x8);
+		archive->nameSize = SDMMD_FileRelayParseNumber(&header[59], 0x6, 0x8);
+		archive->fileSize = SDMMD_FileRelayParseNumber(&header[65], 0xb, 0x8);
+	}
+}
+
+// SVR4 archives pad the header and name, and each file's data, to four bytes
+static void SDMMD_FileRelaySetPadding(struct sdmmd_FileRelayArchive *archive, uint64_t length, enum SDMMD_FileRelayArchiveState next) {
+	archive->padding = (archive->newc ? (0x4 - (length & 0x3)) & 0x3 : 0x0);
+	archive->afterPadding = next;
+	archive->state = (archive->padding ? kSDMMD_FileRelayArchivePadding : next);
+}
+
+// Takes the inflated archive in pieces of any size, only the header and name of the current entry are ever held
+static void SDMMD_FileRelayArchiveConsume(struct sdmmd_FileRelayArchive *archive, const unsigned char *data, uint64_t length) {
+	while (length && archive->result == kAMDSuccess && archive->state != kSDMMD_FileRelayArchiveDone) {
+		uint64_t used = 0x0;
+		switch (archive->state) {
+			case kSDMMD_FileRelayArchiveHeader: {
+				uint32_t headerSize = (archive->headerLength < 0x6 ? 0x6 : (archive->newc ? kSDMMD_FileRelayCpioHeaderSizeNewc : kSDMMD_FileRelayCpioHeaderSizeODC));
+				used = headerSize - archive->headerLength;
+				used = (used < length ? used : length);
+				memcpy(archive->header + archive->headerLength, data, used);
+				archive->headerLength += (uint32_t)used;
+				if (archive->headerLength == 0x6) {
+					if (memcmp(archive->header, kSDMMD_FileRelayCpioMagicODC, 0x6) == 0x0) {
+						archive->newc = false;
+					} else if (memcmp(archive->header, kSDMMD_FileRelayCpioMagicNewc, 0x6) == 0x0 || memcmp(archive->header, kSDMMD_FileRelayCpioMagicCRC, 0x6) == 0x0) {
+						archive->newc = true;
+					} else {
+						printf("SDMMD_FileRelayArchiveConsume: Unknown cpio header.\n");
+						archive->result = kAMDBadHeaderError;
+					}
+				} else if (archive->headerLength == headerSize) {
+					SDMMD_FileRelayParseHeader(archive);
+					if (archive->nameSize == 0x0 || archive->nameSize > sizeof(archive->name)) {
+						printf("SDMMD_FileRelayArchiveConsume: Bad name size in cpio header.\n");
+						archive->result = kAMDBadHeaderError;
+					}
+					archive->nameLength = 0x0;
+					archive->state = kSDMMD_FileRelayArchiveName;
+				}
+				break;
+			}
+			case kSDMMD_FileRelayArchiveName: {
+				used = archive->nameSize - archive->nameLength;
+				used = (used < length ? used : length);
+				memcpy(archive->name + archive->nameLength, data, used);
+				archive->nameLength += used;
+				if (archive->nameLength == archive->nameSize) {
+					archive->name[archive->nameSize - 0x1] = '\0';
+					if (strcmp(archive->name, kSDMMD_FileRelayCpioTrailer) == 0x0) {
+						archive->state = kSDMMD_FileRelayArchiveDone;
+						break;
+					}
+					SDMMD_FileRelayBeginEntry(archive);
+					archive->remaining = archive->fileSize;
+					SDMMD_FileRelaySetPadding(archive, (archive->newc ? kSDMMD_FileRelayCpioHeaderSizeNewc : kSDMMD_FileRelayCpioHeaderSizeODC) + archive->nameSize, kSDMMD_FileRelayArchiveData);
+				}
+				break;
+			}
+			case kSDMMD_FileRelayArchiveData: {
+				used = (archive->remaining < length ? archive->remaining : length);
+				SDMMD_FileRelayEntryData(archive, data, used);
+				archive->remaining -= used;
+				break;
+			}
+			case kSDMMD_FileRelayArchivePadding: {
+				used = (archive->padding < length ? archive->padding : length);
+				archive->padding -= used;
+				if (archive->padding == 0x0) {
+					archive->state = archive->afterPadding;
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+		data += used;
+		length -= used;
+		if (archive->state == kSDMMD_FileRelayArchiveData && archive->remaining == 0x0) {
+			SDMMD_FileRelayEndEntry(archive);
+			archive->headerLength = 0x0;
+			SDMMD_FileRelaySetPadding(archive, archive->fileSize, kSDMMD_FileRelayArchiveHeader);
+		}
+	}
+}
+
+#pragma mark -
+#pragma mark Stream
+#pragma mark -
+
+static ssize_t SDMMD_FileRelayRead(SocketConnection socket, unsigned char *buffer, size_t length) {
+	if (socket.isSSL) {
+		int received = SSL_read(socket.socket.ssl, buffer, (int)length);
+		return (received > 0x0 ? received : (SSL_get_error(socket.socket.ssl, received) == SSL_ERROR_ZERO_RETURN ? 0x0 : -1));
+	}
+	return recv(socket.socket.conn, buffer, length, 0x0);
+}
+
+// Runs on its own queue, fills the chunks in order until the device closes the stream
+static void SDMMD_FileRelayReader(void *context) {
+	struct sdmmd_FileRelayStream *stream = (struct sdmmd_FileRelayStream *)context;
+	uint32_t index = 0x0;
+	bool finished = false;
+	while (!finished) {
+		dispatch_semaphore_wait(stream->empty, DISPATCH_TIME_FOREVER);
+		struct sdmmd_FileRelayChunk *chunk = &stream->chunks[index];
+		chunk->length = (stream->stopped ? -1 : SDMMD_FileRelayRead(stream->socket, chunk->data, kSDMMD_FileRelayChunkSize));
+		finished = (chunk->length <= 0x0);
+		dispatch_semaphore_signal(stream->filled);
+		index = (index + 0x1) % kSDMMD_FileRelayChunkCount;
+	}
+}
+
+static sdmmd_return_t SDMMD_FileRelayInflate(z_stream *zstream, struct sdmmd_FileRelayArchive *archive, unsigned char *output, const unsigned char *input, size_t length, bool *ended) {
+	zstream->next_in = (Bytef *)input;
+	zstream->avail_in = (uInt)length;
+	while (archive->result == kAMDSuccess && !*ended && (zstream->avail_in || zstream->avail_out == 0x0)) {
+		zstream->next_out = output;
+		zstream->avail_out = kSDMMD_FileRelayInflateSize;
+		int status = inflate(zstream, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+			printf("SDMMD_FileRelayInflate: Could not inflate the archive: %d\n", status);
+			return kAMDUndefinedError;
+		}
+		SDMMD_FileRelayArchiveConsume(archive, output, kSDMMD_FileRelayInflateSize - zstream->avail_out);
+		*ended = (status == Z_STREAM_END);
+		if (status == Z_BUF_ERROR) {
+			break;
+		}
+	}
+	return archive->result;
+}
+
+static sdmmd_return_t SDMMD_FileRelayExtract(SDMMD_AMConnectionRef service, const char *root) {
+	struct sdmmd_FileRelayStream stream = {0};
+	stream.socket = SDMMD_TranslateConnectionToSocket(service);
+	stream.empty = dispatch_semaphore_create(kSDMMD_FileRelayChunkCount);
+	stream.filled = dispatch_semaphore_create(0x0);
+	unsigned char *buffers = malloc(kSDMMD_FileRelayChunkSize * kSDMMD_FileRelayChunkCount);
+	for (uint32_t index = 0x0; index < kSDMMD_FileRelayChunkCount; index++) {
+		stream.chunks[index].data = buffers + (index * kSDMMD_FileRelayChunkSize);
+	}
+	struct sdmmd_FileRelayArchive *archive = calloc(0x1, sizeof(struct sdmmd_FileRelayArchive));
+	archive->root = (char *)root;
+	archive->fd = -1;
+	archive->result = kAMDSuccess;
+	unsigned char *output = malloc(kSDMMD_FileRelayInflateSize);
+	z_stream zstream = {0};
+	// 16 on top of the window bits makes zlib expect a gzip header
+	sdmmd_return_t result = (inflateInit2(&zstream, 16 + MAX_WBITS) == Z_OK ? kAMDSuccess : kAMDNoResourcesError);
+
+	dispatch_queue_t readerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.file-relay-reader", DISPATCH_QUEUE_SERIAL);
+	dispatch_group_t readerGroup = dispatch_group_create();
+	dispatch_group_async_f(readerGroup, readerQueue, &stream, SDMMD_FileRelayReader);
+	uint32_t index = 0x0;
+	bool ended = false;
+	while (true) {
+		dispatch_semaphore_wait(stream.filled, DISPATCH_TIME_FOREVER);
+		struct sdmmd_FileRelayChunk *chunk = &stream.chunks[index];
+		if (chunk->length <= 0x0) {
+			if (chunk->length < 0x0 && result == kAMDSuccess && !ended) {
+				result = kAMDReadError;
+			}
+			break;
+		}
+		if (result == kAMDSuccess && !ended) {
+			result = SDMMD_FileRelayInflate(&zstream, archive, output, chunk->data, (size_t)chunk->length, &ended);
+			if (result != kAMDSuccess) {
+				// the reader is woken up by the shutdown and hands back a failed chunk
+				__sync_lock_test_and_set(&stream.stopped, 0x1);
+				shutdown(service->ivars.socket, SHUT_RDWR);
+			}
+		}
+		dispatch_semaphore_signal(stream.empty);
+		index = (index + 0x1) % kSDMMD_FileRelayChunkCount;
+	}
+	dispatch_group_wait(readerGroup, DISPATCH_TIME_FOREVER);
+	dispatch_release(readerGroup);
+	dispatch_release(readerQueue);
+
+	if (result == kAMDSuccess && archive->state != kSDMMD_FileRelayArchiveDone) {
+		printf("SDMMD_FileRelayExtract: The archive ended early.\n");
+		result = kAMDEOFError;
+	}
+	if (archive->fd != -1) {
+		close(archive->fd);
+	}
+	inflateEnd(&zstream);
+	free(output);
+	free(archive);
+	free(buffers);
+	dispatch_release(stream.filled);
+	dispatch_release(stream.empty);
+	return result;
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+sdmmd_return_t SDMMD_FileRelayCopySources(SDMMD_AMDeviceRef device, CFArrayRef sources, CFStringRef destination) {
+	if (device == NULL || sources == NULL || destination == NULL || CFArrayGetCount(sources) == 0x0) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_AMConnectionRef service = NULL;
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_FILE_RELAY), NULL, &service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_FileRelayCopySources: Was unable to start file_relay on the device: 0x%x\n", result);
+		return result;
+	}
+	SocketConnection socket = SDMMD_TranslateConnectionToSocket(service);
+	CFMutableDictionaryRef request = SDMMD_create_dict();
+	CFDictionarySetValue(request, CFSTR(kSDMMD_FileRelayKeySources), sources);
+	result = SDMMD_ServiceSendMessage(socket, request, kCFPropertyListXMLFormat_v1_0);
+	CFRelease(request);
+	CFDictionaryRef response = NULL;
+	if (result == kAMDSuccess) {
+		result = SDMMD_ServiceReceiveMessage(socket, (CFPropertyListRef*)&response);
+	}
+	if (result == kAMDSuccess) {
+		CFStringRef status = (response && CFGetTypeID(response) == CFDictionaryGetTypeID() ? CFDictionaryGetValue(response, CFSTR(kSDMMD_FileRelayKeyStatus)) : NULL);
+		if (status == NULL || !CFEqual(status, CFSTR(kSDMMD_FileRelayStatusAcknowledged))) {
+			CFStringRef error = (response && CFGetTypeID(response) == CFDictionaryGetTypeID() ? CFDictionaryGetValue(response, CFSTR(kSDMMD_FileRelayKeyError)) : NULL);
+			char *errorString = (error && CFGetTypeID(error) == CFStringGetTypeID() ? SDMCFStringGetString(error) : NULL);
+			printf("SDMMD_FileRelayCopySources: file_relay refused the request: %s\n", (errorString ? errorString : "no response"));
+			free(errorString);
+			result = (response ? kAMDInvalidResponseError : kAMDReadError);
+		}
+	}
+	if (response) {
+		CFRelease(response);
+	}
+	if (result == kAMDSuccess) {
+		char *root = SDMCFStringGetString(destination);
+		mkdir(root, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		result = SDMMD_FileRelayExtract(service, root);
+		free(root);
+	}
+	SDMMD_AMDServiceConnectionInvalidate(service);
+	free(service);
+	return result;
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ *  SDMMD_FileRelay.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_FILERELAY_H_
+#define _SDM_MD_FILERELAY_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+#define kSDMMD_FileRelayKeySources				"Sources"
+#define kSDMMD_FileRelayKeyStatus				"Status"
+#define kSDMMD_FileRelayKeyError				"Error"
+#define kSDMMD_FileRelayStatusAcknowledged		"Acknowledged"
+
+// Some of the sources file_relay knows about, which ones a device accepts depends on its version
+#define kSDMMD_FileRelaySourceAppleSupport		"AppleSupport"
+#define kSDMMD_FileRelaySourceCrashReporter		"CrashReporter"
+#define kSDMMD_FileRelaySourceLockdown			"Lockdown"
+#define kSDMMD_FileRelaySourceMobileInstallation	"MobileInstallation"
+#define kSDMMD_FileRelaySourceNetwork			"Network"
+#define kSDMMD_FileRelaySourceSystemConfiguration	"SystemConfiguration"
+#define kSDMMD_FileRelaySourceTmp				"tmp"
+#define kSDMMD_FileRelaySourceUserDatabases		"UserDatabases"
+#define kSDMMD_FileRelaySourceVPN				"VPN"
+#define kSDMMD_FileRelaySourceWiFi				"WiFi"
+
+// The archive is received this much at a time into one of kSDMMD_FileRelayChunkCount buffers, the reader waits when all of them are full
+#define kSDMMD_FileRelayChunkSize				0x40000
+#define kSDMMD_FileRelayChunkCount				0x4
+
+// Inflated data is handed to the cpio parser this much at a time
+#define kSDMMD_FileRelayInflateSize				0x40000
+
+// cpio headers, file_relay sends the portable ASCII format, the SVR4 ones are read as well
+#define kSDMMD_FileRelayCpioMagicODC			"070707"
+#define kSDMMD_FileRelayCpioMagicNewc			"070701"
+#define kSDMMD_FileRelayCpioMagicCRC			"070702"
+#define kSDMMD_FileRelayCpioHeaderSizeODC		76
+#define kSDMMD_FileRelayCpioHeaderSizeNewc		110
+#define kSDMMD_FileRelayCpioTrailer				"TRAILER!!!"
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Asks file_relay for the sources (an array of CFString) and extracts the archive it sends into destination. The gzip stream is inflated and
+// unpacked as it arrives, a background queue reads the socket while the calling thread inflates and writes files, so memory use does not depend
+// on the size of the archive. Entries that would land outside destination are skipped. Needs an active session.
+sdmmd_return_t SDMMD_FileRelayCopySources(SDMMD_AMDeviceRef device, CFArrayRef sources, CFStringRef destination);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ *  SDMMD_HouseArrest.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_HOUSEARREST_C_
+#define _SDM_MD_HOUSEARREST_C_
+
+#include "SDMMD_HouseArrest.h"
+#include "SDMMD_Functions.h"
+#include <pthread.h>
+
+struct sdmmd_HouseArrestEntry {
+	struct sdmmd_HouseArrestEntry *next;	// the cache is kept most recently used first
+	CFStringRef udid;
+	uint32_t device_id;
+	CFStringRef bundleId;
+	enum SDMMD_HouseArrestVendType type;
+	SDMMD_AMConnectionRef service;
+	SDMMD_AFCConnectionRef afc;
+	uint32_t users;
+	bool evicted;							// closed by the last checkin instead of going back to the cache
+	CFAbsoluteTime lastUsed;
+};
+
+static pthread_mutex_t SDMMD_HouseArrestCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sdmmd_HouseArrestEntry *SDMMD_HouseArrestCache = NULL;
+
+#pragma mark -
+#pragma mark Vending
+#pragma mark -
+
+static sdmmd_return_t SDMMD_HouseArrestReadVendResponse(CFDictionaryRef response, CFStringRef bundleId) {
+	sdmmd_return_t result = kAMDReadError;
+	if (response && CFGetTypeID(response) == CFDictionaryGetTypeID()) {
+		CFStringRef error = CFDictionaryGetValue(response, CFSTR(kSDMMD_HouseArrestKeyError));
+		CFStringRef status = CFDictionaryGetValue(response, CFSTR(kSDMMD_HouseArrestKeyStatus));
+		if (error) {
+			char *errorString = (CFGetTypeID(error) == CFStringGetTypeID() ? SDMCFStringGetString(error) : NULL);
+			char *bundle = SDMCFStringGetString(bundleId);
+			printf("SDMMD_HouseArrestVend: Could not vend the container of %s: %s\n", bundle, (errorString ? errorString : "unknown error"));
+			free(bundle);
+			free(errorString);
+			result = (CFEqual(error, CFSTR(kSDMMD_HouseArrestErrorLookupFailed)) ? kAMDNotFoundError : kAMDUndefinedError);
+		} else if (status && CFEqual(status, CFSTR(kSDMMD_HouseArrestStatusComplete))) {
+			result = kAMDSuccess;
+		} else {
+			result = kAMDInvalidResponseError;
+		}
+	}
+	return result;
+}
+
+// Starts house_arrest and asks it for the container, on success the service connection is ready to be used for AFC
+static sdmmd_return_t SDMMD_HouseArrestVend(SDMMD_AMDeviceRef device, CFStringRef bundleId, enum SDMMD_HouseArrestVendType type, SDMMD_AMConnectionRef *service) {
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_HOUSE_ARREST), NULL, service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_HouseArrestVend: Was unable to start the house_arrest service on the device: 0x%x\n", result);
+		return result;
+	}
+	CFMutableDictionaryRef request = SDMMD_create_dict();
+	CFDictionarySetValue(request, CFSTR(kSDMMD_HouseArrestKeyCommand), (type == kSDMMD_HouseArrestVendDocuments ? CFSTR(kSDMMD_HouseArrestCommandVendDocuments) : CFSTR(kSDMMD_HouseArrestCommandVendContainer)));
+	CFDictionarySetValue(request, CFSTR(kSDMMD_HouseArrestKeyIdentifier), bundleId);
+	SocketConnection socket = SDMMD_TranslateConnectionToSocket(*service);
+	result = SDMMD_ServiceSendMessage(socket, request, kCFPropertyListXMLFormat_v1_0);
+	CFRelease(request);
+	if (result == kAMDSuccess) {
+		CFDictionaryRef response = NULL;
+		result = SDMMD_ServiceReceiveMessage(socket, (CFPropertyListRef*)&response);
+		if (result == kAMDSuccess) {
+			result = SDMMD_HouseArrestReadVendResponse(response, bundleId);
+		}
+		if (response) {
+			CFRelease(response);
+		}
+	}
+	if (result != kAMDSuccess) {
+		SDMMD_AMDServiceConnectionInvalidate(*service);
+		free(*service);
+		*service = NULL;
+	}
+	return result;
+}
+
+#pragma mark -
+#pragma mark Connection Cache
+#pragma mark -
+
+static void SDMMD_HouseArrestEntryRelease(struct sdmmd_HouseArrestEntry *entry) {
+	SDMMD_AFCConnectionRelease(entry->afc);
+	SDMMD_AMDServiceConnectionInvalidate(entry->service);
+	free(entry->service);
+	CFRelease(entry->bundleId);
+	CFRelease(entry->udid);
+	free(entry);
+}
+
+static void SDMMD_HouseArrestReleaseList(struct sdmmd_HouseArrestEntry *list) {
+	while (list) {
+		struct sdmmd_HouseArrestEntry *next = list->next;
+		SDMMD_HouseArrestEntryRelease(list);
+		list = next;
+	}
+}
+
+static bool SDMMD_HouseArrestEntryMatchesDevice(struct sdmmd_HouseArrestEntry *entry, SDMMD_AMDeviceRef device) {
+	return (entry->device_id == device->ivars.device_id && device->ivars.unique_device_id && CFEqual(entry->udid, device->ivars.unique_device_id));
+}
+
+// Must be called with SDMMD_HouseArrestCacheLock held. Replies in flight on a connection that is in use would look like unexpected data to
+// the socket peek, so it only runs on idle entries.
+static bool SDMMD_HouseArrestEntryIsHealthy(struct sdmmd_HouseArrestEntry *entry) {
+	if (entry->users) {
+		return (entry->afc->transportError == kAMDSuccess);
+	}
+	return (SDMMD_AFCConnectionIsReusable(entry->afc) && SDMMD_AMDServiceConnectionIsValid(entry->service));
+}
+
+// Must be called with SDMMD_HouseArrestCacheLock held. Unlinks idle entries that timed out, went bad or no longer fit in the cache, and returns
+// them as a list for closing outside the lock.
+static struct sdmmd_HouseArrestEntry* SDMMD_HouseArrestCacheUnlinkEvictable(CFAbsoluteTime now) {
+	struct sdmmd_HouseArrestEntry *evicted = NULL;
+	struct sdmmd_HouseArrestEntry **link = &SDMMD_HouseArrestCache;
+	uint32_t kept = 0x0;
+	while (*link) {
+		struct sdmmd_HouseArrestEntry *entry = *link;
+		bool idle = (entry->users == 0x0);
+		// walking from the most recently used end, so anything past the limit is the least recently used
+		if (idle && (now - entry->lastUsed > kSDMMD_HouseArrestIdleTimeout || kept >= kSDMMD_HouseArrestCacheMax || !SDMMD_HouseArrestEntryIsHealthy(entry))) {
+			*link = entry->next;
+			entry->next = evicted;
+			evicted = entry;
+		} else {
+			kept++;
+			link = &entry->next;
+		}
+	}
+	return evicted;
+}
+
+sdmmd_return_t SDMMD_HouseArrestCheckoutAFCConnection(SDMMD_AMDeviceRef device, CFStringRef bundleId, enum SDMMD_HouseArrestVendType type, SDMMD_AFCConnectionRef *afc) {
+	if (device == NULL || bundleId == NULL || afc == NULL || device->ivars.unique_device_id == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	struct sdmmd_HouseArrestEntry *found = NULL;
+	pthread_mutex_lock(&SDMMD_HouseArrestCacheLock);
+	struct sdmmd_HouseArrestEntry *evicted = SDMMD_HouseArrestCacheUnlinkEvictable(CFAbsoluteTimeGetCurrent());
+	struct sdmmd_HouseArrestEntry **link = &SDMMD_HouseArrestCache;
+	while (*link) {
+		struct sdmmd_HouseArrestEntry *entry = *link;
+		if (!entry->evicted && entry->type == type && SDMMD_HouseArrestEntryMatchesDevice(entry, device) && CFEqual(entry->bundleId, bundleId) && SDMMD_HouseArrestEntryIsHealthy(entry)) {
+			// move to the front
+			*link = entry->next;
+			entry->next = SDMMD_HouseArrestCache;
+			SDMMD_HouseArrestCache = entry;
+			entry->users++;
+			entry->lastUsed = CFAbsoluteTimeGetCurrent();
+			found = entry;
+			break;
+		}
+		link = &entry->next;
+	}
+	pthread_mutex_unlock(&SDMMD_HouseArrestCacheLock);
+	SDMMD_HouseArrestReleaseList(evicted);
+	if (found) {
+		*afc = found->afc;
+		return kAMDSuccess;
+	}
+
+	SDMMD_AMConnectionRef service = NULL;
+	sdmmd_return_t result = SDMMD_HouseArrestVend(device, bundleId, type, &service);
+	if (result == kAMDSuccess) {
+		struct sdmmd_HouseArrestEntry *entry = calloc(0x1, sizeof(struct sdmmd_HouseArrestEntry));
+		entry->udid = CFRetain(device->ivars.unique_device_id);
+		entry->device_id = device->ivars.device_id;
+		entry->bundleId = CFStringCreateCopy(kCFAllocatorDefault, bundleId);
+		entry->type = type;
+		entry->service = service;
+		entry->afc = SDMMD_AFCConnectionCreate(service);
+		entry->users = 0x1;
+		entry->lastUsed = CFAbsoluteTimeGetCurrent();
+		// two callers that missed at the same time both end up cached, the older one simply ages out
+		pthread_mutex_lock(&SDMMD_HouseArrestCacheLock);
+		entry->next = SDMMD_HouseArrestCache;
+		SDMMD_HouseArrestCache = entry;
+		evicted = SDMMD_HouseArrestCacheUnlinkEvictable(entry->lastUsed);
+		pthread_mutex_unlock(&SDMMD_HouseArrestCacheLock);
+		SDMMD_HouseArrestReleaseList(evicted);
+		*afc = entry->afc;
+	}
+	return result;
+}
+
+void SDMMD_HouseArrestCheckinAFCConnection(SDMMD_AFCConnectionRef afc) {
+	if (afc == NULL) {
+		return;
+	}
+	struct sdmmd_HouseArrestEntry *closing = NULL;
+	pthread_mutex_lock(&SDMMD_HouseArrestCacheLock);
+	struct sdmmd_HouseArrestEntry **link = &SDMMD_HouseArrestCache;
+	while (*link) {
+		struct sdmmd_HouseArrestEntry *entry = *link;
+		if (entry->afc == afc) {
+			entry->users--;
+			entry->lastUsed = CFAbsoluteTimeGetCurrent();
+			// a drained entry or one whose connection broke while in use is not handed out again
+			if (entry->users == 0x0 && (entry->evicted || !SDMMD_HouseArrestEntryIsHealthy(entry))) {
+				*link = entry->next;
+				closing = entry;
+			}
+			break;
+		}
+		link = &entry->next;
+	}
+	pthread_mutex_unlock(&SDMMD_HouseArrestCacheLock);
+	if (closing) {
+		closing->next = NULL;
+		SDMMD_HouseArrestReleaseList(closing);
+	}
+}
+
+void SDMMD_HouseArrestDrainConnectionCache(SDMMD_AMDeviceRef device) {
+	struct sdmmd_HouseArrestEntry *drained = NULL;
+	pthread_mutex_lock(&SDMMD_HouseArrestCacheLock);
+	struct sdmmd_HouseArrestEntry **link = &SDMMD_HouseArrestCache;
+	while (*link) {
+		struct sdmmd_HouseArrestEntry *entry = *link;
+		if (device == NULL || SDMMD_HouseArrestEntryMatchesDevice(entry, device)) {
+			if (entry->users) {
+				entry->evicted = true;
+				link = &entry->next;
+			} else {
+				*link = entry->next;
+				entry->next = drained;
+				drained = entry;
+			}
+		} else {
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&SDMMD_HouseArrestCacheLock);
+	SDMMD_HouseArrestReleaseList(drained);
+}
+
+#endif
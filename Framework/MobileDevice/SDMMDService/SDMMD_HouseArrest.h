@@ -0,0 +1,67 @@
+/*
+ *  SDMMD_HouseArrest.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_HOUSEARREST_H_
+#define _SDM_MD_HOUSEARREST_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+#include "SDMMD_AFC.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Sent once on a fresh house_arrest connection, after a "Complete" status the same connection speaks AFC rooted in the vended directory
+#define kSDMMD_HouseArrestKeyCommand				"Command"
+#define kSDMMD_HouseArrestKeyIdentifier				"Identifier"
+#define kSDMMD_HouseArrestKeyStatus					"Status"
+#define kSDMMD_HouseArrestKeyError					"Error"
+#define kSDMMD_HouseArrestStatusComplete			"Complete"
+#define kSDMMD_HouseArrestErrorLookupFailed			"ApplicationLookupFailed"
+
+enum SDMMD_HouseArrestVendType {
+	kSDMMD_HouseArrestVendContainer = 0x0,		// the whole sandbox, Documents, Library and tmp
+	kSDMMD_HouseArrestVendDocuments = 0x1		// only Documents, the only kind allowed for apps that are not development signed
+};
+
+#define kSDMMD_HouseArrestCommandVendContainer		"VendContainer"
+#define kSDMMD_HouseArrestCommandVendDocuments		"VendDocuments"
+
+// Vended connections are kept per device, bundle and vend type. Idle ones past the timeout are closed, and once there are more than
+// kSDMMD_HouseArrestCacheMax the least recently used idle ones are.
+#define kSDMMD_HouseArrestCacheMax					0x10
+#define kSDMMD_HouseArrestIdleTimeout				60.0
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Hands out an AFC connection into the container of bundleId, paths on it are relative to the vended directory. A cached connection is reused
+// if there is a healthy one, otherwise house_arrest is started and asked to vend, which needs an active session. AFC connections can be used from
+// several threads at once, so callers that check out the same bundle at the same time share one connection. Every checkout must be matched by
+// SDMMD_HouseArrestCheckinAFCConnection().
+sdmmd_return_t SDMMD_HouseArrestCheckoutAFCConnection(SDMMD_AMDeviceRef device, CFStringRef bundleId, enum SDMMD_HouseArrestVendType type, SDMMD_AFCConnectionRef *afc);
+void SDMMD_HouseArrestCheckinAFCConnection(SDMMD_AFCConnectionRef afc);
+
+// Closes every idle cached connection to the device, pass NULL to drain the cache for all devices. Connections still checked out are closed
+// when they are checked in.
+void SDMMD_HouseArrestDrainConnectionCache(SDMMD_AMDeviceRef device);
+
+#endif
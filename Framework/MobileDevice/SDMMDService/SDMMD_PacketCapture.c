@@ -0,0 +1,513 @@
+/*
+ *  SDMMD_PacketCapture.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_PACKETCAPTURE_C_
+#define _SDM_MD_PACKETCAPTURE_C_
+
+#include "SDMMD_PacketCapture.h"
+#include "SDMMD_Functions.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+// Output framing
+#define kSDMMD_PacketCaptureLinkTypeEthernet	0x1
+#define kSDMMD_PacketCaptureEthernetLength		0xe
+#define kSDMMD_PacketCaptureFamilyInet			0x2
+#define kSDMMD_PacketCaptureFamilyInet6			0x1e		// AF_INET6 on the device
+#define kSDMMD_PacketCapturePcapMagic			0xa1b2c3d4
+#define kSDMMD_PacketCapturePcapngSectionHeader	0x0a0d0d0a
+#define kSDMMD_PacketCapturePcapngInterface		0x1
+#define kSDMMD_PacketCapturePcapngEnhancedPacket	0x6
+#define kSDMMD_PacketCapturePcapngByteOrder		0x1a2b3c4d
+#define kSDMMD_PacketCapturePcapngOptionComment	0x1
+#define kSDMMD_PacketCapturePcapngOptionIfName	0x2
+
+static inline uint32_t SDMMD_PacketCaptureGetBig32(const unsigned char *bytes) {
+	return ((uint32_t)bytes[0x0] << 24) | ((uint32_t)bytes[0x1] << 16) | ((uint32_t)bytes[0x2] << 8) | (uint32_t)bytes[0x3];
+}
+
+static inline uint32_t SDMMD_PacketCaptureGetLittle32(const unsigned char *bytes) {
+	return ((uint32_t)bytes[0x3] << 24) | ((uint32_t)bytes[0x2] << 16) | ((uint32_t)bytes[0x1] << 8) | (uint32_t)bytes[0x0];
+}
+
+static inline unsigned char* SDMMD_PacketCapturePut32(unsigned char *output, uint32_t value) {
+	memcpy(output, &value, sizeof(value));
+	return output + sizeof(value);
+}
+
+static inline unsigned char* SDMMD_PacketCapturePut16(unsigned char *output, uint16_t value) {
+	memcpy(output, &value, sizeof(value));
+	return output + sizeof(value);
+}
+
+static inline uint32_t SDMMD_PacketCapturePad(uint32_t length) {
+	return (length + 0x3) & ~0x3u;
+}
+
+#pragma mark -
+#pragma mark Buffers
+#pragma mark -
+
+static void SDMMD_PacketCaptureHandOff(SDMMD_PacketCaptureRef capture) {
+	if (capture->current != -1) {
+		capture->current = -1;
+		dispatch_semaphore_signal(capture->filled);
+	}
+}
+
+// Space for one record in the buffer being filled, NULL when every buffer is still waiting to be written
+static unsigned char* SDMMD_PacketCaptureReserve(SDMMD_PacketCaptureRef capture, uint32_t size, dispatch_time_t wait) {
+	if (capture->current != -1 && capture->buffers[capture->current].length + size > kSDMMD_PacketCaptureBufferSize) {
+		SDMMD_PacketCaptureHandOff(capture);
+	}
+	if (capture->current == -1 && dispatch_semaphore_wait(capture->empty, wait) == 0x0) {
+		capture->current = (int32_t)capture->next;
+		capture->next = (capture->next + 0x1) % kSDMMD_PacketCaptureBufferCount;
+		capture->buffers[capture->current].length = 0x0;
+	}
+	if (capture->current == -1) {
+		return NULL;
+	}
+	struct sdmmd_PacketCaptureBuffer *buffer = &capture->buffers[capture->current];
+	unsigned char *record = buffer->data + buffer->length;
+	buffer->length += size;
+	return record;
+}
+
+static void SDMMD_PacketCaptureWriter(void *context) {
+	SDMMD_PacketCaptureRef capture = (SDMMD_PacketCaptureRef)context;
+	uint32_t index = 0x0;
+	bool last = false;
+	while (!last) {
+		dispatch_semaphore_wait(capture->filled, DISPATCH_TIME_FOREVER);
+		struct sdmmd_PacketCaptureBuffer *buffer = &capture->buffers[index];
+		uint32_t offset = 0x0;
+		while (!capture->writeFailed && offset < buffer->length) {
+			ssize_t written = write(capture->fd, buffer->data + offset, buffer->length - offset);
+			if (written <= 0x0) {
+				// the reader of a pipe went away, or the disk is full
+				printf("SDMMD_PacketCaptureWriter: Could not write the capture, stopping.\n");
+				__sync_lock_test_and_set(&capture->writeFailed, 0x1);
+				__sync_lock_test_and_set(&capture->stopped, 0x1);
+				shutdown(capture->service->ivars.socket, SHUT_RDWR);
+				break;
+			}
+			offset += (uint32_t)written;
+		}
+		last = buffer->last;
+		buffer->last = false;
+		index = (index + 0x1) % kSDMMD_PacketCaptureBufferCount;
+		dispatch_semaphore_signal(capture->empty);
+	}
+}
+
+#pragma mark -
+#pragma mark Framing
+#pragma mark -
+
+static void SDMMD_PacketCaptureWriteFileHeader(SDMMD_PacketCaptureRef capture) {
+	if (capture->pcapng) {
+		unsigned char *block = SDMMD_PacketCaptureReserve(capture, 0x1c, DISPATCH_TIME_FOREVER);
+		block = SDMMD_PacketCapturePut32(block, kSDMMD_PacketCapturePcapngSectionHeader);
+		block = SDMMD_PacketCapturePut32(block, 0x1c);
+		block = SDMMD_PacketCapturePut32(block, kSDMMD_PacketCapturePcapngByteOrder);
+		block = SDMMD_PacketCapturePut16(block, 0x1);
+		block = SDMMD_PacketCapturePut16(block, 0x0);
+		// the section length is not known up front
+		memset(block, 0xff, 0x8);
+		SDMMD_PacketCapturePut32(block + 0x8, 0x1c);
+	} else {
+		unsigned char *header = SDMMD_PacketCaptureReserve(capture, 0x18, DISPATCH_TIME_FOREVER);
+		header = SDMMD_PacketCapturePut32(header, kSDMMD_PacketCapturePcapMagic);
+		header = SDMMD_PacketCapturePut16(header, 0x2);
+		header = SDMMD_PacketCapturePut16(header, 0x4);
+		header = SDMMD_PacketCapturePut32(header, 0x0);
+		header = SDMMD_PacketCapturePut32(header, 0x0);
+		header = SDMMD_PacketCapturePut32(header, capture->snapLength);
+		SDMMD_PacketCapturePut32(header, kSDMMD_PacketCaptureLinkTypeEthernet);
+	}
+}
+
+// pcapng packets refer to an interface description block, one is written the first time each interface name shows up
+static bool SDMMD_PacketCaptureGetInterface(SDMMD_PacketCaptureRef capture, const char *name, uint32_t *interface) {
+	for (uint32_t index = 0x0; index < capture->interfaceCount; index++) {
+		if (strcmp(capture->interfaces[index], name) == 0x0) {
+			*interface = index;
+			return true;
+		}
+	}
+	if (capture->interfaceCount == kSDMMD_PacketCaptureInterfaceMax) {
+		// past the limit packets are attributed to the first interface rather than lost
+		*interface = 0x0;
+		return true;
+	}
+	uint32_t nameLength = (uint32_t)strlen(name);
+	uint32_t blockLength = 0x14 + 0x4 + SDMMD_PacketCapturePad(nameLength) + 0x4;
+	unsigned char *block = SDMMD_PacketCaptureReserve(capture, blockLength, DISPATCH_TIME_NOW);
+	if (block == NULL) {
+		return false;
+	}
+	memset(block, 0x0, blockLength);
+	block = SDMMD_PacketCapturePut32(block, kSDMMD_PacketCapturePcapngInterface);
+	block = SDMMD_PacketCapturePut32(block, blockLength);
+	block = SDMMD_PacketCapturePut16(block, kSDMMD_PacketCaptureLinkTypeEthernet);
+	block = SDMMD_PacketCapturePut16(block, 0x0);
+	block = SDMMD_PacketCapturePut32(block, capture->snapLength);
+	block = SDMMD_PacketCapturePut16(block, kSDMMD_PacketCapturePcapngOptionIfName);
+	block = SDMMD_PacketCapturePut16(block, (uint16_t)nameLength);
+	memcpy(block, name, nameLength);
+	block += SDMMD_PacketCapturePad(nameLength) + 0x4;
+	SDMMD_PacketCapturePut32(block, blockLength);
+	strlcpy(capture->interfaces[capture->interfaceCount], name, sizeof(capture->interfaces[0x0]));
+	*interface = capture->interfaceCount++;
+	return true;
+}
+
+// Copies the first length bytes of the frame, prefixed by an empty ethernet header when the device sent the packet without a link layer header
+static void SDMMD_PacketCaptureCopyFrame(unsigned char *output, const unsigned char *packet, uint32_t length, uint32_t family, bool addEthernet) {
+	if (addEthernet) {
+		unsigned char ethernet[kSDMMD_PacketCaptureEthernetLength] = {0};
+		uint16_t type = (family == kSDMMD_PacketCaptureFamilyInet6 ? 0x86dd : (family == kSDMMD_PacketCaptureFamilyInet ? 0x0800 : 0x0));
+		ethernet[0xc] = (unsigned char)(type >> 8);
+		ethernet[0xd] = (unsigned char)(type & 0xff);
+		uint32_t headerLength = (length < kSDMMD_PacketCaptureEthernetLength ? length : kSDMMD_PacketCaptureEthernetLength);
+		memcpy(output, ethernet, headerLength);
+		output += headerLength;
+		length -= headerLength;
+	}
+	memcpy(output, packet, length);
+}
+
+// message is the packet as pcapd sent it, its header followed by the frame, which is copied once straight into the output buffer
+static void SDMMD_PacketCaptureFramePacket(SDMMD_PacketCaptureRef capture, const unsigned char *message, uint64_t length) {
+	uint32_t headerLength = (length >= 0x4 ? SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCaptureHeaderLengthOffset) : 0x0);
+	if (headerLength < kSDMMD_PacketCapturePidOffset || headerLength > length) {
+		__sync_fetch_and_add(&capture->dropped, 0x1);
+		return;
+	}
+	uint32_t packetLength = SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCapturePacketLengthOffset);
+	if ((uint64_t)headerLength + packetLength > length) {
+		__sync_fetch_and_add(&capture->dropped, 0x1);
+		return;
+	}
+	uint32_t family = SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCaptureFamilyOffset);
+	bool addEthernet = (SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCaptureFramePreLengthOffset) == 0x0);
+	uint32_t originalLength = packetLength + (addEthernet ? kSDMMD_PacketCaptureEthernetLength : 0x0);
+	uint32_t capturedLength = (originalLength < capture->snapLength ? originalLength : capture->snapLength);
+	struct timeval timestamp;
+	if (headerLength >= kSDMMD_PacketCaptureHeaderLengthMin) {
+		timestamp.tv_sec = (time_t)SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCaptureSecondsOffset);
+		timestamp.tv_usec = (suseconds_t)SDMMD_PacketCaptureGetBig32(message + kSDMMD_PacketCaptureMicrosecondsOffset);
+	} else {
+		gettimeofday(&timestamp, NULL);
+	}
+
+	unsigned char *record = NULL;
+	if (capture->pcapng) {
+		char name[kSDMMD_PacketCaptureInterfaceNameLength + 0x1] = {0};
+		memcpy(name, message + kSDMMD_PacketCaptureInterfaceOffset, kSDMMD_PacketCaptureInterfaceNameLength);
+		char comment[kSDMMD_PacketCaptureCommandLength + 0x10] = {0};
+		if (headerLength >= kSDMMD_PacketCaptureCommandOffset + kSDMMD_PacketCaptureCommandLength) {
+			char command[kSDMMD_PacketCaptureCommandLength + 0x1] = {0};
+			memcpy(command, message + kSDMMD_PacketCaptureCommandOffset, kSDMMD_PacketCaptureCommandLength);
+			snprintf(comment, sizeof(comment), "%s[%u]", command, SDMMD_PacketCaptureGetLittle32(message + kSDMMD_PacketCapturePidOffset));
+		}
+		uint32_t commentLength = (uint32_t)strlen(comment);
+		uint32_t optionsLength = (commentLength ? 0x4 + SDMMD_PacketCapturePad(commentLength) : 0x0) + 0x4;
+		uint32_t blockLength = 0x1c + SDMMD_PacketCapturePad(capturedLength) + optionsLength + 0x4;
+		uint32_t interface = 0x0;
+		if (SDMMD_PacketCaptureGetInterface(capture, name, &interface)) {
+			record = SDMMD_PacketCaptureReserve(capture, blockLength, DISPATCH_TIME_NOW);
+		}
+		if (record) {
+			uint64_t microseconds = ((uint64_t)timestamp.tv_sec * 1000000ull) + (uint64_t)timestamp.tv_usec;
+			memset(record, 0x0, blockLength);
+			unsigned char *block = SDMMD_PacketCapturePut32(record, kSDMMD_PacketCapturePcapngEnhancedPacket);
+			block = SDMMD_PacketCapturePut32(block, blockLength);
+			block = SDMMD_PacketCapturePut32(block, interface);
+			block = SDMMD_PacketCapturePut32(block, (uint32_t)(microseconds >> 32));
+			block = SDMMD_PacketCapturePut32(block, (uint32_t)(microseconds & 0xffffffff));
+			block = SDMMD_PacketCapturePut32(block, capturedLength);
+			block = SDMMD_PacketCapturePut32(block, originalLength);
+			SDMMD_PacketCaptureCopyFrame(block, message + headerLength, capturedLength, family, addEthernet);
+			block += SDMMD_PacketCapturePad(capturedLength);
+			if (commentLength) {
+				block = SDMMD_PacketCapturePut16(block, kSDMMD_PacketCapturePcapngOptionComment);
+				block = SDMMD_PacketCapturePut16(block, (uint16_t)commentLength);
+				memcpy(block, comment, commentLength);
+				block += SDMMD_PacketCapturePad(commentLength);
+			}
+			// the end of options is already zeroed
+			SDMMD_PacketCapturePut32(block + 0x4, blockLength);
+		}
+	} else {
+		record = SDMMD_PacketCaptureReserve(capture, 0x10 + capturedLength, DISPATCH_TIME_NOW);
+		if (record) {
+			unsigned char *header = SDMMD_PacketCapturePut32(record, (uint32_t)timestamp.tv_sec);
+			header = SDMMD_PacketCapturePut32(header, (uint32_t)timestamp.tv_usec);
+			header = SDMMD_PacketCapturePut32(header, capturedLength);
+			header = SDMMD_PacketCapturePut32(header, originalLength);
+			SDMMD_PacketCaptureCopyFrame(header, message + headerLength, capturedLength, family, addEthernet);
+		}
+	}
+	if (record) {
+		__sync_fetch_and_add(&capture->packets, 0x1);
+		__sync_fetch_and_add(&capture->bytes, capturedLength);
+	} else {
+		__sync_fetch_and_add(&capture->dropped, 0x1);
+	}
+}
+
+#pragma mark -
+#pragma mark Reader
+#pragma mark -
+
+// Each message is a binary plist holding a single data object, it is found in place instead of being decoded into a CFData
+static bool SDMMD_PacketCaptureFindData(const unsigned char *message, uint64_t length, const unsigned char **data, uint64_t *dataLength) {
+	if (length < 0x8 + 0x20 || memcmp(message, "bplist00", 0x8) != 0x0) {
+		return false;
+	}
+	const unsigned char *trailer = message + length - 0x20;
+	uint32_t offsetSize = trailer[0x6];
+	uint64_t topObject = ((uint64_t)SDMMD_PacketCaptureGetBig32(trailer + 0x10) << 32) | SDMMD_PacketCaptureGetBig32(trailer + 0x14);
+	uint64_t offsetTable = ((uint64_t)SDMMD_PacketCaptureGetBig32(trailer + 0x18) << 32) | SDMMD_PacketCaptureGetBig32(trailer + 0x1c);
+	if (offsetSize == 0x0 || offsetSize > 0x8 || offsetTable >= length - 0x20 || topObject >= (length - 0x20 - offsetTable) / offsetSize) {
+		return false;
+	}
+	uint64_t objectOffset = 0x0;
+	for (uint32_t index = 0x0; index < offsetSize; index++) {
+		objectOffset = (objectOffset << 8) | message[offsetTable + (topObject * offsetSize) + index];
+	}
+	if (objectOffset >= offsetTable || (message[objectOffset] & 0xf0) != 0x40) {
+		return false;
+	}
+	uint64_t objectLength = message[objectOffset] & 0x0f;
+	uint64_t position = objectOffset + 0x1;
+	if (objectLength == 0x0f) {
+		// longer data has its length as an integer object right after the marker
+		if (position >= offsetTable || (message[position] & 0xf0) != 0x10 || (message[position] & 0x0f) > 0x3) {
+			return false;
+		}
+		uint32_t integerSize = 0x1 << (message[position] & 0x0f);
+		position++;
+		if (position + integerSize > offsetTable) {
+			return false;
+		}
+		objectLength = 0x0;
+		for (uint32_t index = 0x0; index < integerSize; index++) {
+			objectLength = (objectLength << 8) | message[position + index];
+		}
+		position += integerSize;
+	}
+	if (objectLength > offsetTable - position) {
+		return false;
+	}
+	*data = message + position;
+	*dataLength = objectLength;
+	return true;
+}
+
+static bool SDMMD_PacketCaptureReadFully(SDMMD_PacketCaptureRef capture, unsigned char *buffer, uint32_t length) {
+	while (length) {
+		ssize_t received;
+		if (capture->socket.isSSL) {
+			received = SSL_read(capture->socket.socket.ssl, buffer, (int)length);
+		} else {
+			received = recv(capture->socket.socket.conn, buffer, length, 0x0);
+		}
+		if (received <= 0x0) {
+			return false;
+		}
+		buffer += received;
+		length -= (uint32_t)received;
+	}
+	return true;
+}
+
+static bool SDMMD_PacketCaptureHasPendingData(SDMMD_PacketCaptureRef capture) {
+	if (capture->socket.isSSL && SSL_pending(capture->socket.socket.ssl) > 0x0) {
+		return true;
+	}
+	struct pollfd pending = {.fd = (int)capture->service->ivars.socket, .events = POLLIN};
+	return (poll(&pending, 0x1, 0x0) > 0x0);
+}
+
+static void SDMMD_PacketCaptureReader(void *context) {
+	SDMMD_PacketCaptureRef capture = (SDMMD_PacketCaptureRef)context;
+	uint32_t capacity = 0x10000;
+	unsigned char *message = malloc(capacity);
+	while (!capture->stopped) {
+		uint32_t length = 0x0;
+		if (!SDMMD_PacketCaptureReadFully(capture, (unsigned char *)&length, sizeof(length))) {
+			break;
+		}
+		length = ntohl(length);
+		if (length > kSDMMD_PacketCaptureMessageMax) {
+			printf("SDMMD_PacketCaptureReader: Message of %u bytes is too large.\n", length);
+			break;
+		}
+		if (length > capacity) {
+			capacity = length;
+			message = realloc(message, capacity);
+		}
+		if (!SDMMD_PacketCaptureReadFully(capture, message, length)) {
+			break;
+		}
+		const unsigned char *packet = NULL;
+		uint64_t packetLength = 0x0;
+		CFPropertyListRef decoded = NULL;
+		if (!SDMMD_PacketCaptureFindData(message, length, &packet, &packetLength)) {
+			// anything but the usual binary plist goes through CoreFoundation
+			CFDataRef messageData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, message, length, kCFAllocatorNull);
+			decoded = CFPropertyListCreateWithData(kCFAllocatorDefault, messageData, kCFPropertyListImmutable, NULL, NULL);
+			CFRelease(messageData);
+			if (decoded && CFGetTypeID(decoded) == CFDataGetTypeID()) {
+				packet = CFDataGetBytePtr(decoded);
+				packetLength = (uint64_t)CFDataGetLength(decoded);
+			}
+		}
+		if (packet) {
+			SDMMD_PacketCaptureFramePacket(capture, packet, packetLength);
+		} else {
+			__sync_fetch_and_add(&capture->dropped, 0x1);
+		}
+		if (decoded) {
+			CFRelease(decoded);
+		}
+		if (!SDMMD_PacketCaptureHasPendingData(capture)) {
+			// nothing else is waiting, so live readers get what there is instead of waiting for the buffer to fill
+			SDMMD_PacketCaptureHandOff(capture);
+		}
+	}
+	free(message);
+	__sync_lock_test_and_set(&capture->stopped, 0x1);
+	// the writer stops after the buffer marked last
+	SDMMD_PacketCaptureReserve(capture, 0x0, DISPATCH_TIME_FOREVER);
+	capture->buffers[capture->current].last = true;
+	SDMMD_PacketCaptureHandOff(capture);
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+sdmmd_return_t SDMMD_PacketCaptureCreate(SDMMD_AMDeviceRef device, CFStringRef outputPath, CFDictionaryRef options, SDMMD_PacketCaptureRef *capture) {
+	if (device == NULL || outputPath == NULL || capture == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_PacketCaptureRef newCapture = calloc(0x1, sizeof(struct sdmmd_PacketCaptureClass));
+	CFStringRef format = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_PacketCaptureOptionFormat)) : NULL);
+	newCapture->pcapng = (format && CFEqual(format, CFSTR(kSDMMD_PacketCaptureFormatPcapng)));
+	newCapture->snapLength = kSDMMD_PacketCaptureSnapLengthDefault;
+	CFNumberRef snapLength = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_PacketCaptureOptionSnapLength)) : NULL);
+	if (snapLength && CFGetTypeID(snapLength) == CFNumberGetTypeID()) {
+		CFNumberGetValue(snapLength, kCFNumberSInt32Type, &newCapture->snapLength);
+	}
+	// a record has to fit in one buffer along with its framing
+	if (newCapture->snapLength == 0x0 || newCapture->snapLength > kSDMMD_PacketCaptureBufferSize / 0x2) {
+		newCapture->snapLength = kSDMMD_PacketCaptureBufferSize / 0x2;
+	}
+	newCapture->current = -1;
+
+	char *path = SDMCFStringGetString(outputPath);
+	newCapture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (newCapture->fd == -1) {
+		printf("SDMMD_PacketCaptureCreate: Could not open %s.\n", path);
+		free(path);
+		free(newCapture);
+		return kAMDUndefinedError;
+	}
+	free(path);
+#ifdef F_SETNOSIGPIPE
+	// a pipe whose reader quit fails the write instead of raising SIGPIPE
+	fcntl(newCapture->fd, F_SETNOSIGPIPE, 0x1);
+#endif
+
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_PACKETCAPTURE), NULL, &newCapture->service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_PacketCaptureCreate: Was unable to start pcapd on the device: 0x%x\n", result);
+		SDMMD_PacketCaptureRelease(newCapture);
+		return result;
+	}
+	newCapture->socket = SDMMD_TranslateConnectionToSocket(newCapture->service);
+	unsigned char *buffers = malloc(kSDMMD_PacketCaptureBufferSize * kSDMMD_PacketCaptureBufferCount);
+	for (uint32_t index = 0x0; index < kSDMMD_PacketCaptureBufferCount; index++) {
+		newCapture->buffers[index].data = buffers + (index * kSDMMD_PacketCaptureBufferSize);
+	}
+	newCapture->empty = dispatch_semaphore_create(kSDMMD_PacketCaptureBufferCount);
+	newCapture->filled = dispatch_semaphore_create(0x0);
+	SDMMD_PacketCaptureWriteFileHeader(newCapture);
+
+	newCapture->group = dispatch_group_create();
+	newCapture->writerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.pcap-writer", DISPATCH_QUEUE_SERIAL);
+	newCapture->readerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.pcap-reader", DISPATCH_QUEUE_SERIAL);
+	dispatch_group_async_f(newCapture->group, newCapture->writerQueue, newCapture, SDMMD_PacketCaptureWriter);
+	dispatch_group_async_f(newCapture->group, newCapture->readerQueue, newCapture, SDMMD_PacketCaptureReader);
+	*capture = newCapture;
+	return result;
+}
+
+void SDMMD_PacketCaptureRelease(SDMMD_PacketCaptureRef capture) {
+	if (capture == NULL) {
+		return;
+	}
+	__sync_lock_test_and_set(&capture->stopped, 0x1);
+	if (capture->service) {
+		// unblocks a reader waiting in recv() or SSL_read()
+		shutdown(capture->service->ivars.socket, SHUT_RDWR);
+	}
+	if (capture->group) {
+		dispatch_group_wait(capture->group, DISPATCH_TIME_FOREVER);
+		dispatch_release(capture->group);
+		dispatch_release(capture->readerQueue);
+		dispatch_release(capture->writerQueue);
+	}
+	if (capture->empty) {
+		dispatch_release(capture->empty);
+		dispatch_release(capture->filled);
+		free(capture->buffers[0x0].data);
+	}
+	if (capture->service) {
+		SDMMD_AMDServiceConnectionInvalidate(capture->service);
+		free(capture->service);
+	}
+	close(capture->fd);
+	free(capture);
+}
+
+void SDMMD_PacketCaptureGetStatistics(SDMMD_PacketCaptureRef capture, uint64_t *packets, uint64_t *bytes, uint64_t *dropped) {
+	if (capture) {
+		if (packets) {
+			*packets = (uint64_t)__sync_fetch_and_add(&capture->packets, 0x0);
+		}
+		if (bytes) {
+			*bytes = (uint64_t)__sync_fetch_and_add(&capture->bytes, 0x0);
+		}
+		if (dropped) {
+			*dropped = (uint64_t)__sync_fetch_and_add(&capture->dropped, 0x0);
+		}
+	}
+}
+
+bool SDMMD_PacketCaptureIsRunning(SDMMD_PacketCaptureRef capture) {
+	return (capture && __sync_fetch_and_add(&capture->stopped, 0x0) == 0x0);
+}
+
+#endif
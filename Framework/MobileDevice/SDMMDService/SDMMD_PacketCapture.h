@@ -0,0 +1,114 @@
+/*
+ *  SDMMD_PacketCapture.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_PACKETCAPTURE_H_
+#define _SDM_MD_PACKETCAPTURE_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_PacketCaptureCreate()
+#define kSDMMD_PacketCaptureOptionFormat			"Format"		// CFString, kSDMMD_PacketCaptureFormatPcap (default) or kSDMMD_PacketCaptureFormatPcapng
+#define kSDMMD_PacketCaptureOptionSnapLength		"SnapLength"	// CFNumber, bytes kept of each packet, defaults to kSDMMD_PacketCaptureSnapLengthDefault
+
+#define kSDMMD_PacketCaptureFormatPcap				"pcap"
+#define kSDMMD_PacketCaptureFormatPcapng			"pcapng"
+
+#define kSDMMD_PacketCaptureSnapLengthDefault		0x40000
+
+// Packets are framed into kSDMMD_PacketCaptureBufferCount buffers of this size that a writer queue flushes in order. A buffer is handed over
+// when it is full or when the device has nothing more to send right away, packets that find every buffer still waiting to be written are dropped.
+#define kSDMMD_PacketCaptureBufferSize				0x100000
+#define kSDMMD_PacketCaptureBufferCount				0x4
+
+// Largest message accepted from pcapd
+#define kSDMMD_PacketCaptureMessageMax				0x1000000
+
+// The header pcapd puts in front of every packet, multi-byte fields are big endian except for the two pids
+#define kSDMMD_PacketCaptureHeaderLengthOffset		0
+#define kSDMMD_PacketCapturePacketLengthOffset		5
+#define kSDMMD_PacketCaptureFamilyOffset			13
+#define kSDMMD_PacketCaptureFramePreLengthOffset	17
+#define kSDMMD_PacketCaptureInterfaceOffset			25
+#define kSDMMD_PacketCapturePidOffset				41
+#define kSDMMD_PacketCaptureCommandOffset			45
+#define kSDMMD_PacketCaptureSecondsOffset			87
+#define kSDMMD_PacketCaptureMicrosecondsOffset		91
+#define kSDMMD_PacketCaptureHeaderLengthMin			95
+#define kSDMMD_PacketCaptureInterfaceNameLength		16
+#define kSDMMD_PacketCaptureCommandLength			17
+
+// Interfaces with a pcapng interface description block, one per name seen
+#define kSDMMD_PacketCaptureInterfaceMax			0x20
+
+struct sdmmd_PacketCaptureBuffer {
+	unsigned char *data;
+	uint32_t length;
+	bool last;					// the reader is done, the writer stops after this one
+} sdmmd_PacketCaptureBuffer;
+
+struct sdmmd_PacketCaptureClass {
+	SDMMD_AMConnectionRef service;
+	SocketConnection socket;
+	int fd;
+	bool pcapng;
+	uint32_t snapLength;
+	char interfaces[kSDMMD_PacketCaptureInterfaceMax][kSDMMD_PacketCaptureInterfaceNameLength + 0x1];
+	uint32_t interfaceCount;
+	// the reader owns buffers[current] while it is filling it, the writer takes them back in the same order
+	struct sdmmd_PacketCaptureBuffer buffers[kSDMMD_PacketCaptureBufferCount];
+	int32_t current;			// -1 while every buffer is waiting to be written
+	uint32_t next;
+	dispatch_semaphore_t empty;
+	dispatch_semaphore_t filled;
+	volatile int64_t packets;
+	volatile int64_t bytes;
+	volatile int64_t dropped;
+	volatile int32_t stopped;
+	volatile int32_t writeFailed;
+	dispatch_queue_t readerQueue;
+	dispatch_queue_t writerQueue;
+	dispatch_group_t group;
+} sdmmd_PacketCaptureClass;
+
+#define SDMMD_PacketCaptureRef struct sdmmd_PacketCaptureClass*
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Starts pcapd and writes every packet it reports to outputPath until released, needs an active session. outputPath may be a named pipe
+// (mkfifo) that Wireshark reads from with "-k -i <path>", in which case this blocks until the other end is opened. Non-ethernet packets are
+// given an empty ethernet header so that a single link type covers every interface.
+sdmmd_return_t SDMMD_PacketCaptureCreate(SDMMD_AMDeviceRef device, CFStringRef outputPath, CFDictionaryRef options, SDMMD_PacketCaptureRef *capture);
+
+// Stops the capture, writes out what is buffered, and closes the output
+void SDMMD_PacketCaptureRelease(SDMMD_PacketCaptureRef capture);
+
+// Packets and bytes captured, and packets dropped because the output fell behind or pcapd sent something unreadable. Any may be NULL.
+void SDMMD_PacketCaptureGetStatistics(SDMMD_PacketCaptureRef capture, uint64_t *packets, uint64_t *bytes, uint64_t *dropped);
+
+// False once the device closed the stream or the output could not be written to
+bool SDMMD_PacketCaptureIsRunning(SDMMD_PacketCaptureRef capture);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ *  SDMMD_Screenshot.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_SCREENSHOT_C_
+#define _SDM_MD_SCREENSHOT_C_
+
+#include "SDMMD_Screenshot.h"
+#include "SDMMD_Functions.h"
+#include <ImageIO/ImageIO.h>
+
+struct sdmmd_ScreenshotPlist {
+	const unsigned char *bytes;
+	uint64_t offsetTable;
+	uint64_t objectCount;
+	uint32_t offsetSize;
+	uint32_t refSize;
+};
+
+struct sdmmd_ScreenshotDelivery {
+	SDMMD_ScreenshotRef screenshot;
+	uint32_t frame;
+	CFDataRef image;
+	dispatch_queue_t queue;
+	dispatch_group_t group;
+	SDMMD_ScreenshotCallback callback;
+	void *context;
+};
+
+static const unsigned char SDMMD_ScreenshotPNGSignature[0x8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+#pragma mark -
+#pragma mark Replies
+#pragma mark -
+
+static uint64_t SDMMD_ScreenshotReadNumber(const unsigned char *bytes, uint32_t size) {
+	uint64_t value = 0x0;
+	for (uint32_t index = 0x0; index < size; index++) {
+		value = (value << 8) | bytes[index];
+	}
+	return value;
+}
+
+// Finds an object of the binary plist by reference, content is where its bytes or references start and count is its length
+static bool SDMMD_ScreenshotPlistObject(struct sdmmd_ScreenshotPlist *plist, uint64_t ref, uint8_t *type, uint64_t *count, uint64_t *content) {
+	if (ref >= plist->objectCount) {
+		return false;
+	}
+	uint64_t offset = SDMMD_ScreenshotReadNumber(plist->bytes + plist->offsetTable + (ref * plist->offsetSize), plist->offsetSize);
+	if (offset >= plist->offsetTable) {
+		return false;
+	}
+	*type = plist->bytes[offset] & 0xf0;
+	*count = plist->bytes[offset] & 0x0f;
+	uint64_t position = offset + 0x1;
+	if (*count == 0x0f) {
+		// longer objects have their length as an integer object right after the marker
+		if (position >= plist->offsetTable || (plist->bytes[position] & 0xf0) != 0x10 || (plist->bytes[position] & 0x0f) > 0x3) {
+			return false;
+		}
+		uint32_t size = 0x1 << (plist->bytes[position] & 0x0f);
+		position++;
+		if (position + size > plist->offsetTable) {
+			return false;
+		}
+		*count = SDMMD_ScreenshotReadNumber(plist->bytes + position, size);
+		position += size;
+	}
+	*content = position;
+	return true;
+}
+
+static inline bool SDMMD_ScreenshotPlistFits(struct sdmmd_ScreenshotPlist *plist, uint64_t content, uint64_t count, uint64_t size) {
+	return (size == 0x0 || count <= (plist->offsetTable - content) / size);
+}
+
+// Replies are ["DLMessageProcessMessage", {"MessageType": "ScreenShotReply", "ScreenShotData": <image>}] as a binary plist, the image is
+// located in place so it can be handed out without being copied
+static bool SDMMD_ScreenshotFindImage(const unsigned char *message, uint64_t length, const unsigned char **image, uint64_t *imageLength) {
+	if (length < 0x8 + 0x20 || memcmp(message, "bplist00", 0x8) != 0x0) {
+		return false;
+	}
+	const unsigned char *trailer = message + length - 0x20;
+	struct sdmmd_ScreenshotPlist plist = {message, SDMMD_ScreenshotReadNumber(trailer + 0x18, 0x8), SDMMD_ScreenshotReadNumber(trailer + 0x8, 0x8), trailer[0x6], trailer[0x7]};
+	if (plist.offsetSize == 0x0 || plist.offsetSize > 0x8 || plist.refSize == 0x0 || plist.refSize > 0x8 || plist.offsetTable >= length - 0x20 || plist.objectCount > (length - 0x20 - plist.offsetTable) / plist.offsetSize) {
+		return false;
+	}
+	uint8_t type = 0x0;
+	uint64_t count = 0x0, content = 0x0;
+	if (!SDMMD_ScreenshotPlistObject(&plist, SDMMD_ScreenshotReadNumber(trailer + 0x10, 0x8), &type, &count, &content) || type != 0xa0 || count < 0x2 || !SDMMD_ScreenshotPlistFits(&plist, content, count, plist.refSize)) {
+		return false;
+	}
+	uint64_t dictionaryRef = SDMMD_ScreenshotReadNumber(message + content + plist.refSize, plist.refSize);
+	if (!SDMMD_ScreenshotPlistObject(&plist, dictionaryRef, &type, &count, &content) || type != 0xd0 || !SDMMD_ScreenshotPlistFits(&plist, content, count * 0x2, plist.refSize)) {
+		return false;
+	}
+	// keys come first, then the values in the same order
+	uint64_t keys = content;
+	uint64_t entries = count;
+	size_t keyLength = strlen(kSDMMD_ScreenshotKeyData);
+	for (uint64_t index = 0x0; index < entries; index++) {
+		uint64_t keyRef = SDMMD_ScreenshotReadNumber(message + keys + (index * plist.refSize), plist.refSize);
+		if (!SDMMD_ScreenshotPlistObject(&plist, keyRef, &type, &count, &content) || type != 0x50 || count != keyLength || !SDMMD_ScreenshotPlistFits(&plist, content, count, 0x1)) {
+			continue;
+		}
+		if (memcmp(message + content, kSDMMD_ScreenshotKeyData, keyLength) != 0x0) {
+			continue;
+		}
+		uint64_t valueRef = SDMMD_ScreenshotReadNumber(message + keys + ((entries + index) * plist.refSize), plist.refSize);
+		if (SDMMD_ScreenshotPlistObject(&plist, valueRef, &type, &count, &content) && type == 0x40 && SDMMD_ScreenshotPlistFits(&plist, content, count, 0x1)) {
+			*image = message + content;
+			*imageLength = count;
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+// Anything but the usual binary reply goes through CoreFoundation, which copies the image
+static CFDataRef SDMMD_ScreenshotCopyImageFromMessage(const unsigned char *message, uint32_t length) {
+	CFDataRef image = NULL;
+	CFDataRef messageData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, message, length, kCFAllocatorNull);
+	CFArrayRef reply = CFPropertyListCreateWithData(kCFAllocatorDefault, messageData, kCFPropertyListImmutable, NULL, NULL);
+	CFRelease(messageData);
+	if (reply && CFGetTypeID(reply) == CFArrayGetTypeID() && CFArrayGetCount(reply) >= 0x2) {
+		CFDictionaryRef body = CFArrayGetValueAtIndex(reply, 0x1);
+		if (CFGetTypeID(body) == CFDictionaryGetTypeID()) {
+			CFDataRef data = CFDictionaryGetValue(body, CFSTR(kSDMMD_ScreenshotKeyData));
+			if (data && CFGetTypeID(data) == CFDataGetTypeID()) {
+				image = CFRetain(data);
+			}
+		}
+	}
+	if (reply) {
+		CFRelease(reply);
+	}
+	return image;
+}
+
+static void SDMMD_ScreenshotFreeMessage(void *pointer, void *info) {
+	// pointer is the image inside the message, info is the message itself
+	free(info);
+}
+
+static bool SDMMD_ScreenshotReadFully(SDMMD_ScreenshotRef screenshot, unsigned char *buffer, uint32_t length) {
+	while (length) {
+		ssize_t received;
+		if (screenshot->socket.isSSL) {
+			received = SSL_read(screenshot->socket.socket.ssl, buffer, (int)length);
+		} else {
+			received = recv(screenshot->socket.socket.conn, buffer, length, 0x0);
+		}
+		if (received <= 0x0) {
+			return false;
+		}
+		buffer += received;
+		length -= (uint32_t)received;
+	}
+	return true;
+}
+
+static sdmmd_return_t SDMMD_ScreenshotReceiveImage(SDMMD_ScreenshotRef screenshot, CFDataRef *image) {
+	uint32_t length = 0x0;
+	if (!SDMMD_ScreenshotReadFully(screenshot, (unsigned char *)&length, sizeof(length))) {
+		return kAMDReceiveMessageError;
+	}
+	length = ntohl(length);
+	if (length == 0x0 || length > kSDMMD_ScreenshotMessageMax) {
+		printf("SDMMD_ScreenshotReceiveImage: Reply of %u bytes is not usable.\n", length);
+		return kAMDInvalidResponseError;
+	}
+	unsigned char *message = malloc(length);
+	if (!SDMMD_ScreenshotReadFully(screenshot, message, length)) {
+		free(message);
+		return kAMDReceiveMessageError;
+	}
+	const unsigned char *bytes = NULL;
+	uint64_t byteLength = 0x0;
+	if (SDMMD_ScreenshotFindImage(message, length, &bytes, &byteLength)) {
+		// the image keeps the whole message alive and frees it when it is released
+		CFAllocatorContext context = {0x0, message, NULL, NULL, NULL, NULL, NULL, SDMMD_ScreenshotFreeMessage, NULL};
+		CFAllocatorRef deallocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+		*image = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, bytes, (CFIndex)byteLength, deallocator);
+		CFRelease(deallocator);
+	} else {
+		*image = SDMMD_ScreenshotCopyImageFromMessage(message, length);
+		free(message);
+	}
+	return (*image ? kAMDSuccess : kAMDInvalidResponseError);
+}
+
+#pragma mark -
+#pragma mark Delivery
+#pragma mark -
+
+static CFDataRef SDMMD_ScreenshotCreatePNG(CFDataRef image) {
+	CFMutableDataRef png = NULL;
+	CGImageSourceRef source = CGImageSourceCreateWithData(image, NULL);
+	if (source) {
+		png = CFDataCreateMutable(kCFAllocatorDefault, 0x0);
+		CGImageDestinationRef destination = CGImageDestinationCreateWithData(png, CFSTR("public.png"), 0x1, NULL);
+		bool encoded = false;
+		if (destination) {
+			CGImageDestinationAddImageFromSource(destination, source, 0x0, NULL);
+			encoded = CGImageDestinationFinalize(destination);
+			CFRelease(destination);
+		}
+		if (!encoded) {
+			CFRelease(png);
+			png = NULL;
+		}
+		CFRelease(source);
+	}
+	return png;
+}
+
+static void SDMMD_ScreenshotDeliverFrame(void *context) {
+	struct sdmmd_ScreenshotDelivery *delivery = (struct sdmmd_ScreenshotDelivery *)context;
+	delivery->callback(delivery->screenshot, delivery->frame, delivery->image, delivery->context);
+	CFRelease(delivery->image);
+	dispatch_group_leave(delivery->group);
+	free(delivery);
+}
+
+// Runs on a global queue so several frames are encoded at once, the frame is delivered if encoding fails
+static void SDMMD_ScreenshotEncodeFrame(void *context) {
+	struct sdmmd_ScreenshotDelivery *delivery = (struct sdmmd_ScreenshotDelivery *)context;
+	CFDataRef png = SDMMD_ScreenshotCreatePNG(delivery->image);
+	if (png) {
+		CFRelease(delivery->image);
+		delivery->image = png;
+	} else {
+		printf("SDMMD_ScreenshotEncodeFrame: Could not encode frame %u as PNG.\n", delivery->frame);
+	}
+	dispatch_async_f(delivery->queue, delivery, SDMMD_ScreenshotDeliverFrame);
+}
+
+static void SDMMD_ScreenshotDeliver(SDMMD_ScreenshotRef screenshot, uint32_t frame, CFDataRef image, dispatch_queue_t queue, dispatch_group_t group, SDMMD_ScreenshotCallback callback, void *context) {
+	struct sdmmd_ScreenshotDelivery *delivery = calloc(0x1, sizeof(struct sdmmd_ScreenshotDelivery));
+	*delivery = (struct sdmmd_ScreenshotDelivery){screenshot, frame, image, queue, group, callback, context};
+	dispatch_group_enter(group);
+	bool isPNG = (CFDataGetLength(image) >= (CFIndex)sizeof(SDMMD_ScreenshotPNGSignature) && memcmp(CFDataGetBytePtr(image), SDMMD_ScreenshotPNGSignature, sizeof(SDMMD_ScreenshotPNGSignature)) == 0x0);
+	if (screenshot->encodePNG && !isPNG) {
+		dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0x0), delivery, SDMMD_ScreenshotEncodeFrame);
+	} else {
+		dispatch_async_f(queue, delivery, SDMMD_ScreenshotDeliverFrame);
+	}
+}
+
+#pragma mark -
+#pragma mark DeviceLink
+#pragma mark -
+
+static bool SDMMD_ScreenshotMessageIs(CFPropertyListRef message, CFStringRef name) {
+	return (message && CFGetTypeID(message) == CFArrayGetTypeID() && CFArrayGetCount(message) && CFEqual(CFArrayGetValueAtIndex(message, 0x0), name));
+}
+
+static sdmmd_return_t SDMMD_ScreenshotVersionExchange(SDMMD_ScreenshotRef screenshot) {
+	CFPropertyListRef message = NULL;
+	sdmmd_return_t result = SDMMD_ServiceReceiveMessage(screenshot->socket, &message);
+	if (result == kAMDSuccess && !SDMMD_ScreenshotMessageIs(message, CFSTR(kSDMMD_DeviceLinkVersionExchange))) {
+		result = kAMDInvalidResponseError;
+	}
+	if (message) {
+		CFRelease(message);
+		message = NULL;
+	}
+	if (result == kAMDSuccess) {
+		int32_t major = kSDMMD_ScreenshotVersionMajor;
+		CFNumberRef version = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &major);
+		const void *values[0x3] = {CFSTR(kSDMMD_DeviceLinkVersionExchange), CFSTR(kSDMMD_DeviceLinkVersionsOk), version};
+		CFArrayRef reply = CFArrayCreate(kCFAllocatorDefault, values, 0x3, &kCFTypeArrayCallBacks);
+		result = SDMMD_ServiceSendMessage(screenshot->socket, reply, kCFPropertyListBinaryFormat_v1_0);
+		CFRelease(reply);
+		CFRelease(version);
+	}
+	if (result == kAMDSuccess) {
+		result = SDMMD_ServiceReceiveMessage(screenshot->socket, &message);
+		if (result == kAMDSuccess && !SDMMD_ScreenshotMessageIs(message, CFSTR(kSDMMD_DeviceLinkDeviceReady))) {
+			result = kAMDInvalidResponseError;
+		}
+		if (message) {
+			CFRelease(message);
+		}
+	}
+	return result;
+}
+
+static CFDataRef SDMMD_ScreenshotCreateRequest() {
+	CFMutableDictionaryRef body = SDMMD_create_dict();
+	CFDictionarySetValue(body, CFSTR(kSDMMD_ScreenshotKeyMessageType), CFSTR(kSDMMD_ScreenshotMessageRequest));
+	const void *values[0x2] = {CFSTR(kSDMMD_DeviceLinkProcessMessage), body};
+	CFArrayRef message = CFArrayCreate(kCFAllocatorDefault, values, 0x2, &kCFTypeArrayCallBacks);
+	CFDataRef request = CFPropertyListCreateData(kCFAllocatorDefault, message, kCFPropertyListBinaryFormat_v1_0, 0x0, NULL);
+	CFRelease(message);
+	CFRelease(body);
+	return request;
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+sdmmd_return_t SDMMD_ScreenshotCreate(SDMMD_AMDeviceRef device, CFDictionaryRef options, SDMMD_ScreenshotRef *screenshot) {
+	if (device == NULL || screenshot == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_ScreenshotRef newScreenshot = calloc(0x1, sizeof(struct sdmmd_ScreenshotClass));
+	newScreenshot->pipelineDepth = kSDMMD_ScreenshotPipelineDepthDefault;
+	CFNumberRef depth = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_ScreenshotOptionPipelineDepth)) : NULL);
+	if (depth && CFGetTypeID(depth) == CFNumberGetTypeID()) {
+		CFNumberGetValue(depth, kCFNumberSInt32Type, &newScreenshot->pipelineDepth);
+	}
+	if (newScreenshot->pipelineDepth == 0x0) {
+		newScreenshot->pipelineDepth = 0x1;
+	} else if (newScreenshot->pipelineDepth > kSDMMD_ScreenshotPipelineDepthMax) {
+		newScreenshot->pipelineDepth = kSDMMD_ScreenshotPipelineDepthMax;
+	}
+	CFBooleanRef encode = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_ScreenshotOptionEncodePNG)) : NULL);
+	newScreenshot->encodePNG = (encode && CFGetTypeID(encode) == CFBooleanGetTypeID() && CFBooleanGetValue(encode));
+
+	sdmmd_return_t result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_SCREENSHOT), NULL, &newScreenshot->service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_ScreenshotCreate: Was unable to start screenshotr on the device: 0x%x\n", result);
+		free(newScreenshot);
+		return result;
+	}
+	newScreenshot->socket = SDMMD_TranslateConnectionToSocket(newScreenshot->service);
+	result = SDMMD_ScreenshotVersionExchange(newScreenshot);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_ScreenshotCreate: DeviceLink version exchange failed: 0x%x\n", result);
+		SDMMD_AMDServiceConnectionInvalidate(newScreenshot->service);
+		free(newScreenshot->service);
+		free(newScreenshot);
+		return result;
+	}
+	newScreenshot->request = SDMMD_ScreenshotCreateRequest();
+	newScreenshot->callbackQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.screenshot", DISPATCH_QUEUE_SERIAL);
+	*screenshot = newScreenshot;
+	return result;
+}
+
+void SDMMD_ScreenshotRelease(SDMMD_ScreenshotRef screenshot) {
+	if (screenshot == NULL) {
+		return;
+	}
+	if (!screenshot->broken) {
+		const void *values[0x2] = {CFSTR(kSDMMD_DeviceLinkDisconnect), CFSTR(kSDMMD_DeviceLinkEmptyParameter)};
+		CFArrayRef disconnect = CFArrayCreate(kCFAllocatorDefault, values, 0x2, &kCFTypeArrayCallBacks);
+		SDMMD_ServiceSendMessage(screenshot->socket, disconnect, kCFPropertyListBinaryFormat_v1_0);
+		CFRelease(disconnect);
+	}
+	SDMMD_AMDServiceConnectionInvalidate(screenshot->service);
+	free(screenshot->service);
+	if (screenshot->request) {
+		CFRelease(screenshot->request);
+	}
+	dispatch_release(screenshot->callbackQueue);
+	free(screenshot);
+}
+
+sdmmd_return_t SDMMD_ScreenshotCapture(SDMMD_ScreenshotRef screenshot, uint32_t count, dispatch_queue_t queue, SDMMD_ScreenshotCallback callback, void *context) {
+	if (screenshot == NULL || callback == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	if (screenshot->broken) {
+		return kAMDNotConnectedError;
+	}
+	dispatch_group_t group = dispatch_group_create();
+	sdmmd_return_t result = kAMDSuccess;
+	uint32_t sent = 0x0, received = 0x0;
+	while (received < count && result == kAMDSuccess) {
+		// keep the pipeline full, the device works on the next request while the previous image is on the wire
+		while (sent < count && sent - received < screenshot->pipelineDepth && result == kAMDSuccess) {
+			result = SDMMD_ServiceSend(screenshot->socket, screenshot->request);
+			sent++;
+		}
+		CFDataRef image = NULL;
+		if (result == kAMDSuccess) {
+			result = SDMMD_ScreenshotReceiveImage(screenshot, &image);
+		}
+		if (result == kAMDSuccess) {
+			SDMMD_ScreenshotDeliver(screenshot, received, image, (queue ? queue : screenshot->callbackQueue), group, callback, context);
+			received++;
+		}
+	}
+	if (result != kAMDSuccess) {
+		printf("SDMMD_ScreenshotCapture: Capture stopped after %u of %u frames: 0x%x\n", received, count, result);
+		// replies to the requests still in flight can not be told apart from later ones
+		screenshot->broken = (sent != received);
+	}
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+	dispatch_release(group);
+	return result;
+}
+
+static void SDMMD_ScreenshotKeepImage(SDMMD_ScreenshotRef screenshot, uint32_t frame, CFDataRef image, void *context) {
+	*(CFDataRef *)context = CFRetain(image);
+}
+
+sdmmd_return_t SDMMD_ScreenshotCopyImage(SDMMD_ScreenshotRef screenshot, CFDataRef *image) {
+	if (image == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	*image = NULL;
+	return SDMMD_ScreenshotCapture(screenshot, 0x1, NULL, SDMMD_ScreenshotKeepImage, image);
+}
+
+#endif
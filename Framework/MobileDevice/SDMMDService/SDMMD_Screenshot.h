@@ -0,0 +1,90 @@
+/*
+ *  SDMMD_Screenshot.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_SCREENSHOT_H_
+#define _SDM_MD_SCREENSHOT_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_ScreenshotCreate()
+#define kSDMMD_ScreenshotOptionPipelineDepth	"PipelineDepth"	// CFNumber, capture requests kept in flight, defaults to kSDMMD_ScreenshotPipelineDepthDefault
+#define kSDMMD_ScreenshotOptionEncodePNG		"EncodePNG"		// CFBoolean, re-encode images the device does not send as PNG on a background queue (default false)
+
+#define kSDMMD_ScreenshotPipelineDepthDefault	0x4
+#define kSDMMD_ScreenshotPipelineDepthMax		0x20
+
+// DeviceLink messages spoken by screenshotr
+#define kSDMMD_DeviceLinkVersionExchange		"DLMessageVersionExchange"
+#define kSDMMD_DeviceLinkVersionsOk				"DLVersionsOk"
+#define kSDMMD_DeviceLinkDeviceReady			"DLMessageDeviceReady"
+#define kSDMMD_DeviceLinkProcessMessage			"DLMessageProcessMessage"
+#define kSDMMD_DeviceLinkDisconnect				"DLMessageDisconnect"
+#define kSDMMD_DeviceLinkEmptyParameter			"___EmptyParameterString___"
+
+#define kSDMMD_ScreenshotVersionMajor			300
+#define kSDMMD_ScreenshotKeyMessageType			"MessageType"
+#define kSDMMD_ScreenshotKeyData				"ScreenShotData"
+#define kSDMMD_ScreenshotMessageRequest			"ScreenShotRequest"
+#define kSDMMD_ScreenshotMessageReply			"ScreenShotReply"
+
+// Largest reply accepted from screenshotr
+#define kSDMMD_ScreenshotMessageMax				0x8000000
+
+struct sdmmd_ScreenshotClass;
+
+// Called once per captured frame on the capture's queue, image is TIFF or PNG as the device sent it (PNG when re-encoding) and is only
+// retained for the duration of the call. frame counts from 0 within one SDMMD_ScreenshotCapture() call.
+typedef void (*SDMMD_ScreenshotCallback)(struct sdmmd_ScreenshotClass *screenshot, uint32_t frame, CFDataRef image, void *context);
+
+struct sdmmd_ScreenshotClass {
+	SDMMD_AMConnectionRef service;
+	SocketConnection socket;
+	uint32_t pipelineDepth;
+	bool encodePNG;
+	bool broken;				// a capture failed with replies still outstanding, the connection can not be used any more
+	CFDataRef request;			// the serialized capture request, sent as is for every frame
+	dispatch_queue_t callbackQueue;
+} sdmmd_ScreenshotClass;
+
+#define SDMMD_ScreenshotRef struct sdmmd_ScreenshotClass*
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Starts screenshotr and does the DeviceLink version exchange, the connection is then kept open for any number of captures. Needs an active
+// session and the developer disk image mounted.
+sdmmd_return_t SDMMD_ScreenshotCreate(SDMMD_AMDeviceRef device, CFDictionaryRef options, SDMMD_ScreenshotRef *screenshot);
+
+// Disconnects from screenshotr and closes the connection
+void SDMMD_ScreenshotRelease(SDMMD_ScreenshotRef screenshot);
+
+// Takes count screenshots, keeping up to the pipeline depth of requests in flight. Images are not copied out of the received messages, and are
+// handed to callback on queue (a private serial queue if NULL). Returns once every frame has been delivered.
+sdmmd_return_t SDMMD_ScreenshotCapture(SDMMD_ScreenshotRef screenshot, uint32_t count, dispatch_queue_t queue, SDMMD_ScreenshotCallback callback, void *context);
+
+// Takes a single screenshot, the image belongs to the caller
+sdmmd_return_t SDMMD_ScreenshotCopyImage(SDMMD_ScreenshotRef screenshot, CFDataRef *image);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ *  SDMMD_SyslogRelay.c
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_SYSLOGRELAY_C_
+#define _SDM_MD_SYSLOGRELAY_C_
+
+#include "SDMMD_SyslogRelay.h"
+#include "SDMMD_Functions.h"
+#include <sys/socket.h>
+
+#pragma mark -
+#pragma mark Filtering
+#pragma mark -
+
+// Lines look like "Oct 19 12:34:56 iPhone SpringBoard(FrontBoard)[57] <Notice>: ...", the process is the fifth field up to '[', '(' or ':'
+static bool SDMMD_SyslogRelayMatchesProcess(SDMMD_SyslogRelayRef relay, const char *line, uint32_t length) {
+	const char *end = line + length;
+	const char *field = line;
+	for (uint32_t index = 0x0; index < 0x4; index++) {
+		while (field < end && *field != ' ') {
+			field++;
+		}
+		while (field < end && *field == ' ') {
+			field++;
+		}
+	}
+	const char *nameEnd = field;
+	while (nameEnd < end && *nameEnd != '[' && *nameEnd != '(' && *nameEnd != ':' && *nameEnd != ' ') {
+		nameEnd++;
+	}
+	size_t nameLength = (size_t)(nameEnd - field);
+	for (uint32_t index = 0x0; index < relay->processCount; index++) {
+		if (strlen(relay->processes[index]) == nameLength && memcmp(relay->processes[index], field, nameLength) == 0x0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// line[length] is the byte that ended the line, which belongs to the read buffer and is overwritten so regexec() sees a C string
+static bool SDMMD_SyslogRelayShouldKeep(SDMMD_SyslogRelayRef relay, char *line, uint32_t length) {
+	if (relay->processCount && !SDMMD_SyslogRelayMatchesProcess(relay, line, length)) {
+		return false;
+	}
+	if (relay->hasRegex) {
+		line[length] = '\0';
+		return (regexec(&relay->regex, line, 0x0, NULL, 0x0) == 0x0);
+	}
+	return true;
+}
+
+#pragma mark -
+#pragma mark Ring Buffer
+#pragma mark -
+
+static inline uint64_t SDMMD_SyslogRelayRecordSize(uint32_t length) {
+	// the length word, the line and its terminating NUL, padded so the next length word stays aligned
+	return sizeof(uint32_t) + (((uint64_t)length + 0x1 + 0x3) & ~0x3ull);
+}
+
+static bool SDMMD_SyslogRelayPush(SDMMD_SyslogRelayRef relay, const char *line, uint32_t length) {
+	uint64_t ringSize = relay->ringMask + 0x1;
+	uint64_t head = relay->head;
+	uint64_t tail = __sync_fetch_and_add(&relay->tail, 0x0);
+	uint64_t position = head & relay->ringMask;
+	uint64_t contiguous = ringSize - position;
+	uint64_t recordSize = SDMMD_SyslogRelayRecordSize(length);
+	uint64_t needed = (recordSize > contiguous ? contiguous + recordSize : recordSize);
+	if (needed > ringSize - (head - tail)) {
+		return false;
+	}
+	if (recordSize > contiguous) {
+		*(uint32_t *)(relay->ring + position) = kSDMMD_SyslogRelayRecordWrap;
+		head += contiguous;
+		position = 0x0;
+	}
+	*(uint32_t *)(relay->ring + position) = length;
+	memcpy(relay->ring + position + sizeof(uint32_t), line, length);
+	relay->ring[position + sizeof(uint32_t) + length] = '\0';
+	// the record has to be visible before the consumer can see the new head
+	__sync_synchronize();
+	relay->head = head + recordSize;
+	return true;
+}
+
+uint32_t SDMMD_SyslogRelayDrain(SDMMD_SyslogRelayRef relay, SDMMD_SyslogRelayLineCallback callback, void *context, uint32_t maxLines) {
+	uint32_t count = 0x0;
+	if (relay == NULL || callback == NULL) {
+		return count;
+	}
+	uint64_t ringSize = relay->ringMask + 0x1;
+	uint64_t tail = relay->tail;
+	uint64_t head = __sync_fetch_and_add(&relay->head, 0x0);
+	while (tail != head && (maxLines == 0x0 || count < maxLines)) {
+		uint64_t position = tail & relay->ringMask;
+		uint32_t length = *(uint32_t *)(relay->ring + position);
+		if (length == kSDMMD_SyslogRelayRecordWrap) {
+			tail += ringSize - position;
+		} else {
+			callback((const char *)(relay->ring + position + sizeof(uint32_t)), length, context);
+			tail += SDMMD_SyslogRelayRecordSize(length);
+			count++;
+		}
+		// the reader may only reuse the space once the callback is done with it
+		__sync_synchronize();
+		relay->tail = tail;
+		if (tail == head) {
+			head = __sync_fetch_and_add(&relay->head, 0x0);
+		}
+	}
+	return count;
+}
+
+static void SDMMD_SyslogRelayDrainToHandler(void *context) {
+	SDMMD_SyslogRelayRef relay = (SDMMD_SyslogRelayRef)context;
+	__sync_lock_release(&relay->drainScheduled);
+	SDMMD_SyslogRelayDrain(relay, relay->handler, relay->handlerContext, 0x0);
+}
+
+static void SDMMD_SyslogRelayScheduleDrain(SDMMD_SyslogRelayRef relay) {
+	// one pending drain picks up everything stored before it runs
+	if (relay->handler && __sync_lock_test_and_set(&relay->drainScheduled, 0x1) == 0x0) {
+		dispatch_group_async_f(relay->handlerGroup, relay->handlerQueue, relay, SDMMD_SyslogRelayDrainToHandler);
+	}
+}
+
+#pragma mark -
+#pragma mark Reader
+#pragma mark -
+
+static ssize_t SDMMD_SyslogRelayRead(SDMMD_SyslogRelayRef relay, unsigned char *buffer, size_t length) {
+	if (relay->socket.isSSL) {
+		int received = SSL_read(relay->socket.socket.ssl, buffer, (int)length);
+		return (received > 0x0 ? received : -1);
+	}
+	ssize_t received = recv(relay->socket.socket.conn, buffer, length, 0x0);
+	return (received > 0x0 ? received : -1);
+}
+
+static bool SDMMD_SyslogRelayIngest(SDMMD_SyslogRelayRef relay, char *line, uint32_t length) {
+	bool stored = false;
+	if (length > kSDMMD_SyslogRelayLineMax) {
+		length = kSDMMD_SyslogRelayLineMax;
+	}
+	__sync_fetch_and_add(&relay->received, 0x1);
+	if (SDMMD_SyslogRelayShouldKeep(relay, line, length)) {
+		__sync_fetch_and_add(&relay->kept, 0x1);
+		stored = SDMMD_SyslogRelayPush(relay, line, length);
+		if (!stored) {
+			__sync_fetch_and_add(&relay->dropped, 0x1);
+		}
+	}
+	return stored;
+}
+
+// Messages are NUL terminated and may span several lines, both end a line here. Lines are filtered and copied straight out of the read buffer.
+static void SDMMD_SyslogRelayReader(void *context) {
+	SDMMD_SyslogRelayRef relay = (SDMMD_SyslogRelayRef)context;
+	// room for a cut off line carried over from the previous read, and for the byte the regex filter writes past a line
+	unsigned char *buffer = calloc(0x1, kSDMMD_SyslogRelayLineMax + kSDMMD_SyslogRelayChunkSize + 0x1);
+	size_t carried = 0x0;
+	bool skipping = false;
+	while (!relay->stopped) {
+		ssize_t received = SDMMD_SyslogRelayRead(relay, buffer + carried, kSDMMD_SyslogRelayChunkSize);
+		if (received <= 0x0) {
+			break;
+		}
+		size_t available = carried + (size_t)received;
+		size_t start = 0x0;
+		bool stored = false;
+		for (size_t index = carried; index < available; index++) {
+			if (buffer[index] != '\n' && buffer[index] != '\0') {
+				continue;
+			}
+			if (skipping) {
+				skipping = false;
+			} else if (index > start && SDMMD_SyslogRelayIngest(relay, (char *)(buffer + start), (uint32_t)(index - start))) {
+				stored = true;
+			}
+			start = index + 0x1;
+		}
+		carried = available - start;
+		if (carried > kSDMMD_SyslogRelayLineMax) {
+			// the line is cut off here and the rest of it is skipped
+			if (!skipping && SDMMD_SyslogRelayIngest(relay, (char *)(buffer + start), kSDMMD_SyslogRelayLineMax)) {
+				stored = true;
+			}
+			skipping = true;
+			carried = 0x0;
+		}
+		memmove(buffer, buffer + start, carried);
+		if (stored) {
+			SDMMD_SyslogRelayScheduleDrain(relay);
+		}
+	}
+	free(buffer);
+	__sync_lock_test_and_set(&relay->stopped, 0x1);
+}
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+static sdmmd_return_t SDMMD_SyslogRelayAllocate(CFDictionaryRef options, SDMMD_SyslogRelayRef *relay) {
+	SDMMD_SyslogRelayRef newRelay = calloc(0x1, sizeof(struct sdmmd_SyslogRelayClass));
+	CFStringRef pattern = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_SyslogRelayOptionRegex)) : NULL);
+	if (pattern) {
+		char *regexString = SDMCFStringGetString(pattern);
+		int regexResult = regcomp(&newRelay->regex, regexString, REG_EXTENDED | REG_NOSUB);
+		free(regexString);
+		if (regexResult != 0x0) {
+			printf("SDMMD_SyslogRelayCreate: Invalid regular expression.\n");
+			free(newRelay);
+			return kAMDInvalidArgumentError;
+		}
+		newRelay->hasRegex = true;
+	}
+	CFArrayRef processes = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_SyslogRelayOptionProcesses)) : NULL);
+	if (processes && CFGetTypeID(processes) == CFArrayGetTypeID() && CFArrayGetCount(processes)) {
+		newRelay->processCount = (uint32_t)CFArrayGetCount(processes);
+		newRelay->processes = calloc(newRelay->processCount, sizeof(char *));
+		for (uint32_t index = 0x0; index < newRelay->processCount; index++) {
+			newRelay->processes[index] = SDMCFStringGetString(CFArrayGetValueAtIndex(processes, index));
+		}
+	}
+	uint64_t ringSize = kSDMMD_SyslogRelayBufferSizeDefault;
+	CFNumberRef bufferSize = (options ? CFDictionaryGetValue(options, CFSTR(kSDMMD_SyslogRelayOptionBufferSize)) : NULL);
+	if (bufferSize && CFGetTypeID(bufferSize) == CFNumberGetTypeID()) {
+		uint64_t requested = 0x0;
+		CFNumberGetValue(bufferSize, kCFNumberSInt64Type, &requested);
+		ringSize = kSDMMD_SyslogRelayBufferSizeMin;
+		while (ringSize < requested) {
+			ringSize <<= 0x1;
+		}
+	}
+	newRelay->ring = calloc(0x1, ringSize);
+	newRelay->ringMask = ringSize - 0x1;
+	*relay = newRelay;
+	return kAMDSuccess;
+}
+
+static void SDMMD_SyslogRelayStart(SDMMD_SyslogRelayRef relay, dispatch_queue_t queue, SDMMD_SyslogRelayLineCallback handler, void *context) {
+	if (handler) {
+		relay->handler = handler;
+		relay->handlerContext = context;
+		relay->handlerGroup = dispatch_group_create();
+		// drains only run one at a time on this queue, the caller's queue may be concurrent so it is only used as the target
+		relay->handlerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.syslog-handler", DISPATCH_QUEUE_SERIAL);
+		if (queue) {
+			dispatch_set_target_queue(relay->handlerQueue, queue);
+		}
+	}
+	relay->readerQueue = dispatch_queue_create("com.samdmarshall.sdmmobiledevice.syslog-reader", DISPATCH_QUEUE_SERIAL);
+	relay->readerGroup = dispatch_group_create();
+	dispatch_group_async_f(relay->readerGroup, relay->readerQueue, relay, SDMMD_SyslogRelayReader);
+}
+
+sdmmd_return_t SDMMD_SyslogRelayCreate(SDMMD_AMDeviceRef device, CFDictionaryRef options, dispatch_queue_t queue, SDMMD_SyslogRelayLineCallback handler, void *context, SDMMD_SyslogRelayRef *relay) {
+	if (device == NULL || relay == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_SyslogRelayRef newRelay = NULL;
+	sdmmd_return_t result = SDMMD_SyslogRelayAllocate(options, &newRelay);
+	if (result != kAMDSuccess) {
+		return result;
+	}
+	result = SDMMD_AMDeviceSecureStartService(device, CFSTR(AMSVC_SYSLOG_RELAY), NULL, &newRelay->service);
+	if (result != kAMDSuccess) {
+		printf("SDMMD_SyslogRelayCreate: Was unable to start syslog_relay on the device: 0x%x\n", result);
+		newRelay->stopped = 0x1;
+		SDMMD_SyslogRelayRelease(newRelay);
+		return result;
+	}
+	newRelay->socket = SDMMD_TranslateConnectionToSocket(newRelay->service);
+	SDMMD_SyslogRelayStart(newRelay, queue, handler, context);
+	*relay = newRelay;
+	return result;
+}
+
+sdmmd_return_t SDMMD_SyslogRelayCreateWithSocket(int socket, CFDictionaryRef options, dispatch_queue_t queue, SDMMD_SyslogRelayLineCallback handler, void *context, SDMMD_SyslogRelayRef *relay) {
+	if (socket < 0x0 || relay == NULL) {
+		return kAMDInvalidArgumentError;
+	}
+	SDMMD_SyslogRelayRef newRelay = NULL;
+	sdmmd_return_t result = SDMMD_SyslogRelayAllocate(options, &newRelay);
+	if (result == kAMDSuccess) {
+		newRelay->socket.isSSL = false;
+		newRelay->socket.socket.conn = socket;
+		SDMMD_SyslogRelayStart(newRelay, queue, handler, context);
+		*relay = newRelay;
+	}
+	return result;
+}
+
+void SDMMD_SyslogRelayRelease(SDMMD_SyslogRelayRef relay) {
+	if (relay == NULL) {
+		return;
+	}
+	__sync_lock_test_and_set(&relay->stopped, 0x1);
+	if (relay->service) {
+		// unblocks a reader waiting in recv() or SSL_read()
+		shutdown(relay->service->ivars.socket, SHUT_RDWR);
+	} else if (relay->readerGroup) {
+		// the caller's socket is only shut down for reading, closing it stays with the caller
+		shutdown(relay->socket.socket.conn, SHUT_RD);
+	}
+	if (relay->readerGroup) {
+		dispatch_group_wait(relay->readerGroup, DISPATCH_TIME_FOREVER);
+		dispatch_release(relay->readerGroup);
+		dispatch_release(relay->readerQueue);
+	}
+	if (relay->handlerGroup) {
+		dispatch_group_wait(relay->handlerGroup, DISPATCH_TIME_FOREVER);
+		dispatch_release(relay->handlerGroup);
+		dispatch_release(relay->handlerQueue);
+	}
+	if (relay->service) {
+		SDMMD_AMDServiceConnectionInvalidate(relay->service);
+		free(relay->service);
+	}
+	for (uint32_t index = 0x0; index < relay->processCount; index++) {
+		free(relay->processes[index]);
+	}
+	free(relay->processes);
+	if (relay->hasRegex) {
+		regfree(&relay->regex);
+	}
+	free(relay->ring);
+	free(relay);
+}
+
+void SDMMD_SyslogRelayGetStatistics(SDMMD_SyslogRelayRef relay, uint64_t *received, uint64_t *kept, uint64_t *dropped) {
+	if (relay) {
+		if (received) {
+			*received = (uint64_t)__sync_fetch_and_add(&relay->received, 0x0);
+		}
+		if (kept) {
+			*kept = (uint64_t)__sync_fetch_and_add(&relay->kept, 0x0);
+		}
+		if (dropped) {
+			*dropped = (uint64_t)__sync_fetch_and_add(&relay->dropped, 0x0);
+		}
+	}
+}
+
+bool SDMMD_SyslogRelayIsRunning(SDMMD_SyslogRelayRef relay) {
+	return (relay && __sync_fetch_and_add(&relay->stopped, 0x0) == 0x0);
+}
+
+#endif
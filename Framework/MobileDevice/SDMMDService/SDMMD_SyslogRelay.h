@@ -0,0 +1,103 @@
+/*
+ *  SDMMD_SyslogRelay.h
+ *  SDMMobileDevice
+ *
+ *  Copyright (c) 2013, Sam Marshall
+ *  All rights reserved.
+ * 
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *  3. All advertising materials mentioning features or use of this software must display the following acknowledgement:
+ *  	This product includes software developed by the Sam Marshall.
+ *  4. Neither the name of the Sam Marshall nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+ * 
+ *  THIS SOFTWARE IS PROVIDED BY Sam Marshall ''AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Sam Marshall BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+#ifndef _SDM_MD_SYSLOGRELAY_H_
+#define _SDM_MD_SYSLOGRELAY_H_
+
+#include "SDMMD_AMDevice.h"
+#include "SDMMD_Error.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_Service.h"
+#include <regex.h>
+
+#pragma mark -
+#pragma mark TYPES
+#pragma mark -
+
+// Options dictionary keys for SDMMD_SyslogRelayCreate()
+#define kSDMMD_SyslogRelayOptionProcesses		"Processes"		// CFArray of CFString, only keep lines logged by these processes (default all)
+#define kSDMMD_SyslogRelayOptionRegex			"Regex"			// CFString, extended regular expression a line has to match to be kept (default none)
+#define kSDMMD_SyslogRelayOptionBufferSize		"BufferSize"	// CFNumber, bytes of the ring buffer, rounded up to a power of two, defaults to kSDMMD_SyslogRelayBufferSizeDefault
+
+#define kSDMMD_SyslogRelayBufferSizeDefault		0x100000
+#define kSDMMD_SyslogRelayBufferSizeMin			0x10000
+
+// The stream is read this much at a time, lines longer than kSDMMD_SyslogRelayLineMax are cut off
+#define kSDMMD_SyslogRelayChunkSize				0x10000
+#define kSDMMD_SyslogRelayLineMax				0x4000
+
+// Marks the rest of the ring as unused, the next record starts at the beginning
+#define kSDMMD_SyslogRelayRecordWrap			0xffffffff
+
+// Called once per kept line, line is NUL terminated and only valid for the duration of the call
+typedef void (*SDMMD_SyslogRelayLineCallback)(const char *line, uint32_t length, void *context);
+
+struct sdmmd_SyslogRelayClass {
+	SDMMD_AMConnectionRef service;
+	SocketConnection socket;
+	// filters, applied by the reader before a line is stored
+	char **processes;
+	uint32_t processCount;
+	regex_t regex;
+	bool hasRegex;
+	// single producer, single consumer ring of records, each a uint32_t length and the line padded to four bytes
+	unsigned char *ring;
+	uint64_t ringMask;
+	volatile uint64_t head;		// advanced by the reader only
+	volatile uint64_t tail;		// advanced by the consumer only
+	volatile int64_t received;
+	volatile int64_t kept;
+	volatile int64_t dropped;	// kept lines that found the ring full
+	volatile int32_t stopped;
+	dispatch_queue_t readerQueue;
+	dispatch_group_t readerGroup;
+	// optional handler the ring is drained to as lines arrive
+	dispatch_queue_t handlerQueue;
+	dispatch_group_t handlerGroup;
+	SDMMD_SyslogRelayLineCallback handler;
+	void *handlerContext;
+	volatile int32_t drainScheduled;
+} sdmmd_SyslogRelayClass;
+
+#define SDMMD_SyslogRelayRef struct sdmmd_SyslogRelayClass*
+
+#pragma mark -
+#pragma mark FUNCTIONS
+#pragma mark -
+
+// Starts syslog_relay and begins reading on a background queue, needs an active session. When handler is set the ring is drained to it on queue
+// as lines arrive, never from two blocks at once even if queue is concurrent (a private serial queue is used if queue is NULL), otherwise lines stay in the ring until SDMMD_SyslogRelayDrain() is called.
+sdmmd_return_t SDMMD_SyslogRelayCreate(SDMMD_AMDeviceRef device, CFDictionaryRef options, dispatch_queue_t queue, SDMMD_SyslogRelayLineCallback handler, void *context, SDMMD_SyslogRelayRef *relay);
+
+// Same as SDMMD_SyslogRelayCreate() but reads a plain socket, such as one end of a socketpair() fed from a recorded stream, so filters and
+// throughput can be measured without a device. The socket is shut down for reading on release but not closed.
+sdmmd_return_t SDMMD_SyslogRelayCreateWithSocket(int socket, CFDictionaryRef options, dispatch_queue_t queue, SDMMD_SyslogRelayLineCallback handler, void *context, SDMMD_SyslogRelayRef *relay);
+
+// Stops reading, waits for the reader and any handler in flight, and closes the connection
+void SDMMD_SyslogRelayRelease(SDMMD_SyslogRelayRef relay);
+
+// Hands up to maxLines stored lines (0 for all) to callback and returns how many were handed out. Only for relays created without a handler,
+// and only one thread may drain a relay at a time.
+uint32_t SDMMD_SyslogRelayDrain(SDMMD_SyslogRelayRef relay, SDMMD_SyslogRelayLineCallback callback, void *context, uint32_t maxLines);
+
+// Lines read from the device, lines that passed the filters, and lines of those that were lost because the ring was full. Any may be NULL.
+void SDMMD_SyslogRelayGetStatistics(SDMMD_SyslogRelayRef relay, uint64_t *received, uint64_t *kept, uint64_t *dropped);
+
+// False once the device closed the stream or the connection failed, lines already in the ring can still be drained
+bool SDMMD_SyslogRelayIsRunning(SDMMD_SyslogRelayRef relay);
+
+#endif
@@ -21,6 +21,8 @@
 
 #include "SDMMD_MCP.h"
 #include "SDMMD_Functions.h"
+#include "SDMMD_AFCLock.h"
+#include "SDMMD_AFCCondition.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
@@ -33,6 +35,8 @@ SDMMobileDeviceRef InitializeSDMMobileDevice() {
 		if (!controller) {
 			controller = (SDMMobileDeviceRef)malloc(sizeof(struct sdm_mobiledevice));
 			SDMMD_AMDeviceRefClassInitialize();
+			SDMMD_AFCLockRefClassInitialize();
+			SDMMD_AFCConditionRefClassInitialize();
 			controller->deviceList = CFArrayCreate(kCFAllocatorDefault, NULL, 0, &kCFTypeArrayCallBacks);
 			controller->usbmuxd = SDMMD_USBMuxCreate();
 			SDMMD_USBMuxStartListener(&controller->usbmuxd);
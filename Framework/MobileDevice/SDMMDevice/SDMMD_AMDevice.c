@@ -77,6 +77,8 @@ static void SDMMD_AMDeviceRefFinalize(CFTypeRef cf) {
 		CFRelease(device->ivars.network_address);
 	if (device->ivars.unknown11)
 		CFRelease(device->ivars.unknown11);
+	if (device->ivars.os_build_string)
+		CFRelease(device->ivars.os_build_string);
 	if (device)
 		free(device);
 }
@@ -554,35 +556,157 @@ sdmmd_return_t SDMMD_copy_daemon_name(SDMMD_AMDeviceRef device, CFStringRef *nam
 	return result;
 }
 
-sdmmd_return_t SDMMD__CopyEscrowBag(SDMMD_AMDeviceRef device, CFDataRef *bag) {
+// Parsed pairing records are kept per UDID together with the identity of the file they were read from, a record is reloaded only after the file on disk changes
+struct sdmmd_PairingRecordCacheEntry {
+	struct sdmmd_PairingRecordCacheEntry *next;
+	CFStringRef udid;
+	CFDictionaryRef record;
+	ino_t inode;
+	off_t size;
+	struct timespec modified;
+	bool wifiMissing;		// the device had no WiFiMACAddress to add to this record, so it is not asked again
+};
+
+static pthread_mutex_t SDMMD_PairingRecordCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sdmmd_PairingRecordCacheEntry *SDMMD_PairingRecordCache = NULL;
+
+static void SDMMD_PairingRecordCacheEntryRelease(struct sdmmd_PairingRecordCacheEntry *entry) {
+	CFRelease(entry->udid);
+	CFRelease(entry->record);
+	free(entry);
+}
+
+static struct sdmmd_PairingRecordCacheEntry* SDMMD_PairingRecordCacheFind(CFStringRef udid) {
+	struct sdmmd_PairingRecordCacheEntry *entry = SDMMD_PairingRecordCache;
+	while (entry && !CFEqual(entry->udid, udid)) {
+		entry = entry->next;
+	}
+	return entry;
+}
+
+static void SDMMD_PairingRecordCacheStore(CFStringRef udid, CFDictionaryRef record, struct stat *info) {
+	struct sdmmd_PairingRecordCacheEntry *entry = SDMMD_PairingRecordCacheFind(udid);
+	if (entry == NULL) {
+		entry = calloc(0x1, sizeof(struct sdmmd_PairingRecordCacheEntry));
+		entry->udid = CFStringCreateCopy(kCFAllocatorDefault, udid);
+		entry->next = SDMMD_PairingRecordCache;
+		SDMMD_PairingRecordCache = entry;
+	} else {
+		CFRelease(entry->record);
+	}
+	entry->record = CFDictionaryCreateCopy(kCFAllocatorDefault, record);
+	entry->inode = info->st_ino;
+	entry->size = info->st_size;
+	entry->modified = info->st_mtimespec;
+	entry->wifiMissing = false;
+}
+
+// Must be called with SDMMD_PairingRecordCacheLock held
+static bool SDMMD_PairingRecordCacheEntryMatches(struct sdmmd_PairingRecordCacheEntry *entry, struct stat *info) {
+	return (entry->inode == info->st_ino && entry->size == info->st_size && entry->modified.tv_sec == info->st_mtimespec.tv_sec && entry->modified.tv_nsec == info->st_mtimespec.tv_nsec);
+}
+
+static bool SDMMD_PairingRecordCacheIsWiFiMissing(CFStringRef udid) {
+	pthread_mutex_lock(&SDMMD_PairingRecordCacheLock);
+	struct sdmmd_PairingRecordCacheEntry *entry = SDMMD_PairingRecordCacheFind(udid);
+	bool missing = (entry && entry->wifiMissing);
+	pthread_mutex_unlock(&SDMMD_PairingRecordCacheLock);
+	return missing;
+}
+
+static void SDMMD_PairingRecordCacheNoteWiFiMissing(CFStringRef udid) {
+	pthread_mutex_lock(&SDMMD_PairingRecordCacheLock);
+	struct sdmmd_PairingRecordCacheEntry *entry = SDMMD_PairingRecordCacheFind(udid);
+	if (entry) {
+		entry->wifiMissing = true;
+	}
+	pthread_mutex_unlock(&SDMMD_PairingRecordCacheLock);
+}
+
+void SDMMD__InvalidatePairingRecordCache(CFStringRef udid) {
+	pthread_mutex_lock(&SDMMD_PairingRecordCacheLock);
+	struct sdmmd_PairingRecordCacheEntry **link = &SDMMD_PairingRecordCache;
+	while (*link) {
+		struct sdmmd_PairingRecordCacheEntry *entry = *link;
+		if (udid == NULL || CFEqual(entry->udid, udid)) {
+			*link = entry->next;
+			SDMMD_PairingRecordCacheEntryRelease(entry);
+		} else {
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&SDMMD_PairingRecordCacheLock);
+}
+
+sdmmd_return_t SDMMD__CopyPairingRecord(SDMMD_AMDeviceRef device, CFDictionaryRef *record) {
 	sdmmd_return_t result = kAMDInvalidArgumentError;
-	if (device) {
-		CFMutableDictionaryRef dict;
-		result = SDMMD__CreatePairingRecordFromRecordOnDiskForIdentifier(device, &dict);
-		if (result == 0) {
-			CFTypeRef wifiValue = NULL, bagValue;
-			if (!CFDictionaryContainsKey(dict, CFSTR("WiFiMACAddress"))) {
-				wifiValue = SDMMD_AMDeviceCopyValue(device, NULL, CFSTR("WiFiMACAddress"));
-				if (CFGetTypeID(wifiValue) == CFStringGetTypeID()) {
-					CFDictionarySetValue(dict, CFSTR("WiFiMACAddress"), wifiValue);
+	if (device && device->ivars.unique_device_id && record) {
+		char path[1024] = {0};
+		struct stat info;
+		SDMMD__PairingRecordPathForIdentifier(device->ivars.unique_device_id, path);
+		CFDictionaryRef cached = NULL;
+		bool found = (stat(path, &info) == 0);
+		pthread_mutex_lock(&SDMMD_PairingRecordCacheLock);
+		struct sdmmd_PairingRecordCacheEntry *entry = SDMMD_PairingRecordCacheFind(device->ivars.unique_device_id);
+		if (entry && found && SDMMD_PairingRecordCacheEntryMatches(entry, &info)) {
+			cached = CFRetain(entry->record);
+		}
+		pthread_mutex_unlock(&SDMMD_PairingRecordCacheLock);
+		if (cached) {
+			*record = cached;
+			result = kAMDSuccess;
+		} else {
+			// read without the lock so other devices are not held up by the disk, loading also rewrites the SystemBUID so the file is stat'd again afterwards
+			CFMutableDictionaryRef fileRecord = NULL;
+			result = SDMMD__CreatePairingRecordFromRecordOnDiskForIdentifier(device, &fileRecord);
+			if (result == kAMDSuccess) {
+				if (stat(path, &info) == 0) {
+					pthread_mutex_lock(&SDMMD_PairingRecordCacheLock);
+					SDMMD_PairingRecordCacheStore(device->ivars.unique_device_id, fileRecord, &info);
+					pthread_mutex_unlock(&SDMMD_PairingRecordCacheLock);
 				}
+				*record = fileRecord;
 			}
-			if (wifiValue)
-				CFRelease(wifiValue);
-			bagValue = CFDictionaryGetValue(dict, CFSTR("EscrowBag"));
-			if (bagValue) {
-				if (CFGetTypeID(bagValue) == CFDataGetTypeID()) {
-					CFRetain(bagValue);
-					*bag = bagValue;
-					char *path = calloc(1, 0x401);
-					SDMMD__PairingRecordPathForIdentifier(device->ivars.unique_device_id, path);
-					result = SDMMD_store_dict(dict, path, 0x1);
-					if (result) {
-						printf("SDMMD_CopyEscrowBag: Failed to store escrow bag to %s.\n",path);
+		}
+	}
+	return result;
+}
+
+sdmmd_return_t SDMMD__CopyEscrowBag(SDMMD_AMDeviceRef device, CFDataRef *bag) {
+	sdmmd_return_t result = kAMDInvalidArgumentError;
+	if (device && bag) {
+		CFDictionaryRef record = NULL;
+		result = SDMMD__CopyPairingRecord(device, &record);
+		if (result == 0) {
+			CFTypeRef bagValue = CFDictionaryGetValue(record, CFSTR("EscrowBag"));
+			if (bagValue && CFGetTypeID(bagValue) == CFDataGetTypeID()) {
+				CFRetain(bagValue);
+				*bag = bagValue;
+				if (!CFDictionaryContainsKey(record, CFSTR("WiFiMACAddress")) && !SDMMD_PairingRecordCacheIsWiFiMissing(device->ivars.unique_device_id)) {
+					// only happens the first time a record with a bag is used, after that the bag is served from the cache
+					CFTypeRef wifiValue = SDMMD_AMDeviceCopyValue(device, NULL, CFSTR("WiFiMACAddress"));
+					if (wifiValue == NULL || CFGetTypeID(wifiValue) != CFStringGetTypeID()) {
+						// a device without the value would otherwise be asked on every session start
+						SDMMD_PairingRecordCacheNoteWiFiMissing(device->ivars.unique_device_id);
+					}
+					if (wifiValue) {
+						if (CFGetTypeID(wifiValue) == CFStringGetTypeID()) {
+							CFMutableDictionaryRef dict = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0x0, record);
+							CFDictionarySetValue(dict, CFSTR("WiFiMACAddress"), wifiValue);
+							char *path = calloc(1, 0x401);
+							SDMMD__PairingRecordPathForIdentifier(device->ivars.unique_device_id, path);
+							result = SDMMD_store_dict(dict, path, 0x1);
+							if (result) {
+								printf("SDMMD_CopyEscrowBag: Failed to store escrow bag to %s.\n",path);
+							}
+							free(path);
+							CFRelease(dict);
+						}
+						CFRelease(wifiValue);
 					}
-					free(path);
 				}
-			}	
+			}
+			CFRelease(record);
 		}
 	}
 	return result;
@@ -793,25 +917,30 @@ sdmmd_return_t SDMMD_send_session_stop(SDMMD_AMDeviceRef device, CFTypeRef sessi
 
 sdmmd_return_t SDMMD_AMDeviceStartSession(SDMMD_AMDeviceRef device) {
 	sdmmd_return_t result = kAMDInvalidArgumentError;
-	CFMutableDictionaryRef record = NULL;
+	CFDictionaryRef record = NULL;
 	CFDataRef key = NULL;
 	if (device) {
 		result = kAMDDeviceDisconnectedError;
 		if (device->ivars.device_active) {
 			SDMMD__mutex_lock(device->ivars.mutex_lock);
-			result = SDMMD__CreatePairingRecordFromRecordOnDiskForIdentifier(device, &record);
+			result = SDMMD__CopyPairingRecord(device, &record);
 			if (result == 0) {
 				result = SDMMD_send_session_start(device, record, &device->ivars.session);
 				if (result == 0 && device->ivars.session) {
 					Boolean hasKey = CFDictionaryContainsKey(record, CFSTR("EscrowBag"));
 					if (!hasKey)
 						hasKey = CFDictionaryContainsKey(record, CFSTR("WiFiMACAddress"));
-					if (hasKey)
+					if (hasKey) {
+						// warms the cached record so later unlock-required service starts attach the bag from memory
 						SDMMD__CopyEscrowBag(device, &key);
+						if (key)
+							CFRelease(key);
+					}
 				} else {
 					char *reason = SDMMD_AMDErrorString(result);
 					printf("SDMMD_AMDeviceStartSession: Could not start session with device %u: %s\n",device->ivars.device_id,reason);
 				}
+				CFRelease(record);
 			} 
 			SDMMD__mutex_unlock(device->ivars.mutex_lock);
 		}
@@ -941,6 +1070,8 @@ sdmmd_return_t SDMMD__connect_to_port(SDMMD_AMDeviceRef device, uint32_t port, b
 	return result;
 }
 
+static void SDMMD__CacheOSVersion(SDMMD_AMDeviceRef device);
+
 sdmmd_return_t SDMMD_AMDeviceConnect(SDMMD_AMDeviceRef device) {
 	sdmmd_return_t result = 0x0;
 	uint32_t socket = 0xffffffff;
@@ -968,7 +1099,11 @@ sdmmd_return_t SDMMD_AMDeviceConnect(SDMMD_AMDeviceRef device) {
 									result = kAMDWrongDroidError;
 								} else {
 									result = 0x0;
+									if (device->ivars.os_version == 0x0) {
+										SDMMD__CacheOSVersion(device);
+									}
 								}
+								CFRelease(daemon);
 							} else {
 								result = kAMDNoResourcesError;
 							}
@@ -1353,15 +1488,99 @@ SDMMD_AMDeviceRef SDMMD_AMDeviceCreateCopy(SDMMD_AMDeviceRef device) {
 	return copy;
 }
 
+// Reads up to three dot separated numbers, missing components count as 0 so "7.0" and "7.0.0" pack the same.
+static uint32_t SDMMD__PackOSVersionString(CFStringRef version) {
+	uint32_t components[0x3] = {0x0, 0x0, 0x0};
+	char buffer[0x20] = {0};
+	if (version && CFStringGetCString(version, buffer, sizeof(buffer), kCFStringEncodingUTF8)) {
+		char *cursor = buffer;
+		for (uint32_t index = 0x0; index < 0x3 && *cursor; index++) {
+			components[index] = (uint32_t)strtoul(cursor, &cursor, 10);
+			if (*cursor != '.') {
+				break;
+			}
+			cursor++;
+		}
+	}
+	return SDMMD_PackedOSVersion(components[0], components[1], components[2]);
+}
+
+static uint32_t SDMMD__PackOSBuildString(CFStringRef build) {
+	uint32_t major = 0x0, train = 0x0, number = 0x0;
+	char buffer[0x20] = {0};
+	if (build && CFStringGetCString(build, buffer, sizeof(buffer), kCFStringEncodingUTF8)) {
+		char *cursor = buffer;
+		major = (uint32_t)strtoul(cursor, &cursor, 10);
+		if (*cursor >= 'A' && *cursor <= 'Z') {
+			train = *cursor++;
+			number = (uint32_t)strtoul(cursor, NULL, 10);
+		}
+	}
+	return SDMMD_PackedOSBuild(major, train, number);
+}
+
+// Expects the lockdown connection to be up and the device mutex to be held, called from SDMMD_AMDeviceConnect() once per attach.
+static void SDMMD__CacheOSVersion(SDMMD_AMDeviceRef device) {
+	CFStringRef err = NULL;
+	CFTypeRef productVersion = SDMMD_copy_lockdown_value(device, CFSTR("NULL"), CFSTR(kProductVersion), &err);
+	if (productVersion) {
+		if (CFGetTypeID(productVersion) == CFStringGetTypeID()) {
+			device->ivars.os_version = SDMMD__PackOSVersionString(productVersion);
+		}
+		CFRelease(productVersion);
+	}
+	CFTypeRef buildVersion = SDMMD_copy_lockdown_value(device, CFSTR("NULL"), CFSTR(kBuildVersion), &err);
+	if (buildVersion) {
+		if (CFGetTypeID(buildVersion) == CFStringGetTypeID()) {
+			if (device->ivars.os_build_string) {
+				CFRelease(device->ivars.os_build_string);
+			}
+			device->ivars.os_build_string = CFRetain(buildVersion);
+			device->ivars.os_build = SDMMD__PackOSBuildString(buildVersion);
+		}
+		CFRelease(buildVersion);
+	}
+}
+
+uint32_t SDMMD_AMDeviceGetPackedOSVersion(SDMMD_AMDeviceRef device) {
+	return (device ? device->ivars.os_version : 0x0);
+}
+
+uint32_t SDMMD_AMDeviceGetPackedOSBuild(SDMMD_AMDeviceRef device) {
+	return (device ? device->ivars.os_build : 0x0);
+}
+
+void SDMMD_AMDeviceInvalidateCachedOSVersion(SDMMD_AMDeviceRef device) {
+	if (device) {
+		SDMMD__mutex_lock(device->ivars.mutex_lock);
+		device->ivars.os_version = 0x0;
+		device->ivars.os_build = 0x0;
+		if (device->ivars.os_build_string) {
+			CFRelease(device->ivars.os_build_string);
+			device->ivars.os_build_string = NULL;
+		}
+		SDMMD__mutex_unlock(device->ivars.mutex_lock);
+	}
+}
+
+Boolean SDMMD_device_os_version_is_at_least(SDMMD_AMDeviceRef device, uint32_t version) {
+	return (device && device->ivars.os_version ? device->ivars.os_version >= version : false);
+}
+
 Boolean SDMMD_device_os_is_at_least(SDMMD_AMDeviceRef device, CFStringRef version) {
 	Boolean result = false;
-	if (device) {
-		SDMMD_AMDeviceConnect(device);
-		CFStringRef prodVers = SDMMD_AMDeviceCopyValue(device, NULL, CFSTR(kProductVersion));
-		if (prodVers) {
-				result = (CFStringCompare(prodVers, version, 0x40) != 0xff ? true : false);
+	if (device && version) {
+		if (device->ivars.os_version == 0x0) {
+			// nothing cached for this attach yet, connecting fills it in
+			if (device->ivars.lockdown_conn) {
+				SDMMD__mutex_lock(device->ivars.mutex_lock);
+				SDMMD__CacheOSVersion(device);
+				SDMMD__mutex_unlock(device->ivars.mutex_lock);
+			} else if (SDM_MD_CallSuccessful(SDMMD_AMDeviceConnect(device))) {
+				SDMMD_AMDeviceDisconnect(device);
+			}
 		}
-		CFRelease(prodVers);
+		result = SDMMD_device_os_version_is_at_least(device, SDMMD__PackOSVersionString(version));
 	}
 	return result;
 }
@@ -69,12 +69,15 @@ struct AMDeviceClassBody {
 	unsigned char unknown10[4];			// 156
 	CFDataRef unknown11;				// 160 
 	unsigned char unknown12[4];			// 164
-} __attribute__ ((packed)) AMDeviceClassBody; // size 0x98
+	uint32_t os_version;				// 168 cached ProductVersion, see SDMMD_PackedOSVersion(), 0 until fetched
+	uint32_t os_build;					// 172 cached BuildVersion, see SDMMD_PackedOSBuild()
+	CFStringRef os_build_string;		// 176 cached BuildVersion
+} __attribute__ ((packed)) AMDeviceClassBody; // size 0xa8, 0x98 before the cached OS version fields
 
 struct sdmmd_am_device {
 	struct AMDeviceClassHeader base;
 	struct AMDeviceClassBody ivars;
-} __attribute__ ((packed)) sdmmd_am_device;
+} __attribute__ ((packed)) sdmmd_am_device; // size 0xb8
 
 
 CFTypeID SDMMD_AMDeviceGetTypeID(void);
@@ -92,6 +95,10 @@ typedef AMDInterfaceConnectionType sdmmd_interface_return_t;
 
 #define SDMMD_AMDeviceRef struct sdmmd_am_device*
 
+// Versions are packed so they compare as plain integers, "7.0.4" is SDMMD_PackedOSVersion(7, 0, 4) and "11B554a" is SDMMD_PackedOSBuild(11, 'B', 554)
+#define SDMMD_PackedOSVersion(major, minor, patch) ((((uint32_t)(major) & 0xffff) << 16) | (((uint32_t)(minor) & 0xff) << 8) | ((uint32_t)(patch) & 0xff))
+#define SDMMD_PackedOSBuild(major, train, number) ((((uint32_t)(major) & 0xff) << 24) | (((uint32_t)(train) & 0xff) << 16) | ((uint32_t)(number) & 0xffff))
+
 #pragma mark -
 void SDMMD_AMDeviceRefClassInitialize();
 
@@ -264,6 +271,55 @@ CFTypeRef SDMMD_AMDeviceCopyValue(SDMMD_AMDeviceRef device, CFStringRef domain,
  */
 sdmmd_return_t SDMMD_AMDeviceSetValue(SDMMD_AMDeviceRef device, CFStringRef domain, CFStringRef key, CFTypeRef value);
 
+/*!
+ @function SDMMD_AMDeviceGetPackedOSVersion
+ @discussion
+ 	Returns the ProductVersion of the device packed with SDMMD_PackedOSVersion(). The value is fetched on the first connect after the device attaches and is cached until the device detaches or SDMMD_AMDeviceInvalidateCachedOSVersion() is called, returns 0 if it has not been fetched yet.
+ @param device
+ 	device to get the operating system version of
+ */
+uint32_t SDMMD_AMDeviceGetPackedOSVersion(SDMMD_AMDeviceRef device);
+
+/*!
+ @function SDMMD_AMDeviceGetPackedOSBuild
+ @discussion
+ 	Returns the BuildVersion of the device packed with SDMMD_PackedOSBuild(), cached the same way as SDMMD_AMDeviceGetPackedOSVersion().
+ @param device
+ 	device to get the operating system build of
+ */
+uint32_t SDMMD_AMDeviceGetPackedOSBuild(SDMMD_AMDeviceRef device);
+
+/*!
+ @function SDMMD_AMDeviceInvalidateCachedOSVersion
+ @discussion
+ 	Drops the cached version and build so they are fetched again on the next connect, call this when the device reports that its software has changed.
+ @param device
+ 	device to invalidate the cached version of
+ */
+void SDMMD_AMDeviceInvalidateCachedOSVersion(SDMMD_AMDeviceRef device);
+
+/*!
+ @function SDMMD_device_os_is_at_least
+ @discussion
+ 	Returns true if the device is running the passed version (eg. "7.0") or later. This compares against the cached packed version and only talks to the device when nothing has been cached yet.
+ @param device
+ 	device to check
+ @param version
+ 	CFStringRef of the version to compare with
+ */
+Boolean SDMMD_device_os_is_at_least(SDMMD_AMDeviceRef device, CFStringRef version);
+
+/*!
+ @function SDMMD_device_os_version_is_at_least
+ @discussion
+ 	Same as SDMMD_device_os_is_at_least() but takes a version built with SDMMD_PackedOSVersion(), this never talks to the device.
+ @param device
+ 	device to check
+ @param version
+ 	packed version to compare with
+ */
+Boolean SDMMD_device_os_version_is_at_least(SDMMD_AMDeviceRef device, uint32_t version);
+
 /*!
  @function SDMMD_AMDCreateDeviceList
  @discussion
@@ -302,7 +358,10 @@ sdmmd_interface_return_t SDMMD_AMDeviceGetInterfaceType(SDMMD_AMDeviceRef device
 
 // Everything below here you shouldn't be calling, this is internal for the library
 //=================================================================================
+sdmmd_return_t SDMMD__CopyPairingRecord(SDMMD_AMDeviceRef device, CFDictionaryRef *record);
+void SDMMD__InvalidatePairingRecordCache(CFStringRef udid);
 sdmmd_return_t SDMMD__CopyEscrowBag(SDMMD_AMDeviceRef device, CFDataRef *bag);
+sdmmd_return_t SDMMD__connect_to_port(SDMMD_AMDeviceRef device, uint32_t port, bool hasTimeout, uint32_t *socketConn, bool isSSL);
 
 //SDMMD_lockdown_conn* SDMMD_lockdown_connection_create(uint32_t socket);
 //sdmmd_return_t SDMMD_lockconn_enable_ssl(SDMMD_lockdown_conn *lockdown_conn, CFTypeRef hostCert, CFTypeRef deviceCert, CFTypeRef hostPrivKey, uint32_t num);
@@ -22,11 +22,20 @@
 #include "SDMMD_Functions.h"
 #include "SDMMD_AMDevice.h"
 #include "SDMMD_AFC.h"
+#include "SDMMD_AFCTransfer.h"
+#include "SDMMD_AFCIterator.h"
 #include "SDMMD_Error.h"
 #include "SDMMD_MCP.h"
 #include "SDMMD_USBMuxListener.h"
 #include "SDMMD_Applications.h"
 #include "SDMMD_Notification.h"
 #include "SDMMD_Debugger.h"
+#include "SDMMD_Fleet.h"
+#include "SDMMD_HouseArrest.h"
+#include "SDMMD_CrashReport.h"
+#include "SDMMD_SyslogRelay.h"
+#include "SDMMD_FileRelay.h"
+#include "SDMMD_PacketCapture.h"
+#include "SDMMD_Screenshot.h"
 
 #endif
\ No newline at end of file
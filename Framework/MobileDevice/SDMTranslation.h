@@ -126,9 +126,18 @@ typedef amd_error_t AMDError;
 #define AFCOperationCreateRenamePath        SDMMD_AFCOperationCreateRenamePath
 #define AFCOperationCreateLinkPath          SDMMD_AFCOperationCreateLinkPath
 #define AFCOperationCreateGetFileHash       SDMMD_AFCOperationCreateGetFileHash
+#define AFCOperationCreateGetFileHashWithRange SDMMD_AFCOperationCreateGetFileHashWithRange
 #define AFCOperationCreateSetModTime        SDMMD_AFCOperationCreateSetModTime
 #define AFCConnectionPerformOperation       SDMMD_AFCConnectionPerformOperation
+#define AFCConnectionSetOptions             SDMMD_AFCConnectionSetOptions
 #define AFCProcessOperation                 SDMMD_AFCProcessOperation
+#define AFCFileRefOpen                      SDMMD_AFCFileRefOpen
+#define AFCFileRefRead                      SDMMD_AFCFileRefRead
+#define AFCFileRefWrite                     SDMMD_AFCFileRefWrite
+#define AFCFileRefSeek                      SDMMD_AFCFileRefSeek
+#define AFCFileRefTell                      SDMMD_AFCFileRefTell
+#define AFCFileRefSetFileSize               SDMMD_AFCFileRefSetFileSize
+#define AFCFileRefClose                     SDMMD_AFCFileRefClose
 
 /*
 #define AFCLog                  SDMMD_AFCLog
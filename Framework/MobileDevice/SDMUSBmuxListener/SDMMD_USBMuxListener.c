@@ -21,6 +21,8 @@
 
 #include "SDMMD_USBMuxListener.h"
 #include "SDMMD_MCP.h"
+#include "SDMMD_Connection.h"
+#include "SDMMD_HouseArrest.h"
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -142,6 +144,8 @@ void SDMMD_USBMuxDetachedCallback(void *context, struct USBMuxPacket *packet) {
 		if (detachedId == SDMMD_AMDeviceGetConnectionID(device)) {
 			CFArrayRemoveValueAtIndex(updateWithRemove, i-removeCounter);
 			removeCounter++;
+			SDMMD_AMDeviceDrainServiceConnectionPool(device);
+			SDMMD_HouseArrestDrainConnectionCache(device);
 			CFNotificationCenterPostNotification(CFNotificationCenterGetLocalCenter(), CFSTR("SDMMD_USBMuxListenerDeviceDetachedNotification"), device, NULL, true);
 		}
 	}